@@ -9,12 +9,27 @@
 #include <CoreAudio/AudioServerPlugIn.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <mach/mach_time.h>
+#include <os/log.h>
 #include <pthread.h>
+#include <pthread/qos.h>
 #include <atomic>
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <memory>
 
+#include "AudioArena.hpp"
+#include "AudioClock.hpp"
+#include "AudioFormat.hpp"
+#include "AudioGain.hpp"
+#include "AudioMeter.hpp"
+#include "AudioProbe.hpp"
+#include "AudioResampler.hpp"
+#include "AudioRingBuffer.hpp"
+#include "AudioStats.hpp"
+#include "AudioTap.hpp"
+#include "AudioTrace.hpp"
+
 // ============================================================================
 // Constants
 // ============================================================================
@@ -27,102 +42,521 @@
 
 #define kDevice_SampleRate          48000.0
 #define kDevice_ChannelCount        2
-#define kDevice_BufferSize          512
-#define kDevice_RingBufferSize      (48000 * 2)  // 2 seconds
+#define kDevice_BufferSize          512     // Default IO period
+#define kDevice_MinPeriodFrames     32
+#define kDevice_MaxPeriodFrames     4096
+#define kDevice_RingBufferSeconds   2   // Rounded up to a power of two frames
+// A ring or capture unread for this long has no consumer: a ring's overflow
+// isn't counted as drops, nor is a capture's drain waited for
+#define kDevice_ReaderIdleSeconds   0.5
+#define kDevice_ScratchFrames       kDevice_MaxPeriodFrames  // Integer formats convert through this many frames at a time
+#define kDevice_RingDecodeFrames    128     // A compact ring feeds the resampler through this many frames at a time
+
+// Input depth, in periods, that ReadInput holds the ring at. Low-latency mode
+// takes 1...kDevice_MaxLatencyPeriods and holds it continuously; with the
+// mode off (0) the default is only restored when IO starts.
+#define kDevice_DefaultLatencyPeriods   1
+#define kDevice_MaxLatencyPeriods       4
+
+// With the latency probe on, WriteMix marks a frame this often; see
+// AudioProbe.hpp
+#define kProbe_IntervalSeconds          0.05
+
+// Custom device properties. Values are CFNumbers.
+enum {
+    kAudiDeckDevicePropertyLatencyPeriods   = 'alat',   // 0 = low-latency mode off
+    kAudiDeckDevicePropertyPeriodFrames     = 'aper',   // kDevice_MinPeriodFrames...kDevice_MaxPeriodFrames
+    kAudiDeckDevicePropertyTap              = 'atap',   // 0/1; see AudioTap.hpp for the region's name
+    kAudiDeckDevicePropertyRingEncoding     = 'arng',   // An AudioFormat::Encoding; see DeviceRingBuffer
+    kAudiDeckDevicePropertyOutputLevels     = 'amtr',   // Read-only; see CreateLevelsDictionary()
+    kAudiDeckDevicePropertyIOStats          = 'asts',   // Read-only; see CreateIOStatsDictionary()
+    kAudiDeckDevicePropertyLatencyProbe     = 'aprb',   // 0/1; see ProbeInput() and ProbeCycle()
+    kAudiDeckDevicePropertyProbeHistogram   = 'ahst'    // Read-only; see CreateProbeHistogramDictionary()
+};
+
+// Every device is clocked off the host clock at its exact nominal rate, and a
+// locked device tracks its reference, so all devices share one clock domain
+#define kDevice_ClockDomain         0x61647563  // 'aduc'
+
+static const Float64 kDevice_SupportedSampleRates[] = { 44100.0, 48000.0, 88200.0, 96000.0, 176400.0, 192000.0 };
+static const UInt32 kDevice_SupportedChannelCounts[] = { 2, 8, 16 };    // One IO kernel each; see SelectIOKernel()
+
+// Physical formats may use any of these; the virtual format is always Float32
+static const AudioFormat::Encoding kDevice_SupportedEncodings[] = {
+    AudioFormat::kEncoding_Float32, AudioFormat::kEncoding_Int16, AudioFormat::kEncoding_Int24
+};
+
+#define kDevice_SampleRateCount     (sizeof(kDevice_SupportedSampleRates) / sizeof(kDevice_SupportedSampleRates[0]))
+#define kDevice_ChannelCountCount   (sizeof(kDevice_SupportedChannelCounts) / sizeof(kDevice_SupportedChannelCounts[0]))
+#define kDevice_EncodingCount       (sizeof(kDevice_SupportedEncodings) / sizeof(kDevice_SupportedEncodings[0]))
+#define kDevice_FormatCount         (kDevice_SampleRateCount * kDevice_ChannelCountCount)
+#define kDevice_PhysicalFormatCount (kDevice_FormatCount * kDevice_EncodingCount)
+
+static const AudioServerPlugInCustomPropertyInfo kDevice_CustomProperties[] = {
+    { kAudiDeckDevicePropertyLatencyPeriods, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyPeriodFrames, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyTap, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyRingEncoding, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyOutputLevels, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyIOStats, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyLatencyProbe, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckDevicePropertyProbeHistogram, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone }
+};
+
+#define kDevice_CustomPropertyCount (sizeof(kDevice_CustomProperties) / sizeof(kDevice_CustomProperties[0]))
+
+// Custom plugin properties. The first two are qualified by a client bundle
+// ID (CFString). kAudiDeckPlugInPropertyClientRoute's value is a CFDictionary
+// with "device" (target device UID, empty for none), "gain" (CFNumber, 0...1),
+// "muted" (CFNumber, non-zero silences the app but keeps its gain),
+// "exclusive" (CFNumber, non-zero takes the client out of its own device's
+// mix) and "crossfade" (CFNumber, milliseconds to fade over when the app is
+// moved onto this route, 0...kClient_MaxCrossfadeMs).
+// kAudiDeckPlugInPropertyClientLevels is read-only: the levels of that app's
+// output, after its gain. kAudiDeckPlugInPropertyRoutingConfiguration is
+// unqualified and replaces every route at once: a CFDictionary with
+// "enabled" (CFNumber, 0 puts every app back on its own device) and "routes"
+// (CFDictionary of bundle ID to a route dictionary as above).
+// kAudiDeckPlugInPropertyTrace is a CFNumber, non-zero to record IO events
+// and log them; see the Trace section. kAudiDeckPlugInPropertyDevices is
+// unqualified: a CFArray of device descriptions, as for Plugin_CreateDevice,
+// of every device but the built-in one. Setting it creates and destroys
+// devices to match, while coreaudiod runs; see ApplyDeviceList().
+enum {
+    kAudiDeckPlugInPropertyClientRoute              = 'acrt',
+    kAudiDeckPlugInPropertyClientLevels             = 'acmt',
+    kAudiDeckPlugInPropertyRoutingConfiguration     = 'arcf',
+    kAudiDeckPlugInPropertyTrace                    = 'atrc',
+    kAudiDeckPlugInPropertyDevices                  = 'adev'
+};
+
+static const AudioServerPlugInCustomPropertyInfo kPlugIn_CustomProperties[] = {
+    { kAudiDeckPlugInPropertyClientRoute, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeCFString },
+    { kAudiDeckPlugInPropertyClientLevels, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeCFString },
+    { kAudiDeckPlugInPropertyRoutingConfiguration, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckPlugInPropertyTrace, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone },
+    { kAudiDeckPlugInPropertyDevices, kAudioServerPlugInCustomPropertyDataTypeCFPropertyList, kAudioServerPlugInCustomPropertyDataTypeNone }
+};
+
+#define kPlugIn_CustomPropertyCount (sizeof(kPlugIn_CustomProperties) / sizeof(kPlugIn_CustomProperties[0]))
+
+// Meters publish a snapshot per window; one older than the hold time is from
+// a stream that has stopped, and reads as silence
+#define kMeter_WindowSeconds        0.02
+#define kMeter_HoldSeconds          0.25
+
+// Trace events; see the Trace section for what each records
+enum {
+    kTraceEvent_StartIO             = 1,
+    kTraceEvent_StopIO,
+    kTraceEvent_ZeroTimeStamp,
+    kTraceEvent_ReadInput,
+    kTraceEvent_ProcessOutput,
+    kTraceEvent_WriteMix,
+    kTraceEvent_ConfigChange
+};
 
-// Object IDs - must be unique and > 0
+#define kTrace_Subsystem            kPlugIn_BundleID
+#define kTrace_DrainSeconds         0.1     // The drain thread's sleep between passes
+#define kTrace_DrainBatch           256     // Events copied out per drain() call
+
+// Actions passed through RequestDeviceConfigurationChange
+enum {
+    kDeviceConfigChange_Format      = 1     // Apply the device's pending format and period
+};
+
+#define kPlugIn_MaxDevices          32
+#define kPlugIn_MaxClients          64
+#define kClient_RingBufferSeconds   0.25  // Per-client capture; only needs to cover a few periods
+#define kClient_CrossfadeMs         10.0  // Default re-route crossfade
+#define kClient_MaxCrossfadeMs      500.0
+#define kDevice_RetireSeconds       5.0   // Before a destroyed device's memory is reclaimed
+#define kPlugIn_ArenaDevices        4     // Devices whose rings are wired up front, at the default format
+#define kPlugIn_ArenaClients        16    // Clients whose rings are wired up front, at the default format
+#define kPlugIn_ArenaRoutingTables  4     // Published plus retired
+#define kPlugIn_DeviceListStorageKey    "devices"   // Host storage key of the kAudiDeckPlugInPropertyDevices value
+
+// Object IDs - must be unique and > 0. Each device owns a contiguous block of
+// kDeviceObject_Count IDs starting at its device ID; blocks are handed out
+// from a counter and never reused, so a destroyed device's IDs can't alias a
+// new one. The first device gets the block 2...6. A device lives in the
+// table slot its block number picks (see DeviceSlot()), so any of its IDs
+// resolves to it without a search.
 enum {
     kObjectID_PlugIn                = 1,
-    kObjectID_Device                = 2,
-    kObjectID_Stream_Output         = 3,
-    kObjectID_Stream_Input          = 4,
-    kObjectID_Volume_Master         = 5,
-    kObjectID_Mute_Master           = 6
+    kObjectID_FirstDevice           = 2
+};
+
+// Offsets of a device's objects from its device ID
+enum {
+    kDeviceObject_Device            = 0,
+    kDeviceObject_Stream_Output     = 1,
+    kDeviceObject_Stream_Input      = 2,
+    kDeviceObject_Volume_Master     = 3,
+    kDeviceObject_Mute_Master       = 4,
+    kDeviceObject_Count             = 5
+};
+
+// A device's ring, shared by its WriteMix (producer) and whichever ReadInput
+// plays it back (consumer). The channel count follows the device's format;
+// frames are stored in the device's ring encoding, Float32 unless a compact
+// integer one was asked for (see kAudiDeckDevicePropertyRingEncoding). The
+// base ring only sees bytes, so channelCount() is the real one here;
+// WriteRing() and ReadRegion()/PushRegion() convert on the way through.
+struct DeviceRingBuffer : AudioRingBuffer<UInt8> {
+    DeviceRingBuffer(UInt32 frames, UInt32 inChannels, AudioFormat::Encoding inStorage, AudioArena* arena)
+        : AudioRingBuffer<UInt8>(frames, inChannels * AudioFormat::BytesPerSample(inStorage), arena),
+          storage(inStorage), channels(inChannels) {}
+    
+    UInt32 channelCount() const { return channels; }
+    
+    const AudioFormat::Encoding storage;
+    const UInt32 channels;
+};
+
+// One client's audio on its way to another device's input; always Float32
+using ClientRingBuffer = AudioRingBuffer<Float32>;
+
+// Runs one IO operation on a device's buffer, in the device's physical
+// format. Each format has its own; see SelectIOKernel().
+struct AudiDeckDevice;
+typedef void (*DeviceIOKernel)(AudiDeckDevice* device, UInt32 operationID, UInt32 clientID, void* buffer, UInt32 bufferFrames);
+
+#define kCacheLineSize              ClientRingBuffer::kCacheLineSize
+
+// ============================================================================
+// Arena
+// ============================================================================
+
+// Wired memory for everything IO touches; reserved by AudiDeckDriverCreate
+// and never released, since IO can outlive any one object's owner.
+static AudioArena* gArena = nullptr;
+
+// Gives a struct's new and delete to gArena, so IO never faults on it
+struct ArenaAllocated {
+    static void* operator new(size_t size) { return gArena->allocate(size); }
+    static void* operator new(size_t size, std::align_val_t alignment) { return gArena->allocate(size, (size_t)alignment); }
+    static void operator delete(void* p, size_t size) { gArena->release(p, size); }
+    static void operator delete(void* p, size_t size, std::align_val_t alignment) { gArena->release(p, size, (size_t)alignment); }
+};
+
+// Rings are templates shared with the benchmarks, so they are placed in
+// the arena here rather than deriving from ArenaAllocated; their storage
+// comes from it too.
+template <typename Ring, typename... Args>
+static Ring* NewRing(Args... args) {
+    void* memory = gArena->allocate(sizeof(Ring), alignof(Ring));
+    return new (memory) Ring(args..., gArena);
+}
+
+template <typename Ring>
+static void DeleteRing(Ring* ring) {
+    if (!ring) return;
+    ring->~Ring();
+    gArena->release(ring, sizeof(Ring), alignof(Ring));
+}
+
+// A ring replaced by a format change, chained in gState until no IO thread
+// can still be reading it. Device and client rings share the chain, so the
+// ring is kept with the DeleteRing() for its type.
+struct RetiredRing : ArenaAllocated {
+    void* ring = nullptr;
+    void (*deleteRing)(void* ring) = nullptr;
+    UInt64 retiredHostTime = 0;
+    RetiredRing* nextRetired = nullptr;
 };
 
 // ============================================================================
-// Ring Buffer (Lock-Free)
+// Device State
 // ============================================================================
 
-class RingBuffer {
-public:
-    RingBuffer(uint32_t frames, uint32_t channels) 
-        : mFrames(frames), mChannels(channels), mWritePos(0), mReadPos(0) {
-        mBuffer = new float[frames * channels]();
+struct AudiDeckClient;
+
+// One virtual device. Aligned so that two devices never share a cache line,
+// and grouped so that the fields each thread writes sit on their own lines:
+// IO on one device never contends with IO or control changes on another.
+//
+// A device's input normally plays back its own ring. With a loopback source
+// it plays back the source device's ring instead, resampled when the two
+// run at different rates; the source's own input then reads silence, since
+// each ring has exactly one consumer. A loopback device can also lock its
+// clock to its source's, steering its period so the source ring's fill
+// level holds steady instead of creeping towards overflow or underflow.
+struct alignas(kCacheLineSize) AudiDeckDevice : ArenaAllocated {
+    AudiDeckDevice(AudioObjectID inObjectID, CFStringRef inUID, CFStringRef inName, AudioObjectID inLoopbackSourceID, AudioObjectID inClockReferenceID)
+        : objectID(inObjectID), uid(inUID), uidHash(CFHash(inUID)), name(inName),
+          loopbackSourceID(inLoopbackSourceID), clockReferenceID(inClockReferenceID) {}
+    
+    ~AudiDeckDevice() {
+        CFRelease(uid);
+        CFRelease(name);
+        DeleteRing(ring.load());
+        delete tap.load();
+        gArena->release(ioScratch, ioScratchBytes, kCacheLineSize);
     }
     
-    ~RingBuffer() { delete[] mBuffer; }
+    // Identity - immutable after creation
+    const AudioObjectID objectID;
+    const CFStringRef uid;
+    const CFHashCode uidHash;               // Lets lookups by UID skip most string compares
+    const CFStringRef name;
+    const AudioObjectID loopbackSourceID;   // kAudioObjectUnknown: our own ring
+    const AudioObjectID clockReferenceID;   // kAudioObjectUnknown: free-running
+    UInt64 retiredHostTime = 0;             // Set when the device leaves the table
+    AudiDeckDevice* nextRetired = nullptr;
     
-    void reset() {
-        mWritePos.store(0);
-        mReadPos.store(0);
-        memset(mBuffer, 0, mFrames * mChannels * sizeof(float));
-    }
+    // Format and IO period - changed only inside PerformConfigChange, while
+    // our IO is stopped. Atomic because a loopback consumer reads them from
+    // its IO.
+    std::atomic<Float64> sampleRate{kDevice_SampleRate};
+    std::atomic<UInt32> channelCount{kDevice_ChannelCount};
+    std::atomic<UInt32> periodFrames{kDevice_BufferSize};
+    std::atomic<UInt32> encoding{AudioFormat::kEncoding_Float32};  // Of the physical format
+    std::atomic<UInt32> ringEncoding{AudioFormat::kEncoding_Float32};  // Of our ring's storage
+    Float64 pendingSampleRate = kDevice_SampleRate;     // Under `mutex`
+    UInt32 pendingChannelCount = kDevice_ChannelCount;  // Under `mutex`
+    UInt32 pendingPeriodFrames = kDevice_BufferSize;    // Under `mutex`
+    UInt32 pendingEncoding = AudioFormat::kEncoding_Float32;    // Under `mutex`
+    UInt32 pendingRingEncoding = AudioFormat::kEncoding_Float32;    // Under `mutex`
     
-    uint32_t write(const float* data, uint32_t frames) {
-        uint64_t wp = mWritePos.load();
-        uint64_t rp = mReadPos.load();
-        uint32_t available = mFrames - (uint32_t)(wp - rp);
-        uint32_t toWrite = std::min(frames, available);
-        
-        for (uint32_t i = 0; i < toWrite; i++) {
-            uint32_t idx = (wp + i) % mFrames;
-            for (uint32_t c = 0; c < mChannels; c++) {
-                mBuffer[idx * mChannels + c] = data[i * mChannels + c];
-            }
+    // Chosen for the format by ConfigureDeviceIO, along with the Float32
+    // buffer an integer format renders through
+    DeviceIOKernel ioKernel = nullptr;
+    Float32* ioScratch = nullptr;   // From gArena
+    size_t ioScratchBytes = 0;
+    
+    // Run state - written lock-free by StartIO/StopIO. The device is
+    // running while clientCount is non-zero.
+    alignas(kCacheLineSize) std::atomic<UInt32> clientCount{0};
+    std::atomic<UInt64> timestampCounter{0};   // Zero timestamp seed; bumped per timeline
+    std::atomic<bool> inputNeedsResync{false};  // Trim the input backlog on the next ReadInput
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;  // Pending format and tap creation; never on the IO path
+    
+    // Controls - written by SetPropertyData, read by ReadInput
+    alignas(kCacheLineSize) std::atomic<Float32> volume{1.0f};
+    std::atomic<bool> muted{false};
+    std::atomic<UInt32> latencyPeriods{0};
+    std::atomic<bool> tapEnabled{false};
+    std::atomic<bool> probeEnabled{false};
+    
+    // Set while another device consumes our ring as its loopback source
+    std::atomic<AudioObjectID> ringConsumerID{kAudioObjectUnknown};
+    
+    // Stamped by whichever input reads our ring, ours or a loopback
+    // consumer's, each time it reads
+    alignas(kCacheLineSize) std::atomic<UInt64> ringReadHostTime{0};
+    
+    // IO thread only; started by StartIO before IO runs
+    alignas(kCacheLineSize) AudioClock clock;
+    AudioClockLock clockLock;
+    AudioGain::Stage gainStage;
+    AudioResampler resampler;       // Configured outside IO for source rate -> our rate; storage from gArena
+    bool inputAdjustPending = false;
+    SInt64 inputAdjustFrames = 0;   // > 0: ring frames to drop, < 0: ring frames to insert
+    UInt64 probeMarkHostTime = 0;   // Our WriteMix's last latency marker
+    UInt64 cycleHostTime = 0;       // When the last cycle began, while probing; 0 for none
+    
+    // IO thread only; what every operation of one HAL IO cycle needs from
+    // the client table, gathered in one pass when the cycle begins (see
+    // BeginIOCycle). Entries stay valid for the cycle: a removed client or
+    // device is only freed after kDevice_RetireSeconds.
+    struct IOCycle {
+        struct Source {
+            AudiDeckClient* client;
+            AudiDeckDevice* owner;
+            UInt32 capture;                 // Of `client`'s, the one targeting us
+        };
+        UInt64 counter = UINT64_MAX;        // The HAL's counter of the cycle gathered; reset by StartIO
+        UInt32 meterWindowFrames = 0;
+        UInt32 clientCount = 0;
+        UInt32 sourceCount = 0;
+        AudiDeckClient* clients[kPlugIn_MaxClients];    // Ours, in table order
+        Source sources[2 * kPlugIn_MaxClients];         // Other devices' clients' captures for us, at our rate
+    };
+    alignas(kCacheLineSize) IOCycle ioCycle;
+    
+    // Replaced on a format change. The previous ring is retired like a
+    // device, for a loopback consumer that may still be reading it.
+    std::atomic<DeviceRingBuffer*> ring{nullptr};
+    
+    // Shared memory copy of our output for other processes. Created the
+    // first time it's enabled and kept, mapped, until the device is freed;
+    // written by our WriteMix.
+    std::atomic<AudioTap*> tap{nullptr};
+    
+    // Levels of our output, written by our WriteMix
+    alignas(kCacheLineSize) AudioMeter::Meter outputMeter;
+    
+    // Written by our IO thread only; kept from creation, across format
+    // changes
+    alignas(kCacheLineSize) AudioIOCounters ioStats;
+    
+    // Latency probe. The marker is our WriteMix's and its latencies are
+    // measured by whichever input reads our ring; the cycle jitter is our
+    // own IO thread's. Kept, like ioStats, from creation.
+    alignas(kCacheLineSize) AudioLatencyProbe latencyProbe;
+    alignas(kCacheLineSize) AudioDurationCounters cycleJitter;
+};
+
+// Route chosen for a bundle ID, applied to its clients as they come and go
+struct ClientRoute {
+    CFStringRef bundleID = nullptr;
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    Float32 gain = 1.0f;
+    bool muted = false;
+    bool exclusive = false;
+    Float32 crossfadeMs = kClient_CrossfadeMs;
+    
+    // What the client's gain stage ramps to
+    Float32 targetGain() const { return muted ? 0.0f : gain; }
+};
+
+// Where a client with no route, or any client while routing is disabled,
+// points: its own device only, at unity gain
+static const ClientRoute kClientRoute_Default;
+
+// Every saved route, as one immutable snapshot. A change copies the table,
+// edits the copy and publishes it whole; clients point straight at their
+// entry, so an IO cycle reads a route's fields together and a configuration
+// lands on every client at once. Retired tables stay alive until no IO cycle
+// can still hold one of their entries.
+struct RoutingTable : ArenaAllocated {
+    RoutingTable() = default;
+    RoutingTable(const RoutingTable&) = delete;
+    RoutingTable& operator=(const RoutingTable&) = delete;
+    
+    ~RoutingTable() {
+        for (UInt32 i = 0; i < routeCount; i++) {
+            CFRelease(routes[i].bundleID);
         }
-        mWritePos.store(wp + toWrite);
-        return toWrite;
     }
     
-    uint32_t read(float* data, uint32_t frames) {
-        uint64_t wp = mWritePos.load();
-        uint64_t rp = mReadPos.load();
-        uint32_t available = (uint32_t)(wp - rp);
-        uint32_t toRead = std::min(frames, available);
-        
-        for (uint32_t i = 0; i < toRead; i++) {
-            uint32_t idx = (rp + i) % mFrames;
-            for (uint32_t c = 0; c < mChannels; c++) {
-                data[i * mChannels + c] = mBuffer[idx * mChannels + c];
-            }
-        }
-        // Fill rest with silence
-        for (uint32_t i = toRead; i < frames; i++) {
-            for (uint32_t c = 0; c < mChannels; c++) {
-                data[i * mChannels + c] = 0.0f;
-            }
+    bool enabled = true;
+    UInt32 routeCount = 0;
+    ClientRoute routes[kPlugIn_MaxClients];     // Each with a retained bundle ID
+    
+    UInt64 retiredHostTime = 0;                 // Set when the table is replaced
+    RoutingTable* nextRetired = nullptr;
+};
+
+// One HAL client of a device, i.e. one process doing IO on it. A routed
+// client's output is captured per cycle, before the HAL mixes it with the
+// device's other clients, into one of the client's own rings; the route's
+// target device then mixes it into its input. The rings are written by the
+// IO thread of the device the client belongs to and read by the target's.
+//
+// A route change crossfades: for the new route's crossfade time our IO
+// thread plays to both the old destination and the new one, fading one out
+// as the other comes in, then lets the old one go. Each destination is our
+// own device's mix, a capture for another device, or both.
+struct alignas(kCacheLineSize) AudiDeckClient : ArenaAllocated {
+    AudiDeckClient(UInt32 inClientID, AudioObjectID inDeviceID, pid_t inPID, CFStringRef inBundleID)
+        : clientID(inClientID), deviceID(inDeviceID), pid(inPID), bundleID(inBundleID) {}
+    
+    ~AudiDeckClient() {
+        if (bundleID) CFRelease(bundleID);
+        for (Capture& capture : captures) {
+            DeleteRing(capture.ring.load());
         }
-        mReadPos.store(rp + toRead);
-        return toRead;
     }
     
-private:
-    float* mBuffer;
-    uint32_t mFrames;
-    uint32_t mChannels;
-    std::atomic<uint64_t> mWritePos;
-    std::atomic<uint64_t> mReadPos;
+    // Identity - immutable after creation
+    const UInt32 clientID;
+    const AudioObjectID deviceID;
+    const pid_t pid;
+    const CFStringRef bundleID;             // May be null
+    UInt64 retiredHostTime = 0;             // Set when the client leaves the table
+    AudiDeckClient* nextRetired = nullptr;
+    
+    // Route - an entry of the published routing table, swapped by
+    // SetPropertyData and read by both IO threads. The gain applies to our
+    // output wherever it goes.
+    alignas(kCacheLineSize) std::atomic<const ClientRoute*> route{&kClientRoute_Default};
+    
+    // Where a route sends our output, as last played. Copied out of the
+    // route, since a replaced table can be freed long before our next cycle.
+    struct Destination {
+        AudioObjectID deviceID = kAudioObjectUnknown;
+        bool exclusive = false;
+        UInt32 capture = 0;                 // Ours, if deviceID is another device
+    };
+    
+    // IO thread of the device we belong to
+    AudioGain::Stage gainStage;
+    AudioGain::Crossfade crossfade;
+    Destination playing;
+    Destination leaving;                    // While `crossfade` is active
+    UInt32 lastCapture = 0;                 // The capture most recently given a target
+    
+    // Levels of our output after gain, written by our device's IO thread
+    alignas(kCacheLineSize) AudioMeter::Meter meter;
+    
+    // Our output for other devices. There are two so a crossfade can fill
+    // the incoming target's while the outgoing target drains its own. The
+    // rings follow the format of the device we belong to and are replaced
+    // like a device's ring.
+    struct Capture {
+        std::atomic<ClientRingBuffer*> ring{nullptr};
+        
+        // The device that mixes this capture, kAudioObjectUnknown while
+        // idle. Set by our IO thread; cleared by the target once it has
+        // drained a capture we have stopped writing.
+        std::atomic<AudioObjectID> targetID{kAudioObjectUnknown};
+        std::atomic<bool> draining{false};
+        
+        // When the target last mixed it, or was given it. A target that
+        // hasn't for kDevice_ReaderIdleSeconds isn't reading its input, or
+        // can't take this capture at its rate or channel count.
+        std::atomic<UInt64> readHostTime{0};
+        
+        // The device currently mixing it. A route change can briefly leave
+        // the old and new targets both trying; the claim keeps to one
+        // consumer. Our IO thread holds it as kClaimedByClient, an ID no
+        // device has, while it hands the capture to a new target.
+        static constexpr AudioObjectID kClaimedByClient = kObjectID_PlugIn;
+        std::atomic<AudioObjectID> readerID{kAudioObjectUnknown};
+    };
+    alignas(kCacheLineSize) Capture captures[2];
 };
 
 // ============================================================================
 // Plugin State
 // ============================================================================
 
-struct PlugInState {
+struct PlugInState : ArenaAllocated {
     AudioServerPlugInHostRef host = nullptr;
     
-    Float64 sampleRate = kDevice_SampleRate;
-    std::atomic<bool> isRunning{false};
-    std::atomic<UInt32> clientCount{0};
+    // Published device table. Slots are read lock-free from the IO and
+    // property paths; they are only written under `mutex`.
+    std::atomic<AudiDeckDevice*> devices[kPlugIn_MaxDevices] = {};
+    AudioObjectID nextObjectID = kObjectID_FirstDevice;
     
-    UInt64 anchorHostTime = 0;
-    std::atomic<UInt64> timestampCounter{0};
+    // Devices taken out of the table, chained here and freed once no IO can
+    // still be using them. However many leave within one grace period, each
+    // is kept until its own has passed.
+    AudiDeckDevice* retiredDevices = nullptr;
     
-    std::atomic<Float32> volume{1.0f};
-    std::atomic<bool> muted{false};
+    // Client table, published and retired the same way as devices
+    std::atomic<AudiDeckClient*> clients[kPlugIn_MaxClients] = {};
+    AudiDeckClient* retiredClients = nullptr;
     
-    std::unique_ptr<RingBuffer> ringBuffer;
+    // Routing table, published and replaced whole under `mutex`. Replaced
+    // tables are chained here until they are reclaimed.
+    std::atomic<RoutingTable*> routing{nullptr};
+    RoutingTable* retiredRouting = nullptr;
+    
+    // Rings replaced by format changes, chained the same way. A client's
+    // capture is read by its targets' IO threads, which keep running
+    // through the change.
+    RetiredRing* retiredRings = nullptr;
+    
+    // Recorded into from any thread while enabled; drained by a thread
+    // started the first time it's enabled
+    AudioTrace trace;
+    bool traceThreadStarted = false;    // Under `mutex`
+    
+    // Serializes device and client creation and destruction, and routing
+    // table changes; never taken on the IO path
     pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 };
 
@@ -130,806 +564,2927 @@ static PlugInState* gState = nullptr;
 static mach_timebase_info_data_t gTimebase = {0, 0};
 
 // ============================================================================
-// Forward Declarations
+// Device Table
 // ============================================================================
 
-static HRESULT Plugin_QueryInterface(void* driver, REFIID iid, LPVOID* ppv);
-static ULONG Plugin_AddRef(void* driver);
-static ULONG Plugin_Release(void* driver);
-static OSStatus Plugin_Initialize(AudioServerPlugInDriverRef driver, AudioServerPlugInHostRef host);
-static OSStatus Plugin_CreateDevice(AudioServerPlugInDriverRef driver, CFDictionaryRef desc, const AudioServerPlugInClientInfo* clientInfo, AudioObjectID* outID);
-static OSStatus Plugin_DestroyDevice(AudioServerPlugInDriverRef driver, AudioObjectID deviceID);
-static OSStatus Plugin_AddDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo);
-static OSStatus Plugin_RemoveDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo);
-static OSStatus Plugin_PerformConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info);
-static OSStatus Plugin_AbortConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info);
-static Boolean Plugin_HasProperty(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address);
-static OSStatus Plugin_IsPropertySettable(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, Boolean* outSettable);
-static OSStatus Plugin_GetPropertyDataSize(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32* outSize);
-static OSStatus Plugin_GetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 inSize, UInt32* outSize, void* outData);
-static OSStatus Plugin_SetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 dataSize, const void* data);
-static OSStatus Plugin_StartIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID);
-static OSStatus Plugin_StopIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID);
-static OSStatus Plugin_GetZeroTimeStamp(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, Float64* outSampleTime, UInt64* outHostTime, UInt64* outSeed);
-static OSStatus Plugin_WillDoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, Boolean* outWillDo, Boolean* outWillDoInPlace);
-static OSStatus Plugin_BeginIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo);
-static OSStatus Plugin_DoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, AudioObjectID streamID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo, void* mainBuffer, void* secondaryBuffer);
-static OSStatus Plugin_EndIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo);
+// The table slot of the device whose ID block holds `objectID`
+static UInt32 DeviceSlot(AudioObjectID objectID) {
+    return ((objectID - kObjectID_FirstDevice) / kDeviceObject_Count) % kPlugIn_MaxDevices;
+}
+
+// Resolves any object ID owned by a device to that device, and optionally to
+// which of its objects (kDeviceObject_*) it names. O(1), so IO can call it
+// per operation.
+static AudiDeckDevice* FindDevice(AudioObjectID objectID, UInt32* outDeviceObject = nullptr) {
+    if (objectID < kObjectID_FirstDevice) {
+        return nullptr;
+    }
+    AudiDeckDevice* device = gState->devices[DeviceSlot(objectID)].load(std::memory_order_acquire);
+    if (device && objectID >= device->objectID && objectID < device->objectID + kDeviceObject_Count) {
+        if (outDeviceObject) *outDeviceObject = objectID - device->objectID;
+        return device;
+    }
+    return nullptr;
+}
+
+static AudiDeckDevice* FindDeviceByUID(CFStringRef uid) {
+    const CFHashCode hash = CFHash(uid);
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* device = gState->devices[i].load(std::memory_order_acquire);
+        if (device && device->uidHash == hash && CFEqual(device->uid, uid)) {
+            return device;
+        }
+    }
+    return nullptr;
+}
+
+// Fills `outIDs` with up to `maxCount` device IDs; returns the total count.
+static UInt32 CopyDeviceIDs(AudioObjectID* outIDs, UInt32 maxCount) {
+    UInt32 count = 0;
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* device = gState->devices[i].load(std::memory_order_acquire);
+        if (device) {
+            if (outIDs && count < maxCount) outIDs[count] = device->objectID;
+            count++;
+        }
+    }
+    return count;
+}
+
+static Float64 HostTicksToSeconds(UInt64 ticks) {
+    return (Float64)ticks * gTimebase.numer / gTimebase.denom / 1000000000.0;
+}
+
+static UInt64 HostTicksToNanos(UInt64 ticks) {
+    return ticks * gTimebase.numer / gTimebase.denom;
+}
+
+static Float64 HostTicksPerSecond() {
+    return 1000000000.0 * gTimebase.denom / gTimebase.numer;
+}
+
+// Frees retired devices that have been out of the table long enough for any
+// IO or property call that looked them up to have finished. Caller holds
+// gState->mutex.
+static void ReclaimRetiredDevices() {
+    UInt64 now = mach_absolute_time();
+    AudiDeckDevice** link = &gState->retiredDevices;
+    while (AudiDeckDevice* device = *link) {
+        if (HostTicksToSeconds(now - device->retiredHostTime) >= kDevice_RetireSeconds) {
+            *link = device->nextRetired;
+            delete device;
+        } else {
+            link = &device->nextRetired;
+        }
+    }
+}
+
+// False unless `value` is a CFNumber
+static bool GetSInt32(CFTypeRef value, SInt32* outValue) {
+    return value && CFGetTypeID(value) == CFNumberGetTypeID() &&
+           CFNumberGetValue((CFNumberRef)value, kCFNumberSInt32Type, outValue);
+}
+
+static bool GetFloat32(CFTypeRef value, Float32* outValue) {
+    return value && CFGetTypeID(value) == CFNumberGetTypeID() &&
+           CFNumberGetValue((CFNumberRef)value, kCFNumberFloat32Type, outValue);
+}
+
+static bool IsSupportedSampleRate(Float64 rate) {
+    for (UInt32 i = 0; i < kDevice_SampleRateCount; i++) {
+        if (kDevice_SupportedSampleRates[i] == rate) return true;
+    }
+    return false;
+}
+
+static bool IsSupportedChannelCount(UInt32 channels) {
+    for (UInt32 i = 0; i < kDevice_ChannelCountCount; i++) {
+        if (kDevice_SupportedChannelCounts[i] == channels) return true;
+    }
+    return false;
+}
+
+// Whether a ring holds the storage ResizeRing() is asked for. Client rings
+// only hold Float32.
+static bool RingStores(const ClientRingBuffer* ring) { return true; }
+static bool RingStores(const DeviceRingBuffer* ring, AudioFormat::Encoding storage) { return ring->storage == storage; }
+
+// Frees retired rings that no IO thread can still be reading. Caller holds
+// gState->mutex.
+static void ReclaimRetiredRings() {
+    UInt64 now = mach_absolute_time();
+    RetiredRing** link = &gState->retiredRings;
+    while (RetiredRing* retired = *link) {
+        if (HostTicksToSeconds(now - retired->retiredHostTime) >= kDevice_RetireSeconds) {
+            *link = retired->nextRetired;
+            retired->deleteRing(retired->ring);
+            delete retired;
+        } else {
+            link = &retired->nextRetired;
+        }
+    }
+}
+
+// Parks a replaced ring for deferred reclamation. Caller holds
+// gState->mutex.
+template <typename Ring>
+static void RetireRing(Ring* ring) {
+    if (!ring) return;
+    RetiredRing* retired = new RetiredRing();
+    retired->ring = ring;
+    retired->deleteRing = [](void* p) { DeleteRing((Ring*)p); };
+    retired->retiredHostTime = mach_absolute_time();
+    retired->nextRetired = gState->retiredRings;
+    gState->retiredRings = retired;
+}
+
+// Replaces `ring` unless it already fits `frames` frames of `channels`
+// channels, stored as `storage` for a device's ring. The ring it replaces is
+// retired, for a consumer that may still be reading it. Caller holds
+// gState->mutex.
+template <typename Ring, typename... Storage>
+static void ResizeRing(std::atomic<Ring*>& ring, UInt32 frames, UInt32 channels, Storage... storage) {
+    Ring* current = ring.load();
+    if (!current || current->channelCount() != channels || !RingStores(current, storage...) ||
+        current->capacityFrames() < frames || current->capacityFrames() >= frames * 2) {
+        ReclaimRetiredRings();
+        RetireRing(ring.exchange(NewRing<Ring>(frames, channels, storage...)));
+    }
+}
+
+// Defined with the kernels, under IO Kernels
+static DeviceIOKernel SelectIOKernel(UInt32 encoding, UInt32 channels);
+
+// Sizes the ring and resampler for the device's current format, and picks
+// its IO kernel. Allocates, so only call while the device's IO is stopped
+// (creation or PerformConfigChange). Caller holds gState->mutex.
+static void ConfigureDeviceIO(AudiDeckDevice* device) {
+    Float64 rate = device->sampleRate.load();
+    UInt32 channels = device->channelCount.load();
+    UInt32 encoding = device->encoding.load();
+    
+    device->ioKernel = SelectIOKernel(encoding, channels);
+    gArena->release(device->ioScratch, device->ioScratchBytes, kCacheLineSize);
+    device->ioScratchBytes = (encoding == AudioFormat::kEncoding_Float32) ? 0 : (size_t)kDevice_ScratchFrames * channels * sizeof(Float32);
+    device->ioScratch = device->ioScratchBytes ? (Float32*)gArena->allocate(device->ioScratchBytes, kCacheLineSize) : nullptr;
+    device->clock.configure(rate, device->periodFrames.load(), HostTicksPerSecond());
+    ResizeRing(device->ring, (UInt32)(rate * kDevice_RingBufferSeconds), channels,
+               (AudioFormat::Encoding)device->ringEncoding.load());
+    
+    AudiDeckDevice* source = FindDevice(device->loopbackSourceID);
+    if (source) {
+        device->resampler.configure(source->sampleRate.load(), rate, channels, kDevice_MaxPeriodFrames, gArena);
+    }
+}
+
+// Creates and publishes a device. With `loopbackSourceUID`, the new device's
+// input plays back that device's output. Caller holds gState->mutex.
+static OSStatus AddDevice(CFStringRef uid, CFStringRef name, CFStringRef loopbackSourceUID, CFStringRef clockReferenceUID,
+                          UInt32 periodFrames, UInt32 ringEncoding, AudioObjectID* outID) {
+    ReclaimRetiredDevices();
+    
+    if (FindDeviceByUID(uid)) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    
+    AudiDeckDevice* source = nullptr;
+    if (loopbackSourceUID) {
+        source = FindDeviceByUID(loopbackSourceUID);
+        if (!source || source->ringConsumerID.load() != kAudioObjectUnknown) {
+            return kAudioHardwareIllegalOperationError;
+        }
+    }
+    
+    if (periodFrames < kDevice_MinPeriodFrames || periodFrames > kDevice_MaxPeriodFrames ||
+        ringEncoding >= AudioFormat::kEncodingCount) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    
+    // The source ring's fill level is what tells us how far apart the two
+    // clocks are, so only the loopback source can be a clock reference
+    if (clockReferenceUID && (!loopbackSourceUID || !CFEqual(clockReferenceUID, loopbackSourceUID))) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    
+    // Skip ahead to the next ID block whose slot is free; blocks are never
+    // reused, so skipped ones are simply never handed out
+    for (UInt32 attempt = 0; attempt < kPlugIn_MaxDevices; attempt++, gState->nextObjectID += kDeviceObject_Count) {
+        const UInt32 i = DeviceSlot(gState->nextObjectID);
+        if (gState->devices[i].load(std::memory_order_relaxed) == nullptr) {
+            CFRetain(uid);
+            CFRetain(name);
+            AudiDeckDevice* device = new AudiDeckDevice(gState->nextObjectID, uid, name,
+                                                        source ? source->objectID : (AudioObjectID)kAudioObjectUnknown,
+                                                        clockReferenceUID ? source->objectID : (AudioObjectID)kAudioObjectUnknown);
+            gState->nextObjectID += kDeviceObject_Count;
+            device->periodFrames.store(periodFrames);
+            device->pendingPeriodFrames = periodFrames;
+            device->ringEncoding.store(ringEncoding);
+            device->pendingRingEncoding = ringEncoding;
+            
+            // Loopback devices start out in their source's format
+            if (source) {
+                device->sampleRate.store(source->sampleRate.load());
+                device->channelCount.store(source->channelCount.load());
+                device->pendingSampleRate = device->sampleRate.load();
+                device->pendingChannelCount = device->channelCount.load();
+                source->ringConsumerID.store(device->objectID);
+            }
+            ConfigureDeviceIO(device);
+            
+            gState->devices[i].store(device, std::memory_order_release);
+            if (outID) *outID = device->objectID;
+            return kAudioHardwareNoError;
+        }
+    }
+    return kAudioHardwareUnspecifiedError;
+}
+
+// Unpublishes a device and parks it for deferred reclamation. Caller holds
+// gState->mutex.
+static OSStatus RemoveDevice(AudioObjectID deviceID) {
+    ReclaimRetiredDevices();
+    
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* device = gState->devices[i].load(std::memory_order_relaxed);
+        if (device && device->objectID == deviceID) {
+            gState->devices[i].store(nullptr, std::memory_order_release);
+            device->retiredHostTime = mach_absolute_time();
+            
+            // Hand the source's ring back to the source's own input
+            AudiDeckDevice* source = FindDevice(device->loopbackSourceID);
+            if (source) {
+                source->ringConsumerID.store(kAudioObjectUnknown);
+            }
+            
+            device->nextRetired = gState->retiredDevices;
+            gState->retiredDevices = device;
+            return kAudioHardwareNoError;
+        }
+    }
+    return kAudioHardwareBadDeviceError;
+}
+
+static void NotifyDeviceListChanged() {
+    if (!gState->host) return;
+    
+    AudioObjectPropertyAddress addresses[] = {
+        { kAudioPlugInPropertyDeviceList, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioObjectPropertyOwnedObjects, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain }
+    };
+    gState->host->PropertiesChanged(gState->host, kObjectID_PlugIn, 2, addresses);
+}
+
+// Format changes are applied in Plugin_PerformConfigChange, once the HAL
+// has stopped IO on the device
+static OSStatus RequestFormatChange(AudiDeckDevice* device) {
+    if (!gState->host) {
+        return kAudioHardwareNotRunningError;
+    }
+    return gState->host->RequestDeviceConfigurationChange(gState->host, device->objectID, kDeviceConfigChange_Format, nullptr);
+}
+
+// Maps the device's tap on first use. The region is named after the UID so
+// readers can find it without our object IDs.
+static bool OpenDeviceTap(AudiDeckDevice* device) {
+    pthread_mutex_lock(&device->mutex);
+    if (!device->tap.load()) {
+        char uid[256];
+        char name[32];
+        AudioTap* tap = new AudioTap();
+        if (CFStringGetCString(device->uid, uid, sizeof(uid), kCFStringEncodingUTF8)) {
+            AudioTap::MakeName(uid, name, sizeof(name));
+            if (tap->open(name)) {
+                device->tap.store(tap, std::memory_order_release);
+                tap = nullptr;
+            }
+        }
+        delete tap;
+    }
+    pthread_mutex_unlock(&device->mutex);
+    return device->tap.load() != nullptr;
+}
+
+// ============================================================================
+// Client Table
+// ============================================================================
+
+static AudiDeckClient* FindClient(AudioObjectID deviceID, UInt32 clientID) {
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_acquire);
+        if (client && client->clientID == clientID && client->deviceID == deviceID) {
+            return client;
+        }
+    }
+    return nullptr;
+}
+
+// The route `table` saves for `bundleID`, if any. Safe from any thread that
+// holds a table it loaded.
+static const ClientRoute* FindClientRoute(const RoutingTable* table, CFStringRef bundleID) {
+    for (UInt32 i = 0; i < table->routeCount; i++) {
+        if (CFEqual(table->routes[i].bundleID, bundleID)) {
+            return &table->routes[i];
+        }
+    }
+    return nullptr;
+}
+
+// The route a client with `bundleID` follows under `table`
+static const ClientRoute* ResolveClientRoute(const RoutingTable* table, CFStringRef bundleID) {
+    const ClientRoute* route = (table->enabled && bundleID) ? FindClientRoute(table, bundleID) : nullptr;
+    return route ? route : &kClientRoute_Default;
+}
+
+// Allocates a copy of `table` to edit before publishing it.
+static RoutingTable* CopyRoutingTable(const RoutingTable* table) {
+    RoutingTable* copy = new RoutingTable();
+    copy->enabled = table->enabled;
+    copy->routeCount = table->routeCount;
+    for (UInt32 i = 0; i < table->routeCount; i++) {
+        copy->routes[i] = table->routes[i];
+        CFRetain(copy->routes[i].bundleID);
+    }
+    return copy;
+}
+
+// Frees replaced routing tables that no IO cycle can still be reading.
+// Caller holds gState->mutex.
+static void ReclaimRetiredRoutingTables() {
+    UInt64 now = mach_absolute_time();
+    RoutingTable** link = &gState->retiredRouting;
+    while (RoutingTable* table = *link) {
+        if (HostTicksToSeconds(now - table->retiredHostTime) >= kDevice_RetireSeconds) {
+            *link = table->nextRetired;
+            delete table;
+        } else {
+            link = &table->nextRetired;
+        }
+    }
+}
+
+// Caller holds gState->mutex.
+static void ReclaimRetiredClients() {
+    UInt64 now = mach_absolute_time();
+    AudiDeckClient** link = &gState->retiredClients;
+    while (AudiDeckClient* client = *link) {
+        if (HostTicksToSeconds(now - client->retiredHostTime) >= kDevice_RetireSeconds) {
+            *link = client->nextRetired;
+            delete client;
+        } else {
+            link = &client->nextRetired;
+        }
+    }
+}
+
+// Sizes a client's capture rings for the format of the device it belongs
+// to. Allocates. Caller holds gState->mutex.
+static void ConfigureClientIO(AudiDeckClient* client, AudiDeckDevice* device) {
+    for (AudiDeckClient::Capture& capture : client->captures) {
+        ResizeRing(capture.ring, (UInt32)(device->sampleRate.load() * kClient_RingBufferSeconds), device->channelCount.load());
+    }
+}
+
+// Unpublishes the client in slot `index` and parks it for deferred
+// reclamation. Caller holds gState->mutex.
+static void RetireClient(UInt32 index) {
+    AudiDeckClient* client = gState->clients[index].load(std::memory_order_relaxed);
+    gState->clients[index].store(nullptr, std::memory_order_release);
+    client->retiredHostTime = mach_absolute_time();
+    client->nextRetired = gState->retiredClients;
+    gState->retiredClients = client;
+}
+
+// The HAL removes a device's clients before destroying it; this only catches
+// any it didn't. Caller holds gState->mutex.
+static void RemoveClientsOfDevice(AudioObjectID deviceID) {
+    ReclaimRetiredClients();
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_relaxed);
+        if (client && client->deviceID == deviceID) {
+            RetireClient(i);
+        }
+    }
+}
+
+// Points a client at `route`; its IO thread crossfades onto it on its next
+// cycle. Caller holds gState->mutex.
+static void ApplyClientRoute(AudiDeckClient* client, const ClientRoute* route) {
+    client->route.store(route, std::memory_order_release);
+}
+
+// Makes `table` the routing table and moves every client onto it; IO picks
+// the new routes up on its next cycle. The old table is parked for deferred
+// reclamation. Caller holds gState->mutex.
+static void PublishRoutingTable(RoutingTable* table) {
+    ReclaimRetiredRoutingTables();
+    RoutingTable* previous = gState->routing.load(std::memory_order_relaxed);
+    gState->routing.store(table, std::memory_order_release);
+    
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_relaxed);
+        if (client) {
+            ApplyClientRoute(client, ResolveClientRoute(table, client->bundleID));
+        }
+    }
+    
+    previous->retiredHostTime = mach_absolute_time();
+    previous->nextRetired = gState->retiredRouting;
+    gState->retiredRouting = previous;
+}
+
+// ============================================================================
+// Trace
+// ============================================================================
+
+// Events, with what `frames` and `value` hold for each:
+//   StartIO, StopIO        clients running after the call; -
+//   ZeroTimeStamp          -; sample time of the returned timestamp
+//   ReadInput, WriteMix,   the buffer's frames; nanoseconds spent in DoIO
+//   ProcessOutput
+//   ConfigChange           new period; new sample rate, in Hz
+// Recording is real-time safe, and nothing while tracing is off. Logging
+// happens on the drain thread, at the info level under kTrace_Subsystem.
+
+static const char* TraceEventName(UInt32 event) {
+    switch (event) {
+        case kTraceEvent_StartIO:           return "StartIO";
+        case kTraceEvent_StopIO:            return "StopIO";
+        case kTraceEvent_ZeroTimeStamp:     return "ZeroTimeStamp";
+        case kTraceEvent_ReadInput:         return "ReadInput";
+        case kTraceEvent_ProcessOutput:     return "ProcessOutput";
+        case kTraceEvent_WriteMix:          return "WriteMix";
+        case kTraceEvent_ConfigChange:      return "ConfigChange";
+        default:                            return "?";
+    }
+}
+
+static UInt32 TraceEventForOperation(UInt32 operationID) {
+    switch (operationID) {
+        case kAudioServerPlugInIOOperationReadInput:    return kTraceEvent_ReadInput;
+        case kAudioServerPlugInIOOperationWriteMix:     return kTraceEvent_WriteMix;
+        default:                                        return kTraceEvent_ProcessOutput;
+    }
+}
+
+// For calls that don't already have the time at hand
+static void Trace(UInt32 event, AudioObjectID objectID, UInt32 clientID, UInt32 frames, UInt64 value) {
+    if (gState->trace.isEnabled()) {
+        gState->trace.record(mach_absolute_time(), event, objectID, clientID, frames, value);
+    }
+}
+
+// Copies events out of the trace and logs them, until the plugin goes away.
+// Runs at utility QoS, far below the IO threads, and keeps draining after
+// tracing is turned off until the trace is empty.
+static void* TraceDrainThread(void*) {
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+    os_log_t log = os_log_create(kTrace_Subsystem, "trace");
+    AudioTraceEvent events[kTrace_DrainBatch];
+    const useconds_t sleepMicros = (useconds_t)(kTrace_DrainSeconds * 1000000);
+    
+    for (;;) {
+        UInt64 lost = 0;
+        UInt32 count;
+        do {
+            count = gState->trace.drain(events, kTrace_DrainBatch, &lost);
+            for (UInt32 i = 0; i < count; i++) {
+                const AudioTraceEvent& e = events[i];
+                os_log_info(log, "%llu %{public}s device %u client %u frames %u value %llu",
+                            (unsigned long long)e.hostTime, TraceEventName(e.event), (unsigned)e.objectID,
+                            (unsigned)e.clientID, (unsigned)e.frames, (unsigned long long)e.value);
+            }
+        } while (count == kTrace_DrainBatch);
+        if (lost) {
+            os_log(log, "trace overflowed: %llu events lost", (unsigned long long)lost);
+        }
+        usleep(sleepMicros);
+    }
+    return nullptr;
+}
+
+// Caller holds gState->mutex.
+static bool StartTraceDrain() {
+    if (gState->traceThreadStarted) {
+        return true;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, TraceDrainThread, nullptr) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    gState->traceThreadStarted = true;
+    return true;
+}
+
+// ============================================================================
+// Input Path
+// ============================================================================
+
+// Depth, in the input ring's frames, that a device's input holds the ring at
+// ahead of each read.
+static Float64 InputTargetFrames(AudiDeckDevice* device, AudiDeckDevice* source, Float64 blockFrames) {
+    UInt32 periods = device->latencyPeriods.load(std::memory_order_relaxed);
+    Float64 period = source->periodFrames.load(std::memory_order_relaxed);
+    Float64 target = std::max((periods ? periods : kDevice_DefaultLatencyPeriods) * period, blockFrames);
+    // Another device writes on its own cycle, so its periods land anywhere
+    // within ours
+    if (source != device) {
+        target += period;
+    }
+    return target;
+}
+
+// Input latency in our frames: the ring depth plus the resampler's delay.
+static UInt32 InputLatencyFrames(AudiDeckDevice* device) {
+    AudiDeckDevice* source = device->loopbackSourceID != kAudioObjectUnknown ? FindDevice(device->loopbackSourceID) : device;
+    if (!source) {
+        return 0;
+    }
+    Float64 ratio = source->sampleRate.load() / device->sampleRate.load();
+    Float64 frames = InputTargetFrames(device, source, ceil(device->periodFrames.load() * ratio));
+    if (ratio != 1.0) {
+        frames += AudioResampler::kTaps / 2;
+    }
+    return (UInt32)ceil(frames / ratio);
+}
+
+// Holds the ring our input reads at its target depth. Returns the number of
+// frames of silence to insert at the start of this block, and sets
+// `outFadeOut` when this block should fade to silence ahead of a jump.
+//
+// - The first cycle after StartIO drops any backlog built up while our input
+//   wasn't reading.
+// - With a clock reference, the PI loop steers our clock to hold the depth.
+// - In low-latency mode, a depth that strays from the target by more than
+//   the producer's jitter is corrected as well, by dropping or inserting.
+//
+// Jumps are taken behind a one-block fade to silence so they never click;
+// the gain stage fades back in on the block that makes the jump.
+static UInt32 SyncInput(AudiDeckDevice* device, AudiDeckDevice* source, DeviceRingBuffer* ring, UInt32 bufferFrames, Float64 ratio, bool* outFadeOut) {
+    *outFadeOut = false;
+    
+    if (device->inputAdjustPending) {
+        device->inputAdjustPending = false;
+        if (device->inputAdjustFrames > 0) {
+            ring->consumeRead(ring->peekRead((UInt32)device->inputAdjustFrames).frames());
+            return 0;
+        }
+        return std::min(bufferFrames, (UInt32)(-device->inputAdjustFrames / ratio));
+    }
+    
+    Float64 blockFrames = ceil(bufferFrames * ratio);
+    Float64 target = InputTargetFrames(device, source, blockFrames);
+    Float64 period = source->periodFrames.load(std::memory_order_relaxed);
+    Float64 depth = ring->availableFrames();
+    SInt64 adjust = 0;
+    
+    if (device->inputNeedsResync.exchange(false, std::memory_order_relaxed)) {
+        if (depth > target) {
+            adjust = (SInt64)(depth - target);
+        }
+    } else {
+        if (device->clockReferenceID != kAudioObjectUnknown) {
+            device->clock.setRateScale(device->clockLock.update(depth, target, period));
+        }
+        if (device->latencyPeriods.load(std::memory_order_relaxed) != 0) {
+            // Our own ring is written in step with our reads, so its depth
+            // only moves when a cycle is missed
+            Float64 tolerance = (source == device) ? period / 4 : period;
+            if (fabs(depth - target) > tolerance) {
+                adjust = (SInt64)(depth - target);
+            }
+        }
+    }
+    
+    if (adjust != 0) {
+        device->inputAdjustFrames = adjust;
+        device->inputAdjustPending = true;
+        *outFadeOut = true;
+    }
+    return 0;
+}
+
+// Plays one span of ring storage into `out` through `gain`. Float32 is
+// scaled straight out of ring memory; a compact encoding is decoded into
+// `out` and scaled there, so ring memory is still read once.
+template <UInt32 kChannels>
+static Float32* ReadRegion(AudioGain::Stage& gain, AudioFormat::Encoding storage, Float32* out, const DeviceRingBuffer::Region& region) {
+    const UInt32 samples = region.frames * kChannels;
+    switch (storage) {
+        case AudioFormat::kEncoding_Int16:
+            AudioFormat::Decode<AudioFormat::kEncoding_Int16>(out, region.data, samples);
+            return gain.process(out, out, region.frames, kChannels);
+        case AudioFormat::kEncoding_Int24:
+            AudioFormat::Decode<AudioFormat::kEncoding_Int24>(out, region.data, samples);
+            return gain.process(out, out, region.frames, kChannels);
+        default:
+            return gain.process(out, (const Float32*)region.data, region.frames, kChannels);
+    }
+}
+
+template <AudioFormat::Encoding kStorage, UInt32 kChannels>
+static UInt32 DecodeAndPush(AudioResampler& resampler, const DeviceRingBuffer::Region& region) {
+    constexpr size_t kFrameBytes = (size_t)kChannels * AudioFormat::BytesPerSample(kStorage);
+    Float32 decoded[kDevice_RingDecodeFrames * kChannels];
+    UInt32 pushed = 0;
+    while (pushed < region.frames) {
+        UInt32 frames = std::min(region.frames - pushed, (UInt32)kDevice_RingDecodeFrames);
+        AudioFormat::Decode<kStorage>(decoded, region.data + pushed * kFrameBytes, frames * kChannels);
+        UInt32 accepted = resampler.push(decoded, frames);
+        pushed += accepted;
+        if (accepted < frames) break;
+    }
+    return pushed;
+}
+
+// Feeds one span of ring storage to the resampler; returns how many frames
+// it took. Float32 goes in straight from ring memory, a compact encoding a
+// few frames at a time through the stack.
+template <UInt32 kChannels>
+static UInt32 PushRegion(AudioResampler& resampler, AudioFormat::Encoding storage, const DeviceRingBuffer::Region& region) {
+    switch (storage) {
+        case AudioFormat::kEncoding_Int16:  return DecodeAndPush<AudioFormat::kEncoding_Int16, kChannels>(resampler, region);
+        case AudioFormat::kEncoding_Int24:  return DecodeAndPush<AudioFormat::kEncoding_Int24, kChannels>(resampler, region);
+        default:                            return resampler.push((const Float32*)region.data, region.frames);
+    }
+}
+
+// Latency probe: if the frame `source`'s WriteMix marked is among the
+// `frames` ring frames this read took from `start`, records how long after
+// it was written it reaches the app: from the write to this read, plus the
+// frame's place in our buffer. `leadFrames` of ours come before the first
+// ring frame; `ratio` is ring frames per frame of ours, and a resampled
+// frame also waits out the filter's delay.
+static void ProbeInput(AudiDeckDevice* source, UInt64 start, UInt32 frames, UInt32 leadFrames, Float64 ratio, Float64 rate, UInt64 readHostTime) {
+    UInt32 offset;
+    UInt64 markHostTime;
+    if (!source->latencyProbe.find(start, frames, &offset, &markHostTime)) {
+        return;
+    }
+    Float64 ringFrames = offset + (ratio != 1.0 ? AudioResampler::kTaps / 2 : 0);
+    Float64 seconds = HostTicksToSeconds(readHostTime - markHostTime) + (leadFrames + ringFrames / ratio) / rate;
+    source->latencyProbe.latency.add((UInt64)(seconds * 1e9));
+}
+
+// Plays back the ring our input reads: our own, or our loopback source's.
+// Volume & mute are applied while copying out of ring memory, so the data is
+// touched once; whatever the ring can't supply is silence. Gain changes ramp
+// across the block instead of stepping.
+template <UInt32 kChannels>
+static void ReadInput(AudiDeckDevice* device, Float32* buffer, UInt32 bufferFrames) {
+    constexpr UInt32 channels = kChannels;
+    Float32* const end = buffer + (size_t)bufferFrames * channels;
+    Float32* out = buffer;
+    AudioGain::Stage& gain = device->gainStage;
+    
+    AudiDeckDevice* source = device;
+    if (device->ringConsumerID.load(std::memory_order_relaxed) != kAudioObjectUnknown) {
+        source = nullptr;   // Another device is consuming our ring
+    } else if (device->loopbackSourceID != kAudioObjectUnknown) {
+        source = FindDevice(device->loopbackSourceID);
+    }
+    
+    // A mismatched resampler is waiting on a config change that will catch
+    // it up with the source's new format
+    Float64 sourceRate = source ? source->sampleRate.load(std::memory_order_relaxed) : 0.0;
+    Float64 rate = device->sampleRate.load(std::memory_order_relaxed);
+    bool resampling = sourceRate != rate;
+    if (!source || source->channelCount.load(std::memory_order_relaxed) != channels ||
+        (resampling && !device->resampler.isConfigured(sourceRate, rate, channels))) {
+        memset(buffer, 0, (size_t)(end - buffer) * sizeof(Float32));
+        gain.reset(0.0f);
+        return;
+    }
+    
+    DeviceRingBuffer* ring = source->ring.load(std::memory_order_acquire);
+    UInt64 now = mach_absolute_time();
+    source->ringReadHostTime.store(now, std::memory_order_relaxed);
+    bool fadeOut;
+    UInt32 insertFrames = SyncInput(device, source, ring, bufferFrames, sourceRate / rate, &fadeOut);
+    bool probing = source->probeEnabled.load(std::memory_order_relaxed);
+    memset(out, 0, (size_t)insertFrames * channels * sizeof(Float32));
+    out += (size_t)insertFrames * channels;
+    UInt32 frames = bufferFrames - insertFrames;
+    
+    gain.begin((fadeOut || device->muted.load()) ? 0.0f : device->volume.load(), frames);
+    if (!resampling) {
+        DeviceRingBuffer::Regions regions = ring->peekRead(frames);
+        if (regions.silent) {
+            // Nothing but silence was written: clear once instead of
+            // scaling it
+            memset(out, 0, (size_t)regions.frames() * channels * sizeof(Float32));
+            out += (size_t)regions.frames() * channels;
+        } else {
+            out = ReadRegion<kChannels>(gain, ring->storage, out, regions.first);
+            out = ReadRegion<kChannels>(gain, ring->storage, out, regions.second);
+        }
+        if (probing) {
+            ProbeInput(source, ring->readPosition(), regions.frames(), insertFrames, 1.0, rate, now);
+        }
+        ring->consumeRead(regions.frames());
+    } else {
+        // Feed the filter straight from ring memory, render into the output
+        // buffer, then apply gain in place
+        AudioResampler& resampler = device->resampler;
+        DeviceRingBuffer::Regions regions = ring->peekRead(resampler.inputFramesNeeded(frames));
+        UInt32 pushed = PushRegion<kChannels>(resampler, ring->storage, regions.first);
+        if (pushed == regions.first.frames) {
+            pushed += PushRegion<kChannels>(resampler, ring->storage, regions.second);
+        }
+        if (probing) {
+            ProbeInput(source, ring->readPosition(), pushed, insertFrames, sourceRate / rate, rate, now);
+        }
+        ring->consumeRead(pushed);
+        
+        UInt32 rendered = resampler.process(out, frames);
+        out = gain.process(out, out, rendered, channels);
+    }
+    gain.end();
+    
+    // Ran dry: fade back in once data arrives
+    if (out < end) {
+        memset(out, 0, (size_t)(end - out) * sizeof(Float32));
+        gain.reset(0.0f);
+    }
+    device->ioStats.addZeroFilled(insertFrames + (UInt32)((end - out) / channels));
+}
+
+// ============================================================================
+// Client Streams
+// ============================================================================
+
+// Latency probe: how far this cycle began from one period after the last.
+// Late wake-ups, and the early ones that follow them, show up here long
+// before they cost the ring a frame.
+static void ProbeCycle(AudiDeckDevice* device, UInt64 now) {
+    UInt64 last = device->cycleHostTime;
+    device->cycleHostTime = now;
+    if (last == 0) {
+        return;
+    }
+    Float64 period = device->periodFrames.load(std::memory_order_relaxed) / device->sampleRate.load(std::memory_order_relaxed);
+    device->cycleJitter.add((UInt64)(fabs(HostTicksToSeconds(now - last) - period) * 1e9));
+}
+
+// Gathers the cycle's view of the client table into device->ioCycle, once
+// per HAL IO cycle: the first operation to begin does the scan, and every
+// other operation on the device in the cycle, for every client, reads what
+// it found. Without cycle info each call is its own cycle. Clients added or
+// routed to us mid-cycle are picked up on the next one.
+static void BeginIOCycle(AudiDeckDevice* device, const AudioServerPlugInIOCycleInfo* cycleInfo) {
+    AudiDeckDevice::IOCycle& cycle = device->ioCycle;
+    if (cycleInfo) {
+        if (cycleInfo->mIOCycleCounter == cycle.counter) {
+            return;
+        }
+        cycle.counter = cycleInfo->mIOCycleCounter;
+        device->ioStats.addCycle();
+        if (device->probeEnabled.load(std::memory_order_relaxed)) {
+            ProbeCycle(device, mach_absolute_time());
+        } else {
+            device->cycleHostTime = 0;
+        }
+    }
+    
+    const Float64 rate = device->sampleRate.load(std::memory_order_relaxed);
+    cycle.meterWindowFrames = (UInt32)(rate * kMeter_WindowSeconds);
+    cycle.clientCount = 0;
+    cycle.sourceCount = 0;
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_acquire);
+        if (!client) {
+            continue;
+        }
+        if (client->deviceID == device->objectID) {
+            cycle.clients[cycle.clientCount++] = client;
+            continue;
+        }
+        for (UInt32 k = 0; k < 2; k++) {
+            if (client->captures[k].targetID.load(std::memory_order_acquire) != device->objectID) {
+                continue;
+            }
+            AudiDeckDevice* owner = FindDevice(client->deviceID);
+            if (owner && owner->sampleRate.load(std::memory_order_relaxed) == rate) {
+                cycle.sources[cycle.sourceCount++] = { client, owner, k };
+            }
+        }
+    }
+}
+
+// One of our clients, from the cycle's view if it was there when the cycle
+// began
+static AudiDeckClient* FindCycleClient(AudiDeckDevice* device, UInt32 clientID) {
+    const AudiDeckDevice::IOCycle& cycle = device->ioCycle;
+    for (UInt32 i = 0; i < cycle.clientCount; i++) {
+        if (cycle.clients[i]->clientID == clientID) {
+            return cycle.clients[i];
+        }
+    }
+    return FindClient(device->objectID, clientID);
+}
+
+static UInt32 MeterWindowFrames(AudiDeckDevice* device) {
+    return device->ioCycle.meterWindowFrames;
+}
+
+// True if `destination` sends the client's output to another device, through
+// one of its captures
+static bool IsCaptured(const AudiDeckClient* client, const AudiDeckClient::Destination& destination) {
+    return destination.deviceID != kAudioObjectUnknown && destination.deviceID != client->deviceID;
+}
+
+// True if `destination` leaves the client's output in its own device's mix
+static bool KeepsOwnMix(const AudiDeckClient* client, const AudiDeckClient::Destination& destination) {
+    return destination.deviceID == client->deviceID || !destination.exclusive;
+}
+
+// Lets go of the destination a crossfade has left. Its capture, unless the
+// new destination still uses it, is left for its target to drain; the target
+// then releases it (see MixClients).
+static void EndReroute(AudiDeckClient* client) {
+    const AudiDeckClient::Destination& leaving = client->leaving;
+    if (IsCaptured(client, leaving) && !(IsCaptured(client, client->playing) && client->playing.capture == leaving.capture)) {
+        client->captures[leaving.capture].draining.store(true, std::memory_order_release);
+    }
+}
+
+// Takes a capture back from its last target to give it a new one: keeps any
+// target out of MixClients until ReleaseCapture(). Fails while the capture
+// is still in use, i.e. while a reader holds it or its target has yet to
+// drain it. A target that has gone, stopped, or stopped mixing it never
+// will, so its capture is taken as is.
+static bool ClaimCapture(AudiDeckClient::Capture& capture, UInt64 now) {
+    AudioObjectID target = capture.targetID.load(std::memory_order_acquire);
+    if (target != kAudioObjectUnknown) {
+        AudiDeckDevice* targetDevice = FindDevice(target);
+        UInt64 readHostTime = capture.readHostTime.load(std::memory_order_relaxed);   // May be after `now`
+        if (targetDevice && targetDevice->clientCount.load(std::memory_order_relaxed) != 0 &&
+            (readHostTime >= now || HostTicksToSeconds(now - readHostTime) < kDevice_ReaderIdleSeconds)) {
+            return false;
+        }
+    }
+    AudioObjectID reader = kAudioObjectUnknown;
+    return capture.readerID.compare_exchange_strong(reader, AudiDeckClient::Capture::kClaimedByClient, std::memory_order_acquire);
+}
+
+static void ReleaseCapture(AudiDeckClient::Capture& capture) {
+    capture.readerID.store(kAudioObjectUnknown, std::memory_order_release);
+}
+
+// Starts crossfading a client from where it plays now onto `route`. A
+// capture for a new target is claimed, flushed and handed over before its
+// first frame; one that keeps its target carries on. A route change in the
+// middle of a crossfade cuts the older destination off where it is. Returns
+// false, having changed nothing, if the capture the new target needs is
+// still in use; the next cycle tries again.
+static bool BeginReroute(AudiDeckDevice* device, AudiDeckClient* client, const ClientRoute* route) {
+    AudiDeckClient::Destination next;
+    next.deviceID = route->deviceID;
+    next.exclusive = route->exclusive;
+    bool handOver = false;
+    const UInt64 now = mach_absolute_time();
+    if (IsCaptured(client, next)) {
+        if (IsCaptured(client, client->playing) && client->playing.deviceID == next.deviceID) {
+            next.capture = client->playing.capture;
+        } else {
+            next.capture = 1 - client->lastCapture;
+            if (!ClaimCapture(client->captures[next.capture], now)) {
+                return false;
+            }
+            handOver = true;
+        }
+    }
+    
+    // Before the hand-over, which may give the capture being let go here a
+    // new target
+    if (client->crossfade.isActive()) {
+        EndReroute(client);
+    }
+    if (handOver) {
+        client->lastCapture = next.capture;
+        AudiDeckClient::Capture& capture = client->captures[next.capture];
+        capture.targetID.store(kAudioObjectUnknown, std::memory_order_release);
+        capture.draining.store(false, std::memory_order_relaxed);
+        capture.ring.load(std::memory_order_acquire)->flush();
+        capture.readHostTime.store(now, std::memory_order_relaxed);     // Gives the target time to start mixing it
+        capture.targetID.store(next.deviceID, std::memory_order_release);
+        ReleaseCapture(capture);
+    }
+    client->leaving = client->playing;
+    client->playing = next;
+    
+    const Float64 rate = device->sampleRate.load(std::memory_order_relaxed);
+    client->crossfade.start((UInt32)(route->crossfadeMs * 0.001 * rate));
+    if (!client->crossfade.isActive()) {
+        EndReroute(client);
+    }
+    return true;
+}
+
+// Writes a block of the client's output to one of its captures; during a
+// crossfade, as the given side of it, straight into the ring.
+template <UInt32 kChannels>
+static void WriteCapture(AudiDeckClient::Capture& capture, const Float32* buffer, UInt32 bufferFrames, bool silent,
+                         const AudioGain::Crossfade* crossfade, AudioGain::Crossfade::Side side) {
+    ClientRingBuffer* ring = capture.ring.load(std::memory_order_acquire);
+    if (ring->channelCount() != kChannels) {
+        return;
+    }
+    if (silent) {
+        ring->writeSilence(bufferFrames);
+    } else if (!crossfade) {
+        ring->write(buffer, bufferFrames);
+    } else {
+        ClientRingBuffer::Regions regions = ring->reserveWrite(bufferFrames);
+        crossfade->process(regions.first.data, buffer, regions.first.frames, kChannels, side, 0);
+        crossfade->process(regions.second.data, buffer + regions.first.frames * kChannels, regions.second.frames, kChannels, side, regions.first.frames);
+        ring->commitWrite(regions.frames());
+    }
+}
+
+// Applies a client's gain to its output in place, then sends it where its
+// route says. Runs per client, before the HAL mixes the device's clients
+// together; a route that takes the client out of that mix leaves silence
+// behind. Crossfades onto a changed route, first to the captures and then,
+// since that changes the buffer, in our own mix.
+template <UInt32 kChannels>
+static void ProcessClientOutput(AudiDeckDevice* device, UInt32 clientID, Float32* buffer, UInt32 bufferFrames) {
+    AudiDeckClient* client = FindCycleClient(device, clientID);
+    if (!client) {
+        return;
+    }
+    
+    constexpr UInt32 channels = kChannels;
+    const ClientRoute* route = client->route.load(std::memory_order_acquire);
+    if (route->deviceID != client->playing.deviceID || route->exclusive != client->playing.exclusive) {
+        BeginReroute(device, client, route);    // Or, if it has to wait, next cycle
+    }
+    
+    AudioGain::Stage& gain = client->gainStage;
+    // An idle client skips the gain pass, its ring's copy, and the mix on
+    // the other side
+    const bool silent = AudioGain::IsSilent(buffer, bufferFrames * channels);
+    gain.begin(route->targetGain(), bufferFrames);
+    if (!silent) {
+        gain.process(buffer, buffer, bufferFrames, channels);
+    }
+    gain.end();
+    if (silent) {
+        client->meter.processSilence(bufferFrames, channels, MeterWindowFrames(device), mach_absolute_time());
+    } else {
+        client->meter.process(buffer, bufferFrames, channels, MeterWindowFrames(device), mach_absolute_time());
+    }
+    
+    const AudiDeckClient::Destination& playing = client->playing;
+    const AudiDeckClient::Destination& leaving = client->leaving;
+    AudioGain::Crossfade& crossfade = client->crossfade;
+    const bool fading = crossfade.isActive();
+    const bool sameCapture = fading && IsCaptured(client, leaving) && IsCaptured(client, playing) && leaving.capture == playing.capture;
+    if (IsCaptured(client, playing)) {
+        WriteCapture<channels>(client->captures[playing.capture], buffer, bufferFrames, silent,
+                               (fading && !sameCapture) ? &crossfade : nullptr, AudioGain::Crossfade::kIn);
+    }
+    if (fading && IsCaptured(client, leaving) && !sameCapture) {
+        WriteCapture<channels>(client->captures[leaving.capture], buffer, bufferFrames, silent, &crossfade, AudioGain::Crossfade::kOut);
+    }
+    
+    // Our own device already hears us through the HAL's mix, unless the
+    // route takes us out of it
+    const bool ownNow = KeepsOwnMix(client, playing);
+    const bool ownBefore = fading ? KeepsOwnMix(client, leaving) : ownNow;
+    if (!ownNow && !ownBefore) {
+        memset(buffer, 0, (size_t)bufferFrames * channels * sizeof(Float32));
+    } else if (ownNow != ownBefore && !silent) {
+        crossfade.process(buffer, buffer, bufferFrames, channels, ownNow ? AudioGain::Crossfade::kIn : AudioGain::Crossfade::kOut, 0);
+    }
+    
+    if (fading) {
+        crossfade.advance(bufferFrames);
+        if (!crossfade.isActive()) {
+            EndReroute(client);
+        }
+    }
+}
+
+// Sums the captures other devices' clients send us into our input, on top of
+// what ReadInput produced, and clips once at the end. A capture is only mixed
+// while its device runs at our rate and channel count; the cycle's view
+// already holds just those at our rate. One its client has stopped writing,
+// after a crossfade away from us, is released once drained; if we stop
+// mixing it first, its client takes it back (see ClaimCapture). Our volume &
+// mute apply to the mix at a constant gain per block.
+template <UInt32 kChannels>
+static void MixClients(AudiDeckDevice* device, Float32* buffer, UInt32 bufferFrames) {
+    constexpr UInt32 channels = kChannels;
+    const AudiDeckDevice::IOCycle& cycle = device->ioCycle;
+    if (cycle.sourceCount == 0) {
+        return;
+    }
+    const Float32 volume = device->muted.load(std::memory_order_relaxed) ? 0.0f : device->volume.load(std::memory_order_relaxed);
+    bool mixed = false;
+    
+    for (UInt32 i = 0; i < cycle.sourceCount; i++) {
+        AudiDeckClient::Capture& capture = cycle.sources[i].client->captures[cycle.sources[i].capture];
+        AudiDeckDevice* owner = cycle.sources[i].owner;
+        ClientRingBuffer* ring = capture.ring.load(std::memory_order_acquire);
+        if (capture.targetID.load(std::memory_order_acquire) != device->objectID || ring->channelCount() != channels) {
+            continue;
+        }
+        AudioObjectID reader = kAudioObjectUnknown;
+        if (!capture.readerID.compare_exchange_strong(reader, device->objectID, std::memory_order_acquire)) {
+            continue;
+        }
+        capture.readHostTime.store(mach_absolute_time(), std::memory_order_relaxed);
+        
+        // The client's device writes on its own cycle; anything beyond a
+        // couple of its periods ahead of this block is backlog from before
+        // we started mixing, and only adds latency
+        UInt32 limit = bufferFrames + 2 * owner->periodFrames.load(std::memory_order_relaxed);
+        UInt32 available = ring->peekRead(ring->capacityFrames()).frames();
+        if (available > limit) {
+            ring->consumeRead(available - limit);
+        }
+        
+        ClientRingBuffer::Regions regions = ring->peekRead(bufferFrames);
+        if (!regions.silent) {
+            UInt32 firstSamples = regions.first.frames * channels;
+            AudioGain::Mix(buffer, regions.first.data, firstSamples, volume);
+            AudioGain::Mix(buffer + firstSamples, regions.second.data, regions.second.frames * channels, volume);
+            mixed = true;
+        }
+        ring->consumeRead(regions.frames());
+        
+        // Fails if the client has since given the capture a new target
+        if (capture.draining.load(std::memory_order_acquire) && ring->availableFrames() == 0) {
+            AudioObjectID target = device->objectID;
+            capture.targetID.compare_exchange_strong(target, kAudioObjectUnknown, std::memory_order_release);
+        }
+        capture.readerID.store(kAudioObjectUnknown, std::memory_order_release);
+    }
+    
+    if (mixed) {
+        AudioGain::Apply(buffer, buffer, bufferFrames * channels, 1.0f);
+    }
+}
+
+// ============================================================================
+// IO Kernels
+// ============================================================================
+
+template <AudioFormat::Encoding kStorage, UInt32 kChannels>
+static UInt32 EncodeRing(DeviceRingBuffer* ring, const Float32* buffer, UInt32 frames) {
+    DeviceRingBuffer::Regions regions = ring->reserveWrite(frames);
+    if (regions.frames() == 0) return 0;
+    AudioFormat::Encode<kStorage>(regions.first.data, buffer, regions.first.frames * kChannels);
+    AudioFormat::Encode<kStorage>(regions.second.data, buffer + (size_t)regions.first.frames * kChannels, regions.second.frames * kChannels);
+    ring->commitWrite(regions.frames());
+    return regions.frames();
+}
+
+// Stores `frames` frames of our mix in the ring's encoding, converting
+// straight into ring memory. Returns the number written; frames that don't
+// fit are dropped.
+template <UInt32 kChannels>
+static UInt32 WriteRing(DeviceRingBuffer* ring, const Float32* buffer, UInt32 frames) {
+    switch (ring->storage) {
+        case AudioFormat::kEncoding_Int16:  return EncodeRing<AudioFormat::kEncoding_Int16, kChannels>(ring, buffer, frames);
+        case AudioFormat::kEncoding_Int24:  return EncodeRing<AudioFormat::kEncoding_Int24, kChannels>(ring, buffer, frames);
+        default:                            return EncodeRing<AudioFormat::kEncoding_Float32, kChannels>(ring, buffer, frames);
+    }
+}
+
+// Copies our mix into our ring, and on to the meter and the tap. A silent
+// mix, as when no client is playing, isn't copied: the ring records it as
+// silence, which its reader and the meter skip over.
+template <UInt32 kChannels>
+static void WriteMix(AudiDeckDevice* device, const Float32* buffer, UInt32 bufferFrames) {
+    DeviceRingBuffer* ring = device->ring.load(std::memory_order_acquire);
+    const bool silent = AudioGain::IsSilent(buffer, bufferFrames * kChannels);
+    UInt64 now = mach_absolute_time();
+    
+    // Latency probe: mark the block's first frame, if it will fit
+    if (device->probeEnabled.load(std::memory_order_relaxed) &&
+        HostTicksToSeconds(now - device->probeMarkHostTime) >= kProbe_IntervalSeconds && ring->freeFrames() != 0) {
+        device->latencyProbe.mark(ring->writePosition(), now);
+        device->probeMarkHostTime = now;
+    }
+    UInt32 written = silent ? ring->writeSilence(bufferFrames) : WriteRing<kChannels>(ring, buffer, bufferFrames);
+    
+    // With nothing reading it the ring sits full, which isn't an overrun
+    if (HostTicksToSeconds(now - device->ringReadHostTime.load(std::memory_order_relaxed)) < kDevice_ReaderIdleSeconds) {
+        device->ioStats.addDropped(bufferFrames - written);
+        device->ioStats.noteFill(ring->availableFrames());
+    }
+    if (silent) {
+        device->outputMeter.processSilence(bufferFrames, kChannels, MeterWindowFrames(device), now);
+    } else {
+        device->outputMeter.process(buffer, bufferFrames, kChannels, MeterWindowFrames(device), now);
+    }
+    
+    AudioTap* tap = device->tap.load(std::memory_order_acquire);
+    if (tap && device->tapEnabled.load(std::memory_order_relaxed)) {
+        tap->write(buffer, bufferFrames, kChannels, device->sampleRate.load(std::memory_order_relaxed));
+        tap->publishStats(device->ioStats);
+    }
+}
+
+// The whole IO path for one physical encoding and channel count. With both
+// fixed at compile time, the gain, meter and mix loops lose their per-layout
+// branches and the conversion is a straight vector loop. Float32 runs in
+// place; an integer format converts through the device's scratch buffer, a
+// bounded number of frames at a time. ProcessOutput is always Float32: it
+// runs in the virtual format, before the HAL converts the mix.
+template <AudioFormat::Encoding kEncoding, UInt32 kChannels>
+static void DeviceIO(AudiDeckDevice* device, UInt32 operationID, UInt32 clientID, void* buffer, UInt32 bufferFrames) {
+    constexpr size_t kFrameBytes = (size_t)kChannels * AudioFormat::BytesPerSample(kEncoding);
+    
+    if (operationID == kAudioServerPlugInIOOperationProcessOutput) {
+        // One app's output, before the HAL mixes it with the others
+        ProcessClientOutput<kChannels>(device, clientID, (Float32*)buffer, bufferFrames);
+    }
+    else if (operationID == kAudioServerPlugInIOOperationWriteMix) {
+        // Apps writing audio to our device
+        if constexpr (kEncoding == AudioFormat::kEncoding_Float32) {
+            WriteMix<kChannels>(device, (const Float32*)buffer, bufferFrames);
+        } else {
+            Float32* scratch = device->ioScratch;
+            for (UInt32 done = 0; done < bufferFrames; ) {
+                UInt32 frames = std::min(bufferFrames - done, (UInt32)kDevice_ScratchFrames);
+                AudioFormat::Decode<kEncoding>(scratch, (const UInt8*)buffer + done * kFrameBytes, frames * kChannels);
+                WriteMix<kChannels>(device, scratch, frames);
+                done += frames;
+            }
+        }
+    }
+    else if (operationID == kAudioServerPlugInIOOperationReadInput) {
+        // Apps reading audio from our device (loopback), plus any apps on
+        // other devices routed here
+        if constexpr (kEncoding == AudioFormat::kEncoding_Float32) {
+            ReadInput<kChannels>(device, (Float32*)buffer, bufferFrames);
+            MixClients<kChannels>(device, (Float32*)buffer, bufferFrames);
+        } else {
+            Float32* scratch = device->ioScratch;
+            for (UInt32 done = 0; done < bufferFrames; ) {
+                UInt32 frames = std::min(bufferFrames - done, (UInt32)kDevice_ScratchFrames);
+                ReadInput<kChannels>(device, scratch, frames);
+                MixClients<kChannels>(device, scratch, frames);
+                AudioFormat::Encode<kEncoding>((UInt8*)buffer + done * kFrameBytes, scratch, frames * kChannels);
+                done += frames;
+            }
+        }
+    }
+}
+
+// One case per kDevice_SupportedChannelCounts entry
+template <AudioFormat::Encoding kEncoding>
+static DeviceIOKernel SelectIOKernel(UInt32 channels) {
+    switch (channels) {
+        case 2:     return DeviceIO<kEncoding, 2>;
+        case 8:     return DeviceIO<kEncoding, 8>;
+        case 16:    return DeviceIO<kEncoding, 16>;
+        default:    return nullptr;
+    }
+}
+
+// Null for a format we don't advertise
+static DeviceIOKernel SelectIOKernel(UInt32 encoding, UInt32 channels) {
+    switch (encoding) {
+        case AudioFormat::kEncoding_Float32:    return SelectIOKernel<AudioFormat::kEncoding_Float32>(channels);
+        case AudioFormat::kEncoding_Int16:      return SelectIOKernel<AudioFormat::kEncoding_Int16>(channels);
+        case AudioFormat::kEncoding_Int24:      return SelectIOKernel<AudioFormat::kEncoding_Int24>(channels);
+        default:                                return nullptr;
+    }
+}
+
+// ============================================================================
+// Forward Declarations
+// ============================================================================
+
+static HRESULT Plugin_QueryInterface(void* driver, REFIID iid, LPVOID* ppv);
+static ULONG Plugin_AddRef(void* driver);
+static ULONG Plugin_Release(void* driver);
+static OSStatus Plugin_Initialize(AudioServerPlugInDriverRef driver, AudioServerPlugInHostRef host);
+static OSStatus Plugin_CreateDevice(AudioServerPlugInDriverRef driver, CFDictionaryRef desc, const AudioServerPlugInClientInfo* clientInfo, AudioObjectID* outID);
+static OSStatus Plugin_DestroyDevice(AudioServerPlugInDriverRef driver, AudioObjectID deviceID);
+static OSStatus Plugin_AddDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo);
+static OSStatus Plugin_RemoveDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo);
+static OSStatus Plugin_PerformConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info);
+static OSStatus Plugin_AbortConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info);
+static Boolean Plugin_HasProperty(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address);
+static OSStatus Plugin_IsPropertySettable(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, Boolean* outSettable);
+static OSStatus Plugin_GetPropertyDataSize(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32* outSize);
+static OSStatus Plugin_GetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 inSize, UInt32* outSize, void* outData);
+static OSStatus Plugin_SetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 dataSize, const void* data);
+static OSStatus Plugin_StartIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID);
+static OSStatus Plugin_StopIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID);
+static OSStatus Plugin_GetZeroTimeStamp(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, Float64* outSampleTime, UInt64* outHostTime, UInt64* outSeed);
+static OSStatus Plugin_WillDoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, Boolean* outWillDo, Boolean* outWillDoInPlace);
+static OSStatus Plugin_BeginIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo);
+static OSStatus Plugin_DoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, AudioObjectID streamID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo, void* mainBuffer, void* secondaryBuffer);
+static OSStatus Plugin_EndIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo);
+
+static void BuildPropertyTables();
+
+// ============================================================================
+// Plugin Interface (COM-style)
+// ============================================================================
+
+static AudioServerPlugInDriverInterface gInterface = {
+    // _reserved
+    NULL,
+    // COM methods
+    Plugin_QueryInterface,
+    Plugin_AddRef,
+    Plugin_Release,
+    // Plugin methods
+    Plugin_Initialize,
+    Plugin_CreateDevice,
+    Plugin_DestroyDevice,
+    Plugin_AddDeviceClient,
+    Plugin_RemoveDeviceClient,
+    Plugin_PerformConfigChange,
+    Plugin_AbortConfigChange,
+    Plugin_HasProperty,
+    Plugin_IsPropertySettable,
+    Plugin_GetPropertyDataSize,
+    Plugin_GetPropertyData,
+    Plugin_SetPropertyData,
+    Plugin_StartIO,
+    Plugin_StopIO,
+    Plugin_GetZeroTimeStamp,
+    Plugin_WillDoIO,
+    Plugin_BeginIO,
+    Plugin_DoIO,
+    Plugin_EndIO
+};
+
+static AudioServerPlugInDriverInterface* gInterfacePtr = &gInterface;
+static AudioServerPlugInDriverRef gDriverRef = &gInterfacePtr;
+
+// ============================================================================
+// Entry Point
+// ============================================================================
+
+// What gArena reserves: the plug-in state, every device and client slot,
+// a few routing tables, and ring storage and scratch for
+// kPlugIn_ArenaDevices devices and kPlugIn_ArenaClients clients, with both
+// of a client's captures, at the default format, twice over for the ring a
+// format change retires, along with its retirement record, and a
+// resampler for each of those devices, should it be a loopback device. Each
+// block is allowed a page of alignment padding. Beyond that, state comes
+// from the heap.
+static size_t ArenaBytes() {
+    auto blocks = [](size_t count, size_t bytes, size_t alignment) {
+        return count * (AudioArena::blockBytesFor(bytes, alignment) + AudioArena::kMaxAlignment);
+    };
+    auto ringBytes = [](Float64 seconds) {
+        return (size_t)ClientRingBuffer::capacityFor((UInt32)(kDevice_SampleRate * seconds)) * kDevice_ChannelCount * sizeof(Float32);
+    };
+    return blocks(1, sizeof(PlugInState), alignof(PlugInState)) +
+           blocks(kPlugIn_MaxDevices, sizeof(AudiDeckDevice), alignof(AudiDeckDevice)) +
+           blocks(kPlugIn_MaxClients, sizeof(AudiDeckClient), alignof(AudiDeckClient)) +
+           blocks(kPlugIn_ArenaRoutingTables, sizeof(RoutingTable), alignof(RoutingTable)) +
+           blocks(2 * kPlugIn_ArenaDevices, sizeof(DeviceRingBuffer), alignof(DeviceRingBuffer)) +
+           blocks(4 * kPlugIn_ArenaClients, sizeof(ClientRingBuffer), alignof(ClientRingBuffer)) +
+           blocks(kPlugIn_ArenaDevices + 2 * kPlugIn_ArenaClients, sizeof(RetiredRing), alignof(RetiredRing)) +
+           blocks(2 * kPlugIn_ArenaDevices, ringBytes(kDevice_RingBufferSeconds), kCacheLineSize) +
+           blocks(4 * kPlugIn_ArenaClients, ringBytes(kClient_RingBufferSeconds), kCacheLineSize) +
+           blocks(kPlugIn_ArenaDevices, (size_t)kDevice_ScratchFrames * kDevice_ChannelCount * sizeof(Float32), kCacheLineSize) +
+           blocks(kPlugIn_ArenaDevices, AudioResampler::kTableBytes, AudioResampler::kStorageAlignment) +
+           blocks(kPlugIn_ArenaDevices, AudioResampler::historyBytesFor(kDevice_SampleRate, kDevice_SampleRate, kDevice_ChannelCount, kDevice_MaxPeriodFrames),
+                  AudioResampler::kStorageAlignment);
+}
+
+extern "C" void* AudiDeckDriverCreate(CFAllocatorRef allocator, CFUUIDRef typeUUID) {
+    if (!CFEqual(typeUUID, kAudioServerPlugInTypeUUID)) {
+        return nullptr;
+    }
+    
+    if (!gState) {
+        gArena = new AudioArena();
+        gArena->reserve(ArenaBytes());
+        gState = new PlugInState();
+        gState->routing.store(new RoutingTable());
+        BuildPropertyTables();
+        mach_timebase_info(&gTimebase);
+        AddDevice(CFSTR(kDevice_UID), CFSTR(kDevice_Name), nullptr, nullptr, kDevice_BufferSize, AudioFormat::kEncoding_Float32, nullptr);
+    }
+    
+    return gDriverRef;
+}
+
+// ============================================================================
+// COM Methods
+// ============================================================================
+
+static HRESULT Plugin_QueryInterface(void* driver, REFIID iid, LPVOID* ppv) {
+    CFUUIDRef interfaceID = CFUUIDCreateFromUUIDBytes(NULL, iid);
+    CFUUIDRef pluginUUID = CFUUIDGetConstantUUIDWithBytes(NULL, 
+        0x44, 0x3A, 0xBA, 0xB8, 0xE7, 0xB3, 0x49, 0x1A,
+        0xB9, 0x85, 0xBE, 0xB9, 0x18, 0x70, 0x30, 0xDB);
+    CFUUIDRef unknownUUID = CFUUIDGetConstantUUIDWithBytes(NULL,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46);
+    
+    Boolean match = CFEqual(interfaceID, pluginUUID) || CFEqual(interfaceID, unknownUUID);
+    CFRelease(interfaceID);
+    
+    if (match) {
+        Plugin_AddRef(driver);
+        *ppv = driver;
+        return kAudioHardwareNoError;
+    }
+    
+    *ppv = NULL;
+    return E_NOINTERFACE;
+}
+
+static ULONG Plugin_AddRef(void* driver) {
+    return 1;  // Singleton, never deallocated
+}
+
+static ULONG Plugin_Release(void* driver) {
+    return 1;  // Singleton, never deallocated
+}
+
+// ============================================================================
+// Plugin Lifecycle
+// ============================================================================
+
+// The description may carry "uid" and "name" CFStrings; missing ones are
+// generated from the new device's object ID. An optional "loopback source"
+// UID makes the new device's input play back that device's output, and
+// "clock reference" (the same UID) locks its clock to it. "period frames"
+// and "ring encoding" are CFNumbers, as for kAudiDeckDevicePropertyPeriodFrames
+// and kAudiDeckDevicePropertyRingEncoding. A value of the wrong type fails
+// the whole description: these come from any HAL client and, through the
+// device list, back out of host storage on every launch. Caller holds
+// gState->mutex.
+static OSStatus CreateDeviceFromDescription(CFDictionaryRef desc, AudioObjectID* outID) {
+    CFStringRef uid = desc ? (CFStringRef)CFDictionaryGetValue(desc, CFSTR("uid")) : nullptr;
+    CFStringRef name = desc ? (CFStringRef)CFDictionaryGetValue(desc, CFSTR("name")) : nullptr;
+    CFStringRef source = desc ? (CFStringRef)CFDictionaryGetValue(desc, CFSTR("loopback source")) : nullptr;
+    CFStringRef clockReference = desc ? (CFStringRef)CFDictionaryGetValue(desc, CFSTR("clock reference")) : nullptr;
+    CFNumberRef period = desc ? (CFNumberRef)CFDictionaryGetValue(desc, CFSTR("period frames")) : nullptr;
+    CFNumberRef ringEncoding = desc ? (CFNumberRef)CFDictionaryGetValue(desc, CFSTR("ring encoding")) : nullptr;
+    const CFTypeRef strings[] = { uid, name, source, clockReference };
+    for (CFTypeRef string : strings) {
+        if (string && CFGetTypeID(string) != CFStringGetTypeID()) {
+            return kAudioHardwareIllegalOperationError;
+        }
+    }
+    
+    SInt32 periodFrames = kDevice_BufferSize;
+    SInt32 encoding = AudioFormat::kEncoding_Float32;
+    if ((period && !GetSInt32(period, &periodFrames)) || (ringEncoding && !GetSInt32(ringEncoding, &encoding))) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    
+    char generated[64];
+    CFStringRef ownedUID = nullptr;
+    CFStringRef ownedName = nullptr;
+    if (!uid) {
+        snprintf(generated, sizeof(generated), "%s_%u", kDevice_UID, (unsigned)gState->nextObjectID);
+        uid = ownedUID = CFStringCreateWithCString(NULL, generated, kCFStringEncodingUTF8);
+    }
+    if (!name) {
+        snprintf(generated, sizeof(generated), "%s %u", kDevice_Name, (unsigned)gState->nextObjectID);
+        name = ownedName = CFStringCreateWithCString(NULL, generated, kCFStringEncodingUTF8);
+    }
+    
+    OSStatus status = AddDevice(uid, name, source, clockReference, (UInt32)std::max(periodFrames, 0), (UInt32)std::max(encoding, 0), outID);
+    
+    if (ownedUID) CFRelease(ownedUID);
+    if (ownedName) CFRelease(ownedName);
+    return status;
+}
+
+// Caller holds gState->mutex.
+static OSStatus DestroyDevice(AudioObjectID deviceID) {
+    OSStatus status = RemoveDevice(deviceID);
+    if (status == kAudioHardwareNoError) {
+        RemoveClientsOfDevice(deviceID);
+    }
+    return status;
+}
+
+static bool IsBuiltInDevice(const AudiDeckDevice* device) {
+    return CFEqual(device->uid, CFSTR(kDevice_UID));
+}
+
+// The description CreateDeviceFromDescription() would make `device` again
+// from, with the period and ring encoding last asked of it. Caller holds
+// gState->mutex.
+static CFDictionaryRef CreateDeviceDescription(AudiDeckDevice* device) {
+    pthread_mutex_lock(&device->mutex);
+    SInt32 periodFrames = (SInt32)device->pendingPeriodFrames;
+    SInt32 ringEncoding = (SInt32)device->pendingRingEncoding;
+    pthread_mutex_unlock(&device->mutex);
+    CFNumberRef period = CFNumberCreate(NULL, kCFNumberSInt32Type, &periodFrames);
+    CFNumberRef encoding = CFNumberCreate(NULL, kCFNumberSInt32Type, &ringEncoding);
+    AudiDeckDevice* source = FindDevice(device->loopbackSourceID);
+    
+    const void* keys[6] = { CFSTR("uid"), CFSTR("name"), CFSTR("period frames"), CFSTR("ring encoding") };
+    const void* values[6] = { device->uid, device->name, period, encoding };
+    CFIndex count = 4;
+    if (source) {
+        keys[count] = CFSTR("loopback source");
+        values[count++] = source->uid;
+    }
+    if (source && device->clockReferenceID != kAudioObjectUnknown) {
+        keys[count] = CFSTR("clock reference");
+        values[count++] = source->uid;
+    }
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(period);
+    CFRelease(encoding);
+    return dict;
+}
+
+// The kAudiDeckPlugInPropertyDevices value: every device but the built-in
+// one, oldest first, so that replaying it creates a loopback source before
+// the devices that read it. Caller holds gState->mutex.
+static CFArrayRef CreateDeviceList() {
+    AudiDeckDevice* devices[kPlugIn_MaxDevices];
+    UInt32 count = 0;
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* device = gState->devices[i].load(std::memory_order_relaxed);
+        if (device && !IsBuiltInDevice(device)) {
+            devices[count++] = device;
+        }
+    }
+    std::sort(devices, devices + count, [](const AudiDeckDevice* a, const AudiDeckDevice* b) { return a->objectID < b->objectID; });
+    
+    CFDictionaryRef descriptions[kPlugIn_MaxDevices];
+    for (UInt32 i = 0; i < count; i++) {
+        descriptions[i] = CreateDeviceDescription(devices[i]);
+    }
+    CFArrayRef list = CFArrayCreate(NULL, (const void**)descriptions, count, &kCFTypeArrayCallBacks);
+    for (UInt32 i = 0; i < count; i++) {
+        CFRelease(descriptions[i]);
+    }
+    return list;
+}
+
+// Brings the device table in line with `list`, a kAudiDeckPlugInPropertyDevices
+// value. Devices it doesn't name go first, then those it names that don't
+// exist yet are created in its order; devices that already exist are kept
+// as they are, running or not, so to change one it has to leave the list
+// and come back. The built-in device always stays. Every entry is tried;
+// the first failure is returned. Caller holds gState->mutex.
+static OSStatus ApplyDeviceList(CFPropertyListRef list, bool* outChanged) {
+    *outChanged = false;
+    if (!list || CFGetTypeID(list) != CFArrayGetTypeID()) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    CFArrayRef array = (CFArrayRef)list;
+    const CFIndex count = CFArrayGetCount(array);
+    for (CFIndex i = 0; i < count; i++) {
+        CFTypeRef desc = CFArrayGetValueAtIndex(array, i);
+        CFTypeRef uid = (CFGetTypeID(desc) == CFDictionaryGetTypeID()) ? CFDictionaryGetValue((CFDictionaryRef)desc, CFSTR("uid")) : nullptr;
+        if (!uid || CFGetTypeID(uid) != CFStringGetTypeID()) {
+            return kAudioHardwareIllegalOperationError;
+        }
+    }
+    
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* device = gState->devices[i].load(std::memory_order_relaxed);
+        if (!device || IsBuiltInDevice(device)) continue;
+        bool listed = false;
+        for (CFIndex j = 0; j < count && !listed; j++) {
+            listed = CFEqual(device->uid, CFDictionaryGetValue((CFDictionaryRef)CFArrayGetValueAtIndex(array, j), CFSTR("uid")));
+        }
+        if (!listed && DestroyDevice(device->objectID) == kAudioHardwareNoError) {
+            *outChanged = true;
+        }
+    }
+    
+    OSStatus result = kAudioHardwareNoError;
+    for (CFIndex i = 0; i < count; i++) {
+        CFDictionaryRef desc = (CFDictionaryRef)CFArrayGetValueAtIndex(array, i);
+        if (FindDeviceByUID((CFStringRef)CFDictionaryGetValue(desc, CFSTR("uid")))) continue;
+        OSStatus status = CreateDeviceFromDescription(desc, nullptr);
+        if (status == kAudioHardwareNoError) {
+            *outChanged = true;
+        } else if (result == kAudioHardwareNoError) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+// Keeps the device list in the host's storage, so the devices come back
+// with coreaudiod instead of having to be provisioned again
+static void SaveDeviceList() {
+    if (!gState->host || !gState->host->WriteToStorage) return;
+    
+    pthread_mutex_lock(&gState->mutex);
+    CFArrayRef list = CreateDeviceList();
+    pthread_mutex_unlock(&gState->mutex);
+    gState->host->WriteToStorage(gState->host, CFSTR(kPlugIn_DeviceListStorageKey), (CFPropertyListRef)list);
+    CFRelease(list);
+}
+
+static void RestoreDeviceList() {
+    CFPropertyListRef list = nullptr;
+    if (!gState->host->CopyFromStorage ||
+        gState->host->CopyFromStorage(gState->host, CFSTR(kPlugIn_DeviceListStorageKey), &list) != kAudioHardwareNoError || !list) {
+        return;
+    }
+    bool changed;
+    pthread_mutex_lock(&gState->mutex);
+    ApplyDeviceList(list, &changed);
+    pthread_mutex_unlock(&gState->mutex);
+    CFRelease(list);
+}
+
+// Devices saved by an earlier run are recreated before the HAL first asks
+// for the device list
+static OSStatus Plugin_Initialize(AudioServerPlugInDriverRef driver, AudioServerPlugInHostRef host) {
+    gState->host = host;
+    RestoreDeviceList();
+    return kAudioHardwareNoError;
+}
+
+// See CreateDeviceFromDescription() for the description's keys
+static OSStatus Plugin_CreateDevice(AudioServerPlugInDriverRef driver, CFDictionaryRef desc, const AudioServerPlugInClientInfo* clientInfo, AudioObjectID* outID) {
+    pthread_mutex_lock(&gState->mutex);
+    OSStatus status = CreateDeviceFromDescription(desc, outID);
+    pthread_mutex_unlock(&gState->mutex);
+    
+    if (status == kAudioHardwareNoError) {
+        NotifyDeviceListChanged();
+        SaveDeviceList();
+    }
+    return status;
+}
+
+static OSStatus Plugin_DestroyDevice(AudioServerPlugInDriverRef driver, AudioObjectID deviceID) {
+    pthread_mutex_lock(&gState->mutex);
+    OSStatus status = DestroyDevice(deviceID);
+    pthread_mutex_unlock(&gState->mutex);
+    
+    if (status == kAudioHardwareNoError) {
+        NotifyDeviceListChanged();
+        SaveDeviceList();
+    }
+    return status;
+}
+
+// Gives the client its own slot, picking up any route saved for its bundle
+// ID. With the table full the client still plays through the device's mix;
+// it just can't be routed or have its gain set.
+static OSStatus Plugin_AddDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo) {
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
+    }
+    
+    pthread_mutex_lock(&gState->mutex);
+    ReclaimRetiredClients();
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        if (gState->clients[i].load(std::memory_order_relaxed) == nullptr) {
+            CFStringRef bundleID = clientInfo->mBundleID ? (CFStringRef)CFRetain(clientInfo->mBundleID) : nullptr;
+            AudiDeckClient* client = new AudiDeckClient(clientInfo->mClientID, deviceID, clientInfo->mProcessID, bundleID);
+            ConfigureClientIO(client, device);
+            
+            // Not published yet, so its IO state is still ours to set
+            const ClientRoute* route = ResolveClientRoute(gState->routing.load(std::memory_order_relaxed), bundleID);
+            client->route.store(route, std::memory_order_relaxed);
+            client->gainStage.reset(route->targetGain());
+            client->playing.deviceID = route->deviceID;
+            client->playing.exclusive = route->exclusive;
+            if (IsCaptured(client, client->playing)) {
+                client->captures[0].readHostTime.store(mach_absolute_time(), std::memory_order_relaxed);
+                client->captures[0].targetID.store(route->deviceID, std::memory_order_relaxed);
+            }
+            gState->clients[i].store(client, std::memory_order_release);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gState->mutex);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus Plugin_RemoveDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo) {
+    pthread_mutex_lock(&gState->mutex);
+    ReclaimRetiredClients();
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_relaxed);
+        if (client && client->deviceID == deviceID && client->clientID == clientInfo->mClientID) {
+            RetireClient(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gState->mutex);
+    return kAudioHardwareNoError;
+}
+
+// The HAL has stopped IO on the device before calling this
+static OSStatus Plugin_PerformConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info) {
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
+    }
+    if (action != kDeviceConfigChange_Format) {
+        return kAudioHardwareNoError;
+    }
+    
+    pthread_mutex_lock(&device->mutex);
+    device->sampleRate.store(device->pendingSampleRate);
+    device->channelCount.store(device->pendingChannelCount);
+    device->periodFrames.store(device->pendingPeriodFrames);
+    device->encoding.store(device->pendingEncoding);
+    device->ringEncoding.store(device->pendingRingEncoding);
+    pthread_mutex_unlock(&device->mutex);
+    
+    // Our clients capture in our format
+    pthread_mutex_lock(&gState->mutex);
+    ConfigureDeviceIO(device);
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_relaxed);
+        if (client && client->deviceID == deviceID) {
+            ConfigureClientIO(client, device);
+        }
+    }
+    pthread_mutex_unlock(&gState->mutex);
+    Trace(kTraceEvent_ConfigChange, deviceID, 0, device->periodFrames.load(), (UInt64)device->sampleRate.load());
+    
+    // Loopback consumers of this device read silence until they have taken
+    // our channel count and reconfigured their resampler for our new format;
+    // they keep their own rate
+    for (UInt32 i = 0; i < kPlugIn_MaxDevices; i++) {
+        AudiDeckDevice* consumer = gState->devices[i].load(std::memory_order_acquire);
+        if (consumer && consumer->loopbackSourceID == deviceID && gState->host) {
+            pthread_mutex_lock(&consumer->mutex);
+            consumer->pendingChannelCount = device->channelCount.load();
+            pthread_mutex_unlock(&consumer->mutex);
+            gState->host->RequestDeviceConfigurationChange(gState->host, consumer->objectID, kDeviceConfigChange_Format, nullptr);
+        }
+    }
+    return kAudioHardwareNoError;
+}
+
+static OSStatus Plugin_AbortConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info) {
+    return kAudioHardwareNoError;
+}
+
+// ============================================================================
+// Property Queries
+// ============================================================================
+
+static void FillStreamFormat(AudioStreamBasicDescription* desc, Float64 sampleRate, UInt32 channels,
+                             UInt32 encoding = AudioFormat::kEncoding_Float32) {
+    const UInt32 bytesPerSample = AudioFormat::BytesPerSample((AudioFormat::Encoding)encoding);
+    desc->mSampleRate = sampleRate;
+    desc->mFormatID = kAudioFormatLinearPCM;
+    desc->mFormatFlags = (encoding == AudioFormat::kEncoding_Float32 ? kAudioFormatFlagIsFloat : kAudioFormatFlagIsSignedInteger) |
+                         kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
+    desc->mBytesPerPacket = channels * bytesPerSample;
+    desc->mFramesPerPacket = 1;
+    desc->mBytesPerFrame = channels * bytesPerSample;
+    desc->mChannelsPerFrame = channels;
+    desc->mBitsPerChannel = bytesPerSample * 8;
+    desc->mReserved = 0;
+}
+
+// False unless `desc` is one of our formats, in any encoding
+static bool ParseStreamFormat(const AudioStreamBasicDescription* desc, UInt32* outEncoding) {
+    if (desc->mFormatID != kAudioFormatLinearPCM ||
+        (desc->mFormatFlags & kAudioFormatFlagIsBigEndian) != (kAudioFormatFlagsNativeEndian & kAudioFormatFlagIsBigEndian) ||
+        (desc->mFormatFlags & kAudioFormatFlagIsNonInterleaved) ||
+        !IsSupportedSampleRate(desc->mSampleRate) ||
+        !IsSupportedChannelCount(desc->mChannelsPerFrame)) {
+        return false;
+    }
+    for (UInt32 i = 0; i < kDevice_EncodingCount; i++) {
+        AudioFormat::Encoding encoding = kDevice_SupportedEncodings[i];
+        bool isFloat = encoding == AudioFormat::kEncoding_Float32;
+        UInt32 bytesPerSample = AudioFormat::BytesPerSample(encoding);
+        if (isFloat == ((desc->mFormatFlags & kAudioFormatFlagIsFloat) != 0) &&
+            desc->mBitsPerChannel == bytesPerSample * 8 &&
+            desc->mBytesPerFrame == desc->mChannelsPerFrame * bytesPerSample) {
+            *outEncoding = encoding;
+            return true;
+        }
+    }
+    return false;
+}
+
+// False when the meter has never published. A stream that stopped long
+// enough ago reads as silence rather than its last levels.
+static bool ReadLevels(const AudioMeter::Meter& meter, AudioMeter::Levels* outLevels) {
+    if (!meter.read(outLevels)) {
+        return false;
+    }
+    if (HostTicksToSeconds(mach_absolute_time() - outLevels->hostTime) > kMeter_HoldSeconds) {
+        std::fill(outLevels->peak, outLevels->peak + outLevels->channels, 0.0f);
+        std::fill(outLevels->rms, outLevels->rms + outLevels->channels, 0.0f);
+    }
+    return true;
+}
+
+static CFArrayRef CreateNumberArray(const Float32* values, UInt32 count) {
+    CFNumberRef numbers[AudioMeter::kMaxChannels];
+    for (UInt32 i = 0; i < count; i++) {
+        numbers[i] = CFNumberCreate(NULL, kCFNumberFloat32Type, &values[i]);
+    }
+    CFArrayRef array = CFArrayCreate(NULL, (const void**)numbers, count, &kCFTypeArrayCallBacks);
+    for (UInt32 i = 0; i < count; i++) {
+        CFRelease(numbers[i]);
+    }
+    return array;
+}
+
+// {"peak": [...], "rms": [...]}: one CFNumber per channel, linear full scale.
+// Both are empty until audio has flowed.
+static CFDictionaryRef CreateLevelsDictionary(const AudioMeter::Levels& levels) {
+    CFArrayRef peak = CreateNumberArray(levels.peak, levels.channels);
+    CFArrayRef rms = CreateNumberArray(levels.rms, levels.channels);
+    
+    const void* keys[] = { CFSTR("peak"), CFSTR("rms") };
+    const void* values[] = { peak, rms };
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(peak);
+    CFRelease(rms);
+    return dict;
+}
+
+// The device's IO counters as one CFNumber each (see AudioStats.hpp), with
+// its ring's capacity to measure "maxFillFrames" against. Durations are in
+// nanoseconds, per DoIO call. The "latency" and "jitter" counts are the
+// latency probe's, kept only while it's on: the latency through our ring,
+// from WriteMix to the app reading it, and how far each IO cycle began
+// from one period after the last. Their distribution is in
+// CreateProbeHistogramDictionary().
+static CFDictionaryRef CreateIOStatsDictionary(AudiDeckDevice* device) {
+    AudioIOStats stats = device->ioStats.read();
+    AudioDurations latency = device->latencyProbe.latency.read();
+    AudioDurations jitter = device->cycleJitter.read();
+    const SInt64 values[] = {
+        (SInt64)stats.cycles, (SInt64)stats.framesDropped, (SInt64)stats.framesZeroFilled,
+        (SInt64)stats.maxFillFrames, (SInt64)device->ring.load()->capacityFrames(),
+        (SInt64)stats.ioCount, (SInt64)stats.ioMinNanos, (SInt64)stats.ioMeanNanos(), (SInt64)stats.ioMaxNanos,
+        (SInt64)latency.count, (SInt64)latency.minNanos, (SInt64)latency.meanNanos(), (SInt64)latency.maxNanos,
+        (SInt64)jitter.count, (SInt64)jitter.meanNanos(), (SInt64)jitter.maxNanos
+    };
+    const void* keys[] = {
+        CFSTR("cycles"), CFSTR("framesDropped"), CFSTR("framesZeroFilled"),
+        CFSTR("maxFillFrames"), CFSTR("capacityFrames"),
+        CFSTR("ioCount"), CFSTR("ioMinNanos"), CFSTR("ioMeanNanos"), CFSTR("ioMaxNanos"),
+        CFSTR("latencyCount"), CFSTR("latencyMinNanos"), CFSTR("latencyMeanNanos"), CFSTR("latencyMaxNanos"),
+        CFSTR("jitterCount"), CFSTR("jitterMeanNanos"), CFSTR("jitterMaxNanos")
+    };
+    constexpr UInt32 count = sizeof(values) / sizeof(values[0]);
+    CFNumberRef numbers[count];
+    for (UInt32 i = 0; i < count; i++) {
+        numbers[i] = CFNumberCreate(NULL, kCFNumberSInt64Type, &values[i]);
+    }
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, (const void**)numbers, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    for (UInt32 i = 0; i < count; i++) {
+        CFRelease(numbers[i]);
+    }
+    return dict;
+}
+
+static CFArrayRef CreateSInt64Array(const UInt64* values, UInt32 count) {
+    CFNumberRef numbers[AudioDurations::kBucketCount];
+    for (UInt32 i = 0; i < count; i++) {
+        SInt64 value = (SInt64)values[i];
+        numbers[i] = CFNumberCreate(NULL, kCFNumberSInt64Type, &value);
+    }
+    CFArrayRef array = CFArrayCreate(NULL, (const void**)numbers, count, &kCFTypeArrayCallBacks);
+    for (UInt32 i = 0; i < count; i++) {
+        CFRelease(numbers[i]);
+    }
+    return array;
+}
+
+// {"bucketUpperNanos": [...], "latency": [...], "jitter": [...]}: the
+// latency probe's counts per duration bucket (see AudioDurations), of the
+// same durations as CreateIOStatsDictionary()'s. There is one bound fewer
+// than buckets; the last bucket is everything above the last bound.
+static CFDictionaryRef CreateProbeHistogramDictionary(AudiDeckDevice* device) {
+    UInt64 bounds[AudioDurations::kBucketCount - 1];
+    for (UInt32 b = 0; b < AudioDurations::kBucketCount - 1; b++) {
+        bounds[b] = AudioDurations::upperNanos(b);
+    }
+    AudioDurations latency = device->latencyProbe.latency.read();
+    AudioDurations jitter = device->cycleJitter.read();
+    CFArrayRef arrays[] = {
+        CreateSInt64Array(bounds, AudioDurations::kBucketCount - 1),
+        CreateSInt64Array(latency.buckets, AudioDurations::kBucketCount),
+        CreateSInt64Array(jitter.buckets, AudioDurations::kBucketCount)
+    };
+    
+    const void* keys[] = { CFSTR("bucketUpperNanos"), CFSTR("latency"), CFSTR("jitter") };
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, (const void**)arrays, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    for (CFArrayRef array : arrays) {
+        CFRelease(array);
+    }
+    return dict;
+}
+
+// Caller holds gState->mutex.
+static CFDictionaryRef CreateClientRouteDictionary(const ClientRoute& route) {
+    AudiDeckDevice* device = FindDevice(route.deviceID);
+    SInt32 muted = route.muted ? 1 : 0;
+    SInt32 exclusive = route.exclusive ? 1 : 0;
+    CFNumberRef gain = CFNumberCreate(NULL, kCFNumberFloat32Type, &route.gain);
+    CFNumberRef mutedNumber = CFNumberCreate(NULL, kCFNumberSInt32Type, &muted);
+    CFNumberRef exclusiveNumber = CFNumberCreate(NULL, kCFNumberSInt32Type, &exclusive);
+    CFNumberRef crossfade = CFNumberCreate(NULL, kCFNumberFloat32Type, &route.crossfadeMs);
+    
+    const void* keys[] = { CFSTR("device"), CFSTR("gain"), CFSTR("muted"), CFSTR("exclusive"), CFSTR("crossfade") };
+    const void* values[] = { device ? device->uid : CFSTR(""), gain, mutedNumber, exclusiveNumber, crossfade };
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, values, 5, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(gain);
+    CFRelease(mutedNumber);
+    CFRelease(exclusiveNumber);
+    CFRelease(crossfade);
+    return dict;
+}
+
+// The kAudiDeckPlugInPropertyRoutingConfiguration value for `table`. Caller
+// holds gState->mutex.
+static CFDictionaryRef CreateRoutingConfigurationDictionary(const RoutingTable* table) {
+    const void* bundleIDs[kPlugIn_MaxClients];
+    const void* routes[kPlugIn_MaxClients];
+    for (UInt32 i = 0; i < table->routeCount; i++) {
+        bundleIDs[i] = table->routes[i].bundleID;
+        routes[i] = CreateClientRouteDictionary(table->routes[i]);
+    }
+    CFDictionaryRef routesDict = CFDictionaryCreate(NULL, bundleIDs, routes, table->routeCount, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    for (UInt32 i = 0; i < table->routeCount; i++) {
+        CFRelease(routes[i]);
+    }
+    
+    SInt32 enabled = table->enabled ? 1 : 0;
+    CFNumberRef enabledNumber = CFNumberCreate(NULL, kCFNumberSInt32Type, &enabled);
+    const void* keys[] = { CFSTR("enabled"), CFSTR("routes") };
+    const void* values[] = { enabledNumber, routesDict };
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(enabledNumber);
+    CFRelease(routesDict);
+    return dict;
+}
+
+// Keys missing from `value` take their defaults: no device, unity gain, not
+// muted, not exclusive, kClient_CrossfadeMs. Returns
+// kAudioHardwareBadDeviceError, with the rest of the route filled in, if the
+// device UID isn't one of ours.
+static OSStatus ParseClientRoute(CFPropertyListRef value, ClientRoute* outRoute) {
+    *outRoute = ClientRoute();
+    if (!value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    CFTypeRef uid = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("device"));
+    CFTypeRef gain = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("gain"));
+    CFTypeRef muted = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("muted"));
+    CFTypeRef exclusive = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("exclusive"));
+    CFTypeRef crossfade = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("crossfade"));
+    
+    SInt32 isMuted = 0;
+    SInt32 isExclusive = 0;
+    if ((uid && CFGetTypeID(uid) != CFStringGetTypeID()) ||
+        (gain && (!GetFloat32(gain, &outRoute->gain) || !(outRoute->gain >= 0.0f && outRoute->gain <= 1.0f))) ||
+        (muted && !GetSInt32(muted, &isMuted)) ||
+        (exclusive && !GetSInt32(exclusive, &isExclusive)) ||
+        (crossfade && (!GetFloat32(crossfade, &outRoute->crossfadeMs) ||
+                       !(outRoute->crossfadeMs >= 0.0f && outRoute->crossfadeMs <= kClient_MaxCrossfadeMs)))) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    outRoute->muted = (isMuted != 0);
+    outRoute->exclusive = (isExclusive != 0);
+    
+    if (uid && CFStringGetLength((CFStringRef)uid) > 0) {
+        AudiDeckDevice* device = FindDeviceByUID((CFStringRef)uid);
+        if (!device) {
+            return kAudioHardwareBadDeviceError;
+        }
+        outRoute->deviceID = device->objectID;
+    }
+    return kAudioHardwareNoError;
+}
+
+static bool IsDefaultClientRoute(const ClientRoute& route) {
+    return route.deviceID == kAudioObjectUnknown && route.gain == 1.0f && !route.muted && !route.exclusive &&
+           route.crossfadeMs == kClient_CrossfadeMs;
+}
+
+// Saves the route for the bundle ID and applies it to every client with it,
+// now and as they join.
+static OSStatus SetClientRoute(CFStringRef bundleID, CFPropertyListRef value) {
+    if (!bundleID || CFGetTypeID(bundleID) != CFStringGetTypeID()) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    ClientRoute route;
+    OSStatus status = ParseClientRoute(value, &route);
+    if (status != kAudioHardwareNoError) {
+        return status;
+    }
+    
+    pthread_mutex_lock(&gState->mutex);
+    RoutingTable* table = CopyRoutingTable(gState->routing.load(std::memory_order_relaxed));
+    ClientRoute* entry = const_cast<ClientRoute*>(FindClientRoute(table, bundleID));
+    if (IsDefaultClientRoute(route)) {
+        // The default route needs no entry
+        if (entry) {
+            CFRelease(entry->bundleID);
+            *entry = table->routes[--table->routeCount];
+        }
+    } else if (entry) {
+        route.bundleID = entry->bundleID;
+        *entry = route;
+    } else if (table->routeCount < kPlugIn_MaxClients) {
+        route.bundleID = (CFStringRef)CFRetain(bundleID);
+        table->routes[table->routeCount++] = route;
+    } else {
+        status = kAudioHardwareUnspecifiedError;
+    }
+    
+    if (status == kAudioHardwareNoError) {
+        PublishRoutingTable(table);
+    } else {
+        delete table;
+    }
+    pthread_mutex_unlock(&gState->mutex);
+    return status;
+}
+
+// Replaces every route at once. The configuration may also route apps to
+// outputs that aren't ours, such as physical devices, which the driver can't
+// reach; those apps stay on their own device, still at their route's gain.
+static OSStatus SetRoutingConfiguration(CFPropertyListRef value) {
+    if (!value || CFGetTypeID(value) != CFDictionaryGetTypeID()) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    CFTypeRef enabled = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("enabled"));
+    CFTypeRef routes = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("routes"));
+    SInt32 isEnabled = 1;
+    if ((enabled && !GetSInt32(enabled, &isEnabled)) ||
+        (routes && CFGetTypeID(routes) != CFDictionaryGetTypeID())) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    CFIndex count = routes ? CFDictionaryGetCount((CFDictionaryRef)routes) : 0;
+    if (count > (CFIndex)kPlugIn_MaxClients) {
+        return kAudioHardwareUnspecifiedError;
+    }
+    
+    const void* bundleIDs[kPlugIn_MaxClients];
+    const void* values[kPlugIn_MaxClients];
+    if (count > 0) {
+        CFDictionaryGetKeysAndValues((CFDictionaryRef)routes, bundleIDs, values);
+    }
+    
+    // Parsed before taking the mutex; device lookups are lock-free
+    RoutingTable* table = new RoutingTable();
+    table->enabled = (isEnabled != 0);
+    for (CFIndex i = 0; i < count; i++) {
+        ClientRoute route;
+        OSStatus status = kAudioHardwareIllegalOperationError;
+        if (CFGetTypeID(bundleIDs[i]) == CFStringGetTypeID()) {
+            status = ParseClientRoute((CFPropertyListRef)values[i], &route);
+        }
+        if (status == kAudioHardwareBadDeviceError) {
+            route.exclusive = false;
+        } else if (status != kAudioHardwareNoError) {
+            delete table;
+            return status;
+        }
+        if (!IsDefaultClientRoute(route)) {
+            route.bundleID = (CFStringRef)CFRetain(bundleIDs[i]);
+            table->routes[table->routeCount++] = route;
+        }
+    }
+    
+    pthread_mutex_lock(&gState->mutex);
+    PublishRoutingTable(table);
+    pthread_mutex_unlock(&gState->mutex);
+    return kAudioHardwareNoError;
+}
+
+// ============================================================================
+// Property Handlers
+// ============================================================================
+
+// What a property handler is asked about
+struct PropertyContext {
+    AudiDeckDevice* device;             // Owner of the object; null for the plug-in
+    UInt32 deviceObject;                // kDeviceObject_* of the object
+    const AudioObjectPropertyAddress* address;
+    UInt32 qualifierSize;
+    const void* qualifier;
+};
+
+// Getters write `count` elements: 1 for a single value, or at most what the
+// property's count handler returned, already cut to the caller's buffer.
+// Setters are only called with at least one element's worth of data.
+typedef UInt32 (*PropertyCountProc)(const PropertyContext& context);
+typedef OSStatus (*PropertyGetProc)(const PropertyContext& context, UInt32 count, void* outData);
+typedef OSStatus (*PropertySetProc)(const PropertyContext& context, UInt32 dataSize, const void* data);
+
+struct PropertyDescriptor {
+    AudioObjectPropertySelector selector;
+    UInt32 elementSize;
+    PropertyCountProc count;            // Null for a single value
+    PropertyGetProc get;
+    PropertySetProc set;                // Null for read-only
+};
+
+struct PropertyTable {
+    PropertyDescriptor* descriptors;
+    UInt32 count;
+};
+
+static OSStatus CopyObjectIDs(const AudioObjectID* ids, UInt32 count, void* outData) {
+    std::copy(ids, ids + count, (AudioObjectID*)outData);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus CopyCustomPropertyInfo(const AudioServerPlugInCustomPropertyInfo* info, UInt32 count, void* outData) {
+    std::copy(info, info + count, (AudioServerPlugInCustomPropertyInfo*)outData);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus ReturnPropertyList(CFPropertyListRef value, void* outData) {
+    *((CFPropertyListRef*)outData) = value;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus ReturnSInt32(SInt32 value, void* outData) {
+    return ReturnPropertyList((CFPropertyListRef)CFNumberCreate(NULL, kCFNumberSInt32Type, &value), outData);
+}
+
+static bool IsBundleIDQualifier(const PropertyContext& context) {
+    return context.qualifierSize == sizeof(CFStringRef) && context.qualifier;
+}
+
+// --- Any object ---
+
+template <UInt32 kValue>
+static OSStatus GetUInt32(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = kValue;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetOwningDevice(const PropertyContext& context, UInt32 count, void* outData) {
+    *((AudioObjectID*)outData) = context.device->objectID;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetManufacturer(const PropertyContext& context, UInt32 count, void* outData) {
+    *((CFStringRef*)outData) = CFSTR(kDevice_Manufacturer);
+    return kAudioHardwareNoError;
+}
+
+// --- Plug-in ---
+
+static UInt32 CountPlugInDevices(const PropertyContext& context) {
+    return CopyDeviceIDs(nullptr, 0);
+}
+
+static OSStatus GetPlugInDevices(const PropertyContext& context, UInt32 count, void* outData) {
+    CopyDeviceIDs((AudioObjectID*)outData, count);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetPlugInTranslateUIDToDevice(const PropertyContext& context, UInt32 count, void* outData) {
+    AudiDeckDevice* device = (context.qualifierSize == sizeof(CFStringRef)) ? FindDeviceByUID(*(const CFStringRef*)context.qualifier) : nullptr;
+    *((AudioObjectID*)outData) = device ? device->objectID : (AudioObjectID)kAudioObjectUnknown;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetPlugInResourceBundle(const PropertyContext& context, UInt32 count, void* outData) {
+    *((CFStringRef*)outData) = CFSTR("");
+    return kAudioHardwareNoError;
+}
+
+static UInt32 CountPlugInCustomProperties(const PropertyContext& context) {
+    return kPlugIn_CustomPropertyCount;
+}
+
+static OSStatus GetPlugInCustomProperties(const PropertyContext& context, UInt32 count, void* outData) {
+    return CopyCustomPropertyInfo(kPlugIn_CustomProperties, count, outData);
+}
+
+static OSStatus GetPlugInClientRoute(const PropertyContext& context, UInt32 count, void* outData) {
+    if (!IsBundleIDQualifier(context)) {
+        return kAudioHardwareBadPropertySizeError;
+    }
+    pthread_mutex_lock(&gState->mutex);
+    const ClientRoute* route = FindClientRoute(gState->routing.load(std::memory_order_relaxed), *(const CFStringRef*)context.qualifier);
+    CFDictionaryRef dict = CreateClientRouteDictionary(route ? *route : kClientRoute_Default);
+    pthread_mutex_unlock(&gState->mutex);
+    return ReturnPropertyList((CFPropertyListRef)dict, outData);
+}
+
+static OSStatus SetPlugInClientRoute(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    if (!IsBundleIDQualifier(context)) {
+        return kAudioHardwareBadPropertySizeError;
+    }
+    return SetClientRoute(*(const CFStringRef*)context.qualifier, *((const CFPropertyListRef*)data));
+}
+
+// An app may have clients on several devices; take the loudest
+static OSStatus GetPlugInClientLevels(const PropertyContext& context, UInt32 count, void* outData) {
+    if (!IsBundleIDQualifier(context)) {
+        return kAudioHardwareBadPropertySizeError;
+    }
+    AudioMeter::Levels levels = {};
+    AudioMeter::Levels clientLevels;
+    CFStringRef bundleID = *(const CFStringRef*)context.qualifier;
+    for (UInt32 i = 0; i < kPlugIn_MaxClients; i++) {
+        AudiDeckClient* client = gState->clients[i].load(std::memory_order_acquire);
+        if (client && client->bundleID && CFEqual(client->bundleID, bundleID) && ReadLevels(client->meter, &clientLevels)) {
+            for (UInt32 ch = 0; ch < clientLevels.channels; ch++) {
+                levels.peak[ch] = (ch < levels.channels) ? std::max(levels.peak[ch], clientLevels.peak[ch]) : clientLevels.peak[ch];
+                levels.rms[ch] = (ch < levels.channels) ? std::max(levels.rms[ch], clientLevels.rms[ch]) : clientLevels.rms[ch];
+            }
+            levels.channels = std::max(levels.channels, clientLevels.channels);
+        }
+    }
+    return ReturnPropertyList((CFPropertyListRef)CreateLevelsDictionary(levels), outData);
+}
+
+static OSStatus GetPlugInRoutingConfiguration(const PropertyContext& context, UInt32 count, void* outData) {
+    pthread_mutex_lock(&gState->mutex);
+    CFDictionaryRef dict = CreateRoutingConfigurationDictionary(gState->routing.load(std::memory_order_relaxed));
+    pthread_mutex_unlock(&gState->mutex);
+    return ReturnPropertyList((CFPropertyListRef)dict, outData);
+}
+
+static OSStatus SetPlugInRoutingConfiguration(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    return SetRoutingConfiguration(*((const CFPropertyListRef*)data));
+}
+
+static OSStatus GetPlugInDeviceDescriptions(const PropertyContext& context, UInt32 count, void* outData) {
+    pthread_mutex_lock(&gState->mutex);
+    CFArrayRef list = CreateDeviceList();
+    pthread_mutex_unlock(&gState->mutex);
+    return ReturnPropertyList((CFPropertyListRef)list, outData);
+}
+
+// Hosts see the devices come and go through the device list notification,
+// the same as for Plugin_CreateDevice
+static OSStatus SetPlugInDeviceDescriptions(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    bool changed;
+    pthread_mutex_lock(&gState->mutex);
+    OSStatus status = ApplyDeviceList(*((const CFPropertyListRef*)data), &changed);
+    pthread_mutex_unlock(&gState->mutex);
+    
+    if (changed) {
+        NotifyDeviceListChanged();
+        SaveDeviceList();
+    }
+    return status;
+}
+
+static OSStatus GetPlugInTrace(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32(gState->trace.isEnabled() ? 1 : 0, outData);
+}
+
+static OSStatus SetPlugInTrace(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    SInt32 enabled;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &enabled)) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    pthread_mutex_lock(&gState->mutex);
+    bool started = !enabled || StartTraceDrain();
+    pthread_mutex_unlock(&gState->mutex);
+    if (!started) {
+        return kAudioHardwareUnspecifiedError;
+    }
+    gState->trace.setEnabled(enabled != 0);
+    return kAudioHardwareNoError;
+}
+
+// --- Device ---
+
+static OSStatus GetDeviceName(const PropertyContext& context, UInt32 count, void* outData) {
+    *((CFStringRef*)outData) = (CFStringRef)CFRetain(context.device->name);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDeviceUID(const PropertyContext& context, UInt32 count, void* outData) {
+    *((CFStringRef*)outData) = (CFStringRef)CFRetain(context.device->uid);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDeviceModelUID(const PropertyContext& context, UInt32 count, void* outData) {
+    *((CFStringRef*)outData) = CFSTR(kDevice_ModelUID);
+    return kAudioHardwareNoError;
+}
+
+// The streams in the requested scope, and the controls, which are on the
+// output side
+static UInt32 DeviceOwnedObjects(const PropertyContext& context, AudioObjectID* outIDs) {
+    AudioObjectID deviceID = context.device->objectID;
+    AudioObjectPropertyScope scope = context.address->mScope;
+    UInt32 count = 0;
+    if (scope != kAudioObjectPropertyScopeInput) {
+        outIDs[count++] = deviceID + kDeviceObject_Stream_Output;
+    }
+    if (scope != kAudioObjectPropertyScopeOutput) {
+        outIDs[count++] = deviceID + kDeviceObject_Stream_Input;
+    }
+    if (scope != kAudioObjectPropertyScopeInput) {
+        outIDs[count++] = deviceID + kDeviceObject_Volume_Master;
+        outIDs[count++] = deviceID + kDeviceObject_Mute_Master;
+    }
+    return count;
+}
+
+static UInt32 CountDeviceOwnedObjects(const PropertyContext& context) {
+    AudioObjectID ids[kDeviceObject_Count];
+    return DeviceOwnedObjects(context, ids);
+}
+
+static OSStatus GetDeviceOwnedObjects(const PropertyContext& context, UInt32 count, void* outData) {
+    AudioObjectID ids[kDeviceObject_Count];
+    DeviceOwnedObjects(context, ids);
+    return CopyObjectIDs(ids, count, outData);
+}
+
+static UInt32 DeviceStreams(const PropertyContext& context, AudioObjectID* outIDs) {
+    AudioObjectID deviceID = context.device->objectID;
+    AudioObjectPropertyScope scope = context.address->mScope;
+    UInt32 count = 0;
+    if (scope != kAudioObjectPropertyScopeInput) {
+        outIDs[count++] = deviceID + kDeviceObject_Stream_Output;
+    }
+    if (scope != kAudioObjectPropertyScopeOutput) {
+        outIDs[count++] = deviceID + kDeviceObject_Stream_Input;
+    }
+    return count;
+}
+
+static UInt32 CountDeviceStreams(const PropertyContext& context) {
+    AudioObjectID ids[2];
+    return DeviceStreams(context, ids);
+}
+
+static OSStatus GetDeviceStreams(const PropertyContext& context, UInt32 count, void* outData) {
+    AudioObjectID ids[2];
+    DeviceStreams(context, ids);
+    return CopyObjectIDs(ids, count, outData);
+}
+
+static UInt32 CountDeviceControls(const PropertyContext& context) {
+    return 2;
+}
+
+static OSStatus GetDeviceControls(const PropertyContext& context, UInt32 count, void* outData) {
+    const AudioObjectID ids[] = {
+        context.device->objectID + kDeviceObject_Volume_Master,
+        context.device->objectID + kDeviceObject_Mute_Master
+    };
+    return CopyObjectIDs(ids, count, outData);
+}
+
+static OSStatus GetDeviceIsRunning(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = (context.device->clientCount.load() > 0) ? 1 : 0;
+    return kAudioHardwareNoError;
+}
+
+// Output goes straight into the ring; the ring's depth is accounted for
+// once, on the input side
+static OSStatus GetDeviceLatency(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = (context.address->mScope == kAudioObjectPropertyScopeInput) ? InputLatencyFrames(context.device) : 0;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDeviceZeroTimeStampPeriod(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = context.device->periodFrames.load();
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDeviceNominalSampleRate(const PropertyContext& context, UInt32 count, void* outData) {
+    *((Float64*)outData) = context.device->sampleRate.load();
+    return kAudioHardwareNoError;
+}
+
+static OSStatus SetDeviceNominalSampleRate(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    AudiDeckDevice* device = context.device;
+    Float64 rate = *((const Float64*)data);
+    if (!IsSupportedSampleRate(rate)) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    // Only the rate: a format change not yet applied keeps the rest
+    pthread_mutex_lock(&device->mutex);
+    device->pendingSampleRate = rate;
+    pthread_mutex_unlock(&device->mutex);
+    return RequestFormatChange(device);
+}
+
+static UInt32 CountDeviceSampleRates(const PropertyContext& context) {
+    return kDevice_SampleRateCount;
+}
+
+static OSStatus GetDeviceSampleRates(const PropertyContext& context, UInt32 count, void* outData) {
+    AudioValueRange* ranges = (AudioValueRange*)outData;
+    for (UInt32 i = 0; i < count; i++) {
+        ranges[i].mMinimum = kDevice_SupportedSampleRates[i];
+        ranges[i].mMaximum = kDevice_SupportedSampleRates[i];
+    }
+    return kAudioHardwareNoError;
+}
+
+static UInt32 CountDeviceCustomProperties(const PropertyContext& context) {
+    return kDevice_CustomPropertyCount;
+}
+
+static OSStatus GetDeviceCustomProperties(const PropertyContext& context, UInt32 count, void* outData) {
+    return CopyCustomPropertyInfo(kDevice_CustomProperties, count, outData);
+}
+
+static OSStatus GetDeviceLatencyPeriods(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32((SInt32)context.device->latencyPeriods.load(), outData);
+}
+
+static OSStatus SetDeviceLatencyPeriods(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    AudiDeckDevice* device = context.device;
+    SInt32 periods;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &periods) ||
+        periods < 0 || periods > kDevice_MaxLatencyPeriods) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    device->latencyPeriods.store((UInt32)periods);
+    
+    // ReadInput moves to the new depth on its own; hosts need to pick up the
+    // new latency
+    if (gState->host) {
+        AudioObjectPropertyAddress changed = { kAudioDevicePropertyLatency, kAudioObjectPropertyScopeInput, kAudioObjectPropertyElementMain };
+        gState->host->PropertiesChanged(gState->host, device->objectID, 1, &changed);
+    }
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDevicePeriodFrames(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32((SInt32)context.device->periodFrames.load(), outData);
+}
+
+// The zero timestamp period can only change with IO stopped
+static OSStatus SetDevicePeriodFrames(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    AudiDeckDevice* device = context.device;
+    SInt32 frames;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &frames) ||
+        frames < kDevice_MinPeriodFrames || frames > kDevice_MaxPeriodFrames) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    pthread_mutex_lock(&device->mutex);
+    device->pendingPeriodFrames = (UInt32)frames;
+    pthread_mutex_unlock(&device->mutex);
+    return RequestFormatChange(device);
+}
+
+static OSStatus GetDeviceTap(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32(context.device->tapEnabled.load() ? 1 : 0, outData);
+}
 
-// ============================================================================
-// Plugin Interface (COM-style)
-// ============================================================================
+static OSStatus SetDeviceTap(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    AudiDeckDevice* device = context.device;
+    SInt32 enabled;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &enabled)) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    if (enabled && !OpenDeviceTap(device)) {
+        return kAudioHardwareUnspecifiedError;
+    }
+    device->tapEnabled.store(enabled != 0);
+    return kAudioHardwareNoError;
+}
 
-static AudioServerPlugInDriverInterface gInterface = {
-    // _reserved
-    NULL,
-    // COM methods
-    Plugin_QueryInterface,
-    Plugin_AddRef,
-    Plugin_Release,
-    // Plugin methods
-    Plugin_Initialize,
-    Plugin_CreateDevice,
-    Plugin_DestroyDevice,
-    Plugin_AddDeviceClient,
-    Plugin_RemoveDeviceClient,
-    Plugin_PerformConfigChange,
-    Plugin_AbortConfigChange,
-    Plugin_HasProperty,
-    Plugin_IsPropertySettable,
-    Plugin_GetPropertyDataSize,
-    Plugin_GetPropertyData,
-    Plugin_SetPropertyData,
-    Plugin_StartIO,
-    Plugin_StopIO,
-    Plugin_GetZeroTimeStamp,
-    Plugin_WillDoIO,
-    Plugin_BeginIO,
-    Plugin_DoIO,
-    Plugin_EndIO
-};
+static OSStatus GetDeviceRingEncoding(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32((SInt32)context.device->ringEncoding.load(), outData);
+}
 
-static AudioServerPlugInDriverInterface* gInterfacePtr = &gInterface;
-static AudioServerPlugInDriverRef gDriverRef = &gInterfacePtr;
+// The ring is replaced, so like the period this waits for IO to stop; what
+// the old ring held is dropped
+static OSStatus SetDeviceRingEncoding(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    AudiDeckDevice* device = context.device;
+    SInt32 encoding;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &encoding) ||
+        encoding < 0 || encoding >= (SInt32)AudioFormat::kEncodingCount) {
+        return kAudioHardwareIllegalOperationError;
+    }
+    pthread_mutex_lock(&device->mutex);
+    device->pendingRingEncoding = (UInt32)encoding;
+    pthread_mutex_unlock(&device->mutex);
+    return RequestFormatChange(device);
+}
 
-// ============================================================================
-// Entry Point
-// ============================================================================
+static OSStatus GetDeviceOutputLevels(const PropertyContext& context, UInt32 count, void* outData) {
+    AudioMeter::Levels levels;
+    if (!ReadLevels(context.device->outputMeter, &levels)) {
+        levels.channels = 0;
+    }
+    return ReturnPropertyList((CFPropertyListRef)CreateLevelsDictionary(levels), outData);
+}
 
-extern "C" void* AudiDeckDriverCreate(CFAllocatorRef allocator, CFUUIDRef typeUUID) {
-    if (!CFEqual(typeUUID, kAudioServerPlugInTypeUUID)) {
-        return nullptr;
+static OSStatus GetDeviceIOStats(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnPropertyList((CFPropertyListRef)CreateIOStatsDictionary(context.device), outData);
+}
+
+static OSStatus GetDeviceLatencyProbe(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnSInt32(context.device->probeEnabled.load() ? 1 : 0, outData);
+}
+
+// Takes effect from the next IO cycle; the counts carry on from where they
+// were, so compare two reads of 'asts' to measure one run
+static OSStatus SetDeviceLatencyProbe(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    SInt32 enabled;
+    if (!GetSInt32(*((const CFPropertyListRef*)data), &enabled)) {
+        return kAudioHardwareIllegalOperationError;
     }
-    
-    if (!gState) {
-        gState = new PlugInState();
-        gState->ringBuffer = std::make_unique<RingBuffer>(kDevice_RingBufferSize, kDevice_ChannelCount);
-        mach_timebase_info(&gTimebase);
+    context.device->probeEnabled.store(enabled != 0);
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetDeviceProbeHistogram(const PropertyContext& context, UInt32 count, void* outData) {
+    return ReturnPropertyList((CFPropertyListRef)CreateProbeHistogramDictionary(context.device), outData);
+}
+
+// --- Streams ---
+
+static bool IsOutputStream(const PropertyContext& context) {
+    return context.deviceObject == kDeviceObject_Stream_Output;
+}
+
+static OSStatus GetStreamDirection(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = IsOutputStream(context) ? 0 : 1;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetStreamTerminalType(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = IsOutputStream(context) ? kAudioStreamTerminalTypeSpeaker : kAudioStreamTerminalTypeMicrophone;
+    return kAudioHardwareNoError;
+}
+
+// The virtual format is always Float32; the HAL converts between it and an
+// integer physical format. Both share the rate and channel count.
+static OSStatus GetStreamVirtualFormat(const PropertyContext& context, UInt32 count, void* outData) {
+    FillStreamFormat((AudioStreamBasicDescription*)outData, context.device->sampleRate.load(), context.device->channelCount.load());
+    return kAudioHardwareNoError;
+}
+
+static OSStatus GetStreamPhysicalFormat(const PropertyContext& context, UInt32 count, void* outData) {
+    FillStreamFormat((AudioStreamBasicDescription*)outData, context.device->sampleRate.load(), context.device->channelCount.load(),
+                     context.device->encoding.load());
+    return kAudioHardwareNoError;
+}
+
+// Both streams of a device share one format, so setting either sets the
+// other's too. Without `encoding` the pending one is kept.
+static OSStatus SetStreamFormat(AudiDeckDevice* device, const AudioStreamBasicDescription* desc, const UInt32* encoding) {
+    pthread_mutex_lock(&device->mutex);
+    device->pendingSampleRate = desc->mSampleRate;
+    device->pendingChannelCount = desc->mChannelsPerFrame;
+    if (encoding) {
+        device->pendingEncoding = *encoding;
     }
-    
-    return gDriverRef;
+    pthread_mutex_unlock(&device->mutex);
+    return RequestFormatChange(device);
 }
 
-// ============================================================================
-// COM Methods
-// ============================================================================
+static OSStatus SetStreamVirtualFormat(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    const AudioStreamBasicDescription* desc = (const AudioStreamBasicDescription*)data;
+    UInt32 encoding;
+    if (!ParseStreamFormat(desc, &encoding) || encoding != AudioFormat::kEncoding_Float32) {
+        return kAudioDeviceUnsupportedFormatError;
+    }
+    return SetStreamFormat(context.device, desc, nullptr);
+}
 
-static HRESULT Plugin_QueryInterface(void* driver, REFIID iid, LPVOID* ppv) {
-    CFUUIDRef interfaceID = CFUUIDCreateFromUUIDBytes(NULL, iid);
-    CFUUIDRef pluginUUID = CFUUIDGetConstantUUIDWithBytes(NULL, 
-        0x44, 0x3A, 0xBA, 0xB8, 0xE7, 0xB3, 0x49, 0x1A,
-        0xB9, 0x85, 0xBE, 0xB9, 0x18, 0x70, 0x30, 0xDB);
-    CFUUIDRef unknownUUID = CFUUIDGetConstantUUIDWithBytes(NULL,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46);
-    
-    Boolean match = CFEqual(interfaceID, pluginUUID) || CFEqual(interfaceID, unknownUUID);
-    CFRelease(interfaceID);
-    
-    if (match) {
-        Plugin_AddRef(driver);
-        *ppv = driver;
-        return kAudioHardwareNoError;
+static OSStatus SetStreamPhysicalFormat(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    const AudioStreamBasicDescription* desc = (const AudioStreamBasicDescription*)data;
+    UInt32 encoding;
+    if (!ParseStreamFormat(desc, &encoding)) {
+        return kAudioDeviceUnsupportedFormatError;
     }
-    
-    *ppv = NULL;
-    return E_NOINTERFACE;
+    return SetStreamFormat(context.device, desc, &encoding);
 }
 
-static ULONG Plugin_AddRef(void* driver) {
-    return 1;  // Singleton, never deallocated
+static UInt32 CountStreamVirtualFormats(const PropertyContext& context) {
+    return kDevice_FormatCount;
 }
 
-static ULONG Plugin_Release(void* driver) {
-    return 1;  // Singleton, never deallocated
+static UInt32 CountStreamPhysicalFormats(const PropertyContext& context) {
+    return kDevice_PhysicalFormatCount;
 }
 
-// ============================================================================
-// Plugin Lifecycle
-// ============================================================================
+// Filled once by BuildPropertyTables(): every rate for each channel count,
+// for each encoding in turn. The virtual formats are the Float32 run at the
+// start. Every stream of every device shares it, so enumerating formats
+// across many devices is a copy each.
+static AudioStreamRangedDescription gStreamFormats[kDevice_PhysicalFormatCount];
 
-static OSStatus Plugin_Initialize(AudioServerPlugInDriverRef driver, AudioServerPlugInHostRef host) {
-    gState->host = host;
+static void BuildStreamFormats() {
+    for (UInt32 i = 0; i < kDevice_PhysicalFormatCount; i++) {
+        Float64 rate = kDevice_SupportedSampleRates[i % kDevice_SampleRateCount];
+        UInt32 channels = kDevice_SupportedChannelCounts[(i / kDevice_SampleRateCount) % kDevice_ChannelCountCount];
+        FillStreamFormat(&gStreamFormats[i].mFormat, rate, channels, kDevice_SupportedEncodings[i / kDevice_FormatCount]);
+        gStreamFormats[i].mSampleRateRange.mMinimum = rate;
+        gStreamFormats[i].mSampleRateRange.mMaximum = rate;
+    }
+}
+
+static OSStatus GetStreamFormats(const PropertyContext& context, UInt32 count, void* outData) {
+    std::copy(gStreamFormats, gStreamFormats + count, (AudioStreamRangedDescription*)outData);
     return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_CreateDevice(AudioServerPlugInDriverRef driver, CFDictionaryRef desc, const AudioServerPlugInClientInfo* clientInfo, AudioObjectID* outID) {
-    return kAudioHardwareUnsupportedOperationError;
+// --- Controls ---
+
+static OSStatus GetVolumeScalar(const PropertyContext& context, UInt32 count, void* outData) {
+    *((Float32*)outData) = context.device->volume.load();
+    return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_DestroyDevice(AudioServerPlugInDriverRef driver, AudioObjectID deviceID) {
-    return kAudioHardwareUnsupportedOperationError;
+static OSStatus SetVolumeScalar(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    context.device->volume.store(std::min(std::max(*((const Float32*)data), 0.0f), 1.0f));
+    return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_AddDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo) {
+static OSStatus GetVolumeDecibels(const PropertyContext& context, UInt32 count, void* outData) {
+    Float32 vol = context.device->volume.load();
+    *((Float32*)outData) = (vol > 0) ? (20.0f * log10f(vol)) : -96.0f;
     return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_RemoveDeviceClient(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, const AudioServerPlugInClientInfo* clientInfo) {
+// The bottom of the range is silence, matching GetVolumeDecibels
+static OSStatus SetVolumeDecibels(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    Float32 db = std::min(*((const Float32*)data), 0.0f);
+    context.device->volume.store((db > -96.0f) ? powf(10.0f, db / 20.0f) : 0.0f);
     return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_PerformConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info) {
+static OSStatus GetVolumeDecibelRange(const PropertyContext& context, UInt32 count, void* outData) {
+    AudioValueRange* range = (AudioValueRange*)outData;
+    range->mMinimum = -96.0;
+    range->mMaximum = 0.0;
     return kAudioHardwareNoError;
 }
 
-static OSStatus Plugin_AbortConfigChange(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt64 action, void* info) {
+static OSStatus GetMuteValue(const PropertyContext& context, UInt32 count, void* outData) {
+    *((UInt32*)outData) = context.device->muted ? 1 : 0;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus SetMuteValue(const PropertyContext& context, UInt32 dataSize, const void* data) {
+    context.device->muted.store(*((const UInt32*)data) != 0);
     return kAudioHardwareNoError;
 }
 
 // ============================================================================
-// Property Queries
+// Property Tables
 // ============================================================================
 
-static Boolean Plugin_HasProperty(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address) {
-    switch (objectID) {
-        case kObjectID_PlugIn:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                case kAudioObjectPropertyManufacturer:
-                case kAudioObjectPropertyOwnedObjects:
-                case kAudioPlugInPropertyDeviceList:
-                case kAudioPlugInPropertyTranslateUIDToDevice:
-                case kAudioPlugInPropertyResourceBundle:
-                    return true;
-            }
-            break;
-            
-        case kObjectID_Device:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                case kAudioObjectPropertyName:
-                case kAudioObjectPropertyManufacturer:
-                case kAudioObjectPropertyOwnedObjects:
-                case kAudioDevicePropertyDeviceUID:
-                case kAudioDevicePropertyModelUID:
-                case kAudioDevicePropertyTransportType:
-                case kAudioDevicePropertyRelatedDevices:
-                case kAudioDevicePropertyClockDomain:
-                case kAudioDevicePropertyDeviceIsAlive:
-                case kAudioDevicePropertyDeviceIsRunning:
-                case kAudioDevicePropertyDeviceCanBeDefaultDevice:
-                case kAudioDevicePropertyDeviceCanBeDefaultSystemDevice:
-                case kAudioDevicePropertyLatency:
-                case kAudioDevicePropertyStreams:
-                case kAudioObjectPropertyControlList:
-                case kAudioDevicePropertySafetyOffset:
-                case kAudioDevicePropertyNominalSampleRate:
-                case kAudioDevicePropertyAvailableNominalSampleRates:
-                case kAudioDevicePropertyIsHidden:
-                case kAudioDevicePropertyZeroTimeStampPeriod:
-                    return true;
-            }
-            break;
-            
-        case kObjectID_Stream_Output:
-        case kObjectID_Stream_Input:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                case kAudioStreamPropertyIsActive:
-                case kAudioStreamPropertyDirection:
-                case kAudioStreamPropertyTerminalType:
-                case kAudioStreamPropertyStartingChannel:
-                case kAudioStreamPropertyLatency:
-                case kAudioStreamPropertyVirtualFormat:
-                case kAudioStreamPropertyPhysicalFormat:
-                case kAudioStreamPropertyAvailableVirtualFormats:
-                case kAudioStreamPropertyAvailablePhysicalFormats:
-                    return true;
-            }
-            break;
-            
-        case kObjectID_Volume_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                case kAudioControlPropertyScope:
-                case kAudioControlPropertyElement:
-                case kAudioLevelControlPropertyScalarValue:
-                case kAudioLevelControlPropertyDecibelValue:
-                case kAudioLevelControlPropertyDecibelRange:
-                    return true;
-            }
-            break;
-            
-        case kObjectID_Mute_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                case kAudioControlPropertyScope:
-                case kAudioControlPropertyElement:
-                case kAudioBooleanControlPropertyValue:
-                    return true;
-            }
-            break;
+// One table per object class, sorted by selector in BuildPropertyTables().
+// Columns: selector, element size, count (null for a single value), getter,
+// setter (null for read-only).
+
+static PropertyDescriptor gPlugInProperties[] = {
+    { kAudioObjectPropertyBaseClass,                sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioObjectClassID>,     nullptr },
+    { kAudioObjectPropertyClass,                    sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioPlugInClassID>,     nullptr },
+    { kAudioObjectPropertyOwner,                    sizeof(AudioObjectID),      nullptr,    GetUInt32<kAudioObjectUnknown>,     nullptr },
+    { kAudioObjectPropertyManufacturer,             sizeof(CFStringRef),        nullptr,    GetManufacturer,                    nullptr },
+    { kAudioObjectPropertyOwnedObjects,             sizeof(AudioObjectID),      CountPlugInDevices, GetPlugInDevices,           nullptr },
+    { kAudioPlugInPropertyDeviceList,               sizeof(AudioObjectID),      CountPlugInDevices, GetPlugInDevices,           nullptr },
+    { kAudioPlugInPropertyTranslateUIDToDevice,     sizeof(AudioObjectID),      nullptr,    GetPlugInTranslateUIDToDevice,      nullptr },
+    { kAudioPlugInPropertyResourceBundle,           sizeof(CFStringRef),        nullptr,    GetPlugInResourceBundle,            nullptr },
+    { kAudioObjectPropertyCustomPropertyInfoList,   sizeof(AudioServerPlugInCustomPropertyInfo), CountPlugInCustomProperties, GetPlugInCustomProperties, nullptr },
+    { kAudiDeckPlugInPropertyClientRoute,           sizeof(CFPropertyListRef),  nullptr,    GetPlugInClientRoute,               SetPlugInClientRoute },
+    { kAudiDeckPlugInPropertyClientLevels,          sizeof(CFPropertyListRef),  nullptr,    GetPlugInClientLevels,              nullptr },
+    { kAudiDeckPlugInPropertyRoutingConfiguration,  sizeof(CFPropertyListRef),  nullptr,    GetPlugInRoutingConfiguration,      SetPlugInRoutingConfiguration },
+    { kAudiDeckPlugInPropertyTrace,                 sizeof(CFPropertyListRef),  nullptr,    GetPlugInTrace,                     SetPlugInTrace },
+    { kAudiDeckPlugInPropertyDevices,               sizeof(CFPropertyListRef),  nullptr,    GetPlugInDeviceDescriptions,        SetPlugInDeviceDescriptions }
+};
+
+static PropertyDescriptor gDeviceProperties[] = {
+    { kAudioObjectPropertyBaseClass,                sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioObjectClassID>,     nullptr },
+    { kAudioObjectPropertyClass,                    sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioDeviceClassID>,     nullptr },
+    { kAudioObjectPropertyOwner,                    sizeof(AudioObjectID),      nullptr,    GetUInt32<kObjectID_PlugIn>,        nullptr },
+    { kAudioObjectPropertyName,                     sizeof(CFStringRef),        nullptr,    GetDeviceName,                      nullptr },
+    { kAudioObjectPropertyManufacturer,             sizeof(CFStringRef),        nullptr,    GetManufacturer,                    nullptr },
+    { kAudioObjectPropertyOwnedObjects,             sizeof(AudioObjectID),      CountDeviceOwnedObjects, GetDeviceOwnedObjects, nullptr },
+    { kAudioDevicePropertyDeviceUID,                sizeof(CFStringRef),        nullptr,    GetDeviceUID,                       nullptr },
+    { kAudioDevicePropertyModelUID,                 sizeof(CFStringRef),        nullptr,    GetDeviceModelUID,                  nullptr },
+    { kAudioDevicePropertyTransportType,            sizeof(UInt32),             nullptr,    GetUInt32<kAudioDeviceTransportTypeVirtual>, nullptr },
+    { kAudioDevicePropertyRelatedDevices,           sizeof(AudioObjectID),      nullptr,    GetOwningDevice,                    nullptr },
+    { kAudioDevicePropertyClockDomain,              sizeof(UInt32),             nullptr,    GetUInt32<kDevice_ClockDomain>,     nullptr },
+    { kAudioDevicePropertyDeviceIsAlive,            sizeof(UInt32),             nullptr,    GetUInt32<1>,                       nullptr },
+    { kAudioDevicePropertyDeviceIsRunning,          sizeof(UInt32),             nullptr,    GetDeviceIsRunning,                 nullptr },
+    { kAudioDevicePropertyDeviceCanBeDefaultDevice, sizeof(UInt32),             nullptr,    GetUInt32<1>,                       nullptr },
+    { kAudioDevicePropertyDeviceCanBeDefaultSystemDevice, sizeof(UInt32),       nullptr,    GetUInt32<1>,                       nullptr },
+    { kAudioDevicePropertyLatency,                  sizeof(UInt32),             nullptr,    GetDeviceLatency,                   nullptr },
+    { kAudioDevicePropertyStreams,                  sizeof(AudioObjectID),      CountDeviceStreams, GetDeviceStreams,           nullptr },
+    { kAudioObjectPropertyControlList,              sizeof(AudioObjectID),      CountDeviceControls, GetDeviceControls,         nullptr },
+    // IO is a memory copy, complete when the HAL's call returns
+    { kAudioDevicePropertySafetyOffset,             sizeof(UInt32),             nullptr,    GetUInt32<0>,                       nullptr },
+    { kAudioDevicePropertyNominalSampleRate,        sizeof(Float64),            nullptr,    GetDeviceNominalSampleRate,         SetDeviceNominalSampleRate },
+    { kAudioDevicePropertyAvailableNominalSampleRates, sizeof(AudioValueRange), CountDeviceSampleRates, GetDeviceSampleRates,   nullptr },
+    { kAudioDevicePropertyIsHidden,                 sizeof(UInt32),             nullptr,    GetUInt32<0>,                       nullptr },
+    { kAudioDevicePropertyZeroTimeStampPeriod,      sizeof(UInt32),             nullptr,    GetDeviceZeroTimeStampPeriod,       nullptr },
+    { kAudioObjectPropertyCustomPropertyInfoList,   sizeof(AudioServerPlugInCustomPropertyInfo), CountDeviceCustomProperties, GetDeviceCustomProperties, nullptr },
+    { kAudiDeckDevicePropertyLatencyPeriods,        sizeof(CFPropertyListRef),  nullptr,    GetDeviceLatencyPeriods,            SetDeviceLatencyPeriods },
+    { kAudiDeckDevicePropertyPeriodFrames,          sizeof(CFPropertyListRef),  nullptr,    GetDevicePeriodFrames,              SetDevicePeriodFrames },
+    { kAudiDeckDevicePropertyTap,                   sizeof(CFPropertyListRef),  nullptr,    GetDeviceTap,                       SetDeviceTap },
+    { kAudiDeckDevicePropertyRingEncoding,          sizeof(CFPropertyListRef),  nullptr,    GetDeviceRingEncoding,              SetDeviceRingEncoding },
+    { kAudiDeckDevicePropertyOutputLevels,          sizeof(CFPropertyListRef),  nullptr,    GetDeviceOutputLevels,              nullptr },
+    { kAudiDeckDevicePropertyIOStats,               sizeof(CFPropertyListRef),  nullptr,    GetDeviceIOStats,                   nullptr },
+    { kAudiDeckDevicePropertyLatencyProbe,          sizeof(CFPropertyListRef),  nullptr,    GetDeviceLatencyProbe,              SetDeviceLatencyProbe },
+    { kAudiDeckDevicePropertyProbeHistogram,        sizeof(CFPropertyListRef),  nullptr,    GetDeviceProbeHistogram,            nullptr }
+};
+
+static PropertyDescriptor gStreamProperties[] = {
+    { kAudioObjectPropertyBaseClass,                sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioObjectClassID>,     nullptr },
+    { kAudioObjectPropertyClass,                    sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioStreamClassID>,     nullptr },
+    { kAudioObjectPropertyOwner,                    sizeof(AudioObjectID),      nullptr,    GetOwningDevice,                    nullptr },
+    { kAudioStreamPropertyIsActive,                 sizeof(UInt32),             nullptr,    GetUInt32<1>,                       nullptr },
+    { kAudioStreamPropertyDirection,                sizeof(UInt32),             nullptr,    GetStreamDirection,                 nullptr },
+    { kAudioStreamPropertyTerminalType,             sizeof(UInt32),             nullptr,    GetStreamTerminalType,              nullptr },
+    { kAudioStreamPropertyStartingChannel,          sizeof(UInt32),             nullptr,    GetUInt32<1>,                       nullptr },
+    { kAudioStreamPropertyLatency,                  sizeof(UInt32),             nullptr,    GetUInt32<0>,                       nullptr },
+    { kAudioStreamPropertyVirtualFormat,            sizeof(AudioStreamBasicDescription), nullptr, GetStreamVirtualFormat,       SetStreamVirtualFormat },
+    { kAudioStreamPropertyPhysicalFormat,           sizeof(AudioStreamBasicDescription), nullptr, GetStreamPhysicalFormat,      SetStreamPhysicalFormat },
+    { kAudioStreamPropertyAvailableVirtualFormats,  sizeof(AudioStreamRangedDescription), CountStreamVirtualFormats, GetStreamFormats, nullptr },
+    { kAudioStreamPropertyAvailablePhysicalFormats, sizeof(AudioStreamRangedDescription), CountStreamPhysicalFormats, GetStreamFormats, nullptr }
+};
+
+static PropertyDescriptor gVolumeProperties[] = {
+    { kAudioObjectPropertyBaseClass,                sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioControlClassID>,    nullptr },
+    { kAudioObjectPropertyClass,                    sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioVolumeControlClassID>, nullptr },
+    { kAudioObjectPropertyOwner,                    sizeof(AudioObjectID),      nullptr,    GetOwningDevice,                    nullptr },
+    { kAudioControlPropertyScope,                   sizeof(UInt32),             nullptr,    GetUInt32<kAudioObjectPropertyScopeOutput>, nullptr },
+    { kAudioControlPropertyElement,                 sizeof(UInt32),             nullptr,    GetUInt32<kAudioObjectPropertyElementMain>, nullptr },
+    { kAudioLevelControlPropertyScalarValue,        sizeof(Float32),            nullptr,    GetVolumeScalar,                    SetVolumeScalar },
+    { kAudioLevelControlPropertyDecibelValue,       sizeof(Float32),            nullptr,    GetVolumeDecibels,                  SetVolumeDecibels },
+    { kAudioLevelControlPropertyDecibelRange,       sizeof(AudioValueRange),    nullptr,    GetVolumeDecibelRange,              nullptr }
+};
+
+static PropertyDescriptor gMuteProperties[] = {
+    { kAudioObjectPropertyBaseClass,                sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioControlClassID>,    nullptr },
+    { kAudioObjectPropertyClass,                    sizeof(AudioClassID),       nullptr,    GetUInt32<kAudioMuteControlClassID>, nullptr },
+    { kAudioObjectPropertyOwner,                    sizeof(AudioObjectID),      nullptr,    GetOwningDevice,                    nullptr },
+    { kAudioControlPropertyScope,                   sizeof(UInt32),             nullptr,    GetUInt32<kAudioObjectPropertyScopeOutput>, nullptr },
+    { kAudioControlPropertyElement,                 sizeof(UInt32),             nullptr,    GetUInt32<kAudioObjectPropertyElementMain>, nullptr },
+    { kAudioBooleanControlPropertyValue,            sizeof(UInt32),             nullptr,    GetMuteValue,                       SetMuteValue }
+};
+
+#define PROPERTY_TABLE(table) { table, sizeof(table) / sizeof(table[0]) }
+
+static const PropertyTable gPropertyTables[] = {
+    PROPERTY_TABLE(gPlugInProperties),
+    PROPERTY_TABLE(gDeviceProperties),
+    PROPERTY_TABLE(gStreamProperties),
+    PROPERTY_TABLE(gVolumeProperties),
+    PROPERTY_TABLE(gMuteProperties)
+};
+
+#undef PROPERTY_TABLE
+
+// Indices into gPropertyTables
+enum {
+    kPropertyTable_PlugIn,
+    kPropertyTable_Device,
+    kPropertyTable_Stream,
+    kPropertyTable_Volume,
+    kPropertyTable_Mute
+};
+
+static bool SelectorLess(const PropertyDescriptor& descriptor, AudioObjectPropertySelector selector) {
+    return descriptor.selector < selector;
+}
+
+static void BuildPropertyTables() {
+    for (const PropertyTable& table : gPropertyTables) {
+        std::sort(table.descriptors, table.descriptors + table.count,
+                  [](const PropertyDescriptor& a, const PropertyDescriptor& b) { return a.selector < b.selector; });
     }
-    return false;
+    BuildStreamFormats();
 }
 
-static OSStatus Plugin_IsPropertySettable(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, Boolean* outSettable) {
-    *outSettable = false;
+// Resolves an address to its object's descriptor. Fills in everything in
+// `context` but the qualifier.
+static OSStatus FindProperty(AudioObjectID objectID, const AudioObjectPropertyAddress* address,
+                             PropertyContext* context, const PropertyDescriptor** outDescriptor) {
+    context->device = nullptr;
+    context->deviceObject = kDeviceObject_Device;
+    context->address = address;
+    context->qualifierSize = 0;
+    context->qualifier = nullptr;
     
-    switch (objectID) {
-        case kObjectID_Device:
-            if (address->mSelector == kAudioDevicePropertyNominalSampleRate) {
-                *outSettable = true;
-            }
-            break;
-        case kObjectID_Volume_Master:
-            if (address->mSelector == kAudioLevelControlPropertyScalarValue ||
-                address->mSelector == kAudioLevelControlPropertyDecibelValue) {
-                *outSettable = true;
-            }
-            break;
-        case kObjectID_Mute_Master:
-            if (address->mSelector == kAudioBooleanControlPropertyValue) {
-                *outSettable = true;
-            }
-            break;
+    UInt32 tableIndex;
+    if (objectID == kObjectID_PlugIn) {
+        tableIndex = kPropertyTable_PlugIn;
+    } else {
+        context->device = FindDevice(objectID, &context->deviceObject);
+        if (!context->device) {
+            return kAudioHardwareBadObjectError;
+        }
+        switch (context->deviceObject) {
+            case kDeviceObject_Device:          tableIndex = kPropertyTable_Device; break;
+            case kDeviceObject_Stream_Output:
+            case kDeviceObject_Stream_Input:    tableIndex = kPropertyTable_Stream; break;
+            case kDeviceObject_Volume_Master:   tableIndex = kPropertyTable_Volume; break;
+            default:                            tableIndex = kPropertyTable_Mute; break;
+        }
+    }
+    
+    const PropertyTable& table = gPropertyTables[tableIndex];
+    const PropertyDescriptor* begin = table.descriptors;
+    const PropertyDescriptor* end = begin + table.count;
+    const PropertyDescriptor* descriptor = std::lower_bound(begin, end, address->mSelector, SelectorLess);
+    if (descriptor == end || descriptor->selector != address->mSelector) {
+        return kAudioHardwareUnknownPropertyError;
+    }
+    *outDescriptor = descriptor;
+    return kAudioHardwareNoError;
+}
+
+static UInt32 PropertyElementCount(const PropertyDescriptor* descriptor, const PropertyContext& context) {
+    return descriptor->count ? descriptor->count(context) : 1;
+}
+
+// ============================================================================
+// Property Operations
+// ============================================================================
+
+static Boolean Plugin_HasProperty(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address) {
+    PropertyContext context;
+    const PropertyDescriptor* descriptor;
+    return FindProperty(objectID, address, &context, &descriptor) == kAudioHardwareNoError;
+}
+
+static OSStatus Plugin_IsPropertySettable(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, Boolean* outSettable) {
+    PropertyContext context;
+    const PropertyDescriptor* descriptor;
+    OSStatus status = FindProperty(objectID, address, &context, &descriptor);
+    if (status != kAudioHardwareNoError) {
+        return status;
     }
+    *outSettable = (descriptor->set != nullptr);
     return kAudioHardwareNoError;
 }
 
 static OSStatus Plugin_GetPropertyDataSize(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32* outSize) {
-    *outSize = 0;
-    
-    switch (objectID) {
-        case kObjectID_PlugIn:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyManufacturer:
-                case kAudioPlugInPropertyResourceBundle:
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioObjectPropertyOwnedObjects:
-                case kAudioPlugInPropertyDeviceList:
-                case kAudioPlugInPropertyTranslateUIDToDevice:
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-            }
-            break;
-            
-        case kObjectID_Device:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyName:
-                case kAudioObjectPropertyManufacturer:
-                case kAudioDevicePropertyDeviceUID:
-                case kAudioDevicePropertyModelUID:
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioDevicePropertyTransportType:
-                case kAudioDevicePropertyClockDomain:
-                case kAudioDevicePropertyLatency:
-                case kAudioDevicePropertySafetyOffset:
-                case kAudioDevicePropertyZeroTimeStampPeriod:
-                case kAudioDevicePropertyDeviceIsAlive:
-                case kAudioDevicePropertyDeviceIsRunning:
-                case kAudioDevicePropertyDeviceCanBeDefaultDevice:
-                case kAudioDevicePropertyDeviceCanBeDefaultSystemDevice:
-                case kAudioDevicePropertyIsHidden:
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioObjectPropertyOwnedObjects:
-                    *outSize = sizeof(AudioObjectID) * 4;
-                    break;
-                case kAudioDevicePropertyRelatedDevices:
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioDevicePropertyStreams:
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioObjectPropertyControlList:
-                    *outSize = sizeof(AudioObjectID) * 2;
-                    break;
-                case kAudioDevicePropertyNominalSampleRate:
-                    *outSize = sizeof(Float64);
-                    break;
-                case kAudioDevicePropertyAvailableNominalSampleRates:
-                    *outSize = sizeof(AudioValueRange) * 1;
-                    break;
-            }
-            break;
-            
-        case kObjectID_Stream_Output:
-        case kObjectID_Stream_Input:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioStreamPropertyIsActive:
-                case kAudioStreamPropertyDirection:
-                case kAudioStreamPropertyTerminalType:
-                case kAudioStreamPropertyStartingChannel:
-                case kAudioStreamPropertyLatency:
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyVirtualFormat:
-                case kAudioStreamPropertyPhysicalFormat:
-                    *outSize = sizeof(AudioStreamBasicDescription);
-                    break;
-                case kAudioStreamPropertyAvailableVirtualFormats:
-                case kAudioStreamPropertyAvailablePhysicalFormats:
-                    *outSize = sizeof(AudioStreamRangedDescription);
-                    break;
-            }
-            break;
-            
-        case kObjectID_Volume_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioControlPropertyScope:
-                case kAudioControlPropertyElement:
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioLevelControlPropertyScalarValue:
-                case kAudioLevelControlPropertyDecibelValue:
-                    *outSize = sizeof(Float32);
-                    break;
-                case kAudioLevelControlPropertyDecibelRange:
-                    *outSize = sizeof(AudioValueRange);
-                    break;
-            }
-            break;
-            
-        case kObjectID_Mute_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                case kAudioObjectPropertyClass:
-                case kAudioObjectPropertyOwner:
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioControlPropertyScope:
-                case kAudioControlPropertyElement:
-                case kAudioBooleanControlPropertyValue:
-                    *outSize = sizeof(UInt32);
-                    break;
-            }
-            break;
+    PropertyContext context;
+    const PropertyDescriptor* descriptor;
+    OSStatus status = FindProperty(objectID, address, &context, &descriptor);
+    if (status != kAudioHardwareNoError) {
+        return status;
     }
-    
-    return (*outSize > 0) ? kAudioHardwareNoError : kAudioHardwareUnknownPropertyError;
+    context.qualifierSize = qualifierSize;
+    context.qualifier = qualifier;
+    *outSize = descriptor->elementSize * PropertyElementCount(descriptor, context);
+    return kAudioHardwareNoError;
 }
 
+// A list is cut to as many whole elements as fit in `inSize`; a single value
+// needs room for all of it.
 static OSStatus Plugin_GetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 inSize, UInt32* outSize, void* outData) {
-    
-    switch (objectID) {
-        case kObjectID_PlugIn:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                    *((AudioClassID*)outData) = kAudioObjectClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyClass:
-                    *((AudioClassID*)outData) = kAudioPlugInClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyOwner:
-                    *((AudioObjectID*)outData) = kAudioObjectUnknown;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioObjectPropertyManufacturer:
-                    *((CFStringRef*)outData) = CFSTR(kDevice_Manufacturer);
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioObjectPropertyOwnedObjects:
-                case kAudioPlugInPropertyDeviceList:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioPlugInPropertyTranslateUIDToDevice:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioPlugInPropertyResourceBundle:
-                    *((CFStringRef*)outData) = CFSTR("");
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                default:
-                    return kAudioHardwareUnknownPropertyError;
-            }
-            break;
-            
-        case kObjectID_Device:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                    *((AudioClassID*)outData) = kAudioObjectClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyClass:
-                    *((AudioClassID*)outData) = kAudioDeviceClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyOwner:
-                    *((AudioObjectID*)outData) = kObjectID_PlugIn;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioObjectPropertyName:
-                    *((CFStringRef*)outData) = CFSTR(kDevice_Name);
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioObjectPropertyManufacturer:
-                    *((CFStringRef*)outData) = CFSTR(kDevice_Manufacturer);
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioDevicePropertyDeviceUID:
-                    *((CFStringRef*)outData) = CFSTR(kDevice_UID);
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioDevicePropertyModelUID:
-                    *((CFStringRef*)outData) = CFSTR(kDevice_ModelUID);
-                    *outSize = sizeof(CFStringRef);
-                    break;
-                case kAudioDevicePropertyTransportType:
-                    *((UInt32*)outData) = kAudioDeviceTransportTypeVirtual;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyRelatedDevices:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioDevicePropertyClockDomain:
-                    *((UInt32*)outData) = 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyDeviceIsAlive:
-                    *((UInt32*)outData) = 1;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyDeviceIsRunning:
-                    *((UInt32*)outData) = gState->isRunning ? 1 : 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyDeviceCanBeDefaultDevice:
-                case kAudioDevicePropertyDeviceCanBeDefaultSystemDevice:
-                    *((UInt32*)outData) = 1;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyLatency:
-                case kAudioDevicePropertySafetyOffset:
-                    *((UInt32*)outData) = 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyZeroTimeStampPeriod:
-                    *((UInt32*)outData) = kDevice_BufferSize;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioDevicePropertyIsHidden:
-                    *((UInt32*)outData) = 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioObjectPropertyOwnedObjects: {
-                    AudioObjectID* ids = (AudioObjectID*)outData;
-                    ids[0] = kObjectID_Stream_Output;
-                    ids[1] = kObjectID_Stream_Input;
-                    ids[2] = kObjectID_Volume_Master;
-                    ids[3] = kObjectID_Mute_Master;
-                    *outSize = sizeof(AudioObjectID) * 4;
-                    break;
-                }
-                case kAudioDevicePropertyStreams:
-                    if (address->mScope == kAudioObjectPropertyScopeOutput) {
-                        *((AudioObjectID*)outData) = kObjectID_Stream_Output;
-                    } else {
-                        *((AudioObjectID*)outData) = kObjectID_Stream_Input;
-                    }
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioObjectPropertyControlList: {
-                    AudioObjectID* ids = (AudioObjectID*)outData;
-                    ids[0] = kObjectID_Volume_Master;
-                    ids[1] = kObjectID_Mute_Master;
-                    *outSize = sizeof(AudioObjectID) * 2;
-                    break;
-                }
-                case kAudioDevicePropertyNominalSampleRate:
-                    *((Float64*)outData) = gState->sampleRate;
-                    *outSize = sizeof(Float64);
-                    break;
-                case kAudioDevicePropertyAvailableNominalSampleRates: {
-                    AudioValueRange* range = (AudioValueRange*)outData;
-                    range->mMinimum = kDevice_SampleRate;
-                    range->mMaximum = kDevice_SampleRate;
-                    *outSize = sizeof(AudioValueRange);
-                    break;
-                }
-                default:
-                    return kAudioHardwareUnknownPropertyError;
-            }
-            break;
-            
-        case kObjectID_Stream_Output:
-        case kObjectID_Stream_Input: {
-            bool isOutput = (objectID == kObjectID_Stream_Output);
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                    *((AudioClassID*)outData) = kAudioObjectClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyClass:
-                    *((AudioClassID*)outData) = kAudioStreamClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyOwner:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioStreamPropertyIsActive:
-                    *((UInt32*)outData) = 1;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyDirection:
-                    *((UInt32*)outData) = isOutput ? 0 : 1;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyTerminalType:
-                    *((UInt32*)outData) = isOutput ? kAudioStreamTerminalTypeSpeaker : kAudioStreamTerminalTypeMicrophone;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyStartingChannel:
-                    *((UInt32*)outData) = 1;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyLatency:
-                    *((UInt32*)outData) = 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioStreamPropertyVirtualFormat:
-                case kAudioStreamPropertyPhysicalFormat: {
-                    AudioStreamBasicDescription* desc = (AudioStreamBasicDescription*)outData;
-                    desc->mSampleRate = gState->sampleRate;
-                    desc->mFormatID = kAudioFormatLinearPCM;
-                    desc->mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
-                    desc->mBytesPerPacket = kDevice_ChannelCount * sizeof(Float32);
-                    desc->mFramesPerPacket = 1;
-                    desc->mBytesPerFrame = kDevice_ChannelCount * sizeof(Float32);
-                    desc->mChannelsPerFrame = kDevice_ChannelCount;
-                    desc->mBitsPerChannel = 32;
-                    *outSize = sizeof(AudioStreamBasicDescription);
-                    break;
-                }
-                case kAudioStreamPropertyAvailableVirtualFormats:
-                case kAudioStreamPropertyAvailablePhysicalFormats: {
-                    AudioStreamRangedDescription* desc = (AudioStreamRangedDescription*)outData;
-                    desc->mFormat.mSampleRate = gState->sampleRate;
-                    desc->mFormat.mFormatID = kAudioFormatLinearPCM;
-                    desc->mFormat.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagsNativeEndian | kAudioFormatFlagIsPacked;
-                    desc->mFormat.mBytesPerPacket = kDevice_ChannelCount * sizeof(Float32);
-                    desc->mFormat.mFramesPerPacket = 1;
-                    desc->mFormat.mBytesPerFrame = kDevice_ChannelCount * sizeof(Float32);
-                    desc->mFormat.mChannelsPerFrame = kDevice_ChannelCount;
-                    desc->mFormat.mBitsPerChannel = 32;
-                    desc->mSampleRateRange.mMinimum = gState->sampleRate;
-                    desc->mSampleRateRange.mMaximum = gState->sampleRate;
-                    *outSize = sizeof(AudioStreamRangedDescription);
-                    break;
-                }
-                default:
-                    return kAudioHardwareUnknownPropertyError;
-            }
-            break;
-        }
-        
-        case kObjectID_Volume_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                    *((AudioClassID*)outData) = kAudioControlClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyClass:
-                    *((AudioClassID*)outData) = kAudioVolumeControlClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyOwner:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioControlPropertyScope:
-                    *((UInt32*)outData) = kAudioObjectPropertyScopeOutput;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioControlPropertyElement:
-                    *((UInt32*)outData) = kAudioObjectPropertyElementMain;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioLevelControlPropertyScalarValue:
-                    *((Float32*)outData) = gState->volume.load();
-                    *outSize = sizeof(Float32);
-                    break;
-                case kAudioLevelControlPropertyDecibelValue: {
-                    Float32 vol = gState->volume.load();
-                    *((Float32*)outData) = (vol > 0) ? (20.0f * log10f(vol)) : -96.0f;
-                    *outSize = sizeof(Float32);
-                    break;
-                }
-                case kAudioLevelControlPropertyDecibelRange: {
-                    AudioValueRange* range = (AudioValueRange*)outData;
-                    range->mMinimum = -96.0;
-                    range->mMaximum = 0.0;
-                    *outSize = sizeof(AudioValueRange);
-                    break;
-                }
-                default:
-                    return kAudioHardwareUnknownPropertyError;
-            }
-            break;
-            
-        case kObjectID_Mute_Master:
-            switch (address->mSelector) {
-                case kAudioObjectPropertyBaseClass:
-                    *((AudioClassID*)outData) = kAudioControlClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyClass:
-                    *((AudioClassID*)outData) = kAudioMuteControlClassID;
-                    *outSize = sizeof(AudioClassID);
-                    break;
-                case kAudioObjectPropertyOwner:
-                    *((AudioObjectID*)outData) = kObjectID_Device;
-                    *outSize = sizeof(AudioObjectID);
-                    break;
-                case kAudioControlPropertyScope:
-                    *((UInt32*)outData) = kAudioObjectPropertyScopeOutput;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioControlPropertyElement:
-                    *((UInt32*)outData) = kAudioObjectPropertyElementMain;
-                    *outSize = sizeof(UInt32);
-                    break;
-                case kAudioBooleanControlPropertyValue:
-                    *((UInt32*)outData) = gState->muted ? 1 : 0;
-                    *outSize = sizeof(UInt32);
-                    break;
-                default:
-                    return kAudioHardwareUnknownPropertyError;
-            }
-            break;
-            
-        default:
-            return kAudioHardwareBadObjectError;
+    PropertyContext context;
+    const PropertyDescriptor* descriptor;
+    OSStatus status = FindProperty(objectID, address, &context, &descriptor);
+    if (status != kAudioHardwareNoError) {
+        return status;
     }
+    context.qualifierSize = qualifierSize;
+    context.qualifier = qualifier;
     
-    return kAudioHardwareNoError;
+    UInt32 count = 1;
+    if (descriptor->count) {
+        count = std::min(descriptor->count(context), inSize / descriptor->elementSize);
+    } else if (inSize < descriptor->elementSize) {
+        return kAudioHardwareBadPropertySizeError;
+    }
+    status = descriptor->get(context, count, outData);
+    if (status == kAudioHardwareNoError) {
+        *outSize = descriptor->elementSize * count;
+    }
+    return status;
 }
 
 static OSStatus Plugin_SetPropertyData(AudioServerPlugInDriverRef driver, AudioObjectID objectID, pid_t clientPID, const AudioObjectPropertyAddress* address, UInt32 qualifierSize, const void* qualifier, UInt32 dataSize, const void* data) {
-    
-    switch (objectID) {
-        case kObjectID_Volume_Master:
-            if (address->mSelector == kAudioLevelControlPropertyScalarValue) {
-                gState->volume.store(*((Float32*)data));
-            }
-            break;
-        case kObjectID_Mute_Master:
-            if (address->mSelector == kAudioBooleanControlPropertyValue) {
-                gState->muted.store(*((UInt32*)data) != 0);
-            }
-            break;
+    PropertyContext context;
+    const PropertyDescriptor* descriptor;
+    OSStatus status = FindProperty(objectID, address, &context, &descriptor);
+    if (status != kAudioHardwareNoError) {
+        return status;
     }
-    
-    return kAudioHardwareNoError;
+    if (!descriptor->set) {
+        return kAudioHardwareUnsupportedOperationError;
+    }
+    if (dataSize < descriptor->elementSize || !data) {
+        return kAudioHardwareBadPropertySizeError;
+    }
+    context.qualifierSize = qualifierSize;
+    context.qualifier = qualifier;
+    return descriptor->set(context, dataSize, data);
 }
 
 // ============================================================================
 // IO Operations
 // ============================================================================
 
+// StartIO and StopIO are O(1) and never block. The first client starts a
+// new timeline; none of our IO runs for this device until it returns, so
+// the IO-thread state can be reset here. The ring is flushed rather than
+// cleared, which is safe even while a loopback consumer reads it.
 static OSStatus Plugin_StartIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID) {
-    pthread_mutex_lock(&gState->mutex);
-    
-    if (gState->clientCount.fetch_add(1) == 0) {
-        gState->isRunning.store(true);
-        gState->anchorHostTime = mach_absolute_time();
-        gState->timestampCounter.store(0);
-        gState->ringBuffer->reset();
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
     }
     
-    pthread_mutex_unlock(&gState->mutex);
+    UInt32 running = device->clientCount.fetch_add(1, std::memory_order_acq_rel);
+    Trace(kTraceEvent_StartIO, deviceID, clientID, running + 1, 0);
+    if (running == 0) {
+        device->clock.start(mach_absolute_time());
+        device->timestampCounter.fetch_add(1, std::memory_order_release);
+        device->clockLock.reset();
+        device->resampler.reset();
+        device->ioCycle.counter = UINT64_MAX;
+        device->cycleHostTime = 0;
+        device->ring.load(std::memory_order_acquire)->flush();
+        
+        AudioTap* tap = device->tap.load(std::memory_order_acquire);
+        if (tap) {
+            tap->restart();
+        }
+    }
+    // A client joining a running device may be the first input client, and
+    // the ring may have backed up while only output was running
+    device->inputNeedsResync.store(true, std::memory_order_release);
     return kAudioHardwareNoError;
 }
 
 static OSStatus Plugin_StopIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID) {
-    pthread_mutex_lock(&gState->mutex);
-    
-    if (gState->clientCount.fetch_sub(1) == 1) {
-        gState->isRunning.store(false);
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
     }
     
-    pthread_mutex_unlock(&gState->mutex);
+    UInt32 count = device->clientCount.load(std::memory_order_relaxed);
+    do {
+        if (count == 0) {
+            return kAudioHardwareIllegalOperationError;
+        }
+    } while (!device->clientCount.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel));
+    Trace(kTraceEvent_StopIO, deviceID, clientID, count - 1, 0);
     return kAudioHardwareNoError;
 }
 
 static OSStatus Plugin_GetZeroTimeStamp(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, Float64* outSampleTime, UInt64* outHostTime, UInt64* outSeed) {
-    UInt64 currentTime = mach_absolute_time();
-    Float64 elapsedNanos = (Float64)(currentTime - gState->anchorHostTime) * gTimebase.numer / gTimebase.denom;
-    Float64 elapsedSamples = elapsedNanos * gState->sampleRate / 1000000000.0;
-    
-    UInt64 cycles = (UInt64)(elapsedSamples / kDevice_BufferSize);
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
+    }
     
-    *outSampleTime = cycles * kDevice_BufferSize;
-    *outHostTime = gState->anchorHostTime + (UInt64)(cycles * kDevice_BufferSize / gState->sampleRate * 1000000000.0 * gTimebase.denom / gTimebase.numer);
-    *outSeed = gState->timestampCounter.load();
+    device->clock.zeroTimeStamp(mach_absolute_time(), outSampleTime, outHostTime);
+    *outSeed = device->timestampCounter.load();
+    Trace(kTraceEvent_ZeroTimeStamp, deviceID, clientID, 0, (UInt64)*outSampleTime);
     
     return kAudioHardwareNoError;
 }
 
 static OSStatus Plugin_WillDoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, Boolean* outWillDo, Boolean* outWillDoInPlace) {
     *outWillDo = (operationID == kAudioServerPlugInIOOperationReadInput || 
+                  operationID == kAudioServerPlugInIOOperationProcessOutput ||
                   operationID == kAudioServerPlugInIOOperationWriteMix);
     *outWillDoInPlace = true;
     return kAudioHardwareNoError;
 }
 
+// The HAL begins and ends each operation separately, and needs its buffer
+// complete by the time DoIO returns, so the work itself can't be deferred
+// past DoIO. What BeginIO can do is the per-cycle lookups every operation
+// of the cycle would otherwise repeat.
 static OSStatus Plugin_BeginIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo) {
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
+    }
+    
+    BeginIOCycle(device, cycleInfo);
     return kAudioHardwareNoError;
 }
 
 static OSStatus Plugin_DoIO(AudioServerPlugInDriverRef driver, AudioObjectID deviceID, AudioObjectID streamID, UInt32 clientID, UInt32 operationID, UInt32 bufferFrames, const AudioServerPlugInIOCycleInfo* cycleInfo, void* mainBuffer, void* secondaryBuffer) {
-    Float32* buffer = (Float32*)mainBuffer;
-    
-    if (operationID == kAudioServerPlugInIOOperationWriteMix) {
-        // Apps writing audio to our device
-        gState->ringBuffer->write(buffer, bufferFrames);
-    } 
-    else if (operationID == kAudioServerPlugInIOOperationReadInput) {
-        // Apps reading audio from our device (loopback)
-        gState->ringBuffer->read(buffer, bufferFrames);
-        
-        // Apply volume & mute
-        if (gState->muted.load()) {
-            memset(buffer, 0, bufferFrames * kDevice_ChannelCount * sizeof(Float32));
-        } else {
-            Float32 vol = gState->volume.load();
-            if (vol != 1.0f) {
-                for (UInt32 i = 0; i < bufferFrames * kDevice_ChannelCount; i++) {
-                    buffer[i] *= vol;
-                }
-            }
-        }
+    AudiDeckDevice* device = FindDevice(deviceID);
+    if (!device) {
+        return kAudioHardwareBadDeviceError;
     }
     
+    // Normally done by BeginIO already; costs one compare then
+    BeginIOCycle(device, cycleInfo);
+    UInt64 start = mach_absolute_time();
+    device->ioKernel(device, operationID, clientID, mainBuffer, bufferFrames);
+    UInt64 nanos = HostTicksToNanos(mach_absolute_time() - start);
+    device->ioStats.addIO(nanos);
+    gState->trace.record(start, TraceEventForOperation(operationID), deviceID, clientID, bufferFrames, nanos);
     return kAudioHardwareNoError;
 }
 
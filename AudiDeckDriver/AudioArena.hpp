@@ -0,0 +1,189 @@
+/*
+ *  AudioArena.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Wired memory for state the IO threads touch: device and client objects,
+ *  rings and their storage. The region is reserved once, up front, locked
+ *  into RAM and prefaulted, so IO never takes a page fault on memory that
+ *  came from here, whether it was handed out a second ago or a day ago.
+ *
+ *  - Blocks come in power-of-two size classes, aligned to their size up to
+ *    a page. Each class keeps its free blocks on a lock-free stack, so
+ *    blocks are recycled as devices and clients come and go without ever
+ *    going back to the system; a class with none free carves a new block
+ *    from the unused end of the region.
+ *  - Blocks are never split or merged. Our sizes come from a handful of
+ *    formats, so the classes in use settle quickly.
+ *  - Once the region is used up, allocate() falls back to the heap and
+ *    prefaults what it got, so a format bigger than the reservation still
+ *    works, just without the wiring; heapBytes() says how much that is.
+ *
+ *  allocate() and release() are lock-free; neither is meant for the IO
+ *  path, since the heap fallback isn't.
+ */
+
+#ifndef AudioArena_hpp
+#define AudioArena_hpp
+
+#include <sys/mman.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+class AudioArena {
+public:
+    static constexpr size_t kMinBlockBytes = 64;
+    static constexpr size_t kMaxAlignment = 4096;
+    static constexpr uint32_t kClassCount = 32;
+
+    AudioArena() = default;
+    AudioArena(const AudioArena&) = delete;
+    AudioArena& operator=(const AudioArena&) = delete;
+
+    ~AudioArena() {
+        if (mBase) {
+            munlock(mBase, mBytes);
+            munmap(mBase, mBytes);
+        }
+    }
+
+    // Not thread safe; call once, before anything is allocated. Returns
+    // false if the region couldn't be mapped, leaving every allocation to
+    // the heap. Failing to wire it isn't fatal: the pages are still
+    // prefaulted, just not pinned.
+    bool reserve(size_t bytes) {
+        bytes = (bytes + kMaxAlignment - 1) & ~(kMaxAlignment - 1);
+        void* region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (region == MAP_FAILED) {
+            return false;
+        }
+        mWired = mlock(region, bytes) == 0;
+        std::memset(region, 0, bytes);
+        mBase = (char*)region;
+        mBytes = bytes;
+        return true;
+    }
+
+    // Any thread, lock-free. Never returns null; see heapBytes().
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        const uint32_t sizeClass = classFor(bytes, alignment);
+        void* block = pop(sizeClass);
+        if (!block) {
+            block = carve(sizeClass);
+        }
+        if (!block) {
+            const size_t heapBytes = blockBytes(sizeClass);
+            block = ::operator new(heapBytes, std::align_val_t(heapAlignment(sizeClass)));
+            std::memset(block, 0, heapBytes);
+            mHeapBytes.fetch_add(heapBytes, std::memory_order_relaxed);
+        }
+        return block;
+    }
+
+    // Any thread, lock-free. `bytes` and `alignment` must match the
+    // allocate() that returned `block`.
+    void release(void* block, size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        if (!block) return;
+        const uint32_t sizeClass = classFor(bytes, alignment);
+        if (!contains(block)) {
+            mHeapBytes.fetch_sub(blockBytes(sizeClass), std::memory_order_relaxed);
+            ::operator delete(block, std::align_val_t(heapAlignment(sizeClass)));
+            return;
+        }
+        push(sizeClass, (char*)block);
+    }
+
+    // Bytes a request takes up once rounded to its size class.
+    static size_t blockBytesFor(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        return blockBytes(classFor(bytes, alignment));
+    }
+
+    bool contains(const void* block) const {
+        return mBase && (const char*)block >= mBase && (const char*)block < mBase + mBytes;
+    }
+
+    size_t reservedBytes() const { return mBytes; }
+    size_t carvedBytes() const { return mCarved.load(std::memory_order_relaxed); }
+    size_t heapBytes() const { return mHeapBytes.load(std::memory_order_relaxed); }
+    bool isWired() const { return mWired; }
+
+private:
+    static uint32_t classFor(size_t bytes, size_t alignment) {
+        uint32_t sizeClass = 0;
+        while (blockBytes(sizeClass) < bytes || blockBytes(sizeClass) < alignment) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    static size_t blockBytes(uint32_t sizeClass) { return kMinBlockBytes << sizeClass; }
+
+    static size_t heapAlignment(uint32_t sizeClass) {
+        const size_t bytes = blockBytes(sizeClass);
+        return bytes < kMaxAlignment ? bytes : kMaxAlignment;
+    }
+
+    // Free lists hold a block's index in kMinBlockBytes units, plus one so
+    // that 0 is empty, in the low half of the head; the high half is a tag
+    // bumped by every push so a pop can't be fooled by a block that left
+    // and came back in between (ABA). Each free block holds the next index
+    // in its first word. Region memory is never unmapped while in use, so
+    // reading a block another thread has just popped is harmless; its CAS
+    // then fails.
+    char* blockAt(uint32_t index) const { return mBase + (size_t)(index - 1) * kMinBlockBytes; }
+    static std::atomic<uint32_t>* link(char* block) { return (std::atomic<uint32_t>*)block; }
+
+    void* pop(uint32_t sizeClass) {
+        std::atomic<uint64_t>& head = mFree[sizeClass];
+        uint64_t current = head.load(std::memory_order_acquire);
+        while ((uint32_t)current != 0) {
+            char* block = blockAt((uint32_t)current);
+            const uint64_t next = link(block)->load(std::memory_order_relaxed);
+            const uint64_t replacement = (current & 0xFFFFFFFF00000000ull) | next;
+            if (head.compare_exchange_weak(current, replacement, std::memory_order_acquire, std::memory_order_acquire)) {
+                std::memset(block, 0, sizeof(uint32_t));
+                return block;
+            }
+        }
+        return nullptr;
+    }
+
+    void push(uint32_t sizeClass, char* block) {
+        std::atomic<uint64_t>& head = mFree[sizeClass];
+        const uint64_t index = (uint64_t)((block - mBase) / kMinBlockBytes) + 1;
+        uint64_t current = head.load(std::memory_order_relaxed);
+        uint64_t replacement;
+        do {
+            link(block)->store((uint32_t)current, std::memory_order_relaxed);
+            replacement = (((current >> 32) + 1) << 32) | index;
+        } while (!head.compare_exchange_weak(current, replacement, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Takes a new block of the class from the unused end of the region, or
+    // returns null once there isn't room.
+    void* carve(uint32_t sizeClass) {
+        const size_t bytes = blockBytes(sizeClass);
+        const size_t alignment = heapAlignment(sizeClass);
+        size_t offset = mCarved.load(std::memory_order_relaxed);
+        size_t start;
+        do {
+            start = (offset + alignment - 1) & ~(alignment - 1);
+            if (!mBase || start + bytes > mBytes) {
+                return nullptr;
+            }
+        } while (!mCarved.compare_exchange_weak(offset, start + bytes, std::memory_order_relaxed));
+        return mBase + start;
+    }
+
+    char* mBase = nullptr;
+    size_t mBytes = 0;
+    bool mWired = false;
+
+    alignas(64) std::atomic<size_t> mCarved{0};
+    std::atomic<size_t> mHeapBytes{0};
+    alignas(64) std::atomic<uint64_t> mFree[kClassCount] = {};
+};
+
+#endif /* AudioArena_hpp */
@@ -0,0 +1,199 @@
+/*
+ *  AudioBridge.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Plays a device's tap (see AudioTap.hpp) out of another device, from that
+ *  device's IO callback. Meant for a process outside coreaudiod forwarding
+ *  one of our virtual devices to real hardware: the tap is read in place,
+ *  filtered straight into the output buffer, and gain is applied there, so
+ *  the audio is copied once on the way through.
+ *
+ *  - The two devices run on different clocks. An AudioClockLock holds the
+ *    tap's unread depth at a target, and its correction becomes a rate
+ *    scale on the resampler, which also converts between nominal rates.
+ *  - The target is one output period plus one writer period plus the
+ *    filter's lookahead, which is about as shallow as two free-running
+ *    periods can be bridged without underrunning.
+ *  - render() is real-time safe. configure() allocates, so when the tap's
+ *    format changes, render() plays silence and raises needsConfigure()
+ *    until the owner has stopped output and reconfigured.
+ *  - Until the depth first reaches the target, and again after the tap runs
+ *    dry or is overwritten, render() plays silence and re-primes; gain fades
+ *    in from there.
+ */
+
+#ifndef AudioBridge_hpp
+#define AudioBridge_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "AudioClock.hpp"
+#include "AudioGain.hpp"
+#include "AudioResampler.hpp"
+#include "AudioTap.hpp"
+
+class AudioBridge {
+public:
+    static constexpr uint32_t kMaxFrames = 4096;        // Per render() call
+
+    AudioBridge() = default;
+    AudioBridge(const AudioBridge&) = delete;
+    AudioBridge& operator=(const AudioBridge&) = delete;
+
+    bool open(const char* tapName) { return mReader.open(tapName); }
+    void close() { mReader.close(); }
+    bool isOpen() const { return mReader.isOpen(); }
+
+    // Not real-time safe; the output must be stopped. Takes the tap's
+    // current format, and sizes the target from both sides' periods.
+    // Returns false while the tap has no format yet.
+    bool configure(double outputRate, uint32_t outputChannels, uint32_t outputPeriodFrames, uint32_t writerPeriodFrames) {
+        mNeedsConfigure.store(false, std::memory_order_relaxed);
+        mReader.peek(0);
+        mInputRate = mReader.sampleRate();
+        mInputChannels = mReader.channelCount();
+        mOutputRate = outputRate;
+        mOutputChannels = outputChannels;
+        if (mInputChannels == 0 || mOutputChannels == 0 || mOutputRate <= 0.0) {
+            mInputChannels = 0;
+            return false;
+        }
+
+        mResampler.configure(mInputRate, mOutputRate, mInputChannels, kMaxFrames);
+        mScratch.assign((size_t)kMaxFrames * mInputChannels, 0.0f);
+        mPeriodFrames = std::ceil(outputPeriodFrames * mInputRate / mOutputRate);
+        mTargetFrames = mPeriodFrames + writerPeriodFrames + AudioResampler::kTaps / 2;
+        mPlaying = false;
+        return true;
+    }
+
+    // Any thread. Ramps over the next render().
+    void setGain(float gain) { mGain.store(gain, std::memory_order_relaxed); }
+    float gain() const { return mGain.load(std::memory_order_relaxed); }
+
+    // Any thread. Set by render() once the tap's format no longer matches
+    // the last configure().
+    bool needsConfigure() const { return mNeedsConfigure.load(std::memory_order_relaxed); }
+
+    // Tap frames held back to absorb both sides' periods; adds
+    // targetFrames() / inputRate() to the output device's own latency.
+    double targetFrames() const { return mTargetFrames; }
+    double inputRate() const { return mInputRate; }
+
+    // Times render() has played silence for want of data.
+    uint64_t underruns() const { return mUnderruns.load(std::memory_order_relaxed); }
+
+    AudioIOStats sourceStats() const { return mReader.ioStats(); }
+
+    // Real-time safe. Fills `frames` interleaved frames of the configured
+    // output format at `out`.
+    void render(float* out, uint32_t frames) {
+        const size_t totalSamples = (size_t)frames * mOutputChannels;
+        frames = std::min(frames, kMaxFrames);
+
+        AudioTapReader::Regions regions = mReader.peek(AudioTap::kCapacityFrames);
+        if (mInputChannels == 0 || mReader.channelCount() != mInputChannels || mReader.sampleRate() != mInputRate) {
+            if (mReader.channelCount() != 0) {
+                mNeedsConfigure.store(true, std::memory_order_relaxed);
+            }
+            silence(out, 0, totalSamples);
+            return;
+        }
+
+        double depth = regions.frames();
+        if (!mPlaying) {
+            if (depth < mTargetFrames) {
+                silence(out, 0, totalSamples);
+                return;
+            }
+            mPlaying = true;
+            mLock.reset();
+            mResampler.reset();
+            mStage.reset(0.0f);
+        }
+
+        // A backlog the loop would take seconds to work off, e.g. after a
+        // stall on either side, is skipped instead
+        if (depth > mTargetFrames + 8 * mPeriodFrames) {
+            mReader.consume((uint32_t)(depth - mTargetFrames));
+            depth = mTargetFrames;
+            mStage.reset(0.0f);
+        }
+        mResampler.setRateScale(mLock.update(depth, mTargetFrames, mPeriodFrames));
+
+        // Feed the filter straight from tap memory
+        regions = mReader.peek(mResampler.inputFramesNeeded(frames));
+        uint32_t pushed = mResampler.push(regions.first.data, regions.first.frames);
+        if (pushed == regions.first.frames) {
+            pushed += mResampler.push(regions.second.data, regions.second.frames);
+        }
+        if (!mReader.consume(pushed)) {
+            // Overwritten while we read it
+            mPlaying = false;
+            mUnderruns.fetch_add(1, std::memory_order_relaxed);
+            silence(out, 0, totalSamples);
+            return;
+        }
+
+        // Render into the output buffer and apply gain in place; only a
+        // channel count mismatch goes through scratch
+        const bool direct = mInputChannels == mOutputChannels;
+        float* dst = direct ? out : mScratch.data();
+        const uint32_t rendered = mResampler.process(dst, frames);
+        mStage.begin(mGain.load(std::memory_order_relaxed), rendered);
+        mStage.process(dst, dst, rendered, mInputChannels);
+        mStage.end();
+        if (!direct) {
+            mapChannels(out, dst, rendered);
+        }
+
+        // Ran dry: re-prime before playing again
+        if (rendered < frames) {
+            mPlaying = false;
+            mUnderruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        silence(out, (size_t)rendered * mOutputChannels, totalSamples);
+    }
+
+private:
+    static void silence(float* out, size_t from, size_t to) {
+        if (to > from) {
+            std::memset(out + from, 0, (to - from) * sizeof(float));
+        }
+    }
+
+    // Channel n to channel n; extra output channels are silent
+    void mapChannels(float* out, const float* in, uint32_t frames) const {
+        const uint32_t shared = std::min(mInputChannels, mOutputChannels);
+        for (uint32_t i = 0; i < frames; i++) {
+            float* frame = out + (size_t)i * mOutputChannels;
+            std::memcpy(frame, in + (size_t)i * mInputChannels, shared * sizeof(float));
+            std::fill(frame + shared, frame + mOutputChannels, 0.0f);
+        }
+    }
+
+    AudioTapReader mReader;
+    AudioResampler mResampler;
+    AudioClockLock mLock;
+    AudioGain::Stage mStage;
+    std::vector<float> mScratch;
+
+    double mInputRate = 0.0;
+    double mOutputRate = 0.0;
+    uint32_t mInputChannels = 0;
+    uint32_t mOutputChannels = 0;
+    double mPeriodFrames = 0.0;         // One output period, in tap frames
+    double mTargetFrames = 0.0;
+    bool mPlaying = false;
+
+    alignas(64) std::atomic<float> mGain{1.0f};
+    std::atomic<bool> mNeedsConfigure{false};
+    std::atomic<uint64_t> mUnderruns{0};
+};
+
+#endif /* AudioBridge_hpp */
@@ -0,0 +1,121 @@
+/*
+ *  AudioClock.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Zero-timestamp generator for a virtual device, and the PI loop that can
+ *  slave it to another device's clock.
+ *
+ *  The clock advances whole periods in integer host ticks. The period length
+ *  is held as 32.32 fixed point and the fractional tick is carried from one
+ *  period to the next, so timestamps accumulate no rounding error however
+ *  long the device runs, and each call costs the same after hours of uptime
+ *  as after a second.
+ */
+
+#ifndef AudioClock_hpp
+#define AudioClock_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+class AudioClock {
+public:
+    // Not safe while the clock is running.
+    void configure(double sampleRate, uint32_t periodFrames, double hostTicksPerSecond) {
+        mPeriodFrames = periodFrames;
+        mNominalPeriodTicks = (uint64_t)std::llround((double)periodFrames * hostTicksPerSecond / sampleRate * kFractionScale);
+        mPeriodTicks.store(mNominalPeriodTicks, std::memory_order_relaxed);
+    }
+
+    // Restarts the timeline at `hostTime` and drops any rate correction.
+    void start(uint64_t hostTime) {
+        mZeroHostTime = hostTime;
+        mFraction = 0;
+        mSampleTime = 0;
+        mPeriodTicks.store(mNominalPeriodTicks, std::memory_order_relaxed);
+    }
+
+    // Rate correction as a factor on the nominal rate; > 1 runs fast. Takes
+    // effect from the next period boundary.
+    void setRateScale(double scale) {
+        mPeriodTicks.store((uint64_t)((double)mNominalPeriodTicks / scale), std::memory_order_relaxed);
+    }
+
+    uint32_t periodFrames() const { return mPeriodFrames; }
+
+    // Advances to the last period boundary at or before `now` and returns
+    // it. Must be called from one thread at a time.
+    void zeroTimeStamp(uint64_t now, double* outSampleTime, uint64_t* outHostTime) {
+        const uint64_t period = mPeriodTicks.load(std::memory_order_relaxed);
+        if (now > mZeroHostTime && period > 0) {
+            // Boundary k is due once (mFraction + k * period) >> 32 <= elapsed
+            const uint64_t elapsed = now - mZeroHostTime;
+            const unsigned __int128 limit = ((unsigned __int128)(elapsed + 1) << 32) - 1 - mFraction;
+            const uint64_t periods = (uint64_t)(limit / period);
+            if (periods > 0) {
+                const unsigned __int128 total = (unsigned __int128)periods * period + mFraction;
+                mZeroHostTime += (uint64_t)(total >> 32);
+                mFraction = (uint64_t)total & kFractionMask;
+                mSampleTime += periods * mPeriodFrames;
+            }
+        }
+        *outSampleTime = (double)mSampleTime;
+        *outHostTime = mZeroHostTime;
+    }
+
+private:
+    static constexpr double kFractionScale = 4294967296.0;
+    static constexpr uint64_t kFractionMask = 0xFFFFFFFFull;
+
+    uint64_t mNominalPeriodTicks = 0;           // 32.32 host ticks
+    std::atomic<uint64_t> mPeriodTicks{0};      // Nominal, corrected by setRateScale()
+    uint32_t mPeriodFrames = 0;
+
+    uint64_t mZeroHostTime = 0;
+    uint64_t mFraction = 0;                     // Sub-tick remainder, 0.32
+    uint64_t mSampleTime = 0;
+};
+
+// Locks a consumer's clock to its producer's by holding the fill level of
+// the ring between them at a target. Fill above target means the producer
+// runs fast, so the consumer speeds up, and vice versa. Owned by the
+// consumer's IO thread.
+class AudioClockLock {
+public:
+    static constexpr double kMaxCorrection = 0.001;     // +/- 1000 ppm
+    static constexpr double kProportionalGain = 1e-4;   // Per period of error
+    static constexpr double kIntegralGain = 1e-6;       // Per period of error per update
+    static constexpr double kSmoothing = 0.05;          // Fill level low-pass
+
+    void reset() {
+        mPrimed = false;
+        mIntegral = 0.0;
+    }
+
+    // Feeds one fill measurement, in the ring's frames, and returns the
+    // rate scale to apply to the consumer's clock. The target can move
+    // between calls.
+    double update(double fillFrames, double targetFrames, double periodFrames) {
+        if (!mPrimed) {
+            mFilteredFill = fillFrames;
+            mPrimed = true;
+        }
+        mFilteredFill += kSmoothing * (fillFrames - mFilteredFill);
+        const double error = (mFilteredFill - targetFrames) / std::max(periodFrames, 1.0);
+
+        // Clamp the integral on its own so it can't wind up past what the
+        // output can use
+        mIntegral = std::clamp(mIntegral + kIntegralGain * error, -kMaxCorrection, kMaxCorrection);
+        const double correction = std::clamp(kProportionalGain * error + mIntegral, -kMaxCorrection, kMaxCorrection);
+        return 1.0 + correction;
+    }
+
+private:
+    bool mPrimed = false;
+    double mFilteredFill = 0.0;
+    double mIntegral = 0.0;
+};
+
+#endif /* AudioClock_hpp */
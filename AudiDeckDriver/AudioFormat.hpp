@@ -0,0 +1,111 @@
+/*
+ *  AudioFormat.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Sample encodings a stream's physical format can use, and the kernels
+ *  that convert them to and from the interleaved Float32 everything else
+ *  works in. Integers are native endian and packed: Int24 is three bytes
+ *  per sample.
+ *
+ *  Float32 <-> Int16 is vectorized (see AudioSIMD.hpp). Int24 has no
+ *  useful vector load, so it stays scalar; callers that know the channel
+ *  count at compile time give the compiler a fixed trip count to unroll.
+ */
+
+#ifndef AudioFormat_hpp
+#define AudioFormat_hpp
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "AudioSIMD.hpp"
+
+namespace AudioFormat {
+
+using namespace AudioSIMD;
+
+enum Encoding : uint32_t {
+    kEncoding_Float32 = 0,
+    kEncoding_Int16,
+    kEncoding_Int24,
+    kEncodingCount
+};
+
+static constexpr uint32_t BytesPerSample(Encoding encoding) {
+    return encoding == kEncoding_Int16 ? 2 : encoding == kEncoding_Int24 ? 3 : 4;
+}
+
+// Full scale of each integer encoding: -1.0 maps to -kScale, and +1.0 to
+// kScale - 1 after saturation
+static constexpr float kInt16Scale = 32768.0f;
+static constexpr float kInt24Scale = 8388608.0f;
+
+// ----------------------------------------------------------------------------
+// Kernels
+// ----------------------------------------------------------------------------
+
+// Converts `samples` samples of `kEncoding` at src to Float32 at dst.
+template <Encoding kEncoding>
+static inline void Decode(float* dst, const void* src, uint32_t samples) {
+    if constexpr (kEncoding == kEncoding_Float32) {
+        std::memcpy(dst, src, (size_t)samples * sizeof(float));
+    } else if constexpr (kEncoding == kEncoding_Int16) {
+        const int16_t* in = (const int16_t*)src;
+        const float scale = 1.0f / kInt16Scale;
+        uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+        const Vec vscale = Splat(scale);
+        for (; i + kWidth <= samples; i += kWidth) {
+            Store(dst + i, Mul(LoadInt16(in + i), vscale));
+        }
+#endif
+        for (; i < samples; i++) {
+            dst[i] = (float)in[i] * scale;
+        }
+    } else {
+        const uint8_t* in = (const uint8_t*)src;
+        const float scale = 1.0f / kInt24Scale;
+        for (uint32_t i = 0; i < samples; i++, in += 3) {
+            // Assemble in the top three bytes so the shift back sign-extends
+            const int32_t value = (int32_t)(((uint32_t)in[0] << 8) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 24)) >> 8;
+            dst[i] = (float)value * scale;
+        }
+    }
+}
+
+// Converts `samples` Float32 samples at src to `kEncoding` at dst. Integer
+// encodings clip to full scale and round to nearest; Float32 is copied
+// as is.
+template <Encoding kEncoding>
+static inline void Encode(void* dst, const float* src, uint32_t samples) {
+    if constexpr (kEncoding == kEncoding_Float32) {
+        std::memcpy(dst, src, (size_t)samples * sizeof(float));
+    } else if constexpr (kEncoding == kEncoding_Int16) {
+        int16_t* out = (int16_t*)dst;
+        uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+        const Vec vscale = Splat(kInt16Scale);
+        for (; i + kWidth <= samples; i += kWidth) {
+            StoreInt16(out + i, Mul(FlushClip(Load(src + i)), vscale));
+        }
+#endif
+        for (; i < samples; i++) {
+            const long value = std::lrint(FlushClip(src[i]) * kInt16Scale);
+            out[i] = (int16_t)(value > 32767 ? 32767 : value);
+        }
+    } else {
+        uint8_t* out = (uint8_t*)dst;
+        for (uint32_t i = 0; i < samples; i++, out += 3) {
+            long value = std::lrint(FlushClip(src[i]) * kInt24Scale);
+            if (value > 8388607) value = 8388607;
+            out[0] = (uint8_t)value;
+            out[1] = (uint8_t)(value >> 8);
+            out[2] = (uint8_t)(value >> 16);
+        }
+    }
+}
+
+} // namespace AudioFormat
+
+#endif /* AudioFormat_hpp */
@@ -0,0 +1,242 @@
+/*
+ *  AudioGain.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Vectorized gain stage for the IO thread. Copies interleaved Float32 out
+ *  of ring memory, applies a constant gain or a per-frame linear ramp, and
+ *  flushes denormals / clips to [-1, 1], all in a single pass. Crossfade
+ *  splits one signal between two destinations with equal-power ramps.
+ *
+ *  The instruction set is chosen at compile time (see AudioSIMD.hpp).
+ */
+
+#ifndef AudioGain_hpp
+#define AudioGain_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "AudioSIMD.hpp"
+
+namespace AudioGain {
+
+using namespace AudioSIMD;
+
+// ----------------------------------------------------------------------------
+// Kernels
+// ----------------------------------------------------------------------------
+
+// dst[i] = FlushClip(src[i] * gain). dst and src may alias.
+static inline void Apply(float* dst, const float* src, uint32_t samples, float gain) {
+    uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+    const Vec g = Splat(gain);
+    for (; i + kWidth <= samples; i += kWidth) {
+        Store(dst + i, FlushClip(Mul(Load(src + i), g)));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = FlushClip(src[i] * gain);
+    }
+}
+
+// Like Apply(), but the gain for frame n is startGain + n * frameStep, and
+// every channel in a frame gets the same gain. dst and src may alias.
+static inline void ApplyRamp(float* dst, const float* src, uint32_t frames, uint32_t channels,
+                             float startGain, float frameStep) {
+    const uint32_t samples = frames * channels;
+    uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+    if (channels != 0 && kWidth % channels == 0) {
+        // Several whole frames per vector: lane k belongs to frame k / channels
+        float lanes[kWidth];
+        for (uint32_t k = 0; k < kWidth; k++) {
+            lanes[k] = startGain + frameStep * (float)(k / channels);
+        }
+        Vec g = Load(lanes);
+        const Vec step = Splat(frameStep * (float)(kWidth / channels));
+        for (; i + kWidth <= samples; i += kWidth) {
+            Store(dst + i, FlushClip(Mul(Load(src + i), g)));
+            g = Add(g, step);
+        }
+    } else if (channels % kWidth == 0) {
+        // Each frame is a whole number of vectors: broadcast its gain
+        for (uint32_t frame = 0; frame < frames; frame++) {
+            const Vec g = Splat(startGain + frameStep * (float)frame);
+            for (uint32_t end = i + channels; i < end; i += kWidth) {
+                Store(dst + i, FlushClip(Mul(Load(src + i), g)));
+            }
+        }
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = FlushClip(src[i] * (startGain + frameStep * (float)(i / channels)));
+    }
+}
+
+// dst[i] += src[i] * gain, with no clipping, so several sources can be summed
+// and clipped once at the end.
+static inline void Mix(float* dst, const float* src, uint32_t samples, float gain) {
+    uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+    const Vec g = Splat(gain);
+    for (; i + kWidth <= samples; i += kWidth) {
+        Store(dst + i, MulAdd(Load(dst + i), Load(src + i), g));
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+// True if every sample is zero, of either sign. Checks a few vectors at a
+// time and stops at the first that isn't, so a buffer with sound in it
+// costs next to nothing.
+static inline bool IsSilent(const float* src, uint32_t samples) {
+    uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+    constexpr uint32_t kChunk = 8 * kWidth;
+    for (; i + kChunk <= samples; i += kChunk) {
+        Vec peak = Abs(Load(src + i));
+        for (uint32_t k = kWidth; k < kChunk; k += kWidth) {
+            peak = Max(peak, Abs(Load(src + i + k)));
+        }
+        if (Sum(peak) != 0.0f) return false;
+    }
+#endif
+    for (; i < samples; i++) {
+        if (src[i] != 0.0f) return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Gain stage
+// ----------------------------------------------------------------------------
+
+// Tracks the gain actually applied on the IO thread and ramps it linearly to
+// the requested target across each block, so volume and mute changes don't
+// zipper. Owned by a single IO thread.
+class Stage {
+public:
+    // Call once per block, before process(). Returns false when the gain is
+    // settled at `target` for the whole block.
+    bool begin(float target, uint32_t blockFrames) {
+        mTarget = target;
+        mFrameStep = (blockFrames > 0) ? (target - mCurrent) / (float)blockFrames : 0.0f;
+        if (mFrameStep == 0.0f) mCurrent = target;
+        return mFrameStep != 0.0f;
+    }
+
+    // Copies `frames` frames from src to dst with the block's gain, and
+    // returns the position just past the last sample written. Consecutive
+    // calls continue the same ramp, so a block split across the ring's wrap
+    // point stays continuous.
+    float* process(float* dst, const float* src, uint32_t frames, uint32_t channels) {
+        const uint32_t samples = frames * channels;
+        if (samples == 0) return dst;
+
+        if (mFrameStep != 0.0f) {
+            ApplyRamp(dst, src, frames, channels, mCurrent, mFrameStep);
+            mCurrent += mFrameStep * (float)frames;
+        } else if (mCurrent == 1.0f) {
+            // Unity is a bit-exact pass-through
+            if (dst != src) std::memcpy(dst, src, samples * sizeof(float));
+        } else if (mCurrent == 0.0f) {
+            std::memset(dst, 0, samples * sizeof(float));
+        } else {
+            Apply(dst, src, samples, mCurrent);
+        }
+        return dst + samples;
+    }
+
+    // Call once per block, after process(). Lands exactly on the target even
+    // if the block was short.
+    void end() {
+        mCurrent = mTarget;
+        mFrameStep = 0.0f;
+    }
+
+    // Jumps to `gain` with no ramp, e.g. to 0 after a dropout so the next
+    // block fades back in.
+    void reset(float gain) {
+        mCurrent = gain;
+        mTarget = gain;
+        mFrameStep = 0.0f;
+    }
+
+    float current() const { return mCurrent; }
+
+private:
+    float mCurrent = 1.0f;
+    float mTarget = 1.0f;
+    float mFrameStep = 0.0f;
+};
+
+// ----------------------------------------------------------------------------
+// Crossfade
+// ----------------------------------------------------------------------------
+
+// Moves a signal from one destination to another over a fixed number of
+// frames. The incoming side's gain follows sin and the outgoing side's cos
+// of a quarter turn, so the two together keep the signal's power level
+// throughout. The curves are evaluated exactly every kSegmentFrames frames
+// and ramped linearly in between, which keeps the per-sample work to
+// ApplyRamp(). Owned by a single IO thread.
+class Crossfade {
+public:
+    static constexpr uint32_t kSegmentFrames = 16;
+
+    enum Side { kIn, kOut };
+
+    void start(uint32_t frames) {
+        mFrames = frames;
+        mPosition = 0;
+    }
+
+    bool isActive() const { return mPosition < mFrames; }
+
+    // dst = FlushClip(src * gain) for `frames` frames of `side`, starting
+    // `offset` frames into the current block; past the end of the fade the
+    // incoming side passes through and the outgoing side is silent. Doesn't
+    // move the fade on, so each side of a block, and each span of a side,
+    // can be rendered separately; see advance(). dst and src may alias.
+    void process(float* dst, const float* src, uint32_t frames, uint32_t channels, Side side, uint32_t offset) const {
+        uint32_t done = 0;
+        while (done < frames) {
+            const uint32_t position = mPosition + offset + done;
+            if (position >= mFrames) {
+                const uint32_t samples = (frames - done) * channels;
+                if (side == kOut) {
+                    std::memset(dst + done * channels, 0, samples * sizeof(float));
+                } else if (dst != src) {
+                    std::memcpy(dst + done * channels, src + done * channels, samples * sizeof(float));
+                }
+                return;
+            }
+            const uint32_t span = std::min({ kSegmentFrames - position % kSegmentFrames, frames - done, mFrames - position });
+            const float startGain = gainAt(position, side);
+            const float endGain = gainAt(position + span, side);
+            ApplyRamp(dst + done * channels, src + done * channels, span, channels, startGain, (endGain - startGain) / (float)span);
+            done += span;
+        }
+    }
+
+    // Call once per block, after every process() for it.
+    void advance(uint32_t frames) { mPosition = std::min(mPosition + frames, mFrames); }
+
+private:
+    float gainAt(uint32_t position, Side side) const {
+        const double angle = 1.5707963267948966 * (double)position / (double)mFrames;
+        return (float)(side == kIn ? std::sin(angle) : std::cos(angle));
+    }
+
+    uint32_t mFrames = 0;
+    uint32_t mPosition = 0;
+};
+
+} // namespace AudioGain
+
+#endif /* AudioGain_hpp */
@@ -0,0 +1,204 @@
+/*
+ *  AudioMeter.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Per-channel peak and RMS metering for the IO thread, published lock-free
+ *  for the property path to read at whatever rate the UI polls.
+ *
+ *  The IO thread accumulates every block with a vectorized kernel and
+ *  publishes one snapshot per window into one of two slots; readers copy the
+ *  newest complete slot. The writer never waits, and a reader only retries
+ *  if it was so slow that the writer came round to its slot again.
+ */
+
+#ifndef AudioMeter_hpp
+#define AudioMeter_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "AudioSIMD.hpp"
+
+namespace AudioMeter {
+
+using namespace AudioSIMD;
+
+static constexpr uint32_t kMaxChannels = 16;
+
+// ----------------------------------------------------------------------------
+// Kernels
+// ----------------------------------------------------------------------------
+
+// For each channel, raises peak[ch] to the largest |sample| and adds the sum
+// of squares to sumSquares[ch]. `channels` must not exceed kMaxChannels.
+static inline void Accumulate(const float* src, uint32_t frames, uint32_t channels, float* peak, float* sumSquares) {
+    const uint32_t samples = frames * channels;
+    uint32_t i = 0;
+#if AUDIOSIMD_VECTOR
+    if (channels != 0 && kWidth % channels == 0) {
+        // Several whole frames per vector: lane k belongs to channel k % channels
+        Vec vpeak = Splat(0.0f);
+        Vec vsum = Splat(0.0f);
+        for (; i + kWidth <= samples; i += kWidth) {
+            const Vec x = Load(src + i);
+            vpeak = Max(vpeak, Abs(x));
+            vsum = MulAdd(vsum, x, x);
+        }
+        float lanePeak[kWidth];
+        float laneSum[kWidth];
+        Store(lanePeak, vpeak);
+        Store(laneSum, vsum);
+        for (uint32_t k = 0; k < kWidth; k++) {
+            peak[k % channels] = std::max(peak[k % channels], lanePeak[k]);
+            sumSquares[k % channels] += laneSum[k];
+        }
+    } else if (channels % kWidth == 0) {
+        // Each frame is a whole number of vectors: one accumulator per group
+        const uint32_t groups = channels / kWidth;
+        Vec vpeak[kMaxChannels / kWidth];
+        Vec vsum[kMaxChannels / kWidth];
+        for (uint32_t g = 0; g < groups; g++) {
+            vpeak[g] = Splat(0.0f);
+            vsum[g] = Splat(0.0f);
+        }
+        for (; i < samples; ) {
+            for (uint32_t g = 0; g < groups; g++, i += kWidth) {
+                const Vec x = Load(src + i);
+                vpeak[g] = Max(vpeak[g], Abs(x));
+                vsum[g] = MulAdd(vsum[g], x, x);
+            }
+        }
+        for (uint32_t g = 0; g < groups; g++) {
+            float lanePeak[kWidth];
+            float laneSum[kWidth];
+            Store(lanePeak, vpeak[g]);
+            Store(laneSum, vsum[g]);
+            for (uint32_t k = 0; k < kWidth; k++) {
+                peak[g * kWidth + k] = std::max(peak[g * kWidth + k], lanePeak[k]);
+                sumSquares[g * kWidth + k] += laneSum[k];
+            }
+        }
+    }
+#endif
+    for (; i < samples; i++) {
+        const uint32_t ch = i % channels;
+        peak[ch] = std::max(peak[ch], std::fabs(src[i]));
+        sumSquares[ch] += src[i] * src[i];
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Meter
+// ----------------------------------------------------------------------------
+
+// One window's levels, linear full scale.
+struct Levels {
+    uint64_t hostTime;          // When the window closed
+    uint32_t channels;
+    float peak[kMaxChannels];
+    float rms[kMaxChannels];
+};
+
+// Written by a single IO thread, read from any thread.
+class Meter {
+public:
+    // IO thread. Publishes a snapshot each time `windowFrames` frames have
+    // accumulated; `hostTime` stamps it. A channel count change (or more
+    // than kMaxChannels, which isn't metered) drops the partial window.
+    void process(const float* data, uint32_t frames, uint32_t channels, uint32_t windowFrames, uint64_t hostTime) {
+        if (channels == 0 || channels > kMaxChannels) return;
+        if (channels != mChannels) {
+            mChannels = channels;
+            clear();
+        }
+        Accumulate(data, frames, channels, mPeak, mSumSquares);
+        mFrames += frames;
+        if (mFrames >= windowFrames) {
+            publish(hostTime);
+        }
+    }
+
+    // IO thread. Same as process() on `frames` frames of zeros, which only
+    // count towards the window.
+    void processSilence(uint32_t frames, uint32_t channels, uint32_t windowFrames, uint64_t hostTime) {
+        if (channels == 0 || channels > kMaxChannels) return;
+        if (channels != mChannels) {
+            mChannels = channels;
+            clear();
+        }
+        mFrames += frames;
+        if (mFrames >= windowFrames) {
+            publish(hostTime);
+        }
+    }
+
+    // Any thread. Copies the newest snapshot; false until there is one.
+    bool read(Levels* out) const {
+        for (;;) {
+            const uint64_t sequence = mSequence.load(std::memory_order_acquire);
+            const uint64_t published = sequence >> 1;
+            if (published == 0) {
+                return false;
+            }
+            const Slot& slot = mSlots[published & 1];
+            out->hostTime = slot.hostTime.load(std::memory_order_relaxed);
+            out->channels = slot.channels.load(std::memory_order_relaxed);
+            for (uint32_t ch = 0; ch < out->channels; ch++) {
+                out->peak[ch] = slot.peak[ch].load(std::memory_order_relaxed);
+                out->rms[ch] = slot.rms[ch].load(std::memory_order_relaxed);
+            }
+            // The writer only returns to this slot for snapshot published + 2
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (mSequence.load(std::memory_order_relaxed) < 2 * published + 3) {
+                return true;
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> hostTime{0};
+        std::atomic<uint32_t> channels{0};
+        std::atomic<float> peak[kMaxChannels] = {};
+        std::atomic<float> rms[kMaxChannels] = {};
+    };
+
+    // mSequence is 2n while snapshot n is the newest, and 2n + 1 while
+    // snapshot n + 1 is being written into the other slot
+    void publish(uint64_t hostTime) {
+        const uint64_t next = (mSequence.load(std::memory_order_relaxed) >> 1) + 1;
+        mSequence.store(2 * next - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        Slot& slot = mSlots[next & 1];
+        slot.hostTime.store(hostTime, std::memory_order_relaxed);
+        slot.channels.store(mChannels, std::memory_order_relaxed);
+        for (uint32_t ch = 0; ch < mChannels; ch++) {
+            slot.peak[ch].store(mPeak[ch], std::memory_order_relaxed);
+            slot.rms[ch].store(std::sqrt(mSumSquares[ch] / (float)mFrames), std::memory_order_relaxed);
+        }
+        mSequence.store(2 * next, std::memory_order_release);
+        clear();
+    }
+
+    void clear() {
+        std::fill(mPeak, mPeak + kMaxChannels, 0.0f);
+        std::fill(mSumSquares, mSumSquares + kMaxChannels, 0.0f);
+        mFrames = 0;
+    }
+
+    // IO thread only
+    float mPeak[kMaxChannels] = {};
+    float mSumSquares[kMaxChannels] = {};
+    uint32_t mFrames = 0;
+    uint32_t mChannels = 0;
+
+    std::atomic<uint64_t> mSequence{0};
+    Slot mSlots[2];
+};
+
+} // namespace AudioMeter
+
+#endif /* AudioMeter_hpp */
@@ -0,0 +1,86 @@
+/*
+ *  AudioProbe.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Latency probe for a ring: the producer marks one frame by its index and
+ *  the host time it was written, and the consumer, when a read takes that
+ *  frame, turns the marker into a latency. The marker rides alongside the
+ *  ring rather than in it, so the audio itself is never touched and any
+ *  signal, silence included, can be measured.
+ *
+ *  - There is one marker at a time. mark() replaces it whether or not it
+ *    was found, so a marker the consumer never reaches, e.g. because
+ *    nothing reads the ring, costs nothing but a later one.
+ *  - A marker the consumer has already read past without seeing, as after
+ *    a flush or a trimmed backlog, is dropped rather than measured.
+ *  - The marker is published seqlock style by its single writer. A reader
+ *    that catches it mid-update leaves it for its next read instead of
+ *    retrying, so neither side ever waits.
+ *
+ *  The consumer keeps the latencies it measures in `latency`; see
+ *  AudioDurationCounters.
+ */
+
+#ifndef AudioProbe_hpp
+#define AudioProbe_hpp
+
+#include <atomic>
+#include <cstdint>
+
+#include "AudioStats.hpp"
+
+class AudioLatencyProbe {
+public:
+    AudioLatencyProbe() = default;
+    AudioLatencyProbe(const AudioLatencyProbe&) = delete;
+    AudioLatencyProbe& operator=(const AudioLatencyProbe&) = delete;
+
+    // Producer side, real-time safe. Marks ring frame `frame` as written at
+    // `hostTime`. Call before the frame is committed, so no read can take
+    // it ahead of the marker.
+    void mark(uint64_t frame, uint64_t hostTime) {
+        const uint64_t sequence = mSequence.load(std::memory_order_relaxed);
+        mSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        mFrame.store(frame, std::memory_order_relaxed);
+        mHostTime.store(hostTime, std::memory_order_relaxed);
+        mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Markers placed so far. Any thread.
+    uint64_t markCount() const { return mSequence.load(std::memory_order_relaxed) / 2; }
+
+    // Consumer side, real-time safe. True, once per marker, if the marked
+    // frame is among the `frames` a read takes from ring frame `start`;
+    // returns how far into them it is and when it was written.
+    bool find(uint64_t start, uint32_t frames, uint32_t* outOffset, uint64_t* outHostTime) {
+        const uint64_t sequence = mSequence.load(std::memory_order_acquire);
+        if ((sequence & 1) || sequence == mFoundSequence) {
+            return false;
+        }
+        const uint64_t frame = mFrame.load(std::memory_order_relaxed);
+        const uint64_t hostTime = mHostTime.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (mSequence.load(std::memory_order_relaxed) != sequence || frame >= start + frames) {
+            return false;
+        }
+        mFoundSequence = sequence;
+        if (frame < start) {
+            return false;
+        }
+        *outOffset = (uint32_t)(frame - start);
+        *outHostTime = hostTime;
+        return true;
+    }
+
+    // Written by the consumer only
+    AudioDurationCounters latency;
+
+private:
+    alignas(64) std::atomic<uint64_t> mSequence{0};     // Odd while mark() is writing
+    std::atomic<uint64_t> mFrame{0};
+    std::atomic<uint64_t> mHostTime{0};
+    alignas(64) uint64_t mFoundSequence = 0;            // Consumer's
+};
+
+#endif /* AudioProbe_hpp */
@@ -0,0 +1,394 @@
+/*
+ *  AudioRecorder.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Records a device's tap (see AudioTap.hpp) to CAF files, from a process
+ *  outside coreaudiod, without becoming a HAL client of the device. Meant
+ *  for sessions hours long, from several devices at once.
+ *
+ *  - Two threads per recorder, neither of them real-time. The capture
+ *    thread wakes every kPollMilliseconds and copies what the tap has into
+ *    fixed-size chunks; the writer thread writes full chunks out with
+ *    pwrite(). The tap holds over a second of audio, so a capture thread
+ *    that only ever copies keeps well ahead of it, and the chunks queued in
+ *    between absorb the disk's stalls.
+ *  - Memory is bounded: the chunks are allocated by start() and recycled.
+ *    If the disk falls so far behind that none is free, the capture thread
+ *    drops audio rather than grow, and counts what it dropped.
+ *  - Chunks are page-aligned and fill with as many frames as make a whole
+ *    number of pages, so each is written at a page-aligned offset with
+ *    caching off for the file (F_NOCACHE), and hours of audio don't push
+ *    everything else out of the page cache. Only a file's last chunk ends
+ *    short.
+ *  - The data chunk's size stays "unknown" until the file is closed, which
+ *    CAF allows, so a file cut short by a crash is still readable up to its
+ *    last write.
+ *  - A file holds one format. When the tap's changes, recording carries on
+ *    in a new file: "NAME.caf", then "NAME-2.caf", "NAME-3.caf" and so on.
+ *    A tap reader resyncs to the newest frame on a new format, so what the
+ *    device wrote before the next poll, kPollMilliseconds at most, is lost.
+ */
+
+#ifndef AudioRecorder_hpp
+#define AudioRecorder_hpp
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AudioTap.hpp"
+
+class AudioRecorder {
+public:
+    static constexpr size_t kChunkBytes = 1 << 20;
+    static constexpr size_t kPageBytes = 4096;
+    static constexpr uint32_t kDefaultChunkCount = 16;
+    static constexpr uint32_t kPollMilliseconds = 50;
+    static constexpr off_t kDataOffset = kPageBytes;    // Where the audio starts in each file
+
+    AudioRecorder() = default;
+    AudioRecorder(const AudioRecorder&) = delete;
+    AudioRecorder& operator=(const AudioRecorder&) = delete;
+    ~AudioRecorder() { stop(); }
+
+    bool open(const char* tapName) { return mReader.open(tapName); }
+    bool isOpen() const { return mReader.isOpen(); }
+
+    // Starts recording the open tap to `path`, a .caf file, with
+    // `chunkCount` chunks of buffering. The first file is created once the
+    // tap has a format. Not thread safe with stop().
+    void start(const std::string& path, uint32_t chunkCount = kDefaultChunkCount) {
+        stop();
+        mBasePath = path;
+        if (mBasePath.size() > 4 && mBasePath.compare(mBasePath.size() - 4, 4, ".caf") == 0) {
+            mBasePath.resize(mBasePath.size() - 4);
+        }
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            void* data = nullptr;
+            if (posix_memalign(&data, kPageBytes, kChunkBytes) == 0) {
+                mChunks.push_back(Chunk{ (float*)data });
+            }
+        }
+        for (Chunk& chunk : mChunks) {
+            mFree.push_back(&chunk);
+        }
+        mStopping = false;
+        mCaptureDone = false;
+        mWriter = std::thread([this] { writeLoop(); });
+        mCapture = std::thread([this] { captureLoop(); });
+    }
+
+    // Writes out everything captured so far, closes the file and frees the
+    // chunks.
+    void stop() {
+        if (!mCapture.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mCapture.join();
+        mWriter.join();
+        for (Chunk& chunk : mChunks) {
+            free(chunk.data);
+        }
+        mChunks.clear();
+        mFree.clear();
+        mFull.clear();
+    }
+
+    // Any thread.
+    uint64_t framesWritten() const { return mFramesWritten.load(std::memory_order_relaxed); }
+    uint64_t framesDropped() const { return mFramesDropped.load(std::memory_order_relaxed); }
+    uint32_t fileCount() const { return mFileCount.load(std::memory_order_relaxed); }
+    // Set once a file couldn't be created or written; what follows is dropped.
+    bool failed() const { return mFailed.load(std::memory_order_relaxed); }
+
+private:
+    // Interleaved frames of one format
+    struct Chunk {
+        float* data;
+        uint32_t frames = 0;
+        uint32_t channels = 0;
+        double sampleRate = 0.0;
+
+        size_t bytes() const { return (size_t)frames * channels * sizeof(float); }
+        // The most frames that still fill whole pages
+        uint32_t capacityFrames() const {
+            const size_t frameBytes = channels * sizeof(float);
+            const size_t unitBytes = std::lcm(kPageBytes, frameBytes);
+            return (uint32_t)(kChunkBytes / unitBytes * unitBytes / frameBytes);
+        }
+    };
+
+    // ------------------------------------------------------------------------
+    // Capture thread
+    // ------------------------------------------------------------------------
+
+    void captureLoop() {
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            const bool stopping = mStopping;
+            lock.unlock();
+
+            drain();
+            if (stopping) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(kPollMilliseconds));
+        }
+        if (mCurrent) {
+            queue(mCurrent);
+            mCurrent = nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCaptureDone = true;
+        mReady.notify_one();
+    }
+
+    // Copies everything the tap has into chunks, queueing each as it fills
+    void drain() {
+        for (;;) {
+            AudioTapReader::Regions regions = mReader.peek(AudioTap::kCapacityFrames);
+            const uint32_t channels = mReader.channelCount();
+            if (channels == 0 || regions.frames() == 0) return;
+
+            if (mCurrent && (mCurrent->channels != channels || mCurrent->sampleRate != mReader.sampleRate())) {
+                queue(mCurrent);
+                mCurrent = nullptr;
+            }
+            if (!mCurrent) {
+                mCurrent = takeFree();
+                if (!mCurrent) {
+                    // The writer is this far behind; let the tap move on
+                    mReader.consume(regions.frames());
+                    mFramesDropped.fetch_add(regions.frames(), std::memory_order_relaxed);
+                    return;
+                }
+                mCurrent->frames = 0;
+                mCurrent->channels = channels;
+                mCurrent->sampleRate = mReader.sampleRate();
+            }
+
+            const uint32_t frames = std::min(regions.frames(), mCurrent->capacityFrames() - mCurrent->frames);
+            float* out = mCurrent->data + (size_t)mCurrent->frames * channels;
+            const uint32_t first = std::min(frames, regions.first.frames);
+            std::memcpy(out, regions.first.data, (size_t)first * channels * sizeof(float));
+            std::memcpy(out + (size_t)first * channels, regions.second.data, (size_t)(frames - first) * channels * sizeof(float));
+            if (mReader.consume(frames)) {
+                mCurrent->frames += frames;
+            } else {
+                // Overwritten while we copied it
+                mFramesDropped.fetch_add(frames, std::memory_order_relaxed);
+            }
+
+            if (mCurrent->frames == mCurrent->capacityFrames()) {
+                queue(mCurrent);
+                mCurrent = nullptr;
+            }
+        }
+    }
+
+    Chunk* takeFree() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFree.empty()) return nullptr;
+        Chunk* chunk = mFree.back();
+        mFree.pop_back();
+        return chunk;
+    }
+
+    void queue(Chunk* chunk) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFull.push_back(chunk);
+        mReady.notify_one();
+    }
+
+    // ------------------------------------------------------------------------
+    // Writer thread
+    // ------------------------------------------------------------------------
+
+    void writeLoop() {
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mReady.wait(lock, [this] { return !mFull.empty() || mCaptureDone; });
+            if (mFull.empty()) break;
+            Chunk* chunk = mFull.front();
+            mFull.pop_front();
+            lock.unlock();
+
+            write(*chunk);
+
+            lock.lock();
+            mFree.push_back(chunk);
+        }
+        closeFile();
+    }
+
+    void write(const Chunk& chunk) {
+        if (chunk.frames == 0) return;
+        if (mFile >= 0 && (chunk.channels != mFileChannels || chunk.sampleRate != mFileRate)) {
+            closeFile();
+        }
+        if (mFile < 0 && !mFailed.load(std::memory_order_relaxed)) {
+            openFile(chunk.sampleRate, chunk.channels);
+        }
+        if (mFile < 0) {
+            mFramesDropped.fetch_add(chunk.frames, std::memory_order_relaxed);
+            return;
+        }
+
+        const char* bytes = (const char*)chunk.data;
+        size_t remaining = chunk.bytes();
+        while (remaining > 0) {
+            const ssize_t written = pwrite(mFile, bytes, remaining, kDataOffset + mDataBytes);
+            if (written <= 0) {
+                mFailed.store(true, std::memory_order_relaxed);
+                mFramesDropped.fetch_add(remaining / (chunk.channels * sizeof(float)), std::memory_order_relaxed);
+                closeFile();
+                return;
+            }
+            bytes += written;
+            remaining -= (size_t)written;
+            mDataBytes += (off_t)written;
+        }
+        mFramesWritten.fetch_add(chunk.frames, std::memory_order_relaxed);
+    }
+
+    // "NAME.caf" for the first file, "NAME-N.caf" after that
+    void openFile(double sampleRate, uint32_t channels) {
+        const uint32_t index = mFileCount.load(std::memory_order_relaxed) + 1;
+        std::string path = mBasePath;
+        if (index > 1) {
+            path += "-" + std::to_string(index);
+        }
+        path += ".caf";
+
+        mFile = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (mFile < 0) {
+            mFailed.store(true, std::memory_order_relaxed);
+            return;
+        }
+#ifdef F_NOCACHE
+        fcntl(mFile, F_NOCACHE, 1);
+#endif
+        uint8_t header[kDataOffset];
+        makeHeader(header, sampleRate, channels);
+        if (pwrite(mFile, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            ::close(mFile);
+            mFile = -1;
+            mFailed.store(true, std::memory_order_relaxed);
+            return;
+        }
+        mFileRate = sampleRate;
+        mFileChannels = channels;
+        mDataBytes = 0;
+        mFileCount.store(index, std::memory_order_relaxed);
+    }
+
+    // Fills in the data chunk's size now that it's known
+    void closeFile() {
+        if (mFile < 0) return;
+        uint8_t size[8];
+        putUInt64(size, (uint64_t)mDataBytes + 4);  // Includes the edit count
+        pwrite(mFile, size, sizeof(size), kDataOffset - 12);
+        ::close(mFile);
+        mFile = -1;
+    }
+
+    // ------------------------------------------------------------------------
+    // CAF
+    // ------------------------------------------------------------------------
+
+    // File header, then 'desc', a 'free' chunk padding the audio out to
+    // kDataOffset, and the 'data' chunk's header with its size unknown.
+    // CAF is big-endian throughout, apart from the samples, which are
+    // native little-endian Float32.
+    static void makeHeader(uint8_t* header, double sampleRate, uint32_t channels) {
+        std::memset(header, 0, kDataOffset);
+        uint8_t* p = header;
+        p = putTag(p, "caff");
+        p = putUInt16(p, 1);                    // Version
+        p = putUInt16(p, 0);                    // Flags
+
+        p = putTag(p, "desc");
+        p = putUInt64(p, 32);
+        uint64_t rateBits;
+        std::memcpy(&rateBits, &sampleRate, sizeof(rateBits));
+        p = putUInt64(p, rateBits);
+        p = putTag(p, "lpcm");
+        p = putUInt32(p, 1 | 2);                // Float, little-endian
+        p = putUInt32(p, channels * 4);         // Bytes per packet
+        p = putUInt32(p, 1);                    // Frames per packet
+        p = putUInt32(p, channels);
+        p = putUInt32(p, 32);                   // Bits per channel
+
+        const uint64_t freeBytes = (uint64_t)(kDataOffset - (p - header) - 12 - 16);
+        p = putTag(p, "free");
+        p = putUInt64(p, freeBytes);
+        p += freeBytes;
+
+        p = putTag(p, "data");
+        p = putUInt64(p, ~0ull);                // Unknown until closeFile()
+        putUInt32(p, 0);                        // Edit count
+    }
+
+    static uint8_t* putTag(uint8_t* p, const char* tag) {
+        std::memcpy(p, tag, 4);
+        return p + 4;
+    }
+
+    static uint8_t* putUInt16(uint8_t* p, uint16_t value) {
+        p[0] = (uint8_t)(value >> 8);
+        p[1] = (uint8_t)value;
+        return p + 2;
+    }
+
+    static uint8_t* putUInt32(uint8_t* p, uint32_t value) {
+        for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (24 - 8 * i));
+        return p + 4;
+    }
+
+    static uint8_t* putUInt64(uint8_t* p, uint64_t value) {
+        for (int i = 0; i < 8; i++) p[i] = (uint8_t)(value >> (56 - 8 * i));
+        return p + 8;
+    }
+
+    AudioTapReader mReader;
+    std::string mBasePath;
+
+    std::vector<Chunk> mChunks;
+    std::mutex mMutex;
+    std::condition_variable mReady;         // A chunk was queued, or capture ended
+    std::vector<Chunk*> mFree;              // Under mMutex
+    std::deque<Chunk*> mFull;               // Under mMutex
+    bool mStopping = false;                 // Under mMutex
+    bool mCaptureDone = false;              // Under mMutex
+    std::thread mCapture;
+    std::thread mWriter;
+
+    // Capture thread only
+    Chunk* mCurrent = nullptr;
+
+    // Writer thread only
+    int mFile = -1;
+    off_t mDataBytes = 0;
+    double mFileRate = 0.0;
+    uint32_t mFileChannels = 0;
+
+    std::atomic<uint64_t> mFramesWritten{0};
+    std::atomic<uint64_t> mFramesDropped{0};
+    std::atomic<uint32_t> mFileCount{0};
+    std::atomic<bool> mFailed{false};
+};
+
+#endif /* AudioRecorder_hpp */
@@ -0,0 +1,237 @@
+/*
+ *  AudioResampler.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Polyphase windowed-sinc sample-rate converter for interleaved Float32.
+ *
+ *  configure() builds the filter table and sizes all buffers, and is the
+ *  only call that allocates. push(), process() and setRateScale() are real-
+ *  time safe. History is kept planar (one contiguous run per channel) so the
+ *  per-channel dot products run straight through AudioSIMD vectors whatever
+ *  the channel count. Coefficients for a fractional position are linearly
+ *  interpolated between the two nearest of kPhases precomputed phases.
+ *  Given an AudioArena, the table and history come from it, like a ring's
+ *  storage, so the IO path never faults on them.
+ */
+
+#ifndef AudioResampler_hpp
+#define AudioResampler_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "AudioArena.hpp"
+#include "AudioSIMD.hpp"
+
+class AudioResampler {
+public:
+    static constexpr uint32_t kTaps = 32;               // Per phase; a multiple of every kWidth
+    static constexpr uint32_t kPhases = 128;
+    static constexpr uint32_t kMaxPushFrames = 8192;    // Input frames buffered ahead of the filter, at least
+    static constexpr double kMaxRateScale = 1.01;       // Headroom for setRateScale() in that
+    static constexpr size_t kStorageAlignment = 64;
+    static constexpr size_t kTableBytes = (size_t)(kPhases + 1) * kTaps * sizeof(float);
+
+    AudioResampler() = default;
+    AudioResampler(const AudioResampler&) = delete;
+    AudioResampler& operator=(const AudioResampler&) = delete;
+
+    ~AudioResampler() { releaseStorage(); }
+
+    // History a configure() with these arguments allocates, in bytes
+    static size_t historyBytesFor(double inputRate, double outputRate, uint32_t channels, uint32_t maxOutputFrames = 0) {
+        return (size_t)capacityFor(inputRate / outputRate, maxOutputFrames) * channels * sizeof(float);
+    }
+
+    // Not real-time safe. History is sized so one push() and process() can
+    // render `maxOutputFrames` frames at a time. Storage comes from `arena`
+    // if given, otherwise from the heap.
+    void configure(double inputRate, double outputRate, uint32_t channels, uint32_t maxOutputFrames = 0, AudioArena* arena = nullptr) {
+        mInputRate = inputRate;
+        mOutputRate = outputRate;
+        mChannels = channels;
+        mBaseStep = inputRate / outputRate;
+        mStep = mBaseStep;
+
+        // Cut off just under the lower of the two Nyquist frequencies
+        const double cutoff = std::min(1.0, outputRate / inputRate) * 0.97;
+        const double center = (double)(kTaps / 2 - 1);
+
+        releaseStorage();
+        mArena = arena;
+        mCapacity = capacityFor(mBaseStep, maxOutputFrames);
+        mHistoryBytes = (size_t)mCapacity * channels * sizeof(float);
+        mTable = allocateStorage(kTableBytes);
+        mHistory = allocateStorage(mHistoryBytes);
+
+        for (uint32_t phase = 0; phase <= kPhases; phase++) {
+            float* row = &mTable[(size_t)phase * kTaps];
+            double sum = 0.0;
+            for (uint32_t k = 0; k < kTaps; k++) {
+                double x = (double)k - center - (double)phase / kPhases;
+                double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x * cutoff) / (M_PI * x * cutoff);
+                double w = 0.42 + 0.5 * std::cos(M_PI * x / (kTaps / 2)) + 0.08 * std::cos(2.0 * M_PI * x / (kTaps / 2));
+                double h = (std::fabs(x) < kTaps / 2) ? sinc * w : 0.0;
+                row[k] = (float)h;
+                sum += h;
+            }
+            // Unity DC gain for every phase
+            for (uint32_t k = 0; k < kTaps; k++) {
+                row[k] = (float)(row[k] / sum);
+            }
+        }
+        reset();
+    }
+
+    // Real-time safe. Drops buffered input and re-primes with silence.
+    void reset() {
+        if (mHistory) std::memset(mHistory, 0, mHistoryBytes);
+        mHistoryFrames = kTaps - 1;
+        mPosition = 0.0;
+    }
+
+    bool isConfigured(double inputRate, double outputRate, uint32_t channels) const {
+        return mInputRate == inputRate && mOutputRate == outputRate && mChannels == channels;
+    }
+
+    // Nudges the conversion ratio by `scale` (~1.0) for drift correction.
+    void setRateScale(double scale) { mStep = mBaseStep * scale; }
+
+    // Input frames that must still be pushed before process() can render
+    // `outFrames` frames.
+    uint32_t inputFramesNeeded(uint32_t outFrames) const {
+        if (outFrames == 0) return 0;
+        uint64_t last = (uint64_t)(mPosition + mStep * (outFrames - 1)) + kTaps;
+        return (last > mHistoryFrames) ? (uint32_t)(last - mHistoryFrames) : 0;
+    }
+
+    // Appends interleaved input; returns how many frames fit.
+    uint32_t push(const float* interleaved, uint32_t frames) {
+        frames = std::min(frames, mCapacity - mHistoryFrames);
+        for (uint32_t ch = 0; ch < mChannels; ch++) {
+            float* plane = channelPlane(ch) + mHistoryFrames;
+            for (uint32_t i = 0; i < frames; i++) {
+                plane[i] = interleaved[(size_t)i * mChannels + ch];
+            }
+        }
+        mHistoryFrames += frames;
+        return frames;
+    }
+
+    // Renders up to `outFrames` interleaved frames from pushed input; returns
+    // how many were produced.
+    uint32_t process(float* out, uint32_t outFrames) {
+        float coeffs[kTaps];
+        uint32_t produced = 0;
+
+        while (produced < outFrames) {
+            uint32_t index = (uint32_t)mPosition;
+            if (index + kTaps > mHistoryFrames) break;
+
+            interpolateCoefficients(mPosition - index, coeffs);
+            for (uint32_t ch = 0; ch < mChannels; ch++) {
+                out[(size_t)produced * mChannels + ch] = dot(coeffs, channelPlane(ch) + index);
+            }
+            mPosition += mStep;
+            produced++;
+        }
+
+        // Discard input the filter has moved past
+        uint32_t consumed = std::min((uint32_t)mPosition, mHistoryFrames);
+        if (consumed > 0) {
+            uint32_t remaining = mHistoryFrames - consumed;
+            for (uint32_t ch = 0; ch < mChannels; ch++) {
+                float* plane = channelPlane(ch);
+                std::memmove(plane, plane + consumed, remaining * sizeof(float));
+            }
+            mHistoryFrames = remaining;
+            mPosition -= consumed;
+        }
+        return produced;
+    }
+
+private:
+    static uint32_t capacityFor(double step, uint32_t maxOutputFrames) {
+        const double pushFrames = std::ceil(maxOutputFrames * step * kMaxRateScale) + 1.0;
+        return kTaps + std::max(kMaxPushFrames, (uint32_t)pushFrames);
+    }
+
+    float* allocateStorage(size_t bytes) {
+        void* storage = mArena ? mArena->allocate(bytes, kStorageAlignment) : ::operator new(bytes, std::align_val_t(kStorageAlignment));
+        return static_cast<float*>(storage);
+    }
+
+    void freeStorage(float* storage, size_t bytes) {
+        if (!storage) return;
+        if (mArena) {
+            mArena->release(storage, bytes, kStorageAlignment);
+        } else {
+            ::operator delete(storage, std::align_val_t(kStorageAlignment));
+        }
+    }
+
+    void releaseStorage() {
+        freeStorage(mTable, kTableBytes);
+        freeStorage(mHistory, mHistoryBytes);
+        mTable = nullptr;
+        mHistory = nullptr;
+        mHistoryBytes = 0;
+    }
+
+    float* channelPlane(uint32_t ch) { return mHistory + (size_t)ch * mCapacity; }
+
+    void interpolateCoefficients(double frac, float* coeffs) const {
+        double scaled = frac * kPhases;
+        uint32_t phase = std::min((uint32_t)scaled, kPhases - 1);
+        const float* lo = &mTable[(size_t)phase * kTaps];
+        const float* hi = lo + kTaps;
+        const float t = (float)(scaled - phase);
+        uint32_t k = 0;
+#if AUDIOSIMD_VECTOR
+        using namespace AudioSIMD;
+        const Vec vt = Splat(t);
+        for (; k < kTaps; k += kWidth) {
+            Vec a = Load(lo + k);
+            Store(coeffs + k, MulAdd(a, vt, Sub(Load(hi + k), a)));
+        }
+#endif
+        for (; k < kTaps; k++) {
+            coeffs[k] = lo[k] + t * (hi[k] - lo[k]);
+        }
+    }
+
+    static float dot(const float* coeffs, const float* x) {
+        uint32_t k = 0;
+        float sum = 0.0f;
+#if AUDIOSIMD_VECTOR
+        using namespace AudioSIMD;
+        Vec acc = Splat(0.0f);
+        for (; k < kTaps; k += kWidth) {
+            acc = MulAdd(acc, Load(coeffs + k), Load(x + k));
+        }
+        sum = Sum(acc);
+#endif
+        for (; k < kTaps; k++) {
+            sum += coeffs[k] * x[k];
+        }
+        return sum;
+    }
+
+    AudioArena* mArena = nullptr;
+    float* mTable = nullptr;                // kPhases + 1 rows of kTaps
+    float* mHistory = nullptr;              // mChannels planes of mCapacity
+    size_t mHistoryBytes = 0;
+    uint32_t mCapacity = 0;
+    uint32_t mHistoryFrames = 0;
+    uint32_t mChannels = 0;
+    double mInputRate = 0.0;
+    double mOutputRate = 0.0;
+    double mBaseStep = 1.0;
+    double mStep = 1.0;
+    double mPosition = 0.0;
+};
+
+#endif /* AudioResampler_hpp */
@@ -1,120 +1,300 @@
 /*
  *  AudioRingBuffer.hpp
- *  AudioRouterDriver
+ *  AudiDeck Virtual Audio Driver
  *
- *  C++ Lock-free ring buffer for audio data transfer
+ *  Single-producer / single-consumer lock-free ring buffer for interleaved
+ *  audio. The producer is the WriteMix IO thread, the consumer is the
+ *  ReadInput IO thread; neither ever blocks.
+ *
+ *  - Capacity is rounded up to a power of two so wrapping is a mask, not a
+ *    division.
+ *  - Data is interleaved and contiguous, so every transfer is at most two
+ *    memcpy()s around the wrap point. reserveWrite()/commitWrite() and
+ *    peekRead()/consumeRead() expose those spans directly so callers can
+ *    process in place instead of copying through a scratch buffer.
+ *  - Indices are free-running 64-bit frame counters published with
+ *    release/acquire ordering.
+ *  - The write and read indices live on separate cache lines, each next to
+ *    the side's private cached copy of the opposite index, so the two IO
+ *    threads only touch each other's line when the cached view runs out.
+ *  - flush() discards buffered data from any thread in O(1): it publishes
+ *    the current write index as a flush point, and the consumer skips up to
+ *    it on its next read. Storage is never cleared; the consumer never
+ *    reads past what the producer has published.
+ *  - The producer records where the last frame with sound ended, so the
+ *    consumer can tell when all it is about to read is silence
+ *    (Regions::silent) and skip processing it. writeSilence() stops
+ *    touching storage once a whole lap of it has been silent, so an idle
+ *    ring costs its indices and nothing else.
+ *  - Storage comes from an AudioArena when one is given, so it can be
+ *    wired, and from the heap otherwise.
  */
 
 #ifndef AudioRingBuffer_hpp
 #define AudioRingBuffer_hpp
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <new>
+
+#include "AudioArena.hpp"
+
+// Apple Silicon uses 128-byte cache lines; Intel uses 64.
+#if defined(__aarch64__) || defined(__arm64__)
+#define kAudioRingBuffer_CacheLineSize 128
+#else
+#define kAudioRingBuffer_CacheLineSize 64
+#endif
 
+// Channels == 0 means the channel count is supplied at runtime.
+template <typename Sample, uint32_t Channels = 0>
 class AudioRingBuffer {
 public:
-    AudioRingBuffer(uint32_t bufferSizeFrames, uint32_t channelCount)
-        : mChannelCount(channelCount)
-        , mWriteIndex(0)
-        , mReadIndex(0)
+    static constexpr size_t kCacheLineSize = kAudioRingBuffer_CacheLineSize;
+
+    AudioRingBuffer(uint32_t bufferSizeFrames, uint32_t channelCount = Channels, AudioArena* arena = nullptr)
+        : mChannelCount(Channels ? Channels : channelCount)
     {
-        // Round up to power of 2 for efficient modulo
+        uint32_t size = capacityFor(bufferSizeFrames);
+        mBufferSize = size;
+        mBufferMask = size - 1;
+
+        size_t bytes = static_cast<size_t>(size) * mChannelCount * sizeof(Sample);
+        void* storage = arena ? arena->allocate(bytes, kCacheLineSize) : ::operator new(bytes, std::align_val_t(kCacheLineSize));
+        mBuffer = std::unique_ptr<Sample, StorageDelete>(static_cast<Sample*>(storage), StorageDelete{ arena, bytes });
+        std::memset(mBuffer.get(), 0, bytes);
+    }
+
+    // Capacity a ring asked for `frames` frames ends up with: rounded up to
+    // a power of 2 for efficient modulo.
+    static uint32_t capacityFor(uint32_t frames) {
         uint32_t size = 1;
-        while (size < bufferSizeFrames) {
+        while (size < frames) {
             size <<= 1;
         }
-        mBufferSize = size;
-        mBufferMask = size - 1;
-        
-        mBuffer = std::make_unique<float[]>(static_cast<size_t>(size) * channelCount);
-        std::memset(mBuffer.get(), 0, static_cast<size_t>(size) * channelCount * sizeof(float));
+        return size;
     }
-    
-    void reset() {
-        mWriteIndex.store(0, std::memory_order_relaxed);
-        mReadIndex.store(0, std::memory_order_relaxed);
-        std::memset(mBuffer.get(), 0, static_cast<size_t>(mBufferSize) * mChannelCount * sizeof(float));
+
+    AudioRingBuffer(const AudioRingBuffer&) = delete;
+    AudioRingBuffer& operator=(const AudioRingBuffer&) = delete;
+
+    // Any thread, while both sides run. Everything written before the call
+    // is dropped the next time the consumer reads.
+    void flush() {
+        uint64_t writeIdx = mWriteIndex.load(std::memory_order_acquire);
+        uint64_t flushIdx = mFlushIndex.load(std::memory_order_relaxed);
+        while (flushIdx < writeIdx &&
+               !mFlushIndex.compare_exchange_weak(flushIdx, writeIdx, std::memory_order_release, std::memory_order_relaxed)) {
+        }
     }
-    
+
+    uint32_t capacityFrames() const { return mBufferSize; }
+    uint32_t channelCount() const { return Channels ? Channels : mChannelCount; }
+
+    // Approximate when called from a third thread.
     uint32_t availableFrames() const {
-        uint64_t write = mWriteIndex.load(std::memory_order_acquire);
         uint64_t read = mReadIndex.load(std::memory_order_acquire);
+        uint64_t write = mWriteIndex.load(std::memory_order_acquire);
         return static_cast<uint32_t>(write - read);
     }
-    
+
     uint32_t freeFrames() const {
         return mBufferSize - availableFrames();
     }
-    
-    uint32_t write(const float* data, uint32_t frameCount) {
-        uint32_t free = freeFrames();
-        uint32_t toWrite = (frameCount < free) ? frameCount : free;
-        
+
+    // Producer side: the free-running index the next frame written lands at.
+    uint64_t writePosition() const { return mWriteIndex.load(std::memory_order_relaxed); }
+
+    // Consumer side: the index of the first frame the last peekRead()
+    // exposed, until it's consumed.
+    uint64_t readPosition() const { return mReadIndex.load(std::memory_order_relaxed); }
+
+    // A contiguous span of interleaved frames inside the ring.
+    struct Region {
+        Sample* data;
+        uint32_t frames;
+    };
+
+    // Any transfer touches at most two spans: up to the end of the storage,
+    // then from its start after the wrap.
+    struct Regions {
+        Region first;
+        Region second;
+        bool silent = false;    // peekRead() only: every frame was written as silence
+
+        uint32_t frames() const { return first.frames + second.frames; }
+    };
+
+    // Producer side. Exposes free space for up to `frameCount` frames so the
+    // caller can render straight into ring memory, then publish what it
+    // wrote with commitWrite().
+    Regions reserveWrite(uint32_t frameCount) {
+        uint64_t writeIdx = mWriteIndex.load(std::memory_order_relaxed);
+        return regionsAt(writeIdx, std::min(frameCount, producerFreeFrames(writeIdx, frameCount)));
+    }
+
+    // `frameCount` must not exceed what the last reserveWrite() returned.
+    // The frames are taken to hold sound.
+    void commitWrite(uint32_t frameCount) {
+        const uint64_t writeIdx = mWriteIndex.load(std::memory_order_relaxed) + frameCount;
+        // Published before the frames, so a consumer that sees them sees
+        // this too
+        mSoundEnd.store(writeIdx, std::memory_order_relaxed);
+        mWriteIndex.store(writeIdx, std::memory_order_release);
+    }
+
+    // Consumer side. Exposes readable data for up to `frameCount` frames
+    // without consuming it; release it with consumeRead().
+    Regions peekRead(uint32_t frameCount) {
+        uint64_t readIdx = applyFlush();
+        Regions regions = regionsAt(readIdx, std::min(frameCount, consumerAvailableFrames(readIdx, frameCount)));
+        regions.silent = mSoundEnd.load(std::memory_order_relaxed) <= readIdx;
+        return regions;
+    }
+
+    // `frameCount` must not exceed what the last peekRead() returned.
+    void consumeRead(uint32_t frameCount) {
+        mReadIndex.store(mReadIndex.load(std::memory_order_relaxed) + frameCount, std::memory_order_release);
+    }
+
+    // Producer side. Returns the number of frames written; frames that do
+    // not fit are dropped.
+    uint32_t write(const Sample* data, uint32_t frameCount) {
+        Regions regions = reserveWrite(frameCount);
+        uint32_t toWrite = regions.frames();
+
+        if (toWrite == 0) return 0;
+
+        std::memcpy(regions.first.data, data, bytesFor(regions.first.frames));
+        if (regions.second.frames > 0) {
+            std::memcpy(regions.second.data, data + samplesFor(regions.first.frames), bytesFor(regions.second.frames));
+        }
+
+        commitWrite(toWrite);
+        return toWrite;
+    }
+
+    // Producer side. Like write() of `frameCount` zeroed frames, but leaves
+    // the consumer seeing silence. Storage that has held only silence for a
+    // whole lap is already zero and isn't touched.
+    uint32_t writeSilence(uint32_t frameCount) {
+        Regions regions = reserveWrite(frameCount);
+        uint32_t toWrite = regions.frames();
         if (toWrite == 0) return 0;
-        
         uint64_t writeIdx = mWriteIndex.load(std::memory_order_relaxed);
-        
-        for (uint32_t i = 0; i < toWrite; i++) {
-            uint32_t bufferPos = static_cast<uint32_t>((writeIdx + i) & mBufferMask);
-            size_t bufferOffset = static_cast<size_t>(bufferPos) * mChannelCount;
-            size_t dataOffset = static_cast<size_t>(i) * mChannelCount;
-            
-            for (uint32_t ch = 0; ch < mChannelCount; ch++) {
-                mBuffer[bufferOffset + ch] = data[dataOffset + ch];
-            }
+        if (writeIdx - mSoundEnd.load(std::memory_order_relaxed) < mBufferSize) {
+            std::memset(regions.first.data, 0, bytesFor(regions.first.frames));
+            std::memset(regions.second.data, 0, bytesFor(regions.second.frames));
         }
-        
-        std::atomic_thread_fence(std::memory_order_release);
         mWriteIndex.store(writeIdx + toWrite, std::memory_order_release);
-        
         return toWrite;
     }
-    
-    uint32_t read(float* data, uint32_t frameCount) {
-        uint32_t available = availableFrames();
-        uint32_t toRead = (frameCount < available) ? frameCount : available;
-        
-        if (toRead == 0) {
-            // Fill with silence
-            std::memset(data, 0, static_cast<size_t>(frameCount) * mChannelCount * sizeof(float));
-            return 0;
-        }
-        
-        uint64_t readIdx = mReadIndex.load(std::memory_order_relaxed);
-        std::atomic_thread_fence(std::memory_order_acquire);
-        
-        for (uint32_t i = 0; i < toRead; i++) {
-            uint32_t bufferPos = static_cast<uint32_t>((readIdx + i) & mBufferMask);
-            size_t bufferOffset = static_cast<size_t>(bufferPos) * mChannelCount;
-            size_t dataOffset = static_cast<size_t>(i) * mChannelCount;
-            
-            for (uint32_t ch = 0; ch < mChannelCount; ch++) {
-                data[dataOffset + ch] = mBuffer[bufferOffset + ch];
+
+    // Consumer side. Returns the number of frames read; the remainder of
+    // `data` is filled with silence.
+    uint32_t read(Sample* data, uint32_t frameCount) {
+        Regions regions = peekRead(frameCount);
+        uint32_t toRead = regions.frames();
+
+        if (toRead > 0) {
+            std::memcpy(data, regions.first.data, bytesFor(regions.first.frames));
+            if (regions.second.frames > 0) {
+                std::memcpy(data + samplesFor(regions.first.frames), regions.second.data, bytesFor(regions.second.frames));
             }
+            consumeRead(toRead);
         }
-        
-        mReadIndex.store(readIdx + toRead, std::memory_order_release);
-        
+
         // Fill remaining with silence
         if (toRead < frameCount) {
-            size_t offset = static_cast<size_t>(toRead) * mChannelCount;
-            size_t remaining = static_cast<size_t>(frameCount - toRead) * mChannelCount;
-            std::memset(data + offset, 0, remaining * sizeof(float));
+            std::memset(data + samplesFor(toRead), 0, bytesFor(frameCount - toRead));
         }
-        
+
         return toRead;
     }
-    
+
 private:
-    std::unique_ptr<float[]> mBuffer;
+    struct StorageDelete {
+        AudioArena* arena;
+        size_t bytes;
+        void operator()(Sample* p) const {
+            if (arena) {
+                arena->release(p, bytes, kCacheLineSize);
+            } else {
+                ::operator delete(p, std::align_val_t(kCacheLineSize));
+            }
+        }
+    };
+
+    size_t samplesFor(uint32_t frames) const { return static_cast<size_t>(frames) * channelCount(); }
+    size_t bytesFor(uint32_t frames) const { return samplesFor(frames) * sizeof(Sample); }
+
+    Regions regionsAt(uint64_t index, uint32_t frames) const {
+        uint32_t offset = static_cast<uint32_t>(index & mBufferMask);
+        uint32_t firstFrames = std::min(frames, mBufferSize - offset);
+        Sample* buffer = mBuffer.get();
+        return Regions{
+            { buffer + samplesFor(offset), firstFrames },
+            { buffer, frames - firstFrames }
+        };
+    }
+
+    // Only reloads the consumer's index when the cached one says there is
+    // not enough room.
+    uint32_t producerFreeFrames(uint64_t writeIdx, uint32_t wanted) {
+        uint32_t free = mBufferSize - static_cast<uint32_t>(writeIdx - mCachedReadIndex);
+        if (free < wanted) {
+            mCachedReadIndex = mReadIndex.load(std::memory_order_acquire);
+            free = mBufferSize - static_cast<uint32_t>(writeIdx - mCachedReadIndex);
+        }
+        return free;
+    }
+
+    // Consumer side. Skips to the flush point if a flush() has moved it past
+    // us, and returns the read index.
+    uint64_t applyFlush() {
+        uint64_t readIdx = mReadIndex.load(std::memory_order_relaxed);
+        uint64_t flushIdx = mFlushIndex.load(std::memory_order_acquire);
+        if (flushIdx <= readIdx) {
+            return readIdx;
+        }
+        // The flush point was read from mWriteIndex, so a fresh load can't
+        // be behind it
+        mCachedWriteIndex = mWriteIndex.load(std::memory_order_acquire);
+        mReadIndex.store(flushIdx, std::memory_order_release);
+        return flushIdx;
+    }
+
+    // Only reloads the producer's index when the cached one says there is
+    // not enough data.
+    uint32_t consumerAvailableFrames(uint64_t readIdx, uint32_t wanted) {
+        uint32_t available = static_cast<uint32_t>(mCachedWriteIndex - readIdx);
+        if (available < wanted) {
+            mCachedWriteIndex = mWriteIndex.load(std::memory_order_acquire);
+            available = static_cast<uint32_t>(mCachedWriteIndex - readIdx);
+        }
+        return available;
+    }
+
+    // Read-only after construction; shared by both sides.
+    alignas(kCacheLineSize) std::unique_ptr<Sample, StorageDelete> mBuffer;
     uint32_t mBufferSize;
     uint32_t mBufferMask;
     uint32_t mChannelCount;
-    std::atomic<uint64_t> mWriteIndex;
-    std::atomic<uint64_t> mReadIndex;
+
+    // Producer-owned line. mSoundEnd is the write index just past the last
+    // frame written with sound.
+    alignas(kCacheLineSize) std::atomic<uint64_t> mWriteIndex{0};
+    uint64_t mCachedReadIndex = 0;
+    std::atomic<uint64_t> mSoundEnd{0};
+
+    // Consumer-owned line. mFlushIndex is written by flush(), which is rare.
+    alignas(kCacheLineSize) std::atomic<uint64_t> mReadIndex{0};
+    uint64_t mCachedWriteIndex = 0;
+    std::atomic<uint64_t> mFlushIndex{0};
 };
 
 #endif /* AudioRingBuffer_hpp */
-
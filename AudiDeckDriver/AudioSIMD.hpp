@@ -0,0 +1,136 @@
+/*
+ *  AudioSIMD.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Thin compile-time vector layer shared by the IO-thread kernels: NEON on
+ *  Apple Silicon, AVX or SSE2 on Intel (whichever the build enables), and
+ *  kWidth == 1 with no Vec type otherwise. Kernels test AUDIOSIMD_VECTOR
+ *  and always keep a scalar tail.
+ *
+ *  LoadInt16 / StoreInt16 move kWidth int16 samples in and out of a Vec
+ *  without scaling; the store rounds to nearest and saturates.
+ */
+
+#ifndef AudioSIMD_hpp
+#define AudioSIMD_hpp
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIOSIMD_NEON 1
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define AUDIOSIMD_AVX 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIOSIMD_SSE2 1
+#endif
+
+#if AUDIOSIMD_NEON || AUDIOSIMD_AVX || AUDIOSIMD_SSE2
+#define AUDIOSIMD_VECTOR 1
+#endif
+
+namespace AudioSIMD {
+
+#if AUDIOSIMD_NEON
+typedef float32x4_t Vec;
+static constexpr uint32_t kWidth = 4;
+static inline Vec Load(const float* p) { return vld1q_f32(p); }
+static inline void Store(float* p, Vec v) { vst1q_f32(p, v); }
+static inline Vec Splat(float x) { return vdupq_n_f32(x); }
+static inline Vec Add(Vec a, Vec b) { return vaddq_f32(a, b); }
+static inline Vec Sub(Vec a, Vec b) { return vsubq_f32(a, b); }
+static inline Vec Mul(Vec a, Vec b) { return vmulq_f32(a, b); }
+static inline Vec MulAdd(Vec acc, Vec a, Vec b) { return vfmaq_f32(acc, a, b); }
+static inline Vec Max(Vec a, Vec b) { return vmaxq_f32(a, b); }
+static inline Vec Abs(Vec x) { return vabsq_f32(x); }
+static inline float Sum(Vec v) { return vaddvq_f32(v); }
+static inline Vec FlushClip(Vec x) {
+    uint32x4_t keep = vcageq_f32(x, vdupq_n_f32(FLT_MIN));
+    x = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(x), keep));
+    return vminq_f32(vmaxq_f32(x, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+}
+static inline Vec LoadInt16(const int16_t* p) { return vcvtq_f32_s32(vmovl_s16(vld1_s16(p))); }
+static inline void StoreInt16(int16_t* p, Vec v) { vst1_s16(p, vqmovn_s32(vcvtnq_s32_f32(v))); }
+#elif AUDIOSIMD_AVX
+typedef __m256 Vec;
+static constexpr uint32_t kWidth = 8;
+static inline Vec Load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void Store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+static inline Vec Splat(float x) { return _mm256_set1_ps(x); }
+static inline Vec Add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+static inline Vec Sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+static inline Vec Mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+static inline Vec MulAdd(Vec acc, Vec a, Vec b) { return _mm256_add_ps(acc, _mm256_mul_ps(a, b)); }
+static inline Vec Max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+static inline Vec Abs(Vec x) { return _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff))); }
+static inline float Sum(Vec v) {
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+static inline Vec FlushClip(Vec x) {
+    const Vec absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    Vec keep = _mm256_cmp_ps(_mm256_and_ps(x, absMask), _mm256_set1_ps(FLT_MIN), _CMP_GE_OQ);
+    x = _mm256_and_ps(x, keep);
+    return _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+}
+static inline Vec LoadInt16(const int16_t* p) {
+    __m128i x = _mm_loadu_si128((const __m128i*)p);
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+static inline void StoreInt16(int16_t* p, Vec v) {
+    __m256i x = _mm256_cvtps_epi32(v);
+    _mm_storeu_si128((__m128i*)p, _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extractf128_si256(x, 1)));
+}
+#elif AUDIOSIMD_SSE2
+typedef __m128 Vec;
+static constexpr uint32_t kWidth = 4;
+static inline Vec Load(const float* p) { return _mm_loadu_ps(p); }
+static inline void Store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+static inline Vec Splat(float x) { return _mm_set1_ps(x); }
+static inline Vec Add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+static inline Vec Sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+static inline Vec Mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+static inline Vec MulAdd(Vec acc, Vec a, Vec b) { return _mm_add_ps(acc, _mm_mul_ps(a, b)); }
+static inline Vec Max(Vec a, Vec b) { return _mm_max_ps(a, b); }
+static inline Vec Abs(Vec x) { return _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))); }
+static inline float Sum(Vec v) {
+    __m128 x = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+static inline Vec FlushClip(Vec x) {
+    const Vec absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    Vec keep = _mm_cmpge_ps(_mm_and_ps(x, absMask), _mm_set1_ps(FLT_MIN));
+    x = _mm_and_ps(x, keep);
+    return _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+}
+static inline Vec LoadInt16(const int16_t* p) {
+    __m128i x = _mm_loadl_epi64((const __m128i*)p);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+}
+static inline void StoreInt16(int16_t* p, Vec v) {
+    __m128i x = _mm_cvtps_epi32(v);
+    _mm_storel_epi64((__m128i*)p, _mm_packs_epi32(x, x));
+}
+#else
+static constexpr uint32_t kWidth = 1;
+#endif
+
+// Zeroes denormals and clips to [-1, 1]
+static inline float FlushClip(float x) {
+    if (std::fabs(x) < FLT_MIN) x = 0.0f;
+    return std::min(std::max(x, -1.0f), 1.0f);
+}
+
+} // namespace AudioSIMD
+
+#endif /* AudioSIMD_hpp */
@@ -0,0 +1,174 @@
+/*
+ *  AudioStats.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Counters a device's IO thread keeps about its own IO: frames its ring had
+ *  no room for, frames its input padded with silence, how full its ring got,
+ *  and how long each DoIO took. Counts only grow and the extremes only
+ *  widen, so a reader measures an interval by taking the difference of two
+ *  reads.
+ *
+ *  Every field has one writer, so updates are a relaxed load and store
+ *  rather than a read-modify-write, and cost the IO thread no more than the
+ *  plain arithmetic. Readers see each field whole but not the set as one
+ *  snapshot, which is fine for counters. The layout is plain enough to live
+ *  in shared memory; see AudioTapHeader.
+ *
+ *  AudioDurationCounters is the same idea for one kind of duration whose
+ *  spread matters more than its extremes, e.g. the latency probe's (see
+ *  AudioProbe.hpp): a count per half-octave bucket alongside the totals.
+ */
+
+#ifndef AudioStats_hpp
+#define AudioStats_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+// One read of an AudioIOCounters
+struct AudioIOStats {
+    uint64_t cycles;
+    uint64_t framesDropped;         // Written while the ring was full
+    uint64_t framesZeroFilled;      // Read while the ring was short
+    uint64_t maxFillFrames;         // Deepest the ring has been after a write
+    uint64_t ioCount;               // DoIO calls
+    uint64_t ioTotalNanos;
+    uint64_t ioMinNanos;            // 0 until the first DoIO
+    uint64_t ioMaxNanos;
+
+    uint64_t ioMeanNanos() const { return ioCount ? ioTotalNanos / ioCount : 0; }
+};
+
+struct AudioIOCounters {
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> framesDropped{0};
+    std::atomic<uint64_t> framesZeroFilled{0};
+    std::atomic<uint64_t> maxFillFrames{0};
+    std::atomic<uint64_t> ioCount{0};
+    std::atomic<uint64_t> ioTotalNanos{0};
+    std::atomic<uint64_t> ioMinNanos{0};
+    std::atomic<uint64_t> ioMaxNanos{0};
+
+    // Writer side, real-time safe.
+    void addCycle() { add(cycles, 1); }
+    void addDropped(uint64_t frames) { if (frames) add(framesDropped, frames); }
+    void addZeroFilled(uint64_t frames) { if (frames) add(framesZeroFilled, frames); }
+
+    void noteFill(uint64_t frames) {
+        if (frames > maxFillFrames.load(std::memory_order_relaxed)) {
+            maxFillFrames.store(frames, std::memory_order_relaxed);
+        }
+    }
+
+    void addIO(uint64_t nanos) {
+        const uint64_t count = ioCount.load(std::memory_order_relaxed);
+        if (count == 0 || nanos < ioMinNanos.load(std::memory_order_relaxed)) {
+            ioMinNanos.store(nanos, std::memory_order_relaxed);
+        }
+        if (nanos > ioMaxNanos.load(std::memory_order_relaxed)) {
+            ioMaxNanos.store(nanos, std::memory_order_relaxed);
+        }
+        add(ioTotalNanos, nanos);
+        ioCount.store(count + 1, std::memory_order_relaxed);
+    }
+
+    // Writer side: mirrors every field into `other`, e.g. a copy in shared
+    // memory.
+    void copyTo(AudioIOCounters& other) const {
+        other.cycles.store(cycles.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.framesDropped.store(framesDropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.framesZeroFilled.store(framesZeroFilled.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.maxFillFrames.store(maxFillFrames.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.ioCount.store(ioCount.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.ioTotalNanos.store(ioTotalNanos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.ioMinNanos.store(ioMinNanos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.ioMaxNanos.store(ioMaxNanos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    // Any thread.
+    AudioIOStats read() const {
+        AudioIOStats stats;
+        stats.cycles = cycles.load(std::memory_order_relaxed);
+        stats.framesDropped = framesDropped.load(std::memory_order_relaxed);
+        stats.framesZeroFilled = framesZeroFilled.load(std::memory_order_relaxed);
+        stats.maxFillFrames = maxFillFrames.load(std::memory_order_relaxed);
+        stats.ioCount = ioCount.load(std::memory_order_relaxed);
+        stats.ioTotalNanos = ioTotalNanos.load(std::memory_order_relaxed);
+        stats.ioMinNanos = ioMinNanos.load(std::memory_order_relaxed);
+        stats.ioMaxNanos = ioMaxNanos.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+static_assert(std::is_standard_layout<AudioIOCounters>::value, "AudioIOCounters is mapped into shared memory");
+
+// One read of an AudioDurationCounters
+struct AudioDurations {
+    // Bucket b holds durations up to upperNanos(b), half an octave apart
+    // from 125 us up to 256 ms; the last holds everything longer.
+    static constexpr uint32_t kBucketCount = 24;
+
+    static uint64_t upperNanos(uint32_t bucket) {
+        return ((bucket & 1) ? 176777ull : 125000ull) << (bucket / 2);
+    }
+
+    static uint32_t bucketFor(uint64_t nanos) {
+        uint32_t bucket = 0;
+        while (bucket < kBucketCount - 1 && nanos > upperNanos(bucket)) {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t minNanos;              // 0 until the first
+    uint64_t maxNanos;
+    uint64_t buckets[kBucketCount];
+
+    uint64_t meanNanos() const { return count ? totalNanos / count : 0; }
+};
+
+struct AudioDurationCounters {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> totalNanos{0};
+    std::atomic<uint64_t> minNanos{0};
+    std::atomic<uint64_t> maxNanos{0};
+    std::atomic<uint64_t> buckets[AudioDurations::kBucketCount] = {};
+
+    // Writer side, real-time safe.
+    void add(uint64_t nanos) {
+        const uint64_t n = count.load(std::memory_order_relaxed);
+        if (n == 0 || nanos < minNanos.load(std::memory_order_relaxed)) {
+            minNanos.store(nanos, std::memory_order_relaxed);
+        }
+        if (nanos > maxNanos.load(std::memory_order_relaxed)) {
+            maxNanos.store(nanos, std::memory_order_relaxed);
+        }
+        std::atomic<uint64_t>& bucket = buckets[AudioDurations::bucketFor(nanos)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        totalNanos.store(totalNanos.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+        count.store(n + 1, std::memory_order_relaxed);
+    }
+
+    // Any thread.
+    AudioDurations read() const {
+        AudioDurations durations;
+        durations.count = count.load(std::memory_order_relaxed);
+        durations.totalNanos = totalNanos.load(std::memory_order_relaxed);
+        durations.minNanos = minNanos.load(std::memory_order_relaxed);
+        durations.maxNanos = maxNanos.load(std::memory_order_relaxed);
+        for (uint32_t b = 0; b < AudioDurations::kBucketCount; b++) {
+            durations.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+        }
+        return durations;
+    }
+};
+
+#endif /* AudioStats_hpp */
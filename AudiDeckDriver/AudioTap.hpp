@@ -0,0 +1,350 @@
+/*
+ *  AudioTap.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Broadcast ring in POSIX shared memory, so other processes can read a
+ *  device's audio without becoming CoreAudio clients of it.
+ *
+ *  - One writer (the device's IO thread) and any number of readers. The
+ *    writer never waits: a reader that falls a whole capacity behind has
+ *    been overwritten, finds out when it validates, and skips ahead.
+ *  - The region is a fixed AudioTapHeader followed by kCapacityFrames
+ *    frames of interleaved Float32, sized for kMaxChannels, so a format
+ *    change never remaps. Frame n lives at slot n & kFrameMask at the
+ *    current channel count.
+ *  - The format sits behind `epoch`, a sequence lock that is odd while the
+ *    writer changes it. Each epoch restarts the frame counters at 0, and
+ *    readers resync when they see a new one.
+ *  - `reserveIndex` is published before the writer touches storage and
+ *    `writeIndex` after, so a reader can check afterwards that nothing it
+ *    read was being overwritten, and read in place instead of copying.
+ *  - `ioStats` mirrors the device's IO counters (see AudioStats.hpp) as of
+ *    its last write, so a monitor can watch them without a property call.
+ *
+ *  The layout is plain enough to map from Swift or C; field offsets and
+ *  kVersion only ever change together.
+ */
+
+#ifndef AudioTap_hpp
+#define AudioTap_hpp
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "AudioStats.hpp"
+
+struct AudioTapHeader {
+    uint32_t magic;                     // AudioTap::kMagic
+    uint32_t version;                   // AudioTap::kVersion
+    uint32_t headerBytes;               // Offset of the first frame
+    uint32_t capacityFrames;
+    uint32_t maxChannels;
+    uint32_t reserved;
+
+    std::atomic<uint64_t> epoch;        // Odd while the format is changing
+    double sampleRate;                  // Under `epoch`
+    uint32_t channelCount;              // Under `epoch`; 0 until the first write
+    uint32_t reserved2;
+
+    alignas(64) std::atomic<uint64_t> reserveIndex;    // Frames being written up to
+    alignas(64) std::atomic<uint64_t> writeIndex;      // Frames written this epoch
+
+    alignas(64) AudioIOCounters ioStats;                // The device's counters; not reset by an epoch
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "AudioTap needs address-free 64-bit atomics");
+
+class AudioTap {
+public:
+    static constexpr uint32_t kMagic = 0x61746170;     // 'atap'
+    static constexpr uint32_t kVersion = 2;
+    static constexpr uint32_t kCapacityFrames = 65536;
+    static constexpr uint32_t kFrameMask = kCapacityFrames - 1;
+    static constexpr uint32_t kMaxChannels = 16;
+    static constexpr size_t kHeaderBytes = (sizeof(AudioTapHeader) + 127) & ~(size_t)127;
+    static constexpr size_t kRegionBytes = kHeaderBytes + (size_t)kCapacityFrames * kMaxChannels * sizeof(float);
+
+    // Shared memory name for the device with this UID: "/audideck." and the
+    // UID's 32-bit FNV-1a hash in hex, well inside the 31 characters macOS
+    // allows.
+    static void MakeName(const char* uid, char* outName, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (const unsigned char* c = (const unsigned char*)uid; *c; c++) {
+            hash = (hash ^ *c) * 16777619u;
+        }
+        snprintf(outName, size, "/audideck.%08x", hash);
+    }
+
+    AudioTap() = default;
+    AudioTap(const AudioTap&) = delete;
+    AudioTap& operator=(const AudioTap&) = delete;
+    ~AudioTap() { close(); }
+
+    // Creates the named region, or takes over one an earlier instance left
+    // behind. Not real-time safe.
+    bool open(const char* name) {
+        close();
+        int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        // macOS sizes a shared memory object only once, so one left behind is
+        // mapped as it is. One too small for us can't be, and is replaced;
+        // its readers keep their mapping of the old one.
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (info.st_size != 0 && info.st_size < (off_t)kRegionBytes) {
+            ::close(fd);
+            shm_unlink(name);
+            fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            info.st_size = 0;
+        }
+        void* region = MAP_FAILED;
+        if (info.st_size != 0 || ftruncate(fd, (off_t)kRegionBytes) == 0) {
+            region = mmap(nullptr, kRegionBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (region == MAP_FAILED) {
+            shm_unlink(name);
+            return false;
+        }
+
+        mHeader = (AudioTapHeader*)region;
+        mFrames = (float*)((char*)region + kHeaderBytes);
+        snprintf(mName, sizeof(mName), "%s", name);
+
+        // A region left behind by an earlier instance may have readers still
+        // mapped; move its epoch on rather than back to 0
+        uint64_t epoch = (mHeader->magic == kMagic) ? mHeader->epoch.load() : 0;
+        mHeader->epoch.store(epoch | 1);
+        mHeader->magic = kMagic;
+        mHeader->version = kVersion;
+        mHeader->headerBytes = (uint32_t)kHeaderBytes;
+        mHeader->capacityFrames = kCapacityFrames;
+        mHeader->maxChannels = kMaxChannels;
+        // Fault every page in, and wire them if we may, so the IO thread's
+        // first lap through the ring doesn't fault on each one
+        std::memset(mFrames, 0, kRegionBytes - kHeaderBytes);
+        mlock(region, kRegionBytes);
+        mHeader->sampleRate = 0.0;
+        mHeader->channelCount = 0;
+        mHeader->reserveIndex.store(0);
+        mHeader->writeIndex.store(0);
+        AudioIOCounters().copyTo(mHeader->ioStats);
+        mHeader->epoch.store((epoch | 1) + 1, std::memory_order_release);
+        mSampleRate = 0.0;
+        mChannels = 0;
+        return true;
+    }
+
+    // Unmaps and unlinks; readers keep their mapping until they close it.
+    void close() {
+        if (!mHeader) return;
+        munmap(mHeader, kRegionBytes);
+        shm_unlink(mName);
+        mHeader = nullptr;
+        mFrames = nullptr;
+    }
+
+    bool isOpen() const { return mHeader != nullptr; }
+    const char* name() const { return mName; }
+
+    // Writer side, real-time safe. Readers drop whatever they were following
+    // and pick up from the next write.
+    void restart() {
+        beginEpoch(mSampleRate, mChannels);
+    }
+
+    // Writer side, real-time safe. A new format starts a new epoch; more
+    // than kMaxChannels channels aren't tapped.
+    void write(const float* data, uint32_t frames, uint32_t channels, double sampleRate) {
+        if (channels == 0 || channels > kMaxChannels) return;
+        if (channels != mChannels || sampleRate != mSampleRate) {
+            beginEpoch(sampleRate, channels);
+        }
+        // Only the last capacity's worth can survive anyway
+        if (frames > kCapacityFrames) {
+            data += (size_t)(frames - kCapacityFrames) * channels;
+            frames = kCapacityFrames;
+        }
+
+        const uint64_t start = mHeader->writeIndex.load(std::memory_order_relaxed);
+        mHeader->reserveIndex.store(start + frames, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        const uint32_t slot = (uint32_t)start & kFrameMask;
+        const uint32_t first = std::min(frames, kCapacityFrames - slot);
+        std::memcpy(mFrames + (size_t)slot * channels, data, (size_t)first * channels * sizeof(float));
+        std::memcpy(mFrames, data + (size_t)first * channels, (size_t)(frames - first) * channels * sizeof(float));
+
+        mHeader->writeIndex.store(start + frames, std::memory_order_release);
+    }
+
+    // Writer side, real-time safe.
+    void publishStats(const AudioIOCounters& stats) {
+        stats.copyTo(mHeader->ioStats);
+    }
+
+private:
+    void beginEpoch(double sampleRate, uint32_t channels) {
+        const uint64_t epoch = mHeader->epoch.load(std::memory_order_relaxed);
+        mHeader->epoch.store(epoch + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        mHeader->sampleRate = sampleRate;
+        mHeader->channelCount = channels;
+        mHeader->reserveIndex.store(0, std::memory_order_relaxed);
+        mHeader->writeIndex.store(0, std::memory_order_relaxed);
+        mHeader->epoch.store(epoch + 2, std::memory_order_release);
+        mSampleRate = sampleRate;
+        mChannels = channels;
+    }
+
+    AudioTapHeader* mHeader = nullptr;
+    float* mFrames = nullptr;
+    char mName[32] = {};
+    double mSampleRate = 0.0;      // Writer's copy of the header's format
+    uint32_t mChannels = 0;
+};
+
+// Follows a tap from another process. Reads either copy out with read(), or
+// happen in place between peek() and a consume() that says whether the data
+// was intact.
+class AudioTapReader {
+public:
+    struct Region {
+        const float* data;
+        uint32_t frames;
+    };
+
+    struct Regions {
+        Region first;
+        Region second;
+
+        uint32_t frames() const { return first.frames + second.frames; }
+    };
+
+    AudioTapReader() = default;
+    AudioTapReader(const AudioTapReader&) = delete;
+    AudioTapReader& operator=(const AudioTapReader&) = delete;
+    ~AudioTapReader() { close(); }
+
+    bool open(const char* name) {
+        close();
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        void* region = mmap(nullptr, AudioTap::kRegionBytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (region == MAP_FAILED) {
+            return false;
+        }
+        mHeader = (const AudioTapHeader*)region;
+        if (mHeader->magic != AudioTap::kMagic || mHeader->version != AudioTap::kVersion) {
+            close();
+            return false;
+        }
+        mFrames = (const float*)((const char*)region + mHeader->headerBytes);
+        mEpoch = 1;     // Never a stable epoch, so the first peek() syncs
+        return true;
+    }
+
+    void close() {
+        if (!mHeader) return;
+        munmap((void*)mHeader, AudioTap::kRegionBytes);
+        mHeader = nullptr;
+        mFrames = nullptr;
+    }
+
+    bool isOpen() const { return mHeader != nullptr; }
+
+    // Format of the data the last peek() returned; 0 channels until the
+    // writer has written.
+    double sampleRate() const { return mSampleRate; }
+    uint32_t channelCount() const { return mChannels; }
+
+    // The writing device's IO counters as of its last write.
+    AudioIOStats ioStats() const { return mHeader->ioStats.read(); }
+
+    // Exposes up to `maxFrames` unread frames in place. After a new epoch
+    // or an overrun the position jumps to the newest data, so the first
+    // call after either returns nothing.
+    Regions peek(uint32_t maxFrames) {
+        Regions regions = {};
+        const uint64_t epoch = mHeader->epoch.load(std::memory_order_acquire);
+        if (epoch & 1) {
+            return regions;
+        }
+        if (epoch != mEpoch) {
+            const double sampleRate = mHeader->sampleRate;
+            const uint32_t channels = mHeader->channelCount;
+            const uint64_t written = mHeader->writeIndex.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (mHeader->epoch.load(std::memory_order_relaxed) != epoch) {
+                return regions;
+            }
+            mEpoch = epoch;
+            mSampleRate = sampleRate;
+            mChannels = channels;
+            mPosition = written;
+        }
+
+        const uint64_t written = mHeader->writeIndex.load(std::memory_order_acquire);
+        if (written - mPosition > AudioTap::kCapacityFrames) {
+            mPosition = written;
+        }
+        const uint32_t frames = (uint32_t)std::min<uint64_t>(maxFrames, written - mPosition);
+        const uint32_t slot = (uint32_t)mPosition & AudioTap::kFrameMask;
+        const uint32_t first = std::min(frames, AudioTap::kCapacityFrames - slot);
+        regions.first = { mFrames + (size_t)slot * mChannels, first };
+        regions.second = { mFrames, frames - first };
+        return regions;
+    }
+
+    // Moves past `frames` frames from the last peek(). Returns false if the
+    // writer overwrote or re-formatted any of them while they were in use,
+    // in which case they must be discarded.
+    bool consume(uint32_t frames) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const bool intact = mHeader->epoch.load(std::memory_order_relaxed) == mEpoch &&
+                            mHeader->reserveIndex.load(std::memory_order_relaxed) <= mPosition + AudioTap::kCapacityFrames;
+        mPosition += frames;
+        return intact;
+    }
+
+    // Copies up to `maxFrames` frames into `out`, which must hold
+    // maxFrames * kMaxChannels samples. Returns the number of intact frames
+    // read, in channelCount() channels.
+    uint32_t read(float* out, uint32_t maxFrames) {
+        Regions regions = peek(maxFrames);
+        const size_t firstSamples = (size_t)regions.first.frames * mChannels;
+        std::memcpy(out, regions.first.data, firstSamples * sizeof(float));
+        std::memcpy(out + firstSamples, regions.second.data, (size_t)regions.second.frames * mChannels * sizeof(float));
+        return consume(regions.frames()) ? regions.frames() : 0;
+    }
+
+private:
+    const AudioTapHeader* mHeader = nullptr;
+    const float* mFrames = nullptr;
+    uint64_t mEpoch = 0;
+    uint64_t mPosition = 0;
+    double mSampleRate = 0.0;
+    uint32_t mChannels = 0;
+};
+
+#endif /* AudioTap_hpp */
@@ -0,0 +1,112 @@
+/*
+ *  AudioTrace.hpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Flight recorder for the IO path: a fixed ring of small binary events that
+ *  any thread can record from without locking, allocating or calling into
+ *  the system, drained by one low-priority reader that does the slow part.
+ *
+ *  - Writers claim a slot with one fetch_add on the head and never wait. A
+ *    full ring overwrites its oldest events; the reader counts what it
+ *    missed instead of holding writers up.
+ *  - Each slot carries a sequence number that is odd while its writer is
+ *    filling it and 2 * (index + 1) once event `index` is complete, so the
+ *    reader can tell a finished event from one in progress or one already
+ *    overwritten by a later lap, and checks again after copying.
+ *  - Slots are a cache line each, so writers on different threads don't
+ *    share lines.
+ *  - Recording costs one relaxed load while the trace is disabled.
+ */
+
+#ifndef AudioTrace_hpp
+#define AudioTrace_hpp
+
+#include <atomic>
+#include <cstdint>
+
+struct AudioTraceEvent {
+    uint64_t hostTime;      // mach_absolute_time() when recorded
+    uint64_t value;         // Meaning depends on the event
+    uint32_t event;         // Chosen by the caller
+    uint32_t objectID;
+    uint32_t clientID;
+    uint32_t frames;
+};
+
+class AudioTrace {
+public:
+    static constexpr uint32_t kCapacity = 4096;    // Events; a power of two
+    static constexpr uint32_t kMask = kCapacity - 1;
+
+    AudioTrace() = default;
+    AudioTrace(const AudioTrace&) = delete;
+    AudioTrace& operator=(const AudioTrace&) = delete;
+
+    // Any thread. Events recorded while disabled are dropped.
+    void setEnabled(bool enabled) { mEnabled.store(enabled, std::memory_order_relaxed); }
+    bool isEnabled() const { return mEnabled.load(std::memory_order_relaxed); }
+
+    // Any thread, real-time safe.
+    void record(uint64_t hostTime, uint32_t event, uint32_t objectID, uint32_t clientID, uint32_t frames, uint64_t value) {
+        if (!mEnabled.load(std::memory_order_relaxed)) return;
+
+        const uint64_t index = mHead.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = mSlots[index & kMask];
+        slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.event.hostTime = hostTime;
+        slot.event.value = value;
+        slot.event.event = event;
+        slot.event.objectID = objectID;
+        slot.event.clientID = clientID;
+        slot.event.frames = frames;
+        slot.sequence.store(2 * index + 2, std::memory_order_release);
+    }
+
+    // Reader side; one reader at a time. Copies up to `maxEvents` events,
+    // oldest first, and adds the number overwritten before they could be
+    // read to `*ioLost`. Stops early at an event still being written, which
+    // the next call picks up.
+    uint32_t drain(AudioTraceEvent* out, uint32_t maxEvents, uint64_t* ioLost) {
+        const uint64_t head = mHead.load(std::memory_order_acquire);
+        if (head - mNext > kCapacity) {
+            *ioLost += head - mNext - kCapacity;
+            mNext = head - kCapacity;
+        }
+
+        uint32_t count = 0;
+        while (mNext < head && count < maxEvents) {
+            const Slot& slot = mSlots[mNext & kMask];
+            const uint64_t complete = 2 * mNext + 2;
+            const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence < complete) {
+                break;
+            }
+            if (sequence == complete) {
+                out[count] = slot.event;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == complete) {
+                    count++;
+                    mNext++;
+                    continue;
+                }
+            }
+            (*ioLost)++;
+            mNext++;
+        }
+        return count;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence{0};
+        AudioTraceEvent event;
+    };
+
+    alignas(64) std::atomic<bool> mEnabled{false};
+    alignas(64) std::atomic<uint64_t> mHead{0};
+    alignas(64) uint64_t mNext = 0;     // Reader's position
+    Slot mSlots[kCapacity];
+};
+
+#endif /* AudioTrace_hpp */
@@ -0,0 +1,389 @@
+/*
+ *  AudiDeckBench.cpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Standalone benchmarks for the IO path; runs without coreaudiod. Built by
+ *  `./build.sh bench` into build/bench/AudiDeckBench.
+ *
+ *  - ring: AudioRingBuffer between a producer and a consumer thread, as
+ *    fast as the ring allows, three ways: write()/read() with the channel
+ *    count at runtime, the same with it fixed at compile time, and the
+ *    zero-copy reserveWrite()/peekRead() path with the gain fused in, as
+ *    ReadInput uses it.
+ *  - doio: the driver itself, compiled into this binary and driven through
+ *    its interface with a stub host. One thread issues WriteMix and another
+ *    ReadInput on every device, paced like the HAL's IO threads (half a
+ *    period apart), optionally faster than real time.
+ *
+ *  Both threads are pinned (an affinity tag and a time-constraint policy on
+ *  macOS, a CPU on Linux). Each line reports the mean cost of one cycle,
+ *  p50/p99/p999/max of each side's calls, and throughput in frames/s.
+ *
+ *  Usage: AudiDeckBench [ring|doio] [--cycles N] [--speed N]
+ */
+
+#include "../AudiDeckDriver.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+// ============================================================================
+// Configuration
+// ============================================================================
+
+static const UInt32 kBench_PeriodFrames[] = { 64, 256, 1024 };
+static const UInt32 kBench_ChannelCounts[] = { 2, 8, 16 };     // Each must be one of kDevice_SupportedChannelCounts
+static const UInt32 kBench_DeviceCounts[] = { 1, 4, 16 };
+
+#define kBench_DefaultRingCycles    200000
+#define kBench_DefaultIOCycles      1000
+#define kBench_DefaultSpeed         8       // Paced IO runs this many times faster than real time
+#define kBench_RingFrames           8192
+#define kBench_Gain                 0.5f    // Keeps the gain stage off its unity pass-through
+
+template <typename T, size_t N>
+static constexpr size_t CountOf(const T (&)[N]) { return N; }
+
+// ============================================================================
+// Timing
+// ============================================================================
+
+typedef std::chrono::steady_clock BenchClock;
+
+static uint64_t NowNanos() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now().time_since_epoch()).count();
+}
+
+// Sleeps until shortly before `deadline`, then spins, so a paced thread
+// wakes on time without relying on the scheduler's timer slack.
+static void WaitUntil(uint64_t deadline) {
+    const uint64_t kSpinNanos = 50000;
+    uint64_t now = NowNanos();
+    if (now + kSpinNanos < deadline) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now - kSpinNanos));
+    }
+    while (NowNanos() < deadline) {
+    }
+}
+
+// Per-call durations of one side of a run
+class Samples {
+public:
+    explicit Samples(size_t capacity) { mNanos.reserve(capacity); }
+
+    void add(uint64_t nanos) { mNanos.push_back(nanos); }
+
+    double mean() const {
+        if (mNanos.empty()) return 0.0;
+        double total = 0.0;
+        for (uint64_t ns : mNanos) total += (double)ns;
+        return total / (double)mNanos.size();
+    }
+
+    // Sorts in place; call once the run is over
+    uint64_t percentile(double fraction) {
+        if (mNanos.empty()) return 0;
+        if (!mSorted) {
+            std::sort(mNanos.begin(), mNanos.end());
+            mSorted = true;
+        }
+        size_t index = std::min(mNanos.size() - 1, (size_t)(fraction * (double)mNanos.size()));
+        return mNanos[index];
+    }
+
+private:
+    std::vector<uint64_t> mNanos;
+    bool mSorted = false;
+};
+
+static void PrintSide(const char* name, Samples& samples) {
+    printf(" | %s p50 %6llu p99 %6llu p999 %6llu max %7llu", name,
+           (unsigned long long)samples.percentile(0.50), (unsigned long long)samples.percentile(0.99),
+           (unsigned long long)samples.percentile(0.999), (unsigned long long)samples.percentile(1.0));
+}
+
+// ============================================================================
+// Threads
+// ============================================================================
+
+// Keeps the calling thread on its own core for the run and, on macOS, gives
+// it the real-time policy the HAL gives its IO threads.
+static void PinCurrentThread(UInt32 index, uint64_t periodNanos) {
+#if defined(__APPLE__)
+    thread_affinity_policy_data_t affinity = { (integer_t)(index + 1) };
+    thread_policy_set(mach_thread_self(), THREAD_AFFINITY_POLICY, (thread_policy_t)&affinity, THREAD_AFFINITY_POLICY_COUNT);
+
+    // Free-running threads (no period) stay on the default policy
+    if (periodNanos > 0) {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        uint64_t periodTicks = periodNanos * timebase.denom / timebase.numer;
+        thread_time_constraint_policy_data_t policy;
+        policy.period = (uint32_t)periodTicks;
+        policy.computation = (uint32_t)(periodTicks / 4);
+        policy.constraint = (uint32_t)(periodTicks / 2);
+        policy.preemptible = 1;
+        thread_policy_set(mach_thread_self(), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// ============================================================================
+// Ring Benchmarks
+// ============================================================================
+
+enum RingMode {
+    kRingMode_Copy,         // write()/read(), channels at runtime
+    kRingMode_Fixed,        // write()/read(), channels at compile time
+    kRingMode_InPlace       // reserveWrite()/peekRead() with the gain applied in ring memory
+};
+
+static const char* const kRingModeNames[] = { "copy", "fixed", "in-place" };
+
+template <typename Ring, RingMode kMode>
+static void RunRing(UInt32 periodFrames, UInt32 channels, UInt32 cycles) {
+    Ring ring(kBench_RingFrames, channels);
+    const size_t samples = (size_t)periodFrames * channels;
+    std::vector<float> source(samples, 0.25f);
+    std::vector<float> sink(samples);
+    Samples writes(cycles);
+    Samples reads(cycles);
+
+    uint64_t start = NowNanos();
+    std::thread producer([&] {
+        PinCurrentThread(0, 0);
+        for (UInt32 c = 0; c < cycles; c++) {
+            if (ring.reserveWrite(periodFrames).frames() < periodFrames) {
+                c--;    // Full; try again
+                continue;
+            }
+            uint64_t t0 = NowNanos();
+            if (kMode == kRingMode_InPlace) {
+                typename Ring::Regions regions = ring.reserveWrite(periodFrames);
+                AudioGain::Apply(regions.first.data, source.data(), regions.first.frames * channels, kBench_Gain);
+                AudioGain::Apply(regions.second.data, source.data() + regions.first.frames * channels,
+                                 regions.second.frames * channels, kBench_Gain);
+                ring.commitWrite(regions.frames());
+            } else {
+                ring.write(source.data(), periodFrames);
+            }
+            writes.add(NowNanos() - t0);
+        }
+    });
+    std::thread consumer([&] {
+        PinCurrentThread(1, 0);
+        AudioGain::Stage gain;
+        gain.reset(kBench_Gain);
+        for (UInt32 c = 0; c < cycles; c++) {
+            if (ring.peekRead(periodFrames).frames() < periodFrames) {
+                c--;    // Empty; try again
+                continue;
+            }
+            uint64_t t0 = NowNanos();
+            if (kMode == kRingMode_InPlace) {
+                typename Ring::Regions regions = ring.peekRead(periodFrames);
+                float* out = gain.process(sink.data(), regions.first.data, regions.first.frames, channels);
+                gain.process(out, regions.second.data, regions.second.frames, channels);
+                ring.consumeRead(regions.frames());
+            } else {
+                ring.read(sink.data(), periodFrames);
+            }
+            reads.add(NowNanos() - t0);
+        }
+    });
+    producer.join();
+    consumer.join();
+    double seconds = (double)(NowNanos() - start) * 1e-9;
+
+    printf("ring %-8s %5u fr %2u ch | cycle %8.1f ns", kRingModeNames[kMode], periodFrames, channels, writes.mean() + reads.mean());
+    PrintSide("write", writes);
+    PrintSide("read", reads);
+    printf(" | %.3g frames/s\n", (double)cycles * periodFrames / seconds);
+}
+
+template <UInt32 kChannels>
+static void RunRingModes(UInt32 periodFrames, UInt32 cycles) {
+    RunRing<AudioRingBuffer<float>, kRingMode_Copy>(periodFrames, kChannels, cycles);
+    RunRing<AudioRingBuffer<float, kChannels>, kRingMode_Fixed>(periodFrames, kChannels, cycles);
+    RunRing<AudioRingBuffer<float>, kRingMode_InPlace>(periodFrames, kChannels, cycles);
+}
+
+static void RunRingBenchmarks(UInt32 cycles) {
+    for (UInt32 channels : kBench_ChannelCounts) {
+        for (UInt32 periodFrames : kBench_PeriodFrames) {
+            switch (channels) {
+                case 2:     RunRingModes<2>(periodFrames, cycles); break;
+                case 8:     RunRingModes<8>(periodFrames, cycles); break;
+                case 16:    RunRingModes<16>(periodFrames, cycles); break;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// DoIO Benchmarks
+// ============================================================================
+
+static AudioServerPlugInDriverRef gBenchDriver = nullptr;
+
+static OSStatus BenchHost_PropertiesChanged(AudioServerPlugInHostRef host, AudioObjectID objectID, UInt32 count, const AudioObjectPropertyAddress* addresses) {
+    return kAudioHardwareNoError;
+}
+
+// Nothing runs IO while the benchmark reconfigures, so changes are applied
+// straight away rather than on a later HAL pass
+static OSStatus BenchHost_RequestDeviceConfigurationChange(AudioServerPlugInHostRef host, AudioObjectID deviceID, UInt64 action, void* info) {
+    return (*gBenchDriver)->PerformDeviceConfigurationChange(gBenchDriver, deviceID, action, info);
+}
+
+static AudioServerPlugInHostInterface gBenchHost = {
+    BenchHost_PropertiesChanged, nullptr, nullptr, nullptr, BenchHost_RequestDeviceConfigurationChange
+};
+
+static OSStatus SetDeviceFormat(AudioObjectID deviceID, UInt32 periodFrames, UInt32 channels) {
+    AudioObjectPropertyAddress address = { kAudiDeckDevicePropertyPeriodFrames, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain };
+    SInt32 frames = (SInt32)periodFrames;
+    CFNumberRef number = CFNumberCreate(NULL, kCFNumberSInt32Type, &frames);
+    OSStatus status = (*gBenchDriver)->SetPropertyData(gBenchDriver, deviceID, 0, &address, 0, nullptr, sizeof(number), &number);
+    CFRelease(number);
+    if (status != kAudioHardwareNoError) {
+        return status;
+    }
+
+    AudioStreamBasicDescription format;
+    FillStreamFormat(&format, kDevice_SampleRate, channels);
+    address.mSelector = kAudioStreamPropertyVirtualFormat;
+    status = (*gBenchDriver)->SetPropertyData(gBenchDriver, deviceID + kDeviceObject_Stream_Output, 0, &address, 0, nullptr, sizeof(format), &format);
+    if (status != kAudioHardwareNoError) {
+        return status;
+    }
+
+    Float32 volume = kBench_Gain;
+    address.mSelector = kAudioLevelControlPropertyScalarValue;
+    return (*gBenchDriver)->SetPropertyData(gBenchDriver, deviceID + kDeviceObject_Volume_Master, 0, &address, 0, nullptr, sizeof(volume), &volume);
+}
+
+// Issues `operationID` on every device once per period, starting
+// `offsetNanos` into each period.
+static void RunIOThread(UInt32 index, const std::vector<AudioObjectID>& devices, UInt32 operationID, UInt32 periodFrames,
+                        UInt32 channels, UInt32 cycles, UInt64 start, UInt64 periodNanos, UInt64 offsetNanos, Samples* samples) {
+    PinCurrentThread(index, periodNanos);
+    std::vector<float> buffer((size_t)periodFrames * channels, 0.25f);
+
+    for (UInt32 c = 0; c < cycles; c++) {
+        WaitUntil(start + c * periodNanos + offsetNanos);
+        uint64_t t0 = NowNanos();
+        for (AudioObjectID deviceID : devices) {
+            AudioObjectID streamID = deviceID + (operationID == kAudioServerPlugInIOOperationWriteMix ? kDeviceObject_Stream_Output : kDeviceObject_Stream_Input);
+            (*gBenchDriver)->DoIOOperation(gBenchDriver, deviceID, streamID, 0, operationID, periodFrames, nullptr, buffer.data(), nullptr);
+        }
+        samples->add(NowNanos() - t0);
+    }
+}
+
+static void RunIO(const std::vector<AudioObjectID>& devices, UInt32 periodFrames, UInt32 channels, UInt32 cycles, UInt32 speed) {
+    for (AudioObjectID deviceID : devices) {
+        if (SetDeviceFormat(deviceID, periodFrames, channels) != kAudioHardwareNoError) {
+            fprintf(stderr, "doio: can't set %u frames x %u channels on device %u\n", periodFrames, channels, (unsigned)deviceID);
+            return;
+        }
+        (*gBenchDriver)->StartIO(gBenchDriver, deviceID, 1);
+    }
+
+    const uint64_t periodNanos = (uint64_t)(1e9 * periodFrames / kDevice_SampleRate / speed);
+    const uint64_t start = NowNanos() + 10 * periodNanos;
+    Samples writes(cycles);
+    Samples reads(cycles);
+    std::thread writer(RunIOThread, 0, std::cref(devices), (UInt32)kAudioServerPlugInIOOperationWriteMix, periodFrames, channels,
+                       cycles, start, periodNanos, 0, &writes);
+    std::thread reader(RunIOThread, 1, std::cref(devices), (UInt32)kAudioServerPlugInIOOperationReadInput, periodFrames, channels,
+                       cycles, start, periodNanos, periodNanos / 2, &reads);
+    writer.join();
+    reader.join();
+
+    for (AudioObjectID deviceID : devices) {
+        (*gBenchDriver)->StopIO(gBenchDriver, deviceID, 1);
+    }
+
+    // Throughput is what the IO threads could sustain if they did nothing
+    // else: frames moved per second of time spent inside DoIO
+    double busySeconds = (writes.mean() + reads.mean()) * cycles * 1e-9;
+    printf("doio %2zu dev %5u fr %2u ch | cycle %8.1f ns", devices.size(), periodFrames, channels, writes.mean() + reads.mean());
+    PrintSide("write", writes);
+    PrintSide("read", reads);
+    printf(" | %.3g frames/s\n", (double)cycles * periodFrames * devices.size() / busySeconds);
+}
+
+static void RunIOBenchmarks(UInt32 cycles, UInt32 speed) {
+    gBenchDriver = (AudioServerPlugInDriverRef)AudiDeckDriverCreate(NULL, kAudioServerPlugInTypeUUID);
+    (*gBenchDriver)->Initialize(gBenchDriver, &gBenchHost);
+
+    // The driver starts with one device; add the rest
+    std::vector<AudioObjectID> allDevices(1, kObjectID_PlugIn + 1);
+    const UInt32 maxDevices = *std::max_element(kBench_DeviceCounts, kBench_DeviceCounts + CountOf(kBench_DeviceCounts));
+    while (allDevices.size() < maxDevices) {
+        AudioObjectID deviceID;
+        if ((*gBenchDriver)->CreateDevice(gBenchDriver, NULL, nullptr, &deviceID) != kAudioHardwareNoError) {
+            fprintf(stderr, "doio: can't create device %zu\n", allDevices.size() + 1);
+            return;
+        }
+        allDevices.push_back(deviceID);
+    }
+
+    for (UInt32 deviceCount : kBench_DeviceCounts) {
+        std::vector<AudioObjectID> devices(allDevices.begin(), allDevices.begin() + deviceCount);
+        for (UInt32 channels : kBench_ChannelCounts) {
+            for (UInt32 periodFrames : kBench_PeriodFrames) {
+                RunIO(devices, periodFrames, channels, cycles, speed);
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char* argv[]) {
+    bool ring = true;
+    bool io = true;
+    UInt32 cycles = 0;
+    UInt32 speed = kBench_DefaultSpeed;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "ring") == 0) {
+            io = false;
+        } else if (strcmp(argv[i], "doio") == 0) {
+            ring = false;
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles = (UInt32)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [ring|doio] [--cycles N] [--speed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // All times in ns
+    if (ring) {
+        RunRingBenchmarks(cycles ? cycles : kBench_DefaultRingCycles);
+    }
+    if (io) {
+        RunIOBenchmarks(cycles ? cycles : kBench_DefaultIOCycles, speed);
+    }
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ *  AudiDeckBridge.cpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Forwards AudiDeck devices to physical outputs, e.g. a virtual device to a
+ *  pair of headphones. A plug-in can't be a client of other devices from
+ *  inside coreaudiod, so this runs as its own process: it turns on each
+ *  source device's tap ('atap'), reads it from shared memory, and plays it
+ *  from an IOProc on the physical device. Built by `./build.sh bridge`.
+ *
+ *  - The IOProc runs on the HAL's IO thread for the output device, which is
+ *    already a time-constraint thread scheduled to its deadline, so the
+ *    bridge adds no thread of its own to the path. Nothing in it locks,
+ *    allocates or calls the HAL; see AudioBridge.hpp.
+ *  - Drift between the virtual clock and the hardware's is taken up by the
+ *    resampler, steered to hold the tap's depth at its target, so nothing
+ *    is ever dropped or repeated while both sides keep up.
+ *  - Several routes can share an output; the first renders straight into
+ *    the output buffer and the rest are mixed in.
+ *  - The output's IO period is set to --period frames, which with the
+ *    source's own period is what sets the added latency. The total is
+ *    printed at start.
+ *  - A format change on either side is picked up between callbacks: the
+ *    output is stopped, its routes reconfigured, and it is started again.
+ *
+ *  Usage: AudiDeckBridge [--period FRAMES] SOURCE_UID=OUTPUT_UID[@GAIN]...
+ *  GAIN is linear (default 1.0). Runs until interrupted.
+ */
+
+#include <CoreAudio/CoreAudio.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../AudioBridge.hpp"
+
+// ============================================================================
+// Constants
+// ============================================================================
+
+#define kBridge_DefaultPeriodFrames 128
+#define kBridge_PollMicroseconds    100000
+
+// Custom device properties (see AudiDeckDriver.cpp)
+#define kBridge_PropertyPeriodFrames    0x61706572  // 'aper'
+#define kBridge_PropertyTap             0x61746170  // 'atap'
+
+// ============================================================================
+// Types
+// ============================================================================
+
+struct BridgeRoute {
+    std::string sourceUID;
+    std::string outputUID;
+    float gain = 1.0f;
+    AudioObjectID sourceID = kAudioObjectUnknown;
+    bool enabledTap = false;        // Left as we found it on exit
+    AudioBridge bridge;
+    uint64_t reportedUnderruns = 0;
+};
+
+struct BridgeOutput {
+    std::string uid;
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    AudioDeviceIOProcID procID = nullptr;
+    Float64 sampleRate = 0.0;
+    UInt32 channels = 0;
+    UInt32 periodFrames = 0;
+    std::vector<BridgeRoute*> routes;
+    std::vector<float> mixBuffer;   // Routes after the first render here
+};
+
+static volatile sig_atomic_t gStop = 0;
+
+// ============================================================================
+// HAL Helpers
+// ============================================================================
+
+static AudioObjectPropertyAddress Address(AudioObjectPropertySelector selector, AudioObjectPropertyScope scope = kAudioObjectPropertyScopeGlobal) {
+    return { selector, scope, kAudioObjectPropertyElementMain };
+}
+
+static AudioObjectID FindDevice(const std::string& uid) {
+    CFStringRef uidString = CFStringCreateWithCString(kCFAllocatorDefault, uid.c_str(), kCFStringEncodingUTF8);
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    AudioValueTranslation translation = { &uidString, sizeof(uidString), &deviceID, sizeof(deviceID) };
+    AudioObjectPropertyAddress address = Address(kAudioHardwarePropertyDeviceForUID);
+    UInt32 size = sizeof(translation);
+    AudioObjectGetPropertyData(kAudioObjectSystemObject, &address, 0, nullptr, &size, &translation);
+    CFRelease(uidString);
+    return deviceID;
+}
+
+static UInt32 GetUInt32(AudioObjectID objectID, AudioObjectPropertySelector selector, AudioObjectPropertyScope scope = kAudioObjectPropertyScopeGlobal) {
+    AudioObjectPropertyAddress address = Address(selector, scope);
+    UInt32 value = 0;
+    UInt32 size = sizeof(value);
+    AudioObjectGetPropertyData(objectID, &address, 0, nullptr, &size, &value);
+    return value;
+}
+
+static Float64 GetNominalRate(AudioObjectID deviceID) {
+    AudioObjectPropertyAddress address = Address(kAudioDevicePropertyNominalSampleRate);
+    Float64 rate = 0.0;
+    UInt32 size = sizeof(rate);
+    AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, &rate);
+    return rate;
+}
+
+// Channels in the first output buffer, which is the one the IOProc fills
+static UInt32 GetOutputChannels(AudioObjectID deviceID) {
+    AudioObjectPropertyAddress address = Address(kAudioDevicePropertyStreamConfiguration, kAudioObjectPropertyScopeOutput);
+    UInt32 size = 0;
+    if (AudioObjectGetPropertyDataSize(deviceID, &address, 0, nullptr, &size) != kAudioHardwareNoError || size < sizeof(AudioBufferList)) {
+        return 0;
+    }
+    std::vector<char> storage(size);
+    AudioBufferList* list = (AudioBufferList*)storage.data();
+    if (AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, list) != kAudioHardwareNoError || list->mNumberBuffers == 0) {
+        return 0;
+    }
+    return list->mBuffers[0].mNumberChannels;
+}
+
+// Output-side latency the HAL adds beyond our period, in frames
+static UInt32 GetOutputLatency(AudioObjectID deviceID) {
+    UInt32 frames = GetUInt32(deviceID, kAudioDevicePropertyLatency, kAudioObjectPropertyScopeOutput) +
+                    GetUInt32(deviceID, kAudioDevicePropertySafetyOffset, kAudioObjectPropertyScopeOutput);
+    AudioObjectPropertyAddress address = Address(kAudioDevicePropertyStreams, kAudioObjectPropertyScopeOutput);
+    AudioObjectID streamID = kAudioObjectUnknown;
+    UInt32 size = sizeof(streamID);
+    if (AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, &streamID) == kAudioHardwareNoError && size == sizeof(streamID)) {
+        frames += GetUInt32(streamID, kAudioStreamPropertyLatency);
+    }
+    return frames;
+}
+
+// Our devices' custom properties carry CFNumbers
+static bool GetCustomSInt32(AudioObjectID deviceID, AudioObjectPropertySelector selector, SInt32* outValue) {
+    AudioObjectPropertyAddress address = Address(selector);
+    CFPropertyListRef value = nullptr;
+    UInt32 size = sizeof(value);
+    if (AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, &value) != kAudioHardwareNoError || !value) {
+        return false;
+    }
+    bool ok = CFGetTypeID(value) == CFNumberGetTypeID() && CFNumberGetValue((CFNumberRef)value, kCFNumberSInt32Type, outValue);
+    CFRelease(value);
+    return ok;
+}
+
+static bool SetCustomSInt32(AudioObjectID deviceID, AudioObjectPropertySelector selector, SInt32 value) {
+    AudioObjectPropertyAddress address = Address(selector);
+    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+    OSStatus status = AudioObjectSetPropertyData(deviceID, &address, 0, nullptr, sizeof(number), &number);
+    CFRelease(number);
+    return status == kAudioHardwareNoError;
+}
+
+// ============================================================================
+// IO
+// ============================================================================
+
+static OSStatus BridgeIOProc(AudioObjectID inDevice, const AudioTimeStamp* inNow,
+                             const AudioBufferList* inInputData, const AudioTimeStamp* inInputTime,
+                             AudioBufferList* outOutputData, const AudioTimeStamp* inOutputTime,
+                             void* inClientData) {
+    BridgeOutput* output = (BridgeOutput*)inClientData;
+    if (!outOutputData || outOutputData->mNumberBuffers == 0) {
+        return kAudioHardwareNoError;
+    }
+    AudioBuffer& buffer = outOutputData->mBuffers[0];
+    if (buffer.mNumberChannels != output->channels || !buffer.mData) {
+        return kAudioHardwareNoError;   // Caught up with at the next poll
+    }
+
+    float* out = (float*)buffer.mData;
+    const UInt32 frames = buffer.mDataByteSize / (output->channels * sizeof(float));
+    output->routes[0]->bridge.render(out, frames);
+
+    const UInt32 mixFrames = std::min(frames, AudioBridge::kMaxFrames);
+    for (size_t i = 1; i < output->routes.size(); i++) {
+        output->routes[i]->bridge.render(output->mixBuffer.data(), mixFrames);
+        AudioGain::Mix(out, output->mixBuffer.data(), mixFrames * output->channels, 1.0f);
+    }
+    return kAudioHardwareNoError;
+}
+
+// ============================================================================
+// Setup
+// ============================================================================
+
+// Brings an output's format up to date and reconfigures its routes. The
+// output must be stopped.
+static bool ConfigureOutput(BridgeOutput* output) {
+    output->sampleRate = GetNominalRate(output->deviceID);
+    output->channels = GetOutputChannels(output->deviceID);
+    output->periodFrames = GetUInt32(output->deviceID, kAudioDevicePropertyBufferFrameSize);
+    output->mixBuffer.assign((size_t)AudioBridge::kMaxFrames * std::max<UInt32>(output->channels, 1), 0.0f);
+
+    bool configured = true;
+    for (BridgeRoute* route : output->routes) {
+        SInt32 writerPeriod = 0;
+        if (!GetCustomSInt32(route->sourceID, kBridge_PropertyPeriodFrames, &writerPeriod)) {
+            writerPeriod = (SInt32)output->periodFrames;
+        }
+        if (!route->bridge.configure(output->sampleRate, output->channels, output->periodFrames, (uint32_t)writerPeriod)) {
+            configured = false;     // The source hasn't played anything yet
+            continue;
+        }
+
+        const double latencyMs = 1000.0 * (route->bridge.targetFrames() / route->bridge.inputRate() +
+                                           (output->periodFrames + GetOutputLatency(output->deviceID)) / output->sampleRate);
+        printf("%s -> %s: %.0f Hz -> %.0f Hz, %u channels, ~%.1f ms\n",
+               route->sourceUID.c_str(), output->uid.c_str(), route->bridge.inputRate(), output->sampleRate,
+               output->channels, latencyMs);
+    }
+    return configured;
+}
+
+static bool StartOutput(BridgeOutput* output, UInt32 periodFrames) {
+    AudioObjectPropertyAddress address = Address(kAudioDevicePropertyBufferFrameSize);
+    AudioObjectSetPropertyData(output->deviceID, &address, 0, nullptr, sizeof(periodFrames), &periodFrames);
+
+    ConfigureOutput(output);
+    if (output->channels == 0) {
+        fprintf(stderr, "%s has no output channels\n", output->uid.c_str());
+        return false;
+    }
+    if (AudioDeviceCreateIOProcID(output->deviceID, BridgeIOProc, output, &output->procID) != kAudioHardwareNoError) {
+        fprintf(stderr, "Can't add an IOProc to %s\n", output->uid.c_str());
+        return false;
+    }
+    return AudioDeviceStart(output->deviceID, output->procID) == kAudioHardwareNoError;
+}
+
+static void StopOutput(BridgeOutput* output) {
+    if (!output->procID) return;
+    AudioDeviceStop(output->deviceID, output->procID);
+    AudioDeviceDestroyIOProcID(output->deviceID, output->procID);
+    output->procID = nullptr;
+}
+
+// SOURCE_UID=OUTPUT_UID[@GAIN]
+static bool ParseRoute(const char* arg, BridgeRoute* route) {
+    const char* equals = strchr(arg, '=');
+    if (!equals || equals == arg) return false;
+    const char* at = strchr(equals, '@');
+    route->sourceUID.assign(arg, equals - arg);
+    route->outputUID.assign(equals + 1, at ? (size_t)(at - equals - 1) : strlen(equals + 1));
+    if (at) {
+        char* end = nullptr;
+        route->gain = strtof(at + 1, &end);
+        if (*end != '\0' || !(route->gain >= 0.0f)) return false;
+    }
+    return !route->outputUID.empty();
+}
+
+static void Usage() {
+    fprintf(stderr, "Usage: AudiDeckBridge [--period FRAMES] SOURCE_UID=OUTPUT_UID[@GAIN]...\n");
+}
+
+static void HandleSignal(int) {
+    gStop = 1;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char** argv) {
+    UInt32 periodFrames = kBridge_DefaultPeriodFrames;
+    std::vector<std::unique_ptr<BridgeRoute>> routes;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--period") == 0 && i + 1 < argc) {
+            periodFrames = (UInt32)atoi(argv[++i]);
+            continue;
+        }
+        std::unique_ptr<BridgeRoute> route(new BridgeRoute);
+        if (!ParseRoute(argv[i], route.get())) {
+            Usage();
+            return 2;
+        }
+        routes.push_back(std::move(route));
+    }
+    if (routes.empty() || periodFrames == 0 || periodFrames > AudioBridge::kMaxFrames) {
+        Usage();
+        return 2;
+    }
+
+    // Open every source's tap and group the routes by output
+    std::vector<std::unique_ptr<BridgeOutput>> outputs;
+    for (auto& route : routes) {
+        route->sourceID = FindDevice(route->sourceUID);
+        SInt32 tapEnabled = 0;
+        if (route->sourceID == kAudioObjectUnknown || !GetCustomSInt32(route->sourceID, kBridge_PropertyTap, &tapEnabled)) {
+            fprintf(stderr, "%s isn't an AudiDeck device\n", route->sourceUID.c_str());
+            return 1;
+        }
+        if (!tapEnabled) {
+            if (!SetCustomSInt32(route->sourceID, kBridge_PropertyTap, 1)) {
+                fprintf(stderr, "Can't enable the tap on %s\n", route->sourceUID.c_str());
+                return 1;
+            }
+            route->enabledTap = true;
+        }
+        char tapName[32];
+        AudioTap::MakeName(route->sourceUID.c_str(), tapName, sizeof(tapName));
+        if (!route->bridge.open(tapName)) {
+            fprintf(stderr, "Can't open the tap for %s\n", route->sourceUID.c_str());
+            return 1;
+        }
+        route->bridge.setGain(route->gain);
+
+        BridgeOutput* output = nullptr;
+        for (auto& existing : outputs) {
+            if (existing->uid == route->outputUID) output = existing.get();
+        }
+        if (!output) {
+            outputs.emplace_back(new BridgeOutput);
+            output = outputs.back().get();
+            output->uid = route->outputUID;
+            output->deviceID = FindDevice(output->uid);
+            if (output->deviceID == kAudioObjectUnknown) {
+                fprintf(stderr, "No device with UID %s\n", output->uid.c_str());
+                return 1;
+            }
+        }
+        output->routes.push_back(route.get());
+    }
+
+    for (auto& output : outputs) {
+        if (!StartOutput(output.get(), periodFrames)) {
+            return 1;
+        }
+    }
+
+    signal(SIGINT, HandleSignal);
+    signal(SIGTERM, HandleSignal);
+
+    // Watch for format changes on either side, and report underruns
+    while (!gStop) {
+        usleep(kBridge_PollMicroseconds);
+        for (auto& output : outputs) {
+            bool reconfigure = GetNominalRate(output->deviceID) != output->sampleRate ||
+                               GetOutputChannels(output->deviceID) != output->channels;
+            for (BridgeRoute* route : output->routes) {
+                reconfigure |= route->bridge.needsConfigure();
+
+                uint64_t underruns = route->bridge.underruns();
+                if (underruns != route->reportedUnderruns) {
+                    fprintf(stderr, "%s: %llu underrun(s)\n", route->sourceUID.c_str(),
+                            (unsigned long long)(underruns - route->reportedUnderruns));
+                    route->reportedUnderruns = underruns;
+                }
+            }
+            if (reconfigure) {
+                AudioDeviceStop(output->deviceID, output->procID);
+                ConfigureOutput(output.get());
+                AudioDeviceStart(output->deviceID, output->procID);
+            }
+        }
+    }
+
+    for (auto& output : outputs) {
+        StopOutput(output.get());
+    }
+    for (auto& route : routes) {
+        if (route->enabledTap) {
+            SetCustomSInt32(route->sourceID, kBridge_PropertyTap, 0);
+        }
+    }
+    return 0;
+}
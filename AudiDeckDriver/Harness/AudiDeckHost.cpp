@@ -0,0 +1,1261 @@
+/*
+ *  AudiDeckHost.cpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Offline stand-in for coreaudiod: loads the built driver bundle, hands it
+ *  a host interface, and replays a scripted run of IO cycles against its
+ *  first device. Built by `./build.sh harness`; runs one scenario per
+ *  process so every run starts from a freshly loaded driver.
+ *
+ *  Each cycle follows the HAL's order: GetZeroTimeStamp, then ReadInput,
+ *  ProcessOutput for every client and WriteMix of their sum, each between
+ *  BeginIOOperation and EndIOOperation. Cycles are paced from the timeline
+ *  start, with optional scripted lateness. Configuration changes the
+ *  driver requests are applied between cycles the way the HAL does it:
+ *  stop IO, perform the change, start IO on a new timeline.
+ *
+ *  The first client plays a frame counter; the others play silence. The
+ *  device's input loops its output back, so every input frame can be
+ *  checked against the counter: zero-filled frames, dropped and repeated
+ *  frames, frames altered by a fade, and the loopback latency. Channel 1
+ *  carries the counter's complement, so any gain other than unity shows
+ *  up even when it lands a sample on a valid counter value, and every
+ *  channel past it must match channel 0. With a compact ring encoding the
+ *  counter steps by four of the encoding's LSBs and comes back within one
+ *  of them; a Float32 ring must give it back exactly. The zero
+ *  timestamps are checked for period alignment, for running ahead of the
+ *  host clock, and for drift from the nominal rate. At the end the driver's
+ *  own IO counters ('asts') are read back to set beside what was measured.
+ *
+ *  More devices can be created to route the signal client to ('acrt').
+ *  Each gets an input-only client of its own, read every cycle right after
+ *  the first device's input, and its input is followed the same way. On a
+ *  Float32 ring a faded frame still carries the counter, in the ratio of
+ *  channels 0 and 1, so a crossfade can be checked frame by frame: each
+ *  destination's stream must be continuous, must fade out rather than stop
+ *  short, and between them they must carry every frame. A route that never
+ *  reaches its device, because the driver couldn't move the client onto it,
+ *  counts as unreached. A device's client can stop reading, as though it
+ *  only did output, while the device keeps running. A device can also
+ *  take the first device as its loopback source; it's read on its own IO
+ *  cycle, at its own rate, and the driver reports what it couldn't supply.
+ *  Since the signal is never silent, a cycle of silence a loopback device
+ *  reads once it has heard the signal is counted too.
+ *
+ *  Usage: AudiDeckHost [--driver PATH] SCENARIO
+ *  PATH is the .driver bundle (default build/AudiDeckDriver.driver) or the
+ *  library inside it. The exit status is non-zero if an `expect` fails.
+ *
+ *  Scenario commands, one per line, `#` starts a comment:
+ *    seed N                random seed for jitter and churn (default 1)
+ *    jitter F              wake each cycle up to F periods late
+ *    stall P               wake the next cycle P periods late
+ *    clients N             run N silent clients alongside the signal client
+ *    churn K MAX           every K cycles, move to a random 0...MAX silent
+ *                          clients; K = 0 stops
+ *    rate HZ               set the device's nominal sample rate
+ *    period FRAMES         set the device's IO period ('aper')
+ *    latency PERIODS       set the device's input depth ('alat')
+ *    probe 0|1             turn the driver's latency probe off or on ('aprb')
+ *    channels N            set the device's channel count
+ *    ring ENC              store the device's ring as float32, int16 or int24
+ *                          ('arng')
+ *    device NAME           create a device with UID NAME, at the first
+ *                          device's period, and start reading its input
+ *    loopback NAME [HZ]    the same, for a device that reads the first
+ *                          device's ring as its loopback source, at rate HZ
+ *    route NAME [MODE] [MS]  route the signal client to device NAME, or to
+ *                          `own` for its own device; MODE is shared (the
+ *                          default) or exclusive, MS the crossfade time
+ *    idle NAME             stop reading device NAME's input; its client keeps
+ *                          running, like one that only does output
+ *    run N                 run N cycles
+ *    expect METRIC <= X    fail the run unless METRIC ends up at most X; see
+ *                          PrintReport() for the metrics
+ */
+
+#include <CoreAudio/AudioServerPlugIn.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ============================================================================
+// Constants
+// ============================================================================
+
+#define kHost_DefaultDriverPath     "build/AudiDeckDriver.driver"
+#define kHost_DriverExecutable      "/Contents/MacOS/AudiDeckDriver"
+#define kHost_FactoryName           "AudiDeckDriverCreate"
+#define kHost_BundleIDPrefix        "com.audideck.harness.client"
+
+// Custom device properties (see AudiDeckDriver.cpp)
+#define kHost_PropertyLatencyPeriods    0x616C6174  // 'alat'
+#define kHost_PropertyPeriodFrames      0x61706572  // 'aper'
+#define kHost_PropertyIOStats           0x61737473  // 'asts'
+#define kHost_PropertyLatencyProbe      0x61707262  // 'aprb'
+#define kHost_PropertyRingEncoding      0x61726E67  // 'arng'
+
+// Custom plug-in properties
+#define kHost_PropertyClientRoute       0x61637274  // 'acrt'
+
+// The counter is carried as (frame % modulus + 1) / modulus, which a
+// Float32 holds exactly; zero stays free to mean silence. Channel 1 carries
+// modulus - frame % modulus, so the two always sum to modulus + 1. The
+// modulus follows the ring encoding: an integer ring gets one counter step
+// per four LSBs, so a sample still rounds to its counter value, and one LSB
+// of slack for the saturation at full scale.
+struct RingEncoding {
+    const char* name;
+    UInt32 signalBits;      // log2 of the modulus
+    double lsb;             // How far a sample may come back from what was sent
+};
+
+// Indexed by the driver's AudioFormat::Encoding
+static const RingEncoding kRingEncodings[] = {
+    { "float32",    16,     0.0 },     // Leaves a faded frame's counter to within kSignalDecodeSlack
+    { "int16",      13,     1.0 / 32768.0 },
+    { "int24",      21,     1.0 / 8388608.0 },
+};
+static const UInt32 kRingEncodingCount = sizeof(kRingEncodings) / sizeof(kRingEncodings[0]);
+
+// A faded frame gives its counter back if it rounds to within this, and its
+// gain is at least kSignalDecodableGain
+#define kSignalDecodeSlack          0.05
+#define kSignalDecodableGain        0.001
+
+// A stream whose last frame before silence is louder than this was cut off
+// rather than faded out
+#define kCutOffGain                 0.05
+
+// A wake-up this far behind schedule counts as late, in periods
+#define kLateWakeupPeriods          0.5
+
+// ============================================================================
+// Results
+// ============================================================================
+
+struct Stats {
+    UInt64 cycles = 0;
+    UInt64 timelines = 0;
+    UInt64 configChanges = 0;
+    UInt64 notifications = 0;
+    UInt64 clientChanges = 0;
+
+    // Input, checked against the counter
+    UInt64 zeroFilled = 0;          // Silent frames on a device the signal plays to, once it had arrived
+    UInt64 discontinuities = 0;     // Jumps in the counter
+    UInt64 dropped = 0;             // Frames skipped by forward jumps
+    UInt64 repeated = 0;            // Frames replayed by backward jumps
+    UInt64 faded = 0;               // Frames that aren't a counter value at unity gain
+    UInt64 channelErrors = 0;       // Frames whose channels past 1 differ from channel 0
+    UInt64 cutOffs = 0;             // Streams that went silent without fading out
+    UInt64 unreached = 0;           // Routes whose device never carried the signal
+    UInt64 latencyMin = UINT64_MAX; // Loopback latency, in frames, of the first device
+    UInt64 latencyMax = 0;
+    double latencySum = 0.0;
+    UInt64 latencyCount = 0;
+
+    // Timing
+    UInt64 lateWakeups = 0;
+    double maxLatePeriods = 0.0;
+    double maxDriftPPM = 0.0;       // Zero timestamp rate vs. nominal, worst timeline
+    UInt64 timeStampErrors = 0;     // Misaligned, backwards, ahead of now, or an unasked-for new seed
+    UInt64 ioErrors = 0;            // Driver calls that returned an error
+    std::vector<UInt64> cycleNanos; // Time spent inside the driver, per cycle
+
+    // The driver's own counters ('asts'), read at the end
+    SInt64 driverCycles = 0;
+    SInt64 driverDropped = 0;
+    SInt64 driverZeroFilled = 0;
+    SInt64 driverMaxFill = 0;
+    SInt64 driverCapacity = 0;
+    SInt64 driverMaxIONanos = 0;
+    SInt64 probeLatencyCount = 0;   // With the latency probe on
+    SInt64 probeLatencyMinNanos = 0;
+    SInt64 probeLatencyMeanNanos = 0;
+    SInt64 probeLatencyMaxNanos = 0;
+    SInt64 probeJitterMeanNanos = 0;
+    SInt64 probeJitterMaxNanos = 0;
+};
+
+// ============================================================================
+// Host State
+// ============================================================================
+
+// Where one device's input is in the counter
+struct Track {
+    bool live = true;               // The signal client's route plays to this device
+    bool haveSignal = false;        // Input has carried the counter since it went live, this timeline
+    bool reached = false;           // Input has carried the counter since it went live
+    UInt64 expectedFrame = 0;       // Counter value the next input frame should carry
+    bool inStream = false;          // The last input frame wasn't silent
+    double lastGain = 0.0;          // Of that frame
+};
+
+// A device created by `device`, read through one input-only client
+struct Listener {
+    std::string name;               // Also its UID
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    AudioObjectID inputStreamID = kAudioObjectUnknown;
+    UInt32 clientID = 0;
+    bool loopback = false;          // Reads the first device's ring, resampled
+    bool reading = true;            // Its input is read each cycle
+    Track track;
+    std::vector<Float32> inputBuffer;
+
+    // Its own format and IO cycle, which only keep step with the first
+    // device's when they share its rate and period
+    Float64 sampleRate = 0.0;
+    UInt32 periodFrames = 0;
+    UInt64 cycles = 0;
+    double dueSeconds = 0.0;        // Of input the first device's cycles have run through, not yet read
+    SInt64 driverZeroFilled = 0;    // Its 'asts', read at the end
+    bool heard = false;             // A loopback listener's input has carried sound
+    UInt64 silentCycles = 0;        // Of a loopback listener, all silence once heard
+};
+
+// A configuration change the driver asked for
+struct PendingChange {
+    AudioObjectID deviceID;
+    UInt64 action;
+};
+
+struct Host {
+    AudioServerPlugInDriverRef driver = nullptr;
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    AudioObjectID inputStreamID = kAudioObjectUnknown;
+    AudioObjectID outputStreamID = kAudioObjectUnknown;
+
+    // Device format, re-read after every configuration change
+    Float64 sampleRate = 0.0;
+    UInt32 channels = 0;
+    UInt32 periodFrames = 0;
+    double ticksPerFrame = 0.0;
+    UInt32 ringEncoding = 0;        // Index into kRingEncodings
+
+    // Client IDs; the first plays the signal
+    std::vector<UInt32> clients;
+    UInt32 nextClientID = 1;
+
+    // Script state
+    std::mt19937 random{1};
+    double jitterPeriods = 0.0;
+    double stallPeriods = 0.0;
+    UInt32 churnCycles = 0;
+    UInt32 churnMax = 0;
+
+    // Configuration changes the driver asked for, applied between cycles
+    std::vector<PendingChange> pendingChanges;
+
+    // Current timeline
+    UInt64 timelineStart = 0;
+    UInt64 timelineCycle = 0;
+    UInt64 seed = 0;
+    bool haveZeroTimeStamp = false;
+    Float64 firstZeroSample = 0.0;
+    UInt64 firstZeroHost = 0;
+    Float64 lastZeroSample = 0.0;
+    UInt64 lastZeroHost = 0;
+
+    // Signal
+    UInt64 framesWritten = 0;       // Counter value of the next frame out
+    UInt32 signalModulus = 1u << 16;
+    Track input;                    // The first device's
+    std::vector<Listener> listeners;
+
+    // Counter values some device's input has carried, by frame
+    std::vector<bool> received;
+    UInt64 firstReceived = UINT64_MAX;
+    UInt64 lastReceived = 0;
+
+    std::vector<Float32> inputBuffer;
+    std::vector<Float32> clientBuffer;
+    std::vector<Float32> mixBuffer;
+
+    Stats stats;
+};
+
+static Host gHost;
+
+static UInt64 HostTicksPerSecond() {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return (UInt64)(1e9 * timebase.denom / timebase.numer);
+}
+
+static UInt64 NowNanos() {
+    return (UInt64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void WaitUntilHostTime(UInt64 hostTime) {
+#if defined(__APPLE__)
+    mach_wait_until(hostTime);
+#else
+    const double nanosPerTick = 1e9 / (double)HostTicksPerSecond();
+    for (UInt64 now = mach_absolute_time(); now < hostTime; now = mach_absolute_time()) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds((UInt64)((hostTime - now) * nanosPerTick)));
+    }
+#endif
+}
+
+static void Check(OSStatus status) {
+    if (status != kAudioHardwareNoError) {
+        gHost.stats.ioErrors++;
+    }
+}
+
+// ============================================================================
+// Host Interface
+// ============================================================================
+
+static OSStatus Host_PropertiesChanged(AudioServerPlugInHostRef host, AudioObjectID objectID, UInt32 count, const AudioObjectPropertyAddress* addresses) {
+    gHost.stats.notifications++;
+    return kAudioHardwareNoError;
+}
+
+static OSStatus Host_CopyFromStorage(AudioServerPlugInHostRef host, CFStringRef key, CFPropertyListRef* outData) {
+    *outData = nullptr;
+    return kAudioHardwareUnknownPropertyError;
+}
+
+static OSStatus Host_WriteToStorage(AudioServerPlugInHostRef host, CFStringRef key, CFPropertyListRef data) {
+    return kAudioHardwareNoError;
+}
+
+static OSStatus Host_DeleteFromStorage(AudioServerPlugInHostRef host, CFStringRef key) {
+    return kAudioHardwareNoError;
+}
+
+// The driver may ask from inside a property call, so this just queues
+static OSStatus Host_RequestDeviceConfigurationChange(AudioServerPlugInHostRef host, AudioObjectID deviceID, UInt64 action, void* info) {
+    gHost.pendingChanges.push_back({ deviceID, action });
+    return kAudioHardwareNoError;
+}
+
+static AudioServerPlugInHostInterface gHostInterface = {
+    Host_PropertiesChanged,
+    Host_CopyFromStorage,
+    Host_WriteToStorage,
+    Host_DeleteFromStorage,
+    Host_RequestDeviceConfigurationChange
+};
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+static AudioServerPlugInDriverRef LoadDriver(const char* path) {
+    std::string library = path;
+    if (library.size() > 7 && library.compare(library.size() - 7, 7, ".driver") == 0) {
+        library += kHost_DriverExecutable;
+    }
+    void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "can't load %s: %s\n", library.c_str(), dlerror());
+        return nullptr;
+    }
+    typedef void* (*FactoryProc)(CFAllocatorRef allocator, CFUUIDRef typeUUID);
+    FactoryProc factory = (FactoryProc)dlsym(handle, kHost_FactoryName);
+    if (!factory) {
+        fprintf(stderr, "%s has no %s\n", library.c_str(), kHost_FactoryName);
+        return nullptr;
+    }
+    return (AudioServerPlugInDriverRef)factory(NULL, kAudioServerPlugInTypeUUID);
+}
+
+static AudioObjectPropertyAddress Address(AudioObjectPropertySelector selector, AudioObjectPropertyScope scope = kAudioObjectPropertyScopeGlobal) {
+    AudioObjectPropertyAddress address = { selector, scope, kAudioObjectPropertyElementMain };
+    return address;
+}
+
+template <typename T>
+static OSStatus GetProperty(AudioObjectID objectID, AudioObjectPropertyAddress address, T* outValue) {
+    UInt32 size = 0;
+    return (*gHost.driver)->GetPropertyData(gHost.driver, objectID, getpid(), &address, 0, nullptr, sizeof(T), &size, outValue);
+}
+
+template <typename T>
+static OSStatus SetProperty(AudioObjectID objectID, AudioObjectPropertyAddress address, const T& value) {
+    return (*gHost.driver)->SetPropertyData(gHost.driver, objectID, getpid(), &address, 0, nullptr, sizeof(T), &value);
+}
+
+static OSStatus SetDeviceNumber(AudioObjectPropertySelector selector, SInt32 value) {
+    CFNumberRef number = CFNumberCreate(NULL, kCFNumberSInt32Type, &value);
+    OSStatus status = SetProperty(gHost.deviceID, Address(selector), (CFPropertyListRef)number);
+    CFRelease(number);
+    return status;
+}
+
+static OSStatus GetDeviceNumber(AudioObjectPropertySelector selector, SInt32* outValue) {
+    CFPropertyListRef value = nullptr;
+    OSStatus status = GetProperty(gHost.deviceID, Address(selector), &value);
+    if (status == kAudioHardwareNoError && value) {
+        if (CFGetTypeID(value) != CFNumberGetTypeID() || !CFNumberGetValue((CFNumberRef)value, kCFNumberSInt32Type, outValue)) {
+            status = kAudioHardwareIllegalOperationError;
+        }
+        CFRelease(value);
+    }
+    return status;
+}
+
+// Keeps the format's encoding; both streams follow
+static OSStatus SetChannelCount(UInt32 channels) {
+    AudioStreamBasicDescription format;
+    OSStatus status = GetProperty(gHost.outputStreamID, Address(kAudioStreamPropertyPhysicalFormat), &format);
+    if (status != kAudioHardwareNoError) {
+        return status;
+    }
+    format.mBytesPerFrame = format.mBytesPerPacket = channels * (format.mBitsPerChannel / 8);
+    format.mChannelsPerFrame = channels;
+    return SetProperty(gHost.outputStreamID, Address(kAudioStreamPropertyPhysicalFormat), format);
+}
+
+static bool SetRingEncoding(const char* name) {
+    for (UInt32 i = 0; i < kRingEncodingCount; i++) {
+        if (strcmp(name, kRingEncodings[i].name) == 0) {
+            return SetDeviceNumber(kHost_PropertyRingEncoding, (SInt32)i) == kAudioHardwareNoError;
+        }
+    }
+    return false;
+}
+
+// Finds the first device and its streams
+static bool OpenDevice() {
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    if (GetProperty(kAudioObjectPlugInObject, Address(kAudioPlugInPropertyDeviceList), &deviceID) != kAudioHardwareNoError ||
+        deviceID == kAudioObjectUnknown) {
+        fprintf(stderr, "the driver has no device\n");
+        return false;
+    }
+    gHost.deviceID = deviceID;
+    GetProperty(deviceID, Address(kAudioDevicePropertyStreams, kAudioObjectPropertyScopeInput), &gHost.inputStreamID);
+    GetProperty(deviceID, Address(kAudioDevicePropertyStreams, kAudioObjectPropertyScopeOutput), &gHost.outputStreamID);
+    if (gHost.inputStreamID == kAudioObjectUnknown || gHost.outputStreamID == kAudioObjectUnknown) {
+        fprintf(stderr, "device %u needs an input and an output stream\n", (unsigned)deviceID);
+        return false;
+    }
+    return true;
+}
+
+// Re-reads the device's format and ring encoding. The counter is only
+// checked in Float32, and takes two channels.
+static bool ReadDeviceFormat() {
+    AudioStreamBasicDescription format;
+    UInt32 period = 0;
+    SInt32 ringEncoding = 0;
+    if (GetProperty(gHost.outputStreamID, Address(kAudioStreamPropertyPhysicalFormat), &format) != kAudioHardwareNoError ||
+        GetProperty(gHost.deviceID, Address(kAudioDevicePropertyZeroTimeStampPeriod), &period) != kAudioHardwareNoError ||
+        GetDeviceNumber(kHost_PropertyRingEncoding, &ringEncoding) != kAudioHardwareNoError ||
+        ringEncoding < 0 || ringEncoding >= (SInt32)kRingEncodingCount) {
+        fprintf(stderr, "can't read the device's format\n");
+        return false;
+    }
+    if (!(format.mFormatFlags & kAudioFormatFlagIsFloat) || format.mBitsPerChannel != 32 || format.mChannelsPerFrame < 2) {
+        fprintf(stderr, "the harness needs a Float32 physical format with at least two channels\n");
+        return false;
+    }
+    gHost.sampleRate = format.mSampleRate;
+    gHost.channels = format.mChannelsPerFrame;
+    gHost.periodFrames = period;
+    gHost.ticksPerFrame = (double)HostTicksPerSecond() / format.mSampleRate;
+    gHost.ringEncoding = (UInt32)ringEncoding;
+
+    // The ring was replaced if the encoding changed, so nothing sent with
+    // the old modulus comes back
+    gHost.signalModulus = 1u << kRingEncodings[ringEncoding].signalBits;
+
+    const size_t samples = (size_t)period * gHost.channels;
+    gHost.inputBuffer.assign(samples, 0.0f);
+    gHost.clientBuffer.assign(samples, 0.0f);
+    gHost.mixBuffer.assign(samples, 0.0f);
+    return true;
+}
+
+// Re-reads a listener's rate and period. Its channel count follows the first
+// device's.
+static bool ReadListenerFormat(Listener& listener) {
+    if (GetProperty(listener.deviceID, Address(kAudioDevicePropertyNominalSampleRate), &listener.sampleRate) != kAudioHardwareNoError ||
+        GetProperty(listener.deviceID, Address(kAudioDevicePropertyZeroTimeStampPeriod), &listener.periodFrames) != kAudioHardwareNoError) {
+        fprintf(stderr, "can't read %s's format\n", listener.name.c_str());
+        return false;
+    }
+    listener.inputBuffer.assign((size_t)listener.periodFrames * gHost.channels, 0.0f);
+    return true;
+}
+
+// ============================================================================
+// Clients
+// ============================================================================
+
+static CFStringRef CreateBundleID(UInt32 clientID) {
+    char bundleID[64];
+    snprintf(bundleID, sizeof(bundleID), "%s%u", kHost_BundleIDPrefix, (unsigned)clientID);
+    return CFStringCreateWithCString(NULL, bundleID, kCFStringEncodingUTF8);
+}
+
+static UInt32 StartClient(AudioObjectID deviceID) {
+    UInt32 clientID = gHost.nextClientID++;
+    CFStringRef bundle = CreateBundleID(clientID);
+    AudioServerPlugInClientInfo info = { clientID, (pid_t)(getpid() + clientID), true, bundle };
+    Check((*gHost.driver)->AddDeviceClient(gHost.driver, deviceID, &info));
+    CFRelease(bundle);
+    Check((*gHost.driver)->StartIO(gHost.driver, deviceID, clientID));
+    return clientID;
+}
+
+static UInt32 AddClient() {
+    UInt32 clientID = StartClient(gHost.deviceID);
+    gHost.clients.push_back(clientID);
+    gHost.stats.clientChanges++;
+    return clientID;
+}
+
+static void RemoveClient() {
+    UInt32 clientID = gHost.clients.back();
+    gHost.clients.pop_back();
+    Check((*gHost.driver)->StopIO(gHost.driver, gHost.deviceID, clientID));
+    AudioServerPlugInClientInfo info = { clientID, (pid_t)(getpid() + clientID), true, nullptr };
+    Check((*gHost.driver)->RemoveDeviceClient(gHost.driver, gHost.deviceID, &info));
+    gHost.stats.clientChanges++;
+}
+
+// `count` silent clients besides the signal client
+static void SetSilentClients(UInt32 count) {
+    while (gHost.clients.size() < count + 1) AddClient();
+    while (gHost.clients.size() > count + 1) RemoveClient();
+}
+
+// ============================================================================
+// Timeline
+// ============================================================================
+
+static void BeginTimeline() {
+    gHost.timelineStart = mach_absolute_time();
+    gHost.timelineCycle = 0;
+    gHost.haveZeroTimeStamp = false;
+    gHost.input.haveSignal = gHost.input.inStream = false;
+    for (Listener& listener : gHost.listeners) {
+        listener.track.haveSignal = listener.track.inStream = false;
+    }
+    gHost.stats.timelines++;
+}
+
+static void StopAll() {
+    for (UInt32 clientID : gHost.clients) {
+        Check((*gHost.driver)->StopIO(gHost.driver, gHost.deviceID, clientID));
+    }
+}
+
+// The first StartIO starts the driver's clock, so the timeline starts here
+static void StartAll() {
+    BeginTimeline();
+    for (UInt32 clientID : gHost.clients) {
+        Check((*gHost.driver)->StartIO(gHost.driver, gHost.deviceID, clientID));
+    }
+}
+
+static void StopListeners() {
+    for (Listener& listener : gHost.listeners) {
+        Check((*gHost.driver)->StopIO(gHost.driver, listener.deviceID, listener.clientID));
+    }
+}
+
+static void StartListeners() {
+    for (Listener& listener : gHost.listeners) {
+        listener.cycles = 0;
+        listener.dueSeconds = 0.0;
+        Check((*gHost.driver)->StartIO(gHost.driver, listener.deviceID, listener.clientID));
+    }
+}
+
+static bool ApplyPendingChanges() {
+    if (gHost.pendingChanges.empty()) {
+        return true;
+    }
+    StopAll();
+    StopListeners();
+    // Performing one change may queue another, e.g. for a loopback consumer
+    while (!gHost.pendingChanges.empty()) {
+        PendingChange change = gHost.pendingChanges.front();
+        gHost.pendingChanges.erase(gHost.pendingChanges.begin());
+        Check((*gHost.driver)->PerformDeviceConfigurationChange(gHost.driver, change.deviceID, change.action, nullptr));
+        gHost.stats.configChanges++;
+    }
+    if (!ReadDeviceFormat()) {
+        return false;
+    }
+    for (Listener& listener : gHost.listeners) {
+        if (!ReadListenerFormat(listener)) {
+            return false;
+        }
+    }
+    StartAll();
+    StartListeners();
+    return true;
+}
+
+// Checks the latest zero timestamp against the last one and the host clock,
+// and tracks the rate it implies
+static void CheckZeroTimeStamp(UInt64 now) {
+    Float64 sampleTime = 0.0;
+    UInt64 hostTime = 0;
+    UInt64 seed = 0;
+    Check((*gHost.driver)->GetZeroTimeStamp(gHost.driver, gHost.deviceID, gHost.clients.front(), &sampleTime, &hostTime, &seed));
+
+    if (!gHost.haveZeroTimeStamp) {
+        gHost.haveZeroTimeStamp = true;
+        gHost.seed = seed;
+        gHost.firstZeroSample = gHost.lastZeroSample = sampleTime;
+        gHost.firstZeroHost = gHost.lastZeroHost = hostTime;
+        return;
+    }
+
+    if (seed != gHost.seed ||
+        fmod(sampleTime, (Float64)gHost.periodFrames) != 0.0 ||
+        sampleTime < gHost.lastZeroSample || hostTime < gHost.lastZeroHost ||
+        hostTime > now + (UInt64)(gHost.periodFrames * gHost.ticksPerFrame)) {
+        gHost.stats.timeStampErrors++;
+    }
+    gHost.seed = seed;
+    gHost.lastZeroSample = sampleTime;
+    gHost.lastZeroHost = hostTime;
+
+    if (sampleTime > gHost.firstZeroSample) {
+        double ticksPerFrame = (double)(hostTime - gHost.firstZeroHost) / (sampleTime - gHost.firstZeroSample);
+        double ppm = std::fabs(gHost.ticksPerFrame / ticksPerFrame - 1.0) * 1e6;
+        gHost.stats.maxDriftPPM = std::max(gHost.stats.maxDriftPPM, ppm);
+    }
+}
+
+// ============================================================================
+// Routes
+// ============================================================================
+
+static Listener* FindListener(const char* name) {
+    for (Listener& listener : gHost.listeners) {
+        if (listener.name == name) return &listener;
+    }
+    return nullptr;
+}
+
+// Creates the device and starts its client. It takes the driver's default
+// format, which has to match the first device's for the signal to reach it.
+//
+// A loopback listener reads the first device's ring instead, at `rate` (0
+// for the default). What it reads is resampled, so isn't followed; the
+// first device's own input is silent while it does, so isn't either. The
+// driver's count of the frames it zero-filled is read at the end.
+static bool AddListener(const char* name, bool loopback, Float64 rate) {
+    if (FindListener(name) || !ApplyPendingChanges()) {
+        return false;
+    }
+    SInt32 period = (SInt32)gHost.periodFrames;
+    CFStringRef source = nullptr;
+    if (loopback && GetProperty(gHost.deviceID, Address(kAudioDevicePropertyDeviceUID), &source) != kAudioHardwareNoError) {
+        return false;
+    }
+    CFStringRef uid = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    CFNumberRef periodFrames = CFNumberCreate(NULL, kCFNumberSInt32Type, &period);
+    const void* keys[] = { CFSTR("uid"), CFSTR("name"), CFSTR("period frames"), CFSTR("loopback source") };
+    const void* values[] = { uid, uid, periodFrames, source };
+    CFDictionaryRef desc = CFDictionaryCreate(NULL, keys, values, loopback ? 4 : 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(uid);
+    CFRelease(periodFrames);
+    if (source) CFRelease(source);
+
+    Listener listener;
+    listener.name = name;
+    listener.loopback = loopback;
+    AudioServerPlugInClientInfo info = { 0, getpid(), true, nullptr };
+    OSStatus status = (*gHost.driver)->CreateDevice(gHost.driver, desc, &info, &listener.deviceID);
+    CFRelease(desc);
+    if (status != kAudioHardwareNoError ||
+        GetProperty(listener.deviceID, Address(kAudioDevicePropertyStreams, kAudioObjectPropertyScopeInput), &listener.inputStreamID) != kAudioHardwareNoError ||
+        (rate != 0.0 && SetProperty(listener.deviceID, Address(kAudioDevicePropertyNominalSampleRate), rate) != kAudioHardwareNoError) ||
+        !ReadListenerFormat(listener)) {
+        return false;
+    }
+    listener.clientID = StartClient(listener.deviceID);
+    listener.track.live = false;
+    if (loopback) {
+        gHost.input.live = false;
+    }
+    gHost.listeners.push_back(listener);
+    return true;
+}
+
+// A device that goes live starts a new stream: where it picks the counter up
+// is checked by what the devices carry between them, not against the last
+// time it played. One that leaves without having carried it was never
+// reached.
+static void SetLive(Track& track, bool live) {
+    if (live && !track.live) {
+        track.haveSignal = track.reached = false;
+    } else if (!live && track.live && !track.reached) {
+        gHost.stats.unreached++;
+    }
+    track.live = live;
+}
+
+// Live devices the signal has yet to reach, besides those already counted
+static UInt64 UnreachedRoutes() {
+    UInt64 routes = gHost.stats.unreached;
+    if (gHost.input.live && !gHost.input.reached) routes++;
+    for (const Listener& listener : gHost.listeners) {
+        if (listener.track.live && !listener.track.reached) routes++;
+    }
+    return routes;
+}
+
+// The HAL stops asking for a device's input once its only running client
+// does output alone; the device itself keeps running
+static bool IdleListener(const char* name) {
+    Listener* listener = FindListener(name);
+    if (!listener) {
+        return false;
+    }
+    listener->reading = false;
+    return true;
+}
+
+// Routes the signal client by its bundle ID. `mode` and `crossfadeMs` may be
+// null for the driver's defaults.
+static bool SetSignalRoute(const char* name, const char* mode, const char* crossfadeMs) {
+    const bool own = strcmp(name, "own") == 0;
+    Listener* target = own ? nullptr : FindListener(name);
+    SInt32 exclusive = mode && strcmp(mode, "exclusive") == 0;
+    if ((!own && !target) || (mode && !exclusive && strcmp(mode, "shared") != 0)) {
+        return false;
+    }
+    Float64 milliseconds = crossfadeMs ? atof(crossfadeMs) : 0.0;
+    CFStringRef uid = CFStringCreateWithCString(NULL, own ? "" : name, kCFStringEncodingUTF8);
+    CFNumberRef isExclusive = CFNumberCreate(NULL, kCFNumberSInt32Type, &exclusive);
+    CFNumberRef crossfade = CFNumberCreate(NULL, kCFNumberFloat64Type, &milliseconds);
+    const void* keys[] = { CFSTR("device"), CFSTR("exclusive"), CFSTR("crossfade") };
+    const void* values[] = { uid, isExclusive, crossfade };
+    CFDictionaryRef route = CFDictionaryCreate(NULL, keys, values, crossfadeMs ? 3 : 2,
+                                               &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFRelease(uid);
+    CFRelease(isExclusive);
+    CFRelease(crossfade);
+
+    CFStringRef bundle = CreateBundleID(gHost.clients.front());
+    AudioObjectPropertyAddress address = Address(kHost_PropertyClientRoute);
+    OSStatus status = (*gHost.driver)->SetPropertyData(gHost.driver, kAudioObjectPlugInObject, getpid(), &address,
+                                                       sizeof(CFStringRef), &bundle, sizeof(CFDictionaryRef), &route);
+    CFRelease(bundle);
+    CFRelease(route);
+    if (status != kAudioHardwareNoError) {
+        return false;
+    }
+
+    SetLive(gHost.input, own || !exclusive);
+    for (Listener& listener : gHost.listeners) {
+        SetLive(listener.track, &listener == target);
+    }
+    return true;
+}
+
+// ============================================================================
+// Signal
+// ============================================================================
+
+static void FillSignal(Float32* buffer, UInt32 frames) {
+    const UInt32 modulus = gHost.signalModulus;
+    for (UInt32 i = 0; i < frames; i++) {
+        UInt32 counter = (UInt32)((gHost.framesWritten + i) % modulus);
+        Float32 value = (Float32)(counter + 1) / (Float32)modulus;
+        Float32* frame = buffer + (size_t)i * gHost.channels;
+        frame[0] = value;
+        frame[1] = (Float32)(modulus - counter) / (Float32)modulus;
+        for (UInt32 ch = 2; ch < gHost.channels; ch++) {
+            frame[ch] = value;
+        }
+    }
+}
+
+// Reads the counter back out of one frame. An exact frame carries it at
+// unity gain, to within the ring encoding's LSB. Off a Float32 ring a frame
+// at any other gain still gives it back, from the ratio of channels 0 and 1,
+// unless it has faded almost to silence. `outGain` is set either way.
+static bool DecodeFrame(const Float32* samples, UInt64* outCounter, double* outGain, bool* outExact) {
+    const double modulus = (double)gHost.signalModulus;
+    const double lsb = kRingEncodings[gHost.ringEncoding].lsb;
+    const double sum = (double)samples[0] + (double)samples[1];
+    double scaled = std::nearbyint((double)samples[0] * modulus);
+    *outExact = scaled >= 1.0 && scaled <= modulus &&
+                std::fabs((double)samples[0] - scaled / modulus) <= lsb &&
+                std::fabs((double)samples[1] - (modulus + 1.0 - scaled) / modulus) <= lsb;
+    *outGain = *outExact ? 1.0 : sum * modulus / (modulus + 1.0);
+    if (!*outExact) {
+        if (lsb != 0.0 || !(*outGain >= kSignalDecodableGain)) {
+            return false;
+        }
+        const double ratio = (double)samples[0] * (modulus + 1.0) / sum;
+        scaled = std::nearbyint(ratio);
+        if (scaled < 1.0 || scaled > modulus || std::fabs(ratio - scaled) > kSignalDecodeSlack) {
+            return false;
+        }
+    }
+    *outCounter = (UInt64)scaled - 1;
+    return true;
+}
+
+// Follows the counter through one block of a device's input (channels 0
+// and 1, with the rest checked against channel 0). Only the first device's
+// latency is measured.
+static void CheckInput(Track& track, const Float32* buffer, UInt32 frames, bool measureLatency) {
+    Stats& stats = gHost.stats;
+    if (gHost.received.size() < gHost.framesWritten) {
+        gHost.received.resize(gHost.framesWritten, false);
+    }
+    bool measuredLatency = !measureLatency;
+    for (UInt32 i = 0; i < frames; i++) {
+        const Float32* samples = buffer + (size_t)i * gHost.channels;
+        if (samples[0] == 0.0f && samples[1] == 0.0f) {
+            if (track.inStream && track.lastGain > kCutOffGain) stats.cutOffs++;
+            track.inStream = false;
+            if (track.live && track.haveSignal) stats.zeroFilled++;
+            continue;
+        }
+        for (UInt32 ch = 2; ch < gHost.channels; ch++) {
+            if (samples[ch] != samples[0]) {
+                stats.channelErrors++;
+                break;
+            }
+        }
+        UInt64 counter;
+        bool exact;
+        bool decoded = DecodeFrame(samples, &counter, &track.lastGain, &exact);
+        track.inStream = true;
+        if (!exact) {
+            stats.faded++;
+        }
+        if (!decoded) {
+            continue;
+        }
+
+        // Unwrap against what was written: the frame can't be from the future
+        UInt64 written = gHost.framesWritten;
+        UInt64 frame = written - ((written - counter) % gHost.signalModulus);
+        if (track.haveSignal && frame != track.expectedFrame) {
+            stats.discontinuities++;
+            if (frame > track.expectedFrame) {
+                stats.dropped += frame - track.expectedFrame;
+            } else {
+                stats.repeated += track.expectedFrame - frame;
+            }
+        }
+        track.haveSignal = true;
+        track.reached |= track.live;
+        track.expectedFrame = frame + 1;
+        if (frame < gHost.received.size()) {
+            gHost.received[frame] = true;
+            gHost.firstReceived = std::min(gHost.firstReceived, frame);
+            gHost.lastReceived = std::max(gHost.lastReceived, frame);
+        }
+
+        if (!measuredLatency && exact) {
+            measuredLatency = true;
+            UInt64 latency = written - (frame - i);     // Of the block's first frame
+            stats.latencyMin = std::min(stats.latencyMin, latency);
+            stats.latencyMax = std::max(stats.latencyMax, latency);
+            stats.latencySum += (double)latency;
+            stats.latencyCount++;
+        }
+    }
+}
+
+// Frames from the first to the last any device carried that none did
+static UInt64 LostFrames() {
+    UInt64 lost = 0;
+    for (UInt64 frame = gHost.firstReceived; frame < gHost.lastReceived; frame++) {
+        if (!gHost.received[frame]) lost++;
+    }
+    return lost;
+}
+
+// ============================================================================
+// IO Cycle
+// ============================================================================
+
+static void DoOperation(AudioObjectID deviceID, UInt32 operationID, AudioObjectID streamID, UInt32 clientID, Float32* buffer,
+                        UInt32 frames, const AudioServerPlugInIOCycleInfo& cycle) {
+    AudioServerPlugInDriverRef driver = gHost.driver;
+    Check((*driver)->BeginIOOperation(driver, deviceID, clientID, operationID, frames, &cycle));
+    Check((*driver)->DoIOOperation(driver, deviceID, streamID, clientID, operationID, frames, &cycle, buffer, nullptr));
+    Check((*driver)->EndIOOperation(driver, deviceID, clientID, operationID, frames, &cycle));
+}
+
+// Reads every period of a listener's input that has come due by the end of
+// the first device's period: once a cycle when they share a rate and
+// period. A routed listener's input is checked as it's read; nothing read
+// now can be newer than what the first device wrote last cycle.
+static void ReadListener(Listener& listener, UInt64 now) {
+    const double period = listener.periodFrames / listener.sampleRate;
+    listener.dueSeconds += gHost.periodFrames / gHost.sampleRate;
+    while (listener.dueSeconds >= period * (1.0 - 1e-9)) {
+        listener.dueSeconds -= period;
+
+        AudioServerPlugInIOCycleInfo cycle;
+        memset(&cycle, 0, sizeof(cycle));
+        cycle.mIOCycleCounter = listener.cycles;
+        cycle.mNominalIOBufferFrameSize = listener.periodFrames;
+        cycle.mCurrentTime.mHostTime = now;
+        cycle.mInputTime.mSampleTime = (Float64)(listener.cycles * listener.periodFrames);
+        cycle.mOutputTime.mSampleTime = (Float64)((listener.cycles + 2) * listener.periodFrames);
+        listener.cycles++;
+
+        DoOperation(listener.deviceID, kAudioServerPlugInIOOperationReadInput, listener.inputStreamID, listener.clientID,
+                    listener.inputBuffer.data(), listener.periodFrames, cycle);
+        if (!listener.loopback) {
+            CheckInput(listener.track, listener.inputBuffer.data(), listener.periodFrames, false);
+        } else if (std::all_of(listener.inputBuffer.begin(), listener.inputBuffer.end(), [](Float32 sample) { return sample == 0.0f; })) {
+            if (listener.heard) listener.silentCycles++;
+        } else {
+            listener.heard = true;
+        }
+    }
+}
+
+static void RunCycle() {
+    const double periodTicks = gHost.periodFrames * gHost.ticksPerFrame;
+
+    // Input for period n is complete at the end of period n
+    UInt64 due = gHost.timelineStart + (UInt64)((gHost.timelineCycle + 1) * periodTicks);
+    double latePeriods = gHost.stallPeriods;
+    if (gHost.jitterPeriods > 0.0) {
+        latePeriods += std::uniform_real_distribution<double>(0.0, gHost.jitterPeriods)(gHost.random);
+    }
+    gHost.stallPeriods = 0.0;
+    WaitUntilHostTime(due + (UInt64)(latePeriods * periodTicks));
+
+    UInt64 now = mach_absolute_time();
+    if (now > due) {
+        double late = (double)(now - due) / periodTicks;
+        if (late > kLateWakeupPeriods) gHost.stats.lateWakeups++;
+        gHost.stats.maxLatePeriods = std::max(gHost.stats.maxLatePeriods, late);
+    }
+
+    AudioServerPlugInIOCycleInfo cycle;
+    memset(&cycle, 0, sizeof(cycle));
+    cycle.mIOCycleCounter = gHost.stats.cycles;
+    cycle.mNominalIOBufferFrameSize = gHost.periodFrames;
+    cycle.mCurrentTime.mHostTime = now;
+    cycle.mInputTime.mSampleTime = (Float64)(gHost.timelineCycle * gHost.periodFrames);
+    cycle.mOutputTime.mSampleTime = (Float64)((gHost.timelineCycle + 2) * gHost.periodFrames);
+
+    UInt64 start = NowNanos();
+    CheckZeroTimeStamp(now);
+    DoOperation(gHost.deviceID, kAudioServerPlugInIOOperationReadInput, gHost.inputStreamID, gHost.clients.front(), gHost.inputBuffer.data(), gHost.periodFrames, cycle);
+    for (Listener& listener : gHost.listeners) {
+        if (listener.reading) ReadListener(listener, now);
+    }
+
+    // Each client's output goes through ProcessOutput before the HAL mixes it
+    std::fill(gHost.mixBuffer.begin(), gHost.mixBuffer.end(), 0.0f);
+    for (size_t c = 0; c < gHost.clients.size(); c++) {
+        if (c == 0) {
+            FillSignal(gHost.clientBuffer.data(), gHost.periodFrames);
+        } else {
+            std::fill(gHost.clientBuffer.begin(), gHost.clientBuffer.end(), 0.0f);
+        }
+        DoOperation(gHost.deviceID, kAudioServerPlugInIOOperationProcessOutput, gHost.outputStreamID, gHost.clients[c], gHost.clientBuffer.data(), gHost.periodFrames, cycle);
+        for (size_t i = 0; i < gHost.mixBuffer.size(); i++) {
+            gHost.mixBuffer[i] += gHost.clientBuffer[i];
+        }
+    }
+    DoOperation(gHost.deviceID, kAudioServerPlugInIOOperationWriteMix, gHost.outputStreamID, gHost.clients.front(), gHost.mixBuffer.data(), gHost.periodFrames, cycle);
+    gHost.stats.cycleNanos.push_back(NowNanos() - start);
+
+    // After the write, so the latency counts this cycle's output
+    gHost.framesWritten += gHost.periodFrames;
+    CheckInput(gHost.input, gHost.inputBuffer.data(), gHost.periodFrames, true);
+
+    gHost.timelineCycle++;
+    gHost.stats.cycles++;
+}
+
+static bool RunCycles(UInt64 count) {
+    for (UInt64 n = 0; n < count; n++) {
+        if (!ApplyPendingChanges()) {
+            return false;
+        }
+        if (gHost.churnCycles > 0 && gHost.stats.cycles % gHost.churnCycles == 0) {
+            SetSilentClients(std::uniform_int_distribution<UInt32>(0, gHost.churnMax)(gHost.random));
+        }
+        RunCycle();
+    }
+    return true;
+}
+
+// ============================================================================
+// Report
+// ============================================================================
+
+static SInt64 GetStatsNumber(CFDictionaryRef stats, CFStringRef key) {
+    SInt64 value = 0;
+    CFNumberRef number = (CFNumberRef)CFDictionaryGetValue(stats, key);
+    if (number) CFNumberGetValue(number, kCFNumberSInt64Type, &value);
+    return value;
+}
+
+static void ReadDriverStats() {
+    CFPropertyListRef value = nullptr;
+    for (Listener& listener : gHost.listeners) {
+        if (listener.loopback && GetProperty(listener.deviceID, Address(kHost_PropertyIOStats), &value) == kAudioHardwareNoError && value) {
+            listener.driverZeroFilled = GetStatsNumber((CFDictionaryRef)value, CFSTR("framesZeroFilled"));
+            CFRelease(value);
+        }
+        value = nullptr;
+    }
+    if (GetProperty(gHost.deviceID, Address(kHost_PropertyIOStats), &value) != kAudioHardwareNoError || !value) {
+        return;
+    }
+    CFDictionaryRef stats = (CFDictionaryRef)value;
+    Stats& out = gHost.stats;
+    out.driverCycles = GetStatsNumber(stats, CFSTR("cycles"));
+    out.driverDropped = GetStatsNumber(stats, CFSTR("framesDropped"));
+    out.driverZeroFilled = GetStatsNumber(stats, CFSTR("framesZeroFilled"));
+    out.driverMaxFill = GetStatsNumber(stats, CFSTR("maxFillFrames"));
+    out.driverCapacity = GetStatsNumber(stats, CFSTR("capacityFrames"));
+    out.driverMaxIONanos = GetStatsNumber(stats, CFSTR("ioMaxNanos"));
+    out.probeLatencyCount = GetStatsNumber(stats, CFSTR("latencyCount"));
+    out.probeLatencyMinNanos = GetStatsNumber(stats, CFSTR("latencyMinNanos"));
+    out.probeLatencyMeanNanos = GetStatsNumber(stats, CFSTR("latencyMeanNanos"));
+    out.probeLatencyMaxNanos = GetStatsNumber(stats, CFSTR("latencyMaxNanos"));
+    out.probeJitterMeanNanos = GetStatsNumber(stats, CFSTR("jitterMeanNanos"));
+    out.probeJitterMaxNanos = GetStatsNumber(stats, CFSTR("jitterMaxNanos"));
+    CFRelease(value);
+}
+
+// Over every loopback listener
+static SInt64 LoopbackZeroFilled() {
+    SInt64 frames = 0;
+    for (const Listener& listener : gHost.listeners) {
+        frames += listener.driverZeroFilled;
+    }
+    return frames;
+}
+
+static UInt64 LoopbackSilentCycles() {
+    UInt64 cycles = 0;
+    for (const Listener& listener : gHost.listeners) {
+        cycles += listener.silentCycles;
+    }
+    return cycles;
+}
+
+static UInt64 CycleNanosPercentile(double fraction) {
+    std::vector<UInt64>& nanos = gHost.stats.cycleNanos;
+    if (nanos.empty()) return 0;
+    std::sort(nanos.begin(), nanos.end());
+    return nanos[std::min(nanos.size() - 1, (size_t)(fraction * (double)nanos.size()))];
+}
+
+// The names `expect` takes
+static bool GetMetric(const std::string& name, double* outValue) {
+    const Stats& stats = gHost.stats;
+    if (name == "zero-filled")          *outValue = (double)stats.zeroFilled;
+    else if (name == "discontinuities") *outValue = (double)stats.discontinuities;
+    else if (name == "dropped")         *outValue = (double)stats.dropped;
+    else if (name == "repeated")        *outValue = (double)stats.repeated;
+    else if (name == "faded")           *outValue = (double)stats.faded;
+    else if (name == "channel-errors")  *outValue = (double)stats.channelErrors;
+    else if (name == "cut-offs")        *outValue = (double)stats.cutOffs;
+    else if (name == "lost")            *outValue = (double)LostFrames();
+    else if (name == "unreached")       *outValue = (double)UnreachedRoutes();
+    else if (name == "latency-max")     *outValue = (double)stats.latencyMax;
+    else if (name == "late-wakeups")    *outValue = (double)stats.lateWakeups;
+    else if (name == "drift-ppm")       *outValue = stats.maxDriftPPM;
+    else if (name == "timestamp-errors") *outValue = (double)stats.timeStampErrors;
+    else if (name == "io-errors")       *outValue = (double)stats.ioErrors;
+    else if (name == "cycle-p99-ns")    *outValue = (double)CycleNanosPercentile(0.99);
+    else if (name == "driver-dropped")  *outValue = (double)stats.driverDropped;
+    else if (name == "driver-zero-filled") *outValue = (double)stats.driverZeroFilled;
+    else if (name == "loopback-zero-filled") *outValue = (double)LoopbackZeroFilled();
+    else if (name == "loopback-silent") *outValue = (double)LoopbackSilentCycles();
+    else if (name == "probe-latency-max-ns") *outValue = (double)stats.probeLatencyMaxNanos;
+    else if (name == "probe-jitter-max-ns") *outValue = (double)stats.probeJitterMaxNanos;
+    else return false;
+    return true;
+}
+
+static void PrintReport(const char* scenario) {
+    const Stats& stats = gHost.stats;
+    printf("%s: %llu cycles, %llu timelines, %llu config changes, %llu client changes\n", scenario,
+           (unsigned long long)stats.cycles, (unsigned long long)stats.timelines,
+           (unsigned long long)stats.configChanges, (unsigned long long)stats.clientChanges);
+    printf("  input     zero-filled %llu, discontinuities %llu (dropped %llu, repeated %llu), faded %llu, channel-errors %llu\n",
+           (unsigned long long)stats.zeroFilled, (unsigned long long)stats.discontinuities,
+           (unsigned long long)stats.dropped, (unsigned long long)stats.repeated, (unsigned long long)stats.faded,
+           (unsigned long long)stats.channelErrors);
+    if (!gHost.listeners.empty()) {
+        printf("  routes    %zu more devices, lost %llu, cut-offs %llu, unreached %llu, loopback-zero-filled %lld, loopback-silent %llu\n",
+               gHost.listeners.size(), (unsigned long long)LostFrames(), (unsigned long long)stats.cutOffs,
+               (unsigned long long)UnreachedRoutes(), (long long)LoopbackZeroFilled(), (unsigned long long)LoopbackSilentCycles());
+    }
+    if (stats.latencyCount > 0) {
+        printf("  latency   %llu...%llu frames, mean %.0f (latency-max)\n", (unsigned long long)stats.latencyMin,
+               (unsigned long long)stats.latencyMax, stats.latencySum / (double)stats.latencyCount);
+    } else {
+        printf("  latency   no signal came back\n");
+    }
+    printf("  clock     drift-ppm %.3f, timestamp-errors %llu, late-wakeups %llu (worst %.2f periods)\n",
+           stats.maxDriftPPM, (unsigned long long)stats.timeStampErrors, (unsigned long long)stats.lateWakeups, stats.maxLatePeriods);
+    printf("  io        p50 %llu ns, cycle-p99-ns %llu, max %llu ns, io-errors %llu\n",
+           (unsigned long long)CycleNanosPercentile(0.5), (unsigned long long)CycleNanosPercentile(0.99),
+           (unsigned long long)CycleNanosPercentile(1.0), (unsigned long long)stats.ioErrors);
+    printf("  driver    %lld cycles, driver-dropped %lld, driver-zero-filled %lld, fill %lld/%lld frames, DoIO max %lld ns\n",
+           (long long)stats.driverCycles, (long long)stats.driverDropped, (long long)stats.driverZeroFilled,
+           (long long)stats.driverMaxFill, (long long)stats.driverCapacity, (long long)stats.driverMaxIONanos);
+    if (stats.probeLatencyCount > 0) {
+        printf("  probe     %lld markers read, latency %lld...%lld ns (probe-latency-max-ns), mean %lld, cycle jitter mean %lld ns, max %lld (probe-jitter-max-ns)\n",
+               (long long)stats.probeLatencyCount, (long long)stats.probeLatencyMinNanos, (long long)stats.probeLatencyMaxNanos,
+               (long long)stats.probeLatencyMeanNanos, (long long)stats.probeJitterMeanNanos, (long long)stats.probeJitterMaxNanos);
+    }
+}
+
+// ============================================================================
+// Scenario
+// ============================================================================
+
+struct Expectation {
+    std::string metric;
+    double limit;
+    int line;
+};
+
+// Runs the scenario's commands in order; expectations are collected and
+// checked once at the end
+static bool RunScenario(FILE* file, const char* name, std::vector<Expectation>* outExpectations) {
+    char text[256];
+    for (int line = 1; fgets(text, sizeof(text), file); line++) {
+        if (char* comment = strchr(text, '#')) *comment = '\0';
+        char command[32] = "";
+        char arg1[64] = "";
+        char arg2[64] = "";
+        char arg3[64] = "";
+        int args = sscanf(text, "%31s %63s %63s %63s", command, arg1, arg2, arg3);
+        if (args <= 0) {
+            continue;
+        }
+
+        std::string cmd = command;
+        bool ok = true;
+        if (cmd == "seed" && args == 2) {
+            gHost.random.seed((unsigned)strtoul(arg1, nullptr, 10));
+        } else if (cmd == "jitter" && args == 2) {
+            gHost.jitterPeriods = atof(arg1);
+        } else if (cmd == "stall" && args == 2) {
+            gHost.stallPeriods = atof(arg1);
+        } else if (cmd == "clients" && args == 2) {
+            SetSilentClients((UInt32)atoi(arg1));
+        } else if (cmd == "churn" && args == 3) {
+            gHost.churnCycles = (UInt32)atoi(arg1);
+            gHost.churnMax = (UInt32)atoi(arg2);
+        } else if (cmd == "rate" && args == 2) {
+            ok = SetProperty(gHost.deviceID, Address(kAudioDevicePropertyNominalSampleRate), (Float64)atof(arg1)) == kAudioHardwareNoError;
+        } else if (cmd == "period" && args == 2) {
+            ok = SetDeviceNumber(kHost_PropertyPeriodFrames, atoi(arg1)) == kAudioHardwareNoError;
+        } else if (cmd == "latency" && args == 2) {
+            ok = SetDeviceNumber(kHost_PropertyLatencyPeriods, atoi(arg1)) == kAudioHardwareNoError;
+        } else if (cmd == "probe" && args == 2) {
+            ok = SetDeviceNumber(kHost_PropertyLatencyProbe, atoi(arg1)) == kAudioHardwareNoError;
+        } else if (cmd == "channels" && args == 2) {
+            ok = SetChannelCount((UInt32)atoi(arg1)) == kAudioHardwareNoError;
+        } else if (cmd == "ring" && args == 2) {
+            ok = SetRingEncoding(arg1);
+        } else if (cmd == "device" && args == 2) {
+            ok = AddListener(arg1, false, 0.0);
+        } else if (cmd == "loopback" && args >= 2) {
+            ok = AddListener(arg1, true, args >= 3 ? atof(arg2) : 0.0);
+        } else if (cmd == "route" && args >= 2) {
+            ok = SetSignalRoute(arg1, args >= 3 ? arg2 : nullptr, args >= 4 ? arg3 : nullptr);
+        } else if (cmd == "idle" && args == 2) {
+            ok = IdleListener(arg1);
+        } else if (cmd == "run" && args == 2) {
+            ok = RunCycles(strtoull(arg1, nullptr, 10));
+        } else if (cmd == "expect" && args == 4 && strcmp(arg2, "<=") == 0) {
+            double value;
+            ok = GetMetric(arg1, &value);
+            outExpectations->push_back({ arg1, atof(arg3), line });
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: can't do '%s'\n", name, line, cmd.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* driverPath = kHost_DefaultDriverPath;
+    const char* scenario = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--driver") == 0 && i + 1 < argc) {
+            driverPath = argv[++i];
+        } else if (!scenario) {
+            scenario = argv[i];
+        } else {
+            scenario = nullptr;
+            break;
+        }
+    }
+    if (!scenario) {
+        fprintf(stderr, "usage: %s [--driver PATH] SCENARIO\n", argv[0]);
+        return 2;
+    }
+    FILE* file = fopen(scenario, "r");
+    if (!file) {
+        fprintf(stderr, "can't open %s\n", scenario);
+        return 2;
+    }
+
+    gHost.driver = LoadDriver(driverPath);
+    if (!gHost.driver || (*gHost.driver)->Initialize(gHost.driver, &gHostInterface) != kAudioHardwareNoError ||
+        !OpenDevice() || !ReadDeviceFormat()) {
+        return 2;
+    }
+
+    // The signal client runs for the whole scenario
+    BeginTimeline();
+    AddClient();
+
+    std::vector<Expectation> expectations;
+    bool completed = RunScenario(file, scenario, &expectations);
+    fclose(file);
+    StopAll();
+    StopListeners();
+
+    ReadDriverStats();
+    PrintReport(scenario);
+    if (!completed) {
+        return 2;
+    }
+    int failures = 0;
+    for (const Expectation& expectation : expectations) {
+        double value = 0.0;
+        GetMetric(expectation.metric, &value);
+        if (value > expectation.limit) {
+            printf("  FAILED    %s:%d: %s is %g, expected <= %g\n", scenario, expectation.line,
+                   expectation.metric.c_str(), value, expectation.limit);
+            failures++;
+        }
+    }
+    printf("  %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
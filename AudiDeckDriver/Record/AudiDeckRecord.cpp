@@ -0,0 +1,207 @@
+/*
+ *  AudiDeckRecord.cpp
+ *  AudiDeck Virtual Audio Driver
+ *
+ *  Records AudiDeck devices to disk. Like the bridge, this runs as its own
+ *  process and reads each device's tap ('atap') from shared memory, so a
+ *  recording adds no HAL client to the device and nothing to its IO path.
+ *  Built by `./build.sh record`.
+ *
+ *  - Each source gets its own AudioRecorder, with its own capture and
+ *    writer threads, so a slow disk under one recording doesn't hold up
+ *    another; see AudioRecorder.hpp.
+ *  - --buffer sets each recording's buffering, in MiB. It's all allocated
+ *    at start; a disk that stalls for longer than it covers costs audio,
+ *    which is reported, never memory.
+ *  - Files are 32-bit float CAF at the device's format. A format change
+ *    during the recording starts the next file.
+ *
+ *  Usage: AudiDeckRecord [--buffer MIB] SOURCE_UID=PATH.caf...
+ *  Runs until interrupted, printing progress every few seconds.
+ */
+
+#include <CoreAudio/CoreAudio.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../AudioRecorder.hpp"
+
+// ============================================================================
+// Constants
+// ============================================================================
+
+#define kRecord_DefaultBufferMiB    16
+#define kRecord_ReportSeconds       5
+
+// Custom device properties (see AudiDeckDriver.cpp)
+#define kRecord_PropertyTap         0x61746170  // 'atap'
+
+// ============================================================================
+// Types
+// ============================================================================
+
+struct Recording {
+    std::string sourceUID;
+    std::string path;
+    AudioObjectID sourceID = kAudioObjectUnknown;
+    bool enabledTap = false;        // Left as we found it on exit
+    AudioRecorder recorder;
+    uint64_t reportedDropped = 0;
+};
+
+static volatile sig_atomic_t gStop = 0;
+
+// ============================================================================
+// HAL Helpers
+// ============================================================================
+
+static AudioObjectPropertyAddress Address(AudioObjectPropertySelector selector) {
+    return { selector, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain };
+}
+
+static AudioObjectID FindDevice(const std::string& uid) {
+    CFStringRef uidString = CFStringCreateWithCString(kCFAllocatorDefault, uid.c_str(), kCFStringEncodingUTF8);
+    AudioObjectID deviceID = kAudioObjectUnknown;
+    AudioValueTranslation translation = { &uidString, sizeof(uidString), &deviceID, sizeof(deviceID) };
+    AudioObjectPropertyAddress address = Address(kAudioHardwarePropertyDeviceForUID);
+    UInt32 size = sizeof(translation);
+    AudioObjectGetPropertyData(kAudioObjectSystemObject, &address, 0, nullptr, &size, &translation);
+    CFRelease(uidString);
+    return deviceID;
+}
+
+// Our devices' custom properties carry CFNumbers
+static bool GetCustomSInt32(AudioObjectID deviceID, AudioObjectPropertySelector selector, SInt32* outValue) {
+    AudioObjectPropertyAddress address = Address(selector);
+    CFPropertyListRef value = nullptr;
+    UInt32 size = sizeof(value);
+    if (AudioObjectGetPropertyData(deviceID, &address, 0, nullptr, &size, &value) != kAudioHardwareNoError || !value) {
+        return false;
+    }
+    bool ok = CFGetTypeID(value) == CFNumberGetTypeID() && CFNumberGetValue((CFNumberRef)value, kCFNumberSInt32Type, outValue);
+    CFRelease(value);
+    return ok;
+}
+
+static bool SetCustomSInt32(AudioObjectID deviceID, AudioObjectPropertySelector selector, SInt32 value) {
+    AudioObjectPropertyAddress address = Address(selector);
+    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &value);
+    OSStatus status = AudioObjectSetPropertyData(deviceID, &address, 0, nullptr, sizeof(number), &number);
+    CFRelease(number);
+    return status == kAudioHardwareNoError;
+}
+
+// ============================================================================
+// Setup
+// ============================================================================
+
+// SOURCE_UID=PATH
+static bool ParseRecording(const char* arg, Recording* recording) {
+    const char* equals = strchr(arg, '=');
+    if (!equals || equals == arg || equals[1] == '\0') return false;
+    recording->sourceUID.assign(arg, equals - arg);
+    recording->path.assign(equals + 1);
+    return true;
+}
+
+static void Usage() {
+    fprintf(stderr, "Usage: AudiDeckRecord [--buffer MIB] SOURCE_UID=PATH.caf...\n");
+}
+
+static void HandleSignal(int) {
+    gStop = 1;
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, char** argv) {
+    int bufferMiB = kRecord_DefaultBufferMiB;
+    std::vector<std::unique_ptr<Recording>> recordings;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+            bufferMiB = atoi(argv[++i]);
+            continue;
+        }
+        std::unique_ptr<Recording> recording(new Recording);
+        if (!ParseRecording(argv[i], recording.get())) {
+            Usage();
+            return 2;
+        }
+        recordings.push_back(std::move(recording));
+    }
+    const size_t chunkCount = (size_t)bufferMiB * (1 << 20) / AudioRecorder::kChunkBytes;
+    if (recordings.empty() || chunkCount < 2) {
+        Usage();
+        return 2;
+    }
+
+    for (auto& recording : recordings) {
+        recording->sourceID = FindDevice(recording->sourceUID);
+        SInt32 tapEnabled = 0;
+        if (recording->sourceID == kAudioObjectUnknown || !GetCustomSInt32(recording->sourceID, kRecord_PropertyTap, &tapEnabled)) {
+            fprintf(stderr, "%s isn't an AudiDeck device\n", recording->sourceUID.c_str());
+            return 1;
+        }
+        if (!tapEnabled) {
+            if (!SetCustomSInt32(recording->sourceID, kRecord_PropertyTap, 1)) {
+                fprintf(stderr, "Can't enable the tap on %s\n", recording->sourceUID.c_str());
+                return 1;
+            }
+            recording->enabledTap = true;
+        }
+        char tapName[32];
+        AudioTap::MakeName(recording->sourceUID.c_str(), tapName, sizeof(tapName));
+        if (!recording->recorder.open(tapName)) {
+            fprintf(stderr, "Can't open the tap for %s\n", recording->sourceUID.c_str());
+            return 1;
+        }
+    }
+
+    signal(SIGINT, HandleSignal);
+    signal(SIGTERM, HandleSignal);
+
+    for (auto& recording : recordings) {
+        recording->recorder.start(recording->path, (uint32_t)chunkCount);
+        printf("%s -> %s\n", recording->sourceUID.c_str(), recording->path.c_str());
+    }
+
+    // Report progress, and anything lost to a disk that couldn't keep up
+    for (unsigned elapsed = 1; !gStop; elapsed++) {
+        sleep(1);
+        for (auto& recording : recordings) {
+            AudioRecorder& recorder = recording->recorder;
+            uint64_t dropped = recorder.framesDropped();
+            if (dropped != recording->reportedDropped) {
+                fprintf(stderr, "%s: %llu frame(s) dropped%s\n", recording->sourceUID.c_str(),
+                        (unsigned long long)(dropped - recording->reportedDropped),
+                        recorder.failed() ? " (write failed)" : "");
+                recording->reportedDropped = dropped;
+            }
+            if (elapsed % kRecord_ReportSeconds == 0) {
+                printf("%s: %llu frames in %u file(s)\n", recording->sourceUID.c_str(),
+                       (unsigned long long)recorder.framesWritten(), recorder.fileCount());
+            }
+        }
+    }
+
+    for (auto& recording : recordings) {
+        recording->recorder.stop();
+        if (recording->enabledTap) {
+            SetCustomSInt32(recording->sourceID, kRecord_PropertyTap, 0);
+        }
+        printf("%s: %llu frames written, %llu dropped\n", recording->sourceUID.c_str(),
+               (unsigned long long)recording->recorder.framesWritten(),
+               (unsigned long long)recording->recorder.framesDropped());
+    }
+    return 0;
+}
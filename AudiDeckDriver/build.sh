@@ -8,6 +8,68 @@ DRIVER_NAME="AudiDeckDriver"
 BUILD_DIR="build"
 DRIVER_BUNDLE="${BUILD_DIR}/${DRIVER_NAME}.driver"
 
+# ./build.sh bench builds the standalone IO benchmarks instead of the driver
+if [ "$1" = "bench" ]; then
+    echo "🔨 Building AudiDeckBench..."
+    mkdir -p "${BUILD_DIR}/bench"
+    /usr/bin/clang++ -std=c++17 -O2 \
+        -framework CoreFoundation \
+        -framework CoreAudio \
+        -o "${BUILD_DIR}/bench/AudiDeckBench" \
+        Benchmarks/AudiDeckBench.cpp
+    echo "✅ Build complete: ${BUILD_DIR}/bench/AudiDeckBench"
+    echo ""
+    echo "⏱  To run: ${BUILD_DIR}/bench/AudiDeckBench [ring|doio] [--cycles N] [--speed N]"
+    exit 0
+fi
+
+# ./build.sh harness builds the offline host that replays scripted IO cycles
+# against a built driver (run ./build.sh first)
+if [ "$1" = "harness" ]; then
+    echo "🔨 Building AudiDeckHost..."
+    mkdir -p "${BUILD_DIR}/harness"
+    /usr/bin/clang++ -std=c++17 -O2 \
+        -framework CoreFoundation \
+        -framework CoreAudio \
+        -o "${BUILD_DIR}/harness/AudiDeckHost" \
+        Harness/AudiDeckHost.cpp
+    echo "✅ Build complete: ${BUILD_DIR}/harness/AudiDeckHost"
+    echo ""
+    echo "🧪 To run: for s in Harness/Scenarios/*.txt; do ${BUILD_DIR}/harness/AudiDeckHost \"\$s\"; done"
+    exit 0
+fi
+
+# ./build.sh bridge builds the tool that forwards AudiDeck devices to
+# physical outputs
+if [ "$1" = "bridge" ]; then
+    echo "🔨 Building AudiDeckBridge..."
+    mkdir -p "${BUILD_DIR}/bridge"
+    /usr/bin/clang++ -std=c++17 -O2 \
+        -framework CoreFoundation \
+        -framework CoreAudio \
+        -o "${BUILD_DIR}/bridge/AudiDeckBridge" \
+        Bridge/AudiDeckBridge.cpp
+    echo "✅ Build complete: ${BUILD_DIR}/bridge/AudiDeckBridge"
+    echo ""
+    echo "🎧 To run: ${BUILD_DIR}/bridge/AudiDeckBridge [--period FRAMES] SOURCE_UID=OUTPUT_UID[@GAIN]..."
+    exit 0
+fi
+
+# ./build.sh record builds the tool that records AudiDeck devices to disk
+if [ "$1" = "record" ]; then
+    echo "🔨 Building AudiDeckRecord..."
+    mkdir -p "${BUILD_DIR}/record"
+    /usr/bin/clang++ -std=c++17 -O2 \
+        -framework CoreFoundation \
+        -framework CoreAudio \
+        -o "${BUILD_DIR}/record/AudiDeckRecord" \
+        Record/AudiDeckRecord.cpp
+    echo "✅ Build complete: ${BUILD_DIR}/record/AudiDeckRecord"
+    echo ""
+    echo "⏺  To run: ${BUILD_DIR}/record/AudiDeckRecord [--buffer MIB] SOURCE_UID=PATH.caf..."
+    exit 0
+fi
+
 echo "🔨 Building ${DRIVER_NAME}..."
 
 # Clean previous build
@@ -14,6 +14,10 @@ import CoreAudio
     // MARK: - Properties
     
     private let driverBundleID = "com.audiorouter.AudiDeck.Driver"
+    private let driverPlugInBundleID = "com.audideck.driver"  // The HAL plug-in's CFBundleIdentifier
+    private let routingConfigurationSelector: AudioObjectPropertySelector = 0x61726366 // 'arcf'
+    private let ioStatsSelector: AudioObjectPropertySelector = 0x61737473 // 'asts'
+    private let devicesSelector: AudioObjectPropertySelector = 0x61646576 // 'adev'
     private let driverPath = "/Library/Audio/Plug-Ins/HAL/AudiDeckDriver.driver"
     private let configPath: URL
     
@@ -118,8 +122,13 @@ import CoreAudio
         do {
             try configData.write(to: configPath)
             
-            // Notify the driver of configuration change (if it supports it)
-            notifyDriverOfConfigChange()
+            // Push the configuration to the running driver; it applies it on
+            // the next IO cycle, without restarting coreaudiod
+            let status = notifyDriverOfConfigChange(configData)
+            if status != noErr {
+                reply(false, "Configuration saved, but the driver rejected it: error \(status)")
+                return
+            }
             
             reply(true, nil)
         } catch {
@@ -167,6 +176,78 @@ import CoreAudio
         }
     }
     
+    func getDriverStatistics(reply: @escaping @Sendable (Data?) -> Void) {
+        guard let plugInID = getDriverPlugInID() else {
+            reply(nil)
+            return
+        }
+        
+        // The same keys as DeviceIOStats
+        var devices: [[String: Any]] = []
+        for deviceID in getPlugInDeviceIDs(plugInID) {
+            guard let uid = getDeviceUID(deviceID), var stats = getDeviceIOStats(deviceID) else {
+                continue
+            }
+            stats["deviceUID"] = uid
+            devices.append(stats)
+        }
+        reply(try? JSONSerialization.data(withJSONObject: devices))
+    }
+    
+    /// The driver creates and destroys devices to match and announces the new device list itself, so
+    /// this needs no Core Audio restart
+    func setVirtualDevices(_ devicesData: Data, reply: @escaping @Sendable (Bool, String?) -> Void) {
+        guard let plugInID = getDriverPlugInID() else {
+            reply(false, "The driver isn't loaded")
+            return
+        }
+        guard let devices = try? JSONDecoder().decode([VirtualDeviceDescription].self, from: devicesData) else {
+            reply(false, "Invalid device list")
+            return
+        }
+        
+        // The keys of Plugin_CreateDevice's description
+        let list: [[String: Any]] = devices.map { device in
+            var entry: [String: Any] = ["uid": device.uid, "name": device.name]
+            if let source = device.loopbackSourceUID {
+                entry["loopback source"] = source
+                if device.locksClock == true {
+                    entry["clock reference"] = source
+                }
+            }
+            if let periodFrames = device.periodFrames {
+                entry["period frames"] = periodFrames
+            }
+            if let ringEncoding = device.ringEncoding {
+                entry["ring encoding"] = ringEncoding
+            }
+            return entry
+        }
+        var value = list as CFArray as CFPropertyList
+        
+        var propertyAddress = AudioObjectPropertyAddress(
+            mSelector: devicesSelector,
+            mScope: kAudioObjectPropertyScopeGlobal,
+            mElement: kAudioObjectPropertyElementMain
+        )
+        
+        let status = withUnsafeMutablePointer(to: &value) { data in
+            AudioObjectSetPropertyData(
+                plugInID,
+                &propertyAddress,
+                0,
+                nil,
+                UInt32(MemoryLayout<CFPropertyList>.size),
+                data
+            )
+        }
+        if status == noErr {
+            reply(true, nil)
+        } else {
+            reply(false, "The driver rejected the device list: error \(status)")
+        }
+    }
+    
     func restartCoreAudio(reply: @escaping @Sendable (Bool, String?) -> Void) {
         restartCoreAudioDaemon(reply: reply)
     }
@@ -263,14 +344,116 @@ import CoreAudio
         return nil
     }
     
-    private func notifyDriverOfConfigChange() {
-        // In a real implementation, this would use a custom notification mechanism
-        // to inform the driver of configuration changes. This could be:
-        // 1. A custom property on the virtual device
-        // 2. A shared memory region
-        // 3. A Mach port message
-        
-        // For now, we rely on the driver polling the config file
+    private func getDriverPlugInID() -> AudioObjectID? {
+        var bundleID = driverPlugInBundleID as CFString
+        var plugInID = AudioObjectID(kAudioObjectUnknown)
+        var size = UInt32(MemoryLayout<AudioObjectID>.size)
+        
+        var propertyAddress = AudioObjectPropertyAddress(
+            mSelector: kAudioHardwarePropertyTranslateBundleIDToPlugIn,
+            mScope: kAudioObjectPropertyScopeGlobal,
+            mElement: kAudioObjectPropertyElementMain
+        )
+        
+        let status = withUnsafeMutablePointer(to: &bundleID) { qualifier in
+            AudioObjectGetPropertyData(
+                AudioObjectID(kAudioObjectSystemObject),
+                &propertyAddress,
+                UInt32(MemoryLayout<CFString>.size),
+                qualifier,
+                &size,
+                &plugInID
+            )
+        }
+        return (status == noErr && plugInID != kAudioObjectUnknown) ? plugInID : nil
+    }
+    
+    private func getPlugInDeviceIDs(_ plugInID: AudioObjectID) -> [AudioDeviceID] {
+        var propertyAddress = AudioObjectPropertyAddress(
+            mSelector: kAudioPlugInPropertyDeviceList,
+            mScope: kAudioObjectPropertyScopeGlobal,
+            mElement: kAudioObjectPropertyElementMain
+        )
+        
+        var dataSize: UInt32 = 0
+        guard AudioObjectGetPropertyDataSize(plugInID, &propertyAddress, 0, nil, &dataSize) == noErr else {
+            return []
+        }
+        
+        var deviceIDs = [AudioDeviceID](repeating: 0, count: Int(dataSize) / MemoryLayout<AudioDeviceID>.size)
+        let status = AudioObjectGetPropertyData(plugInID, &propertyAddress, 0, nil, &dataSize, &deviceIDs)
+        return status == noErr ? deviceIDs : []
+    }
+    
+    /// The device's 'asts' dictionary: one integer per counter
+    private func getDeviceIOStats(_ deviceID: AudioDeviceID) -> [String: Any]? {
+        var stats: CFPropertyList?
+        var size = UInt32(MemoryLayout<CFPropertyList?>.size)
+        
+        var propertyAddress = AudioObjectPropertyAddress(
+            mSelector: ioStatsSelector,
+            mScope: kAudioObjectPropertyScopeGlobal,
+            mElement: kAudioObjectPropertyElementMain
+        )
+        
+        let status = AudioObjectGetPropertyData(deviceID, &propertyAddress, 0, nil, &size, &stats)
+        guard status == noErr, let dictionary = stats as? [String: NSNumber] else {
+            return nil
+        }
+        return dictionary.mapValues { $0.uint64Value }
+    }
+    
+    /// Sends the whole routing configuration to the driver in one property
+    /// write. Rules for outputs the driver doesn't own, such as physical
+    /// devices, are kept at their volume on the app's current device.
+    /// Returns noErr if the driver isn't loaded; it has nothing to update.
+    private func notifyDriverOfConfigChange(_ configData: Data) -> OSStatus {
+        guard let plugInID = getDriverPlugInID() else {
+            return noErr
+        }
+        // The JSON encoding of RoutingConfiguration
+        guard let config = (try? JSONSerialization.jsonObject(with: configData)) as? [String: Any] else {
+            return OSStatus(kAudioHardwareIllegalOperationError)
+        }
+        let rules = config["rules"] as? [[String: Any]] ?? []
+        let isEnabled = config["isEnabled"] as? Bool ?? true
+        
+        var routes: [String: Any] = [:]
+        for rule in rules {
+            guard let bundleID = rule["appBundleIdentifier"] as? String,
+                  let deviceUID = rule["outputDeviceUID"] as? String else {
+                continue
+            }
+            let volume = rule["volume"] as? Double ?? 1.0
+            let isMuted = rule["isMuted"] as? Bool ?? false
+            routes[bundleID] = [
+                "device": deviceUID,
+                "gain": min(max(volume, 0.0), 1.0),
+                "muted": isMuted ? 1 : 0,
+                "exclusive": 1
+            ]
+        }
+        var value = [
+            "enabled": isEnabled ? 1 : 0,
+            "routes": routes
+        ] as CFDictionary as CFPropertyList
+        
+        var propertyAddress = AudioObjectPropertyAddress(
+            mSelector: routingConfigurationSelector,
+            mScope: kAudioObjectPropertyScopeGlobal,
+            mElement: kAudioObjectPropertyElementMain
+        )
+        
+        return withUnsafeMutablePointer(to: &value) { data in
+            AudioObjectSetPropertyData(
+                plugInID,
+                &propertyAddress,
+                0,
+                nil,
+                UInt32(MemoryLayout<CFPropertyList>.size),
+                data
+            )
+        }
     }
 }
 
@@ -31,6 +31,12 @@ import Foundation
     /// Set the default output device
     func setDefaultOutputDevice(_ deviceUID: String, reply: @escaping @Sendable (Bool, String?) -> Void)
     
+    /// Get the driver's per-device IO counters (JSON-encoded [DeviceIOStats])
+    func getDriverStatistics(reply: @escaping @Sendable (Data?) -> Void)
+    
+    /// Replace the driver's devices without restarting Core Audio (JSON-encoded [VirtualDeviceDescription])
+    func setVirtualDevices(_ devicesData: Data, reply: @escaping @Sendable (Bool, String?) -> Void)
+    
     /// Restart Core Audio
     func restartCoreAudio(reply: @escaping @Sendable (Bool, String?) -> Void)
     
@@ -40,6 +40,16 @@ import Foundation
     ///   - reply: Callback with success status and optional error message
     func setDefaultOutputDevice(_ deviceUID: String, reply: @escaping @Sendable (Bool, String?) -> Void)
     
+    /// Get the driver's IO counters for each of its devices
+    /// - Parameter reply: Callback with a JSON-encoded [DeviceIOStats], or nil if the driver isn't loaded
+    func getDriverStatistics(reply: @escaping @Sendable (Data?) -> Void)
+    
+    /// Replace the driver's devices, besides the built-in one, while Core Audio keeps running
+    /// - Parameters:
+    ///   - devicesData: JSON-encoded [VirtualDeviceDescription]
+    ///   - reply: Callback with success status and optional error message
+    func setVirtualDevices(_ devicesData: Data, reply: @escaping @Sendable (Bool, String?) -> Void)
+    
     /// Restart the Core Audio daemon
     /// - Parameter reply: Callback with success status and optional error message
     func restartCoreAudio(reply: @escaping @Sendable (Bool, String?) -> Void)
@@ -32,6 +32,46 @@ public enum AudiDeckConstants {
     public static let defaultChannelCount: UInt32 = 2
     public static let defaultBufferFrameSize: UInt32 = 512
     
+    // MARK: - Driver Properties
+    /// Low-latency input depth in periods (CFNumber, 0 = off, 1-4)
+    public static let latencyPeriodsPropertySelector: UInt32 = 0x616C6174 // 'alat'
+    /// IO period in frames (CFNumber, 32-4096); applied through a device configuration change
+    public static let periodFramesPropertySelector: UInt32 = 0x61706572 // 'aper'
+    /// Per-app route on the plug-in object, qualified by bundle ID (CFString).
+    /// Value is a CFDictionary: "device" (UID, empty = none), "gain" (0-1), "muted" (0/1), "exclusive" (0/1),
+    /// "crossfade" (ms to fade over when an app moves onto the route, 0-500, default 10)
+    public static let clientRoutePropertySelector: UInt32 = 0x61637274 // 'acrt'
+    /// Shared-memory tap of a device's output (CFNumber, 0/1). The region is named
+    /// "/audideck." + the device UID's 32-bit FNV-1a hash as 8 hex digits; layout in AudioTap.hpp
+    public static let tapPropertySelector: UInt32 = 0x61746170 // 'atap'
+    /// Storage of a device's ring (CFNumber: 0 = Float32, 1 = Int16, 2 = Int24). Int16 halves the ring's
+    /// footprint and memory traffic and Int24 takes three quarters, for audio that doesn't need exact float
+    /// (input clips at full scale); applied through a device configuration change, which drops what the ring held
+    public static let ringEncodingPropertySelector: UInt32 = 0x61726E67 // 'arng'
+    /// Device output levels (read-only CFDictionary: "peak" and "rms", one linear CFNumber per channel)
+    public static let outputLevelsPropertySelector: UInt32 = 0x616D7472 // 'amtr'
+    /// Device IO counters since the driver loaded (read-only CFDictionary of CFNumbers; see DeviceIOStats)
+    public static let ioStatsPropertySelector: UInt32 = 0x61737473 // 'asts'
+    /// Latency probe (CFNumber, 0/1): times marked frames from WriteMix to the input reading the device's ring,
+    /// and each IO cycle's start against the period; the results are in 'asts' and 'ahst'
+    public static let latencyProbePropertySelector: UInt32 = 0x61707262 // 'aprb'
+    /// The latency probe's distributions (read-only CFDictionary): "bucketUpperNanos", and "latency" and "jitter",
+    /// one count per bucket; the last bucket is everything above the last bound
+    public static let probeHistogramPropertySelector: UInt32 = 0x61687374 // 'ahst'
+    /// Per-app output levels on the plug-in object, qualified by bundle ID; same dictionary as 'amtr'
+    public static let clientLevelsPropertySelector: UInt32 = 0x61636D74 // 'acmt'
+    /// Every route at once, on the plug-in object (unqualified). Value is a CFDictionary:
+    /// "enabled" (0/1) and "routes" (bundle ID -> a dictionary as for 'acrt')
+    public static let routingConfigurationPropertySelector: UInt32 = 0x61726366 // 'arcf'
+    /// IO event tracing on the plug-in object (CFNumber, 0/1); the driver logs events under
+    /// subsystem "com.audideck.driver", category "trace"
+    public static let tracePropertySelector: UInt32 = 0x61747263 // 'atrc'
+    /// The driver's devices besides the built-in one, on the plug-in object (unqualified). Value is a CFArray of
+    /// CFDictionary: "uid", "name", "loopback source" (UID), "clock reference" (the same UID), "period frames",
+    /// "ring encoding". Setting it creates and destroys devices to match without restarting coreaudiod; the
+    /// driver keeps the list in its host storage, so the devices come back with coreaudiod
+    public static let devicesPropertySelector: UInt32 = 0x61646576 // 'adev'
+    
     // MARK: - User Defaults Keys
     public enum UserDefaultsKeys {
         public static let routingConfiguration = "AudiDeckRoutingConfig"
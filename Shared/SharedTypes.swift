@@ -163,6 +163,49 @@ public enum DriverStatus: Int, Codable, Sendable {
     }
 }
 
+// MARK: - Driver Statistics
+
+/// One virtual device's IO counters, as the driver's 'asts' property reports them.
+/// Counts only grow while the driver is loaded; compare two reads to measure an interval.
+public struct DeviceIOStats: Codable, Sendable {
+    public let deviceUID: String
+    public let cycles: UInt64
+    public let framesDropped: UInt64      // Output the device's ring had no room for
+    public let framesZeroFilled: UInt64   // Input padded with silence because the ring ran short
+    public let maxFillFrames: UInt64      // Deepest the ring has been, out of capacityFrames
+    public let capacityFrames: UInt64
+    public let ioCount: UInt64            // DoIO calls; the durations below are per call
+    public let ioMinNanos: UInt64
+    public let ioMeanNanos: UInt64
+    public let ioMaxNanos: UInt64
+    public let latencyCount: UInt64       // Latency probe markers read; see latencyProbePropertySelector
+    public let latencyMinNanos: UInt64    // WriteMix to the app reading the device's ring
+    public let latencyMeanNanos: UInt64
+    public let latencyMaxNanos: UInt64
+    public let jitterCount: UInt64        // IO cycles timed while probing
+    public let jitterMeanNanos: UInt64    // How far a cycle started from one period after the last
+    public let jitterMaxNanos: UInt64
+}
+
+// MARK: - Virtual Devices
+
+/// A device for the driver to provision, as one entry of its 'adev' property. Optional fields take the
+/// driver's defaults. A device that already exists keeps running as it is; remove it and add it back to
+/// change it.
+public struct VirtualDeviceDescription: Codable, Sendable {
+    public let uid: String
+    public let name: String
+    public var loopbackSourceUID: String? = nil   // Input plays back this device's output
+    public var locksClock: Bool? = nil            // Steer the clock to the loopback source's; off if nil
+    public var periodFrames: UInt32? = nil        // 32-4096
+    public var ringEncoding: UInt32? = nil        // 0 = Float32, 1 = Int16, 2 = Int24
+    
+    public init(uid: String, name: String) {
+        self.uid = uid
+        self.name = name
+    }
+}
+
 // MARK: - XPC Command Types
 
 /// Commands sent from main app to XPC helper